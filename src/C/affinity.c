@@ -0,0 +1,359 @@
+/**
+ * @file    affinity.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief CPU affinity and NUMA aware placement of client threads.
+ *
+ * When a worker CPU list is configured each client thread is pinned
+ * to one CPU from that list. The CPU is chosen from SO_INCOMING_CPU
+ * so the connection is handled where the NIC delivers its packets,
+ * falling back to round robin when that CPU is not in the list.
+ *
+ * Response buffers come from a per NUMA node pool. A pinned thread
+ * first-touches a fresh buffer, so the kernel places it on the
+ * local node, and it is only ever handed out again on that node.
+ *
+ * Per CPU counters are kept for every connection, pinned or not,
+ * and are dumped on SIGUSR1 so imbalance is easy to spot.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <log.h>
+#include <affinity.h>
+
+typedef struct coreStats {
+    unsigned long connections;
+    unsigned long steered;
+    unsigned long bytes;
+} __attribute__((aligned(64))) coreStats;
+
+typedef struct bufferPool {
+    pthread_mutex_t lock;
+    char *free[POOL_BUFFERS_PER_NODE];
+    int count;
+    size_t size;
+} __attribute__((aligned(64))) bufferPool;
+
+static int numCpus;
+static int numNodes = 1;
+static int *cpuNode;
+static unsigned char *allowed;
+static int *workerCpus;
+static int numWorkerCpus;
+static unsigned int nextCpu;
+
+static coreStats *stats;
+static bufferPool *pools;
+
+/**
+ * nodeOfCpu : looks up the NUMA node a CPU belongs to from sysfs,
+ * defaults to node 0 on machines without NUMA information.
+ */
+static int nodeOfCpu(int cpu)
+{
+    char dirName[64];
+    struct dirent *entry;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(dirName, sizeof(dirName), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(dirName)) == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "node", 4) &&
+            (entry->d_name[4] >= '0') && (entry->d_name[4] <= '9')) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * parseCpuList : parses a list such as "0-3,8" into the allowed map.
+ * return: number of CPUs in the list, -1 if malformed
+ */
+static int parseCpuList(const char *cpuList)
+{
+    const char *p = cpuList;
+    char *end;
+    long first, last, cpu;
+    int count = 0;
+
+    while (*p != '\0') {
+        first = strtol(p, &end, 10);
+        if ((end == p) || (first < 0)) {
+            return -1;
+        }
+        last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if ((end == p) || (last < first)) {
+                return -1;
+            }
+            p = end;
+        }
+        if (last >= numCpus) {
+            error_log("CPU %ld is out of range, %d CPUs present",
+                      last, numCpus);
+            return -1;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            if (!allowed[cpu]) {
+                allowed[cpu] = 1;
+                workerCpus[count++] = cpu;
+            }
+        }
+        while ((*p == ',') || (*p == ' ')) {
+            p++;
+        }
+    }
+    return count;
+}
+
+/**
+*affinityInit : sets up per CPU stats and buffer pools, and pinning
+*if a CPU list is given.
+*args:
+*       cpuList: CPUs worker threads may run on, NULL or "" to let
+*                the scheduler place them
+*return:
+*       -1 : the CPU list is invalid
+*        0 : success
+*/
+int affinityInit(const char *cpuList)
+{
+    int cpu, node;
+
+    numCpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (numCpus < 1) {
+        numCpus = 1;
+    }
+
+    cpuNode = calloc(numCpus, sizeof(int));
+    allowed = calloc(numCpus, sizeof(unsigned char));
+    workerCpus = calloc(numCpus, sizeof(int));
+    stats = calloc(numCpus, sizeof(coreStats));
+    if ((cpuNode == NULL) || (allowed == NULL) ||
+        (workerCpus == NULL) || (stats == NULL)) {
+        error_log("%s", "Unable to allocate per CPU state");
+        return -1;
+    }
+
+    for (cpu = 0; cpu < numCpus; cpu++) {
+        cpuNode[cpu] = nodeOfCpu(cpu);
+        if (cpuNode[cpu] >= numNodes) {
+            numNodes = cpuNode[cpu] + 1;
+        }
+    }
+
+    pools = calloc(numNodes * POOL_SIZES, sizeof(bufferPool));
+    if (pools == NULL) {
+        error_log("%s", "Unable to allocate buffer pools");
+        return -1;
+    }
+    for (node = 0; node < numNodes * POOL_SIZES; node++) {
+        pthread_mutex_init(&pools[node].lock, NULL);
+    }
+
+    if ((cpuList != NULL) && (*cpuList != '\0')) {
+        numWorkerCpus = parseCpuList(cpuList);
+        if (numWorkerCpus <= 0) {
+            error_log("Invalid worker CPU list \"%s\"", cpuList);
+            return -1;
+        }
+        debug_log("Pinning workers to %d CPUs on %d nodes",
+                  numWorkerCpus, numNodes);
+    }
+
+    return 0;
+}
+
+/**
+*affinityPickCpu : chooses the CPU that should serve a new connection.
+*Prefers the CPU the connection's packets arrive on.
+*return:
+*       -1 : pinning disabled
+*      cpu : CPU to pin the client thread to
+*/
+int affinityPickCpu(int client_sock)
+{
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+
+    if (numWorkerCpus == 0) {
+        return -1;
+    }
+
+    if ((getsockopt(client_sock, SOL_SOCKET, SO_INCOMING_CPU,
+                    &cpu, &len) == 0) &&
+        (cpu >= 0) && (cpu < numCpus) && allowed[cpu]) {
+        __sync_fetch_and_add(&stats[cpu].steered, 1);
+        return cpu;
+    }
+
+    return workerCpus[__sync_fetch_and_add(&nextCpu, 1) % numWorkerCpus];
+}
+
+/**
+*affinityApply : pins threads created with attr to cpu.
+*return:
+*       0 on success or if cpu is -1, error number otherwise
+*/
+int affinityApply(pthread_attr_t *attr, int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0) {
+        return 0;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/**
+*affinityWorkerCount : number of worker CPUs, 0 if pinning is disabled.
+*/
+int affinityWorkerCount(void)
+{
+    return numWorkerCpus;
+}
+
+/**
+*affinityWorkerCpu : the index'th worker CPU.
+*/
+int affinityWorkerCpu(int index)
+{
+    return workerCpus[index];
+}
+
+static int currentNode(int cpu)
+{
+    if ((cpu < 0) || (cpu >= numCpus)) {
+        cpu = sched_getcpu();
+    }
+    if ((cpu < 0) || (cpu >= numCpus)) {
+        return 0;
+    }
+    return cpuNode[cpu];
+}
+
+/**
+ * nodePool : the pool of buffers of size on the node of cpu, locked.
+ * The first POOL_SIZES sizes asked for get a pool each, in turn.
+ * return: NULL if size has no pool, nor can claim one with claim unset
+ */
+static bufferPool *nodePool(int cpu, size_t size, int claim)
+{
+    bufferPool *pool = &pools[currentNode(cpu) * POOL_SIZES];
+    int i;
+
+    for (i = 0; i < POOL_SIZES; i++, pool++) {
+        pthread_mutex_lock(&pool->lock);
+        if ((pool->size == 0) && claim) {
+            pool->size = size;
+        }
+        if (pool->size == size) {
+            return pool;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+*affinityBufferGet : returns a buffer of size bytes local to the node
+*of cpu. Must be released with affinityBufferPut.
+*/
+char *affinityBufferGet(int cpu, size_t size)
+{
+    bufferPool *pool = nodePool(cpu, size, 0);
+    char *buf = NULL;
+
+    if (pool != NULL) {
+        if (pool->count > 0) {
+            buf = pool->free[--pool->count];
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (buf == NULL) {
+        /* Touched first by this thread, hence allocated node locally */
+        buf = malloc(size);
+    }
+    return buf;
+}
+
+/**
+*affinityBufferPut : returns a buffer to the pool of cpu's node.
+*/
+void affinityBufferPut(int cpu, char *buf, size_t size)
+{
+    bufferPool *pool;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    if ((pool = nodePool(cpu, size, 1)) != NULL) {
+        if (pool->count < POOL_BUFFERS_PER_NODE) {
+            pool->free[pool->count++] = buf;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(buf);
+}
+
+/**
+*affinityRecord : accounts one finished connection to cpu, or to the
+*CPU the caller runs on if cpu is -1.
+*/
+void affinityRecord(int cpu, size_t bytes)
+{
+    if ((cpu < 0) || (cpu >= numCpus)) {
+        cpu = sched_getcpu();
+        if ((cpu < 0) || (cpu >= numCpus)) {
+            return;
+        }
+    }
+    __sync_fetch_and_add(&stats[cpu].connections, 1);
+    __sync_fetch_and_add(&stats[cpu].bytes, bytes);
+}
+
+/**
+*affinityDumpStats : writes the per CPU counters to out.
+*/
+void affinityDumpStats(FILE *out)
+{
+    int cpu;
+
+    fprintf(out, "%-6s%-6s%-8s%-14s%-10s%s\n",
+            "cpu", "node", "worker", "connections", "steered", "bytes");
+    for (cpu = 0; cpu < numCpus; cpu++) {
+        if (!allowed[cpu] && (stats[cpu].connections == 0)) {
+            continue;
+        }
+        fprintf(out, "%-6d%-6d%-8s%-14lu%-10lu%lu\n",
+                cpu, cpuNode[cpu], allowed[cpu] ? "yes" : "no",
+                stats[cpu].connections, stats[cpu].steered,
+                stats[cpu].bytes);
+    }
+    fflush(out);
+}
@@ -0,0 +1,163 @@
+/**
+ * @file    cachepolicy.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Cache-Control and Expires for static files. The "cache" rules
+ * of the configuration match a request path prefix, a file extension
+ * or the MIME type get_mime gives, the first match in file order wins.
+ * Their Cache-Control values are parsed once with the configuration
+ * (see conf.c), a response only copies one in and formats Expires
+ * from its max-age.
+ *
+ * Files whose name carries a content hash, app.3f2a9c1b.js or
+ * index-BqTn8fL2.css, change name whenever they change, so they are
+ * marked immutable for cache_fingerprint seconds before any rule is
+ * looked at.
+ *
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <helper.h>
+#include <response.h>
+#include <cachepolicy.h>
+
+/**
+ * fingerprinted : whether the file name ends in a hash before its
+ * extension: eight or more hex digits, or the mixed case letters and
+ * digits of base64 style hashes, after a '.' or '-'.
+ */
+static int fingerprinted(const char *path)
+{
+    const char *name, *ext, *hash, *c;
+    int hex = 1, digit = 0, upper = 0, lower = 0;
+    size_t len;
+
+    name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    if ((ext = strrchr(name, '.')) == NULL) {
+        return 0;
+    }
+    for (hash = ext; (hash > name) && (hash[-1] != '.') && (hash[-1] != '-');
+         hash--) {
+    }
+    len = ext - hash;
+    if ((hash == name) || (len < CACHE_FINGERPRINT_MIN) ||
+        (len > CACHE_FINGERPRINT_MAX)) {
+        return 0;
+    }
+
+    for (c = hash; c < ext; c++) {
+        if (isdigit((unsigned char) *c)) {
+            digit = 1;
+        } else if ((*c >= 'a') && (*c <= 'f')) {
+            lower = 1;
+        } else if (isupper((unsigned char) *c)) {
+            upper = 1;
+            hex = 0;
+        } else if (islower((unsigned char) *c)) {
+            lower = 1;
+            hex = 0;
+        } else if (*c != '_') {
+            return 0;
+        } else {
+            hex = 0;
+        }
+    }
+    /* Words like "bootstrap" are letters only, a hash has digits too */
+    return digit && (hex || (upper && lower));
+}
+
+static int mimeMatches(const char *pattern, const char *mime)
+{
+    size_t len = strlen(pattern);
+
+    if ((len >= 2) && !strcmp(pattern + len - 2, "/*")) {
+        return !strncasecmp(pattern, mime, len - 1);
+    }
+    return !strcasecmp(pattern, mime);
+}
+
+/**
+*cachePolicyFind : the caching rule for a response.
+*args:
+*       uri: request path, prefix rules match it
+*       resourcePath: file served, for its extension and MIME type
+*return:
+*       the rule, NULL for no caching headers
+*/
+const cacheRule *cachePolicyFind(const serverConfig *cfg, const char *uri,
+                                 const char *resourcePath)
+{
+    const cacheRule *rule;
+    const char *ext, *name;
+    int i;
+
+    if ((cfg->cacheFingerprint > 0) && fingerprinted(resourcePath)) {
+        return &cfg->fingerprintRule;
+    }
+
+    name = strrchr(resourcePath, '/');
+    ext = strrchr((name != NULL) ? name : resourcePath, '.');
+    for (i = 0; i < cfg->numCacheRules; i++) {
+        rule = &cfg->cacheRules[i];
+        switch (rule->kind) {
+        case CACHE_PREFIX:
+            if (!strncmp(uri, rule->match, strlen(rule->match))) {
+                return rule;
+            }
+            break;
+        case CACHE_EXTENSION:
+            if ((ext != NULL) && !strcasecmp(ext, rule->match)) {
+                return rule;
+            }
+            break;
+        case CACHE_MIME:
+            if (mimeMatches(rule->match, get_mime((char *) resourcePath))) {
+                return rule;
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+*cachePolicyExpires : the Expires value for rule, max-age from now.
+*args:
+*       expires: RESP_DATE_LEN + 1 bytes
+*/
+void cachePolicyExpires(const cacheRule *rule, char *expires)
+{
+    respFormatDate(time(NULL) + rule->maxAge, expires);
+}
+
+/**
+*cachePolicyAppend : appends the Cache-Control and Expires headers of
+*rule, nothing if rule is NULL.
+*return:
+*       SUCCESS or FAILURE if the headers do not fit
+*/
+int cachePolicyAppend(bufStruct *response, const cacheRule *rule)
+{
+    char expires[RESP_DATE_LEN + 1];
+
+    if (rule == NULL) {
+        return respFailed(response) ? FAILURE : SUCCESS;
+    }
+    respLiteral(response, "Cache-Control: ");
+    respAppend(response, rule->control, rule->controlLen);
+    respLiteral(response, "\r\n");
+    if (rule->maxAge >= 0) {
+        cachePolicyExpires(rule, expires);
+        respLiteral(response, "Expires: ");
+        respAppend(response, expires, RESP_DATE_LEN);
+        respLiteral(response, "\r\n");
+    }
+    return respFailed(response) ? FAILURE : SUCCESS;
+}
@@ -0,0 +1,334 @@
+/**
+ * @file    capture.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Traffic capture. With capture_file set, every request is
+ * appended to it once answered: its arrival time, connection id,
+ * response status and size, and the request bytes as received, for
+ * replay.c to send again with the same timing.
+ *
+ * The threads serving requests never lock or write to the file. They
+ * copy their record into a ring of capture_buffer megabytes, claiming
+ * space by compare-and-swap on the count of bytes handed out, and
+ * publish it by setting its length word last. A single writer thread
+ * takes the published records in order, writes a batch of them with
+ * one writev() and zeroes the space before handing it back. A record
+ * that finds the ring full is dropped and counted, the request it
+ * belongs to is not held up.
+ *
+ * The file is opened O_APPEND and a batch is always whole records,
+ * so a restarted server appends to the same file while the old one
+ * drains. A short write is carried on where it stopped; a write that
+ * fails halfway leaves a torn record, so capturing stops there and
+ * later requests are counted as dropped. The file is opened once, a
+ * new capture_file needs a restart.
+ *
+ * HTTP/2 streams are captured by h2.c, each as the HTTP/1.1 request it
+ * stands for under the id of its connection.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <trace.h>
+#include <capture.h>
+
+/* In the ring a record is preceded by its length words, see ringHead */
+#define RING_HEAD 8
+
+static char *ring;
+static size_t ringMask;
+static volatile size_t reserved;    /* bytes handed out, ever */
+static volatile size_t consumed;    /* bytes given back, ever */
+static volatile int capturing;
+static volatile int stopping;
+static volatile int broken;         /* a write failed, see captureWriter */
+static int captureFd = -1;
+static pthread_t writer;
+static uint64_t realOffset;         /* epoch ns minus traceNow() */
+
+static unsigned long captured;
+static unsigned long dropped;
+static unsigned long long written;
+
+/**
+ * ringHead : the length words at pos, the space the record takes in the
+ * ring, 0 until it is published, and the bytes of it to write out.
+ */
+static volatile uint32_t *ringHead(size_t pos)
+{
+    return (volatile uint32_t *) (ring + (pos & ringMask));
+}
+
+/**
+ * ringPut : copies len bytes of data to pos, wrapping at the end.
+ */
+static void ringPut(size_t pos, const void *data, size_t len)
+{
+    size_t off = pos & ringMask, first = ringMask + 1 - off;
+
+    if (first >= len) {
+        memcpy(ring + off, data, len);
+    } else {
+        memcpy(ring + off, data, first);
+        memcpy(ring, (const char *) data + first, len - first);
+    }
+}
+
+/**
+ * ringSpan : the iovecs of the len bytes at pos, one or two.
+ */
+static int ringSpan(size_t pos, size_t len, struct iovec *iov)
+{
+    size_t off = pos & ringMask, first = ringMask + 1 - off;
+
+    iov[0].iov_base = ring + off;
+    if (first >= len) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+/**
+ * writeBatch : writes the n iovecs of a batch out whole, going on from
+ * where a short count stopped.
+ * return: SUCCESS, FAILURE if the file is left with part of the batch
+ */
+static int writeBatch(struct iovec *iov, int n)
+{
+    ssize_t ret;
+    int i = 0;
+
+    while (i < n) {
+        ret = writev(captureFd, iov + i, n - i);
+        if ((ret < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (ret <= 0) {
+            error_log("Unable to write the capture: %s",
+                      (ret < 0) ? strerror(errno) : "nothing written");
+            return FAILURE;
+        }
+        written += ret;
+        while ((i < n) && ((size_t) ret >= iov[i].iov_len)) {
+            ret -= iov[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            iov[i].iov_base = (char *) iov[i].iov_base + ret;
+            iov[i].iov_len -= ret;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * captureWriter : writes the published records out, in batches.
+ */
+static void *captureWriter(void *arg)
+{
+    struct iovec iov[2 * CAPTURE_BATCH];
+    struct timespec pause = { 0, CAPTURE_POLL_MS * 1000000L };
+    size_t start, end, span;
+    uint32_t take;
+    int n, i, records;
+
+    for (;;) {
+        start = end = consumed;
+        n = records = 0;
+        while ((records < CAPTURE_BATCH) &&
+               ((take = ringHead(end)[0]) != 0)) {
+            __sync_synchronize();
+            n += ringSpan(end + RING_HEAD, ringHead(end)[1], iov + n);
+            end += take;
+            records++;
+        }
+        if (records == 0) {
+            if (stopping && (reserved == consumed)) {
+                break;
+            }
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        if (!broken && (writeBatch(iov, n) != SUCCESS)) {
+            error_log("%s", "Capture stopped, the file ends in a torn record");
+            broken = 1;
+        }
+
+        /* Unpublished space reads as 0, wherever a length word lands */
+        for (i = ringSpan(start, end - start, iov); i > 0; i--) {
+            memset(iov[i - 1].iov_base, 0, iov[i - 1].iov_len);
+        }
+        span = end - start;
+        __sync_synchronize();
+        __sync_fetch_and_add(&consumed, span);
+    }
+    return NULL;
+}
+
+/**
+*captureInit : opens capture_file and starts the writer, if it is set.
+*args:
+*       cfg: capture_file and capture_buffer
+*       blocked: signals the writer keeps blocked
+*return:
+*       SUCCESS, or FAILURE if capturing is asked for and not possible
+*/
+int captureInit(const serverConfig *cfg, const sigset_t *blocked)
+{
+    struct timespec now;
+    struct stat st;
+    sigset_t oldMask;
+    size_t size = 1 << 20;
+    int ret;
+
+    if (cfg->captureFile[0] == '\0') {
+        return SUCCESS;
+    }
+    while (size < ((size_t) cfg->captureBuffer << 20)) {
+        size <<= 1;
+    }
+
+    captureFd = open(cfg->captureFile, O_WRONLY | O_CREAT | O_APPEND |
+                     O_CLOEXEC, 0600);
+    if (captureFd < 0) {
+        error_log("Unable to open %s: %s", cfg->captureFile,
+                  strerror(errno));
+        return FAILURE;
+    }
+    if ((fstat(captureFd, &st) == 0) && (st.st_size == 0) &&
+        (write(captureFd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) !=
+         CAPTURE_MAGIC_LEN)) {
+        error_log("Unable to write %s: %s", cfg->captureFile,
+                  strerror(errno));
+        close(captureFd);
+        return FAILURE;
+    }
+
+    if ((ring = calloc(1, size)) == NULL) {
+        error_log("%s", "Unable to allocate the capture buffer");
+        close(captureFd);
+        return FAILURE;
+    }
+    ringMask = size - 1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    realOffset = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec -
+                 traceNow();
+
+    pthread_sigmask(SIG_BLOCK, blocked, &oldMask);
+    ret = pthread_create(&writer, NULL, captureWriter, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if (ret != 0) {
+        error_log("%s", "Unable to start the capture writer");
+        free(ring);
+        ring = NULL;
+        close(captureFd);
+        return FAILURE;
+    }
+    capturing = 1;
+    debug_log("Capturing requests to %s", cfg->captureFile);
+    return SUCCESS;
+}
+
+/**
+*captureEnabled : whether requests are captured, and clientResume has to
+*keep a copy of them until they are answered.
+*/
+int captureEnabled(void)
+{
+    return capturing;
+}
+
+/**
+*captureRequest : records a request that was answered. Never blocks.
+*args:
+*       conn: connection id
+*       acceptedNs: traceNow() when the connection was accepted
+*       request, length: the request as received
+*       status, bytes: of the response
+*/
+void captureRequest(uint64_t conn, uint64_t acceptedNs, const char *request,
+                    int length, int status, uint64_t bytes)
+{
+    captureRecord rec;
+    size_t pos, take;
+
+    if (!capturing) {
+        return;
+    }
+    if (broken) {
+        __sync_fetch_and_add(&dropped, 1);
+        return;
+    }
+    if (request == NULL) {
+        length = 0;
+    }
+    take = (RING_HEAD + sizeof(rec) + length + 7) & ~(size_t) 7;
+    do {
+        pos = reserved;
+        if (pos + take - consumed > ringMask + 1) {
+            __sync_fetch_and_add(&dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&reserved, pos, pos + take));
+
+    rec.arrivalNs = acceptedNs + realOffset;
+    rec.durationNs = traceNow() - acceptedNs;
+    rec.conn = conn;
+    rec.bytes = bytes;
+    rec.status = status;
+    rec.length = length;
+    ringPut(pos + RING_HEAD, &rec, sizeof(rec));
+    ringPut(pos + RING_HEAD + sizeof(rec), request, length);
+    ringHead(pos)[1] = sizeof(rec) + length;
+
+    /* Published once the record is all there */
+    __sync_synchronize();
+    ringHead(pos)[0] = take;
+    __sync_fetch_and_add(&captured, 1);
+}
+
+/**
+*captureStop : stops capturing and waits for what was captured to be
+*written out.
+*/
+void captureStop(void)
+{
+    if (!capturing) {
+        return;
+    }
+    capturing = 0;
+    stopping = 1;
+    pthread_join(writer, NULL);
+    close(captureFd);
+}
+
+/**
+*captureDumpStats : writes the requests captured and dropped to out.
+*/
+void captureDumpStats(FILE *out)
+{
+    if (!capturing) {
+        return;
+    }
+    fprintf(out, "capture: %lu requests, %lu dropped, %llu bytes written\n",
+            captured, dropped, written);
+}
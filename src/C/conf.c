@@ -0,0 +1,657 @@
+/**
+ * @file    conf.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Runtime configuration. The server reads an optional
+ * "key = value" file at startup and re-reads it on SIGHUP. Lines
+ * starting with '#' are comments, unknown keys are errors.
+ *
+ * The active configuration is only ever copied out under a read
+ * lock, so every connection works with a consistent snapshot even
+ * while a reload swaps the values underneath it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include <log.h>
+#include <config.h>
+#include <httpparser.h>
+#include <conf.h>
+#include <h2.h>
+#include <listen.h>
+
+enum confType {
+    CONF_INT,
+    CONF_BOOL,
+    CONF_STRING,
+    CONF_SNDBUF,
+    CONF_PROXY,
+    CONF_ALLOW,
+    CONF_CACHE,
+    CONF_LISTEN,
+    CONF_FCGI
+};
+
+typedef struct confKey {
+    const char *name;
+    enum confType type;
+    size_t offset;
+    long min;
+    long max;
+} confKey;
+
+#define KEY(name, type, field, min, max) \
+    { name, type, offsetof(serverConfig, field), min, max }
+
+static const confKey confKeys[] = {
+    KEY("min_port",          CONF_INT,    minPort,         1, MAX_PORT),
+    KEY("backlog",           CONF_INT,    backlog,         1, 65535),
+    KEY("connection_limit",  CONF_INT,    connectionLimit, 1, 1000000),
+    KEY("max_line",          CONF_INT,    maxLine,         64, 1 << 20),
+    KEY("max_buf_size",      CONF_INT,    maxBufSize,      64, 1 << 20),
+    KEY("restart_timeout",   CONF_INT,    restartTimeout,  1, 3600),
+    KEY("drain_timeout",     CONF_INT,    drainTimeout,    0, 86400),
+    KEY("worker_cpus",       CONF_STRING, workerCpus,      0, 0),
+    KEY("event_threads",     CONF_INT,    eventThreads,    0, 1024),
+    KEY("io_threads",        CONF_INT,    ioThreads,       0, 1024),
+    KEY("io_queue",          CONF_INT,    ioQueue,         1, 1000000),
+    KEY("memory_budget",     CONF_INT,    memoryBudget,    0, 1 << 24),
+    KEY("path_index",        CONF_INT,    pathIndex,       0, 1 << 30),
+    KEY("listen",            CONF_LISTEN, listens,         0, 0),
+    KEY("tcp_defer_accept",  CONF_INT,    deferAccept,     0, 3600),
+    KEY("tcp_fastopen",      CONF_INT,    fastOpen,        0, 65535),
+    KEY("tcp_nodelay",       CONF_BOOL,   noDelay,         0, 1),
+    KEY("tcp_notsent_lowat", CONF_INT,    notSentLowat,    0, 1 << 30),
+    KEY("so_rcvbuf",         CONF_INT,    rcvBuf,          0, 1 << 30),
+    KEY("so_sndbuf",         CONF_SNDBUF, sndBuf,          0, 1 << 30),
+    KEY("so_sndbuf_max",     CONF_INT,    sndBufMax,       4096, 1 << 30),
+    KEY("so_busy_poll",      CONF_INT,    busyPoll,        0, 1000000),
+    KEY("send_quantum",      CONF_INT,    sendQuantum,     0, 1 << 30),
+    KEY("proxy",             CONF_PROXY,  proxies,         0, 0),
+    KEY("proxy_idle_connections", CONF_INT, proxyIdle,     0, 1024),
+    KEY("proxy_timeout",     CONF_INT,    proxyTimeout,    1, 3600),
+    KEY("proxy_cache_size",  CONF_INT,    proxyCacheSize,  0, 1 << 30),
+    KEY("proxy_cache_max_object", CONF_INT, proxyCacheMaxObject, 0, 1 << 30),
+    KEY("fastcgi",           CONF_FCGI,   fcgis,           0, 0),
+    KEY("fastcgi_connections", CONF_INT,  fcgiConnections, 1, FASTCGI_CONNS_MAX),
+    KEY("fastcgi_timeout",   CONF_INT,    fcgiTimeout,     1, 3600),
+    KEY("fastcgi_queue_timeout", CONF_INT, fcgiQueueTimeout, 0, 3600),
+    KEY("rate_limit",        CONF_INT,    rateLimit,       0, 1000000),
+    KEY("rate_burst",        CONF_INT,    rateBurst,       1, 1000000),
+    KEY("client_connection_limit", CONF_INT, clientConnectionLimit, 0, 1000000),
+    KEY("fair_queue",        CONF_INT,    fairQueue,       0, 65536),
+    KEY("rate_allow",        CONF_ALLOW,  allow,           0, 0),
+    KEY("cache",             CONF_CACHE,  cacheRules,      0, 0),
+    KEY("cache_fingerprint", CONF_INT,    cacheFingerprint, 0, 1 << 30),
+    KEY("trace_sample",      CONF_INT,    traceSample,     0, 1 << 30),
+    KEY("trace_slow_ms",     CONF_INT,    traceSlowMs,     0, 3600000),
+    KEY("trace_file",        CONF_STRING, traceFile,       0, 0),
+    KEY("capture_file",      CONF_STRING, captureFile,     0, 0),
+    KEY("capture_buffer",    CONF_INT,    captureBuffer,   1, 1024),
+    KEY("h2c",               CONF_BOOL,   h2c,             0, 1),
+    KEY("h2_max_streams",    CONF_INT,    h2MaxStreams,    1, H2_STREAMS_MAX),
+    KEY("h2_idle_timeout",   CONF_INT,    h2IdleTimeout,   1, 3600),
+    KEY("h2_header_table",   CONF_INT,    h2HeaderTable,   0, 65536),
+};
+
+static pthread_rwlock_t confLock = PTHREAD_RWLOCK_INITIALIZER;
+static serverConfig current;
+static volatile unsigned int generation;    /* bumped on every change */
+static char confFile[CONF_MAX_VALUE];
+
+static void confDefaults(serverConfig *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->minPort = MIN_PORT;
+    cfg->backlog = BACKLOG;
+    cfg->connectionLimit = CONNECTION_LIMIT;
+    cfg->maxLine = DEFAULT_MAX_LINE;
+    cfg->maxBufSize = MAX_BUF_SIZE;
+    cfg->restartTimeout = RESTART_TIMEOUT;
+    cfg->drainTimeout = DRAIN_TIMEOUT;
+    cfg->ioThreads = IO_THREADS;
+    cfg->ioQueue = IO_QUEUE;
+    cfg->memoryBudget = MEMORY_BUDGET;
+    cfg->pathIndex = PATH_INDEX;
+    cfg->sndBufMax = SNDBUF_MAX;
+    cfg->sendQuantum = SEND_QUANTUM;
+    cfg->proxyIdle = PROXY_IDLE_CONNECTIONS;
+    cfg->proxyTimeout = PROXY_TIMEOUT;
+    cfg->proxyCacheSize = PROXY_CACHE_SIZE;
+    cfg->proxyCacheMaxObject = PROXY_CACHE_MAX_OBJECT;
+    cfg->fcgiConnections = FASTCGI_CONNECTIONS;
+    cfg->fcgiTimeout = FASTCGI_TIMEOUT;
+    cfg->fcgiQueueTimeout = FASTCGI_QUEUE_TIMEOUT;
+    cfg->rateBurst = RATE_BURST;
+    cfg->fairQueue = FAIR_QUEUE;
+    cfg->cacheFingerprint = CACHE_FINGERPRINT;
+    strcpy(cfg->traceFile, TRACE_FILE);
+    cfg->captureBuffer = CAPTURE_BUFFER;
+    cfg->h2c = 1;
+    cfg->h2MaxStreams = H2_MAX_STREAMS;
+    cfg->h2IdleTimeout = H2_IDLE_TIMEOUT;
+    cfg->h2HeaderTable = H2_HEADER_TABLE;
+}
+
+static char *trim(char *str)
+{
+    char *end;
+
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    end = str + strlen(str);
+    while ((end > str) && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+/**
+ * confAddProxy : appends a "prefix upstream" route.
+ * return: SUCCESS or FAILURE
+ */
+static int confAddProxy(serverConfig *cfg, const char *value)
+{
+    proxyRoute *route;
+    const char *sep = value;
+    size_t len;
+
+    while ((*sep != '\0') && !isspace((unsigned char) *sep)) {
+        sep++;
+    }
+    len = sep - value;
+    while (isspace((unsigned char) *sep)) {
+        sep++;
+    }
+
+    if ((cfg->numProxies == PROXY_MAX_ROUTES) || (len == 0) ||
+        (len >= PROXY_MAX_PREFIX) || (value[0] != '/') ||
+        (*sep == '\0') || (strlen(sep) >= PROXY_MAX_UPSTREAM)) {
+        return FAILURE;
+    }
+
+    route = &cfg->proxies[cfg->numProxies++];
+    memcpy(route->prefix, value, len);
+    route->prefix[len] = '\0';
+    strcpy(route->upstream, sep);
+    return SUCCESS;
+}
+
+/**
+ * confAddFcgi : appends a "prefix backend [connections=N]" route.
+ * return: SUCCESS or FAILURE
+ */
+static int confAddFcgi(serverConfig *cfg, const char *value)
+{
+    fcgiRoute *route;
+    const char *sep = value, *opt;
+    size_t len, backendLen;
+    char *end;
+    long num = 0;
+
+    while ((*sep != '\0') && !isspace((unsigned char) *sep)) {
+        sep++;
+    }
+    len = sep - value;
+    while (isspace((unsigned char) *sep)) {
+        sep++;
+    }
+    for (backendLen = 0; (sep[backendLen] != '\0') &&
+         !isspace((unsigned char) sep[backendLen]); backendLen++) {
+    }
+    opt = sep + backendLen;
+    while (isspace((unsigned char) *opt)) {
+        opt++;
+    }
+
+    if ((cfg->numFcgis == FASTCGI_MAX_ROUTES) || (len == 0) ||
+        (len >= PROXY_MAX_PREFIX) || (value[0] != '/') ||
+        (backendLen == 0) || (backendLen >= PROXY_MAX_UPSTREAM)) {
+        return FAILURE;
+    }
+    if (*opt != '\0') {
+        if (strncmp(opt, "connections=", 12)) {
+            return FAILURE;
+        }
+        errno = 0;
+        num = strtol(opt + 12, &end, 10);
+        if ((errno != 0) || (end == opt + 12) || (*end != '\0') ||
+            (num < 1) || (num > FASTCGI_CONNS_MAX)) {
+            return FAILURE;
+        }
+    }
+
+    route = &cfg->fcgis[cfg->numFcgis++];
+    memcpy(route->prefix, value, len);
+    route->prefix[len] = '\0';
+    memcpy(route->backend, sep, backendLen);
+    route->backend[backendLen] = '\0';
+    route->connections = num;
+    return SUCCESS;
+}
+
+/**
+ * confAddAllow : appends an "address[/prefix]" network, IPv4 or IPv6.
+ * return: SUCCESS or FAILURE
+ */
+static int confAddAllow(serverConfig *cfg, const char *value)
+{
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(value, '/');
+    size_t len = slash ? (size_t) (slash - value) : strlen(value);
+    allowNet *net;
+    long prefix;
+    char *end;
+    int v4;
+
+    if ((cfg->numAllow == RATE_MAX_ALLOW) || (len == 0) ||
+        (len >= sizeof(addr))) {
+        return FAILURE;
+    }
+    memcpy(addr, value, len);
+    addr[len] = '\0';
+
+    net = &cfg->allow[cfg->numAllow];
+    memset(net, 0, sizeof(*net));
+    if (inet_pton(AF_INET, addr, net->addr + 12) == 1) {
+        net->addr[10] = net->addr[11] = 0xff;
+        v4 = 1;
+    } else if (inet_pton(AF_INET6, addr, net->addr) == 1) {
+        v4 = 0;
+    } else {
+        return FAILURE;
+    }
+
+    prefix = v4 ? 32 : 128;
+    if (slash != NULL) {
+        errno = 0;
+        prefix = strtol(slash + 1, &end, 10);
+        if ((errno != 0) || (end == slash + 1) || (*end != '\0') ||
+            (prefix < 0) || (prefix > (v4 ? 32 : 128))) {
+            return FAILURE;
+        }
+    }
+    net->prefixLen = v4 ? prefix + 96 : prefix;
+    cfg->numAllow++;
+    return SUCCESS;
+}
+
+/**
+ * confAddListen : appends an "address [proxy_protocol] [v6only]
+ * [backlog=N] [mode=0660]" listener.
+ * return: SUCCESS or FAILURE
+ */
+static int confAddListen(serverConfig *cfg, const char *value)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    listenSpec *spec;
+    char opt[CONF_MAX_VALUE];
+    const char *sep = value;
+    char *end;
+    size_t len;
+    long num;
+
+    while ((*sep != '\0') && !isspace((unsigned char) *sep)) {
+        sep++;
+    }
+    len = sep - value;
+    if ((cfg->numListens == LISTEN_MAX) || (len == 0) ||
+        (len >= LISTEN_MAX_ADDR)) {
+        return FAILURE;
+    }
+
+    spec = &cfg->listens[cfg->numListens];
+    memset(spec, 0, sizeof(*spec));
+    memcpy(spec->addr, value, len);
+    spec->addr[len] = '\0';
+    if (listenAddress(spec->addr, &addr, &addrLen) != SUCCESS) {
+        return FAILURE;
+    }
+
+    while (*sep != '\0') {
+        while (isspace((unsigned char) *sep)) {
+            sep++;
+        }
+        for (len = 0; (sep[len] != '\0') && !isspace((unsigned char) sep[len]);
+             len++) {
+        }
+        if (len == 0) {
+            break;
+        }
+        memcpy(opt, sep, len);
+        opt[len] = '\0';
+        sep += len;
+
+        if (!strcmp(opt, "proxy_protocol")) {
+            spec->proxyProtocol = 1;
+        } else if (!strcmp(opt, "v6only") && (addr.ss_family == AF_INET6)) {
+            spec->v6only = 1;
+        } else if (!strncmp(opt, "backlog=", 8)) {
+            errno = 0;
+            num = strtol(opt + 8, &end, 10);
+            if ((errno != 0) || (end == opt + 8) || (*end != '\0') ||
+                (num < 1) || (num > 65535)) {
+                return FAILURE;
+            }
+            spec->backlog = num;
+        } else if (!strncmp(opt, "mode=", 5) && (addr.ss_family == AF_UNIX)) {
+            errno = 0;
+            num = strtol(opt + 5, &end, 8);
+            if ((errno != 0) || (end == opt + 5) || (*end != '\0') ||
+                (num < 1) || (num > 0777)) {
+                return FAILURE;
+            }
+            spec->mode = num;
+        } else {
+            return FAILURE;
+        }
+    }
+    cfg->numListens++;
+    return SUCCESS;
+}
+
+/**
+ * cacheMaxAge : the max-age directive of a Cache-Control value.
+ * return: seconds, -1 if there is none
+ */
+static long cacheMaxAge(const char *control)
+{
+    const char *pos = control;
+    char *end;
+    long age;
+
+    while ((pos = strstr(pos, "max-age=")) != NULL) {
+        /* Not s-maxage, which caches other than the client obey */
+        if ((pos == control) || (pos[-1] == ' ') || (pos[-1] == ',')) {
+            age = strtol(pos + 8, &end, 10);
+            return ((end != pos + 8) && (age >= 0)) ? age : -1;
+        }
+        pos += 8;
+    }
+    return -1;
+}
+
+/**
+ * confAddCache : appends a "match directives" caching rule.
+ * return: SUCCESS or FAILURE
+ */
+static int confAddCache(serverConfig *cfg, const char *value)
+{
+    cacheRule *rule;
+    const char *sep = value, *c;
+    size_t len;
+
+    while ((*sep != '\0') && !isspace((unsigned char) *sep)) {
+        sep++;
+    }
+    len = sep - value;
+    while (isspace((unsigned char) *sep)) {
+        sep++;
+    }
+
+    if ((cfg->numCacheRules == CACHE_MAX_RULES) || (len == 0) ||
+        (len >= CACHE_MAX_MATCH) || (*sep == '\0') ||
+        (strlen(sep) >= CACHE_MAX_CONTROL)) {
+        return FAILURE;
+    }
+    for (c = sep; *c != '\0'; c++) {
+        if (!isprint((unsigned char) *c)) {
+            return FAILURE;
+        }
+    }
+
+    rule = &cfg->cacheRules[cfg->numCacheRules];
+    if (value[0] == '/') {
+        rule->kind = CACHE_PREFIX;
+    } else if (value[0] == '.') {
+        rule->kind = CACHE_EXTENSION;
+    } else if (memchr(value, '/', len) != NULL) {
+        rule->kind = CACHE_MIME;
+    } else {
+        return FAILURE;
+    }
+    memcpy(rule->match, value, len);
+    rule->match[len] = '\0';
+    strcpy(rule->control, sep);
+    rule->controlLen = strlen(sep);
+    rule->maxAge = cacheMaxAge(sep);
+    cfg->numCacheRules++;
+    return SUCCESS;
+}
+
+/**
+ * confFinish : settings derived from others once the file is read.
+ */
+static void confFinish(serverConfig *cfg)
+{
+    cacheRule *rule = &cfg->fingerprintRule;
+
+    rule->controlLen = snprintf(rule->control, sizeof(rule->control),
+                                "public, max-age=%d, immutable",
+                                cfg->cacheFingerprint);
+    rule->maxAge = cfg->cacheFingerprint;
+}
+
+/**
+ * confSetKey : validates value and stores it in the field for key.
+ * return: SUCCESS or FAILURE
+ */
+static int confSetKey(serverConfig *cfg, const char *key, const char *value)
+{
+    const confKey *k;
+    char *end;
+    long num;
+    size_t i;
+
+    for (i = 0; i < sizeof(confKeys) / sizeof(confKeys[0]); i++) {
+        k = &confKeys[i];
+        if (strcmp(k->name, key)) {
+            continue;
+        }
+
+        if (k->type == CONF_PROXY) {
+            return confAddProxy(cfg, value);
+        }
+        if (k->type == CONF_FCGI) {
+            return confAddFcgi(cfg, value);
+        }
+        if (k->type == CONF_ALLOW) {
+            return confAddAllow(cfg, value);
+        }
+        if (k->type == CONF_CACHE) {
+            return confAddCache(cfg, value);
+        }
+        if (k->type == CONF_LISTEN) {
+            return confAddListen(cfg, value);
+        }
+
+        if (k->type == CONF_STRING) {
+            if (strlen(value) >= CONF_MAX_VALUE) {
+                return FAILURE;
+            }
+            strcpy((char *) cfg + k->offset, value);
+            return SUCCESS;
+        }
+
+        if ((k->type == CONF_BOOL) &&
+            (!strcmp(value, "on") || !strcmp(value, "yes"))) {
+            value = "1";
+        } else if ((k->type == CONF_BOOL) &&
+                   (!strcmp(value, "off") || !strcmp(value, "no"))) {
+            value = "0";
+        } else if ((k->type == CONF_SNDBUF) && !strcmp(value, "auto")) {
+            *(int *) ((char *) cfg + k->offset) = SNDBUF_AUTO;
+            return SUCCESS;
+        }
+
+        errno = 0;
+        num = strtol(value, &end, 10);
+        if ((errno != 0) || (end == value) || (*end != '\0') ||
+            (num < k->min) || (num > k->max)) {
+            return FAILURE;
+        }
+        *(int *) ((char *) cfg + k->offset) = (int) num;
+        return SUCCESS;
+    }
+
+    return FAILURE;
+}
+
+/**
+ * confParse : reads file on top of the defaults into cfg.
+ * return: SUCCESS or FAILURE, cfg is only valid on SUCCESS
+ */
+static int confParse(const char *file, serverConfig *cfg)
+{
+    char line[CONF_MAX_LINE];
+    char *key, *value, *eq;
+    int lineNo = 0;
+    FILE *fp;
+
+    confDefaults(cfg);
+    if ((file == NULL) || (*file == '\0')) {
+        confFinish(cfg);
+        return SUCCESS;
+    }
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        error_log("Unable to open config file %s: %s", file, strerror(errno));
+        return FAILURE;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineNo++;
+        key = trim(line);
+        if ((*key == '\0') || (*key == '#')) {
+            continue;
+        }
+        if ((eq = strchr(key, '=')) == NULL) {
+            error_log("%s:%d: expected key = value", file, lineNo);
+            fclose(fp);
+            return FAILURE;
+        }
+        *eq = '\0';
+        key = trim(key);
+        value = trim(eq + 1);
+        if (confSetKey(cfg, key, value) != SUCCESS) {
+            error_log("%s:%d: invalid setting %s = %s",
+                      file, lineNo, key, value);
+            fclose(fp);
+            return FAILURE;
+        }
+    }
+
+    fclose(fp);
+    confFinish(cfg);
+    return SUCCESS;
+}
+
+/**
+*confInit : loads the configuration, defaults only if file is NULL.
+*return:
+*       SUCCESS or FAILURE
+*/
+int confInit(const char *file)
+{
+    serverConfig cfg;
+
+    if (file != NULL) {
+        if (strlen(file) >= sizeof(confFile)) {
+            error_log("Config file path too long: %s", file);
+            return FAILURE;
+        }
+        strcpy(confFile, file);
+    }
+
+    if (confParse(confFile, &cfg) != SUCCESS) {
+        return FAILURE;
+    }
+
+    pthread_rwlock_wrlock(&confLock);
+    current = cfg;
+    generation++;
+    pthread_rwlock_unlock(&confLock);
+    return SUCCESS;
+}
+
+/**
+*confReload : re-reads the config file. On error the running
+*configuration is left untouched.
+*return:
+*       SUCCESS or FAILURE
+*/
+int confReload(void)
+{
+    serverConfig cfg;
+
+    if (confParse(confFile, &cfg) != SUCCESS) {
+        error_log("%s", "Keeping previous configuration");
+        return FAILURE;
+    }
+
+    pthread_rwlock_wrlock(&confLock);
+    current = cfg;
+    generation++;
+    pthread_rwlock_unlock(&confLock);
+
+    debug_log("Reloaded configuration from %s",
+              confFile[0] ? confFile : "defaults");
+    return SUCCESS;
+}
+
+/**
+*confSnapshot : copies the active configuration into cfg.
+*/
+void confSnapshot(serverConfig *cfg)
+{
+    pthread_rwlock_rdlock(&confLock);
+    *cfg = current;
+    pthread_rwlock_unlock(&confLock);
+}
+
+/**
+*confRefresh : copies the active configuration into cfg if it changed
+*since the copy gen was returned for. Cheap when nothing changed.
+*args:
+*       cfg: the copy to bring up to date
+*       gen: generation of that copy, 0 for none yet; updated
+*return:
+*       1 if cfg was copied, 0 if it was current
+*/
+int confRefresh(serverConfig *cfg, unsigned int *gen)
+{
+    if (*gen == generation) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&confLock);
+    *cfg = current;
+    *gen = generation;
+    pthread_rwlock_unlock(&confLock);
+    return 1;
+}
+
+/**
+*confConnectionLimit : connection_limit of the active configuration.
+*/
+int confConnectionLimit(void)
+{
+    int limit;
+
+    pthread_rwlock_rdlock(&confLock);
+    limit = current.connectionLimit;
+    pthread_rwlock_unlock(&confLock);
+    return limit;
+}
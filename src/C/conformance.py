@@ -0,0 +1,294 @@
+#!/usr/bin/env python3
+
+# conformance.py - Differential conformance and latency check of the C
+# server against the reference implementation (../reference/simple.py)
+#
+# Starts both servers on the same www root, replays a corpus of raw
+# requests against each, and compares the responses byte for byte:
+# status line, header block and body. Values of the Date header are
+# masked unless --strict is given, since they change every second, as
+# is trailing whitespace in header lines (BaseHTTPServer appends an
+# empty sys_version to Server). So are the 103 Early Hints and Link
+# preload headers the C server adds to HTML pages, which the reference
+# has no equivalent of.
+# Per-request latency (connect to close, median of --repeat runs) is
+# reported side by side.
+#
+# Where the server is meant to answer differently (see the notes in
+# conformance.expected) the file lists the request, the status the
+# server answers with and what differs. Those differences are reported
+# as "expected", anything else as DIFF.
+#
+# Usage: ./conformance.py --www <absolute www path> [options]
+#        make conformance
+#
+# Exits 1 if any response differs other than listed in --expected (with
+# --strict, if any differs at all), 0 otherwise.
+
+import argparse
+import difflib
+import glob
+import os
+import re
+import shlex
+import socket
+import statistics
+import subprocess
+import sys
+import time
+
+# Built in corpus: (name, raw request bytes)
+CORPUS = [
+    ('get-root', b'GET / HTTP/1.1\r\nHost: localhost\r\n\r\n'),
+    ('get-index', b'GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n'),
+    ('get-css', b'GET /style.css HTTP/1.1\r\nHost: localhost\r\n\r\n'),
+    ('get-png', b'GET /images/server_attention_span.png HTTP/1.1\r\n\r\n'),
+    ('get-no-headers', b'GET /index.html HTTP/1.1\r\n\r\n'),
+    ('get-http10', b'GET /index.html HTTP/1.0\r\n\r\n'),
+    ('head-root', b'HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n'),
+    ('head-png', b'HEAD /images/server_attention_span.png HTTP/1.1\r\n\r\n'),
+    ('404-missing', b'GET /missing.html HTTP/1.1\r\n\r\n'),
+    ('404-head', b'HEAD /missing.html HTTP/1.1\r\n\r\n'),
+    ('403-directory', b'GET /images HTTP/1.1\r\n\r\n'),
+    ('403-directory-slash', b'GET /images/ HTTP/1.1\r\n\r\n'),
+    ('505-version', b'GET / HTTP/2.0\r\n\r\n'),
+    ('505-version-head', b'HEAD / HTTP/3.1\r\n\r\n'),
+    ('501-post', b'POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n'),
+    ('501-lowercase', b'get / HTTP/1.1\r\n\r\n'),
+    ('malformed-garbage', b'GARBAGE\r\n\r\n'),
+    ('malformed-no-version', b'GET /\r\n\r\n'),
+    ('malformed-bad-version', b'GET / HTTX/1.1\r\n\r\n'),
+    ('malformed-header', b'GET / HTTP/1.1\r\nNoColonHere\r\n\r\n'),
+    ('query-string', b'GET /index.html?x=1 HTTP/1.1\r\n\r\n'),
+    ('dot-segment', b'GET /./index.html HTTP/1.1\r\n\r\n'),
+    ('percent-encoded', b'GET /%69ndex.html HTTP/1.1\r\n\r\n'),
+    ('traversal', b'GET /../../../../etc/passwd HTTP/1.1\r\n\r\n'),
+    ('long-uri', b'GET /' + b'a' * 2000 + b' HTTP/1.1\r\n\r\n'),
+    ('pipelined', b'GET /style.css HTTP/1.1\r\n\r\n'
+                  b'GET /index.html HTTP/1.1\r\n\r\n'),
+]
+
+DATE_RE = re.compile(rb'^(Date:)[^\r\n]*', re.IGNORECASE | re.MULTILINE)
+TRAILING_WS_RE = re.compile(rb'[ \t]+(?=\r\n)')
+INTERIM_RE = re.compile(rb'^HTTP/1\.1 1\d\d [^\r\n]*\r\n.*?\r\n\r\n',
+                        re.DOTALL)
+LINK_RE = re.compile(rb'^Link:[^\r\n]*\r\n', re.IGNORECASE | re.MULTILINE)
+STATUS_RE = re.compile(rb'^HTTP/\d\.\d ([2-5]\d\d)', re.MULTILINE)
+
+
+def free_port():
+    sock = socket.socket()
+    sock.bind(('127.0.0.1', 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def wait_listening(port, proc, timeout=10.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def start(cmd, port):
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    if not wait_listening(port, proc):
+        proc.kill()
+        sys.exit('failed to start: %s' % ' '.join(cmd))
+    return proc
+
+
+def exchange(port, raw, timeout):
+    """Sends raw, reads until the server closes. Returns (bytes, secs)."""
+    start_time = time.perf_counter()
+    sock = socket.create_connection(('127.0.0.1', port), timeout)
+    sock.settimeout(timeout)
+    data = []
+    try:
+        sock.sendall(raw)
+        sock.shutdown(socket.SHUT_WR)
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data.append(chunk)
+    except OSError as err:
+        data.append(('\n<%s>' % err).encode())
+    finally:
+        sock.close()
+    return b''.join(data), time.perf_counter() - start_time
+
+
+def split_response(resp):
+    head, sep, body = resp.partition(b'\r\n\r\n')
+    if not sep:
+        return resp.split(b'\r\n'), b''
+    return head.split(b'\r\n'), body
+
+
+def mask(resp):
+    resp = INTERIM_RE.sub(b'', resp, count=1)
+    head, sep, body = resp.partition(b'\r\n\r\n')
+    head = LINK_RE.sub(b'', head + b'\r\n')[:-2]
+    head = TRAILING_WS_RE.sub(b'', DATE_RE.sub(rb'\1 <masked>', head + sep))
+    return head + body
+
+
+def compare(ref, ours, strict):
+    """Returns a list of (part, description) of the differences, part
+    being status, headers or body. Empty if identical."""
+    if not strict:
+        ref = mask(ref)
+        ours = mask(ours)
+    if ref == ours:
+        return []
+
+    diffs = []
+    ref_head, ref_body = split_response(ref)
+    our_head, our_body = split_response(ours)
+    if ref_head[:1] != our_head[:1]:
+        diffs.append(('status', 'status line: %r != %r'
+                      % (ref_head[:1], our_head[:1])))
+    if ref_head[1:] != our_head[1:]:
+        lines = difflib.unified_diff(
+            [h.decode('latin-1') for h in ref_head[1:]],
+            [h.decode('latin-1') for h in our_head[1:]],
+            'reference', 'server', lineterm='', n=0)
+        diffs.append(('headers', 'headers:\n      ' +
+                      '\n      '.join(list(lines)[2:])))
+    if ref_body != our_body:
+        offset = next((i for i, (a, b) in enumerate(zip(ref_body, our_body))
+                       if a != b), min(len(ref_body), len(our_body)))
+        diffs.append(('body', 'body: %d vs %d bytes, first difference at '
+                      'byte %d' % (len(ref_body), len(our_body), offset)))
+    return diffs
+
+
+def status_of(resp):
+    """The status code of the first final response, '-' if none."""
+    match = STATUS_RE.search(resp)
+    return match.group(1).decode() if match else '-'
+
+
+def load_expected(path):
+    """Reads the expected differences: {request: [(status, parts)]}, a
+    request listed more than once may differ in any of those ways."""
+    expected = {}
+    if path is None or not os.path.exists(path):
+        return expected
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.split('#', 1)[0].split()
+            if not line:
+                continue
+            if len(line) != 3:
+                sys.exit('%s:%d: expected <request> <status> <parts>'
+                         % (path, number))
+            expected.setdefault(line[0], []).append(
+                (line[1], set(line[2].split(','))))
+    return expected
+
+
+def load_corpus(path):
+    if path is None:
+        return CORPUS
+    corpus = []
+    for name in sorted(glob.glob(os.path.join(path, '*.req'))):
+        with open(name, 'rb') as f:
+            corpus.append((os.path.basename(name)[:-4], f.read()))
+    return corpus
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(
+        description="Compare the C server against the reference simple.py")
+    parser.add_argument('--server', default=os.path.join(here, 'server'))
+    parser.add_argument('--reference', default=os.path.join(
+        here, '..', 'reference', 'simple.py'))
+    parser.add_argument('--python2', default='python2',
+                        help='interpreter for the reference (Python 2)')
+    parser.add_argument('--www', default=os.path.join(here, 'www'))
+    parser.add_argument('--corpus', help='directory of raw *.req files')
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='runs per request for the latency median')
+    parser.add_argument('--timeout', type=float, default=5.0)
+    parser.add_argument('--strict', action='store_true',
+                        help='do not mask Date values and trailing '
+                        'whitespace in headers, and count every difference')
+    parser.add_argument('--expected', default=os.path.join(
+        here, 'conformance.expected'),
+        help='differences the server is meant to have')
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='print full responses of mismatches')
+    args = parser.parse_args()
+
+    www = os.path.abspath(args.www)
+    expected = {} if args.strict else load_expected(args.expected)
+    ref_port, our_port = free_port(), free_port()
+    ref = start(shlex.split(args.python2) +
+                [args.reference, str(ref_port), www], ref_port)
+    ours = start([args.server, str(our_port), www], our_port)
+
+    failures = known = 0
+    ref_total = our_total = 0.0
+    try:
+        print('%-24s %10s %10s  %s' % ('request', 'ref ms', 'server ms',
+                                       'result'))
+        for name, raw in load_corpus(args.corpus):
+            ref_times, our_times = [], []
+            for _ in range(max(1, args.repeat)):
+                ref_resp, secs = exchange(ref_port, raw, args.timeout)
+                ref_times.append(secs)
+                our_resp, secs = exchange(our_port, raw, args.timeout)
+                our_times.append(secs)
+
+            ref_ms = statistics.median(ref_times) * 1000
+            our_ms = statistics.median(our_times) * 1000
+            ref_total += ref_ms
+            our_total += our_ms
+            diffs = compare(ref_resp, our_resp, args.strict)
+            status = status_of(our_resp)
+            if not diffs:
+                result = 'ok'
+                if name in expected:
+                    result += ' (listed in %s, no longer differs)' \
+                        % os.path.basename(args.expected)
+            elif (status, set(part for part, _ in diffs)) in \
+                    expected.get(name, []):
+                result = 'expected'
+                known += 1
+            else:
+                result = 'DIFF'
+                failures += 1
+            print('%-24s %10.3f %10.3f  %s' % (name, ref_ms, our_ms, result))
+            if result == 'DIFF' or (diffs and args.verbose):
+                print('    server status %s, differs in %s'
+                      % (status, ','.join(part for part, _ in diffs)))
+                for _, diff in diffs:
+                    print('    ' + diff)
+                if args.verbose:
+                    print('    reference: %r' % ref_resp[:512])
+                    print('    server:    %r' % our_resp[:512])
+        print('%-24s %10.3f %10.3f  %d of %d differ, %d as expected'
+              % ('total', ref_total, our_total, failures + known,
+                 len(load_corpus(args.corpus)), known))
+    finally:
+        ref.terminate()
+        ours.terminate()
+        ref.wait()
+        ours.wait()
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,1046 @@
+/**
+ * @file    fastcgi.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief FastCGI gateway. Requests whose URI starts with a configured
+ * prefix are passed to a FastCGI responder over TCP ("host:port") or a
+ * Unix socket ("unix:/path", "unix:@name"), so dynamic endpoints are
+ * served by long-lived workers instead of a process per request.
+ *
+ * Every request is sent with FCGI_KEEP_CONN and its connection goes
+ * back to the pool of the backend once the responder ends the request.
+ * A backend is sent at most fastcgi_connections requests at once (or
+ * connections= of the route), each on a connection of its own; the
+ * rest wait fastcgi_queue_timeout seconds for one to be freed, then
+ * get 503. Responders rarely accept more than one request on a
+ * connection, with FCGI_MPXS_CONNS, so requests are never interleaved
+ * on one.
+ *
+ * The request body is streamed to the responder as it is read from
+ * the client, and its output is sent on to the client a record at a
+ * time once the CGI headers are in, never kept whole.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <fastcgi.h>
+#include <listen.h>
+#include <trace.h>
+#include <response.h>
+#include <uri.h>
+#include <memgov.h>
+
+/* Record types and values of the FastCGI 1.0 specification */
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_CONTENT_MAX 65535
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+
+/* Requests run one per connection, they can all have the same id */
+#define FCGI_REQUEST_ID 1
+
+typedef struct backend {
+    char name[PROXY_MAX_UPSTREAM];
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    int resolved;
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    int active;                 /* requests being served */
+    int idle[FASTCGI_CONNS_MAX];
+    int numIdle;
+    unsigned long served;
+    unsigned long queued;
+    unsigned long rejected;
+    struct backend *next;
+} backend;
+
+/* One request to a backend, see fcgiServe */
+typedef struct fcgiRequest {
+    int fd;
+    char *out;                  /* records waiting to be sent */
+    size_t outLen;
+    size_t recStart;            /* header of the record being filled */
+    int recType;                /* 0 if none is */
+    char *in;                   /* record received, or scratch */
+} fcgiRequest;
+
+static pthread_mutex_t backendsLock = PTHREAD_MUTEX_INITIALIZER;
+static backend *backends;
+
+/* Request headers not passed on as HTTP_ params */
+static const char *skipHeaders[] = {
+    "Content-Type", "Content-Length", "Connection", "Keep-Alive",
+    "Transfer-Encoding", "Upgrade", "Proxy", NULL
+};
+
+/* Response headers the server sets itself */
+static const char *ownHeaders[] = {
+    "Status", "Server", "Date", "Connection", "Keep-Alive",
+    "Transfer-Encoding", NULL
+};
+
+static int sendAll(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        traceCall(TRACE_CALL_SEND);
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FAILURE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * recvAll : reads exactly len bytes.
+ * return: SUCCESS, FAILURE with *timedOut set if the backend was slow
+ */
+static int recvAll(int fd, char *buf, size_t len, int *timedOut)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        traceCall(TRACE_CALL_RECV);
+        n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            *timedOut = (n < 0) &&
+                        ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+            return FAILURE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+static int nameIn(const char **names, const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; names[i] != NULL; i++) {
+        if ((strlen(names[i]) == len) && !strncasecmp(name, names[i], len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void recordHeader(char *h, int type, size_t len)
+{
+    h[0] = FCGI_VERSION_1;
+    h[1] = type;
+    h[2] = 0;
+    h[3] = FCGI_REQUEST_ID;
+    h[4] = (len >> 8) & 0xff;
+    h[5] = len & 0xff;
+    h[6] = 0;
+    h[7] = 0;
+}
+
+static int outFlush(fcgiRequest *r)
+{
+    size_t len = r->outLen;
+
+    r->outLen = 0;
+    return sendAll(r->fd, r->out, len);
+}
+
+/* Fills in the header of the record being filled, if there is one */
+static void recordEnd(fcgiRequest *r)
+{
+    if (r->recType != 0) {
+        recordHeader(r->out + r->recStart, r->recType,
+                     r->outLen - r->recStart - FCGI_HEADER_LEN);
+        r->recType = 0;
+    }
+}
+
+/**
+ * recordAppend : appends len bytes to the records of type, all in the
+ * same record. Responders parse each params record on its own, a
+ * name-value pair must not straddle two.
+ * return: SUCCESS or FAILURE
+ */
+static int recordAppend(fcgiRequest *r, int type, const char *data,
+                        size_t len)
+{
+    if ((r->recType != type) ||
+        (r->outLen - r->recStart - FCGI_HEADER_LEN + len > FCGI_CONTENT_MAX) ||
+        (r->outLen + len > FASTCGI_BUF)) {
+        recordEnd(r);
+        if (len > FCGI_CONTENT_MAX) {
+            return FAILURE;
+        }
+        if ((r->outLen + FCGI_HEADER_LEN + len > FASTCGI_BUF) &&
+            (outFlush(r) != SUCCESS)) {
+            return FAILURE;
+        }
+        r->recStart = r->outLen;
+        r->recType = type;
+        r->outLen += FCGI_HEADER_LEN;
+    }
+    memcpy(r->out + r->outLen, data, len);
+    r->outLen += len;
+    return SUCCESS;
+}
+
+/* An empty record, the end of the stream of type */
+static int recordClose(fcgiRequest *r, int type)
+{
+    recordEnd(r);
+    if ((r->outLen + FCGI_HEADER_LEN > FASTCGI_BUF) &&
+        (outFlush(r) != SUCCESS)) {
+        return FAILURE;
+    }
+    recordHeader(r->out + r->outLen, type, 0);
+    r->outLen += FCGI_HEADER_LEN;
+    return SUCCESS;
+}
+
+static size_t lengthPut(char *p, size_t len)
+{
+    if (len < 128) {
+        p[0] = len;
+        return 1;
+    }
+    p[0] = ((len >> 24) & 0x7f) | 0x80;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+    return 4;
+}
+
+/**
+ * paramAdd : appends a name-value pair to the params. With httpName
+ * set, name is a request header turned into its HTTP_ variable.
+ * return: SUCCESS or FAILURE
+ */
+static int paramAdd(fcgiRequest *r, const char *name, size_t nameLen,
+                    const char *value, size_t valueLen, int httpName)
+{
+    size_t fullLen = nameLen + (httpName ? 5 : 0), n, i;
+    char *p = r->in;
+
+    if (fullLen + valueLen + 8 > FCGI_CONTENT_MAX) {
+        return FAILURE;
+    }
+    n = lengthPut(p, fullLen);
+    n += lengthPut(p + n, valueLen);
+    if (httpName) {
+        memcpy(p + n, "HTTP_", 5);
+        n += 5;
+        for (i = 0; i < nameLen; i++) {
+            p[n++] = (name[i] == '-') ? '_' : toupper((unsigned char) name[i]);
+        }
+    } else {
+        memcpy(p + n, name, nameLen);
+        n += nameLen;
+    }
+    memcpy(p + n, value, valueLen);
+    n += valueLen;
+    return recordAppend(r, FCGI_PARAMS, p, n);
+}
+
+static int paramStr(fcgiRequest *r, const char *name, const char *value)
+{
+    return paramAdd(r, name, strlen(name), value, strlen(value), 0);
+}
+
+/**
+ * paramSocket : REMOTE_ or SERVER_ ADDR and PORT of one end of the
+ * client connection, none for Unix sockets.
+ */
+static int paramSocket(fcgiRequest *r, int client_sock, int peer)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    const char *h = host;
+
+    if (((peer ? getpeername(client_sock, (struct sockaddr *) &addr, &len) :
+                 getsockname(client_sock, (struct sockaddr *) &addr, &len))
+         < 0) ||
+        ((addr.ss_family != AF_INET) && (addr.ss_family != AF_INET6)) ||
+        (getnameinfo((struct sockaddr *) &addr, len, host, sizeof(host),
+                     port, sizeof(port),
+                     NI_NUMERICHOST | NI_NUMERICSERV) != 0)) {
+        return SUCCESS;
+    }
+    if (!strncmp(h, "::ffff:", 7) && (strchr(h + 7, '.') != NULL)) {
+        h += 7;
+    }
+    if ((paramStr(r, peer ? "REMOTE_ADDR" : "SERVER_ADDR", h) != SUCCESS) ||
+        (paramStr(r, peer ? "REMOTE_PORT" : "SERVER_PORT", port) != SUCCESS)) {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * backendResolve : fills in the socket address of a backend.
+ */
+static int backendResolve(backend *b)
+{
+    struct addrinfo hints, *res;
+    char host[PROXY_MAX_UPSTREAM];
+    char *port;
+    int status;
+
+    if (!strncmp(b->name, "unix:", 5)) {
+        if (listenAddress(b->name, &b->addr, &b->addrLen) != SUCCESS) {
+            error_log("Bad FastCGI backend %s", b->name);
+            return FAILURE;
+        }
+        b->resolved = 1;
+        return SUCCESS;
+    }
+
+    strcpy(host, b->name);
+    if ((port = strrchr(host, ':')) == NULL) {
+        return FAILURE;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((status = getaddrinfo(host, port, &hints, &res)) != 0) {
+        error_log("Unable to resolve FastCGI backend %s: %s",
+                  b->name, gai_strerror(status));
+        return FAILURE;
+    }
+    memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+    b->addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    b->resolved = 1;
+    return SUCCESS;
+}
+
+/**
+ * backendGet : finds the connection pool of a backend, creating it on
+ * first use. Pools live as long as the process, across reloads.
+ */
+static backend *backendGet(const char *name)
+{
+    backend *b;
+
+    pthread_mutex_lock(&backendsLock);
+    for (b = backends; b != NULL; b = b->next) {
+        if (!strcmp(b->name, name)) {
+            break;
+        }
+    }
+    if ((b == NULL) && ((b = calloc(1, sizeof(backend))) != NULL)) {
+        strcpy(b->name, name);
+        pthread_mutex_init(&b->lock, NULL);
+        pthread_cond_init(&b->freed, NULL);
+        b->next = backends;
+        backends = b;
+    }
+    if ((b != NULL) && !b->resolved && (backendResolve(b) != SUCCESS)) {
+        b = NULL;
+    }
+    pthread_mutex_unlock(&backendsLock);
+    return b;
+}
+
+/**
+ * backendAcquire : takes one of the max request slots of the backend,
+ * waiting up to wait seconds for one to be freed.
+ * return: SUCCESS or FAILURE
+ */
+static int backendAcquire(backend *b, int max, int wait)
+{
+    struct timespec deadline;
+    int ret = SUCCESS;
+
+    pthread_mutex_lock(&b->lock);
+    if ((b->active >= max) && (wait > 0)) {
+        b->queued++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait;
+        while ((b->active >= max) &&
+               (pthread_cond_timedwait(&b->freed, &b->lock,
+                                       &deadline) != ETIMEDOUT)) {
+        }
+    }
+    if (b->active >= max) {
+        b->rejected++;
+        ret = FAILURE;
+    } else {
+        b->active++;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+/**
+ * backendConnect : returns a connection to the backend, an idle one
+ * from the pool if there is a usable one.
+ */
+static int backendConnect(backend *b, int timeout, int *reused)
+{
+    struct timeval tv;
+    int optval = 1;
+    char probe;
+    int fd;
+
+    pthread_mutex_lock(&b->lock);
+    while (b->numIdle > 0) {
+        fd = b->idle[--b->numIdle];
+        pthread_mutex_unlock(&b->lock);
+
+        /* Readable while idle means the backend closed it (or worse) */
+        if ((recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) < 0) &&
+            ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    *reused = 0;
+    if ((fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        error_log("socket() error: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Bounds connect(), every recv() and every send() on the backend */
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *) &b->addr, b->addrLen) < 0) {
+        error_log("connect() to FastCGI backend %s error: %s",
+                  b->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (b->addr.ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+    return fd;
+}
+
+/**
+ * backendRelease : gives back the request slot, and the connection to
+ * the pool if the responder ended the request cleanly.
+ */
+static void backendRelease(backend *b, int fd, int reusable)
+{
+    pthread_mutex_lock(&b->lock);
+    if ((fd >= 0) && reusable && (b->numIdle < FASTCGI_CONNS_MAX)) {
+        b->idle[b->numIdle++] = fd;
+        fd = -1;
+    }
+    b->active--;
+    b->served++;
+    pthread_cond_signal(&b->freed);
+    pthread_mutex_unlock(&b->lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static size_t fcgiError(int client_sock, int code, int method)
+{
+    char buf[MAX_BUF_SIZE + 1];
+    bufStruct response;
+    size_t sent = 0;
+
+    respInit(&response, buf, sizeof(buf));
+    serveError(code, &response, method);
+    traceStatus(code);
+
+    if (sendAll(client_sock, response.buffer, response.bufSize) == SUCCESS) {
+        sent += response.bufSize;
+        if ((response.entitySize != 0) &&
+            (sendAll(client_sock, response.entityBuffer,
+                     response.entitySize) == SUCCESS)) {
+            sent += response.entitySize;
+        }
+    }
+    respEntityFree(&response);
+    return sent;
+}
+
+/**
+ * sendRequest : sends the begin record, the params records buildParams
+ * made and the body of the request, the part received along with the
+ * headers and bodyLeft more bytes read from the client.
+ * return: SUCCESS, or FAILURE with *bodyRead set if some of the body
+ * was read from the client
+ */
+static int sendRequest(fcgiRequest *r, const char *params, size_t paramsLen,
+                       const char *body, size_t bodyLen, long bodyLeft,
+                       int client_sock, int *bodyRead)
+{
+    static const char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN };
+    ssize_t n;
+
+    r->outLen = 0;
+    r->recType = 0;
+    if (recordAppend(r, FCGI_BEGIN_REQUEST, begin, sizeof(begin))
+        != SUCCESS) {
+        return FAILURE;
+    }
+    recordEnd(r);
+    if ((r->outLen + paramsLen > FASTCGI_BUF) && (outFlush(r) != SUCCESS)) {
+        return FAILURE;
+    }
+    memcpy(r->out + r->outLen, params, paramsLen);
+    r->outLen += paramsLen;
+    if (recordClose(r, FCGI_PARAMS) != SUCCESS) {
+        return FAILURE;
+    }
+    while (bodyLen > 0) {
+        n = (bodyLen < FCGI_CONTENT_MAX) ? bodyLen : FCGI_CONTENT_MAX;
+        if (recordAppend(r, FCGI_STDIN, body, n) != SUCCESS) {
+            return FAILURE;
+        }
+        body += n;
+        bodyLen -= n;
+    }
+    while (bodyLeft > 0) {
+        *bodyRead = 1;
+        traceCall(TRACE_CALL_RECV);
+        n = recv(client_sock, r->in,
+                 (bodyLeft < FCGI_CONTENT_MAX) ? bodyLeft : FCGI_CONTENT_MAX,
+                 0);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if ((n <= 0) || (recordAppend(r, FCGI_STDIN, r->in, n) != SUCCESS)) {
+            return FAILURE;
+        }
+        bodyLeft -= n;
+    }
+    if (recordClose(r, FCGI_STDIN) != SUCCESS) {
+        return FAILURE;
+    }
+    return outFlush(r);
+}
+
+/**
+ * buildParams : encodes the CGI/1.1 variables of the request into
+ * params records in r->out, to be sent as they are by sendRequest.
+ * They have to fit in it, FASTCGI_BUF bytes.
+ * return: SUCCESS, or the HTTP error code to answer with
+ */
+static int buildParams(fcgiRequest *r, const fcgiRoute *route,
+                       const char *request, int headerEnd, const char *method,
+                       size_t methodLen, const char *target, size_t targetLen,
+                       const char *version, int client_sock, const char *root)
+{
+    char canonical[MAX_BUF_SIZE], filename[MAX_PATH];
+    char scriptName[PROXY_MAX_PREFIX];
+    const char *query, *pos, *eol, *colon, *value, *host = NULL;
+    size_t rootLen = strlen(root), scriptLen, nameLen, valueLen, hostLen = 0;
+    int code, ok;
+
+    if ((code = uriNormalize(target, targetLen, canonical, sizeof(canonical),
+                             &query)) != SUCCESS) {
+        return code;
+    }
+
+    /* The route prefix without its trailing '/' is the script */
+    scriptLen = strlen(route->prefix);
+    if ((scriptLen > 1) && (route->prefix[scriptLen - 1] == '/')) {
+        scriptLen--;
+    }
+    memcpy(scriptName, route->prefix, scriptLen);
+    scriptName[scriptLen] = '\0';
+    /* A target like "/app/../x" is not under the route once normalized */
+    if (strncmp(canonical, scriptName, scriptLen) ||
+        ((canonical[scriptLen] != '/') && (canonical[scriptLen] != '\0'))) {
+        return NOT_FOUND;
+    }
+    while ((rootLen > 1) && (root[rootLen - 1] == '/')) {
+        rootLen--;
+    }
+    if (snprintf(filename, sizeof(filename), "%.*s%s", (int) rootLen, root,
+                 canonical) >= (int) sizeof(filename)) {
+        return NOT_FOUND;
+    }
+
+    r->outLen = 0;
+    r->recType = 0;
+    ok = (paramStr(r, "GATEWAY_INTERFACE", "CGI/1.1") == SUCCESS) &&
+         (paramStr(r, "SERVER_SOFTWARE", "Simple/1.0") == SUCCESS) &&
+         (paramAdd(r, "SERVER_PROTOCOL", 15, version, 8, 0) == SUCCESS) &&
+         (paramAdd(r, "REQUEST_METHOD", 14, method, methodLen, 0)
+          == SUCCESS) &&
+         (paramAdd(r, "REQUEST_URI", 11, target, targetLen, 0) == SUCCESS) &&
+         (paramStr(r, "SCRIPT_NAME", scriptName) == SUCCESS) &&
+         (paramStr(r, "PATH_INFO", canonical + scriptLen) == SUCCESS) &&
+         (paramStr(r, "SCRIPT_FILENAME", filename) == SUCCESS) &&
+         (paramAdd(r, "DOCUMENT_ROOT", 13, root, rootLen, 0) == SUCCESS) &&
+         (paramAdd(r, "QUERY_STRING", 12, query ? query + 1 : "",
+                   query ? (size_t) (target + targetLen - query - 1) : 0, 0)
+          == SUCCESS) &&
+         (paramSocket(r, client_sock, 1) == SUCCESS) &&
+         (paramSocket(r, client_sock, 0) == SUCCESS);
+
+    pos = memmem(request, headerEnd, "\r\n", 2) + 2;
+    while (ok && ((eol = memmem(pos, request + headerEnd - pos, "\r\n", 2))
+                  != NULL) && (eol != pos)) {
+        colon = memchr(pos, ':', eol - pos);
+        nameLen = colon ? (size_t) (colon - pos) : 0;
+        value = colon ? colon + 1 : eol;
+        while ((value < eol) && ((*value == ' ') || (*value == '\t'))) {
+            value++;
+        }
+        valueLen = eol - value;
+        while ((valueLen > 0) && (value[valueLen - 1] == ' ')) {
+            valueLen--;
+        }
+
+        /* X_Foo would pass for X-Foo once turned into HTTP_X_FOO */
+        if ((nameLen == 0) || (memchr(pos, '_', nameLen) != NULL)) {
+            pos = eol + 2;
+            continue;
+        }
+        if ((nameLen == 12) && !strncasecmp(pos, "Content-Type", 12)) {
+            ok = (paramAdd(r, "CONTENT_TYPE", 12, value, valueLen, 0)
+                  == SUCCESS);
+        } else if ((nameLen == 14) &&
+                   !strncasecmp(pos, "Content-Length", 14)) {
+            ok = (paramAdd(r, "CONTENT_LENGTH", 14, value, valueLen, 0)
+                  == SUCCESS);
+        } else if (!nameIn(skipHeaders, pos, nameLen)) {
+            ok = (paramAdd(r, pos, nameLen, value, valueLen, 1) == SUCCESS);
+        }
+        if ((nameLen == 4) && !strncasecmp(pos, "Host", 4)) {
+            host = value;
+            hostLen = valueLen;
+            if ((colon = memrchr(value, ':', valueLen)) != NULL &&
+                (memchr(colon, ']', value + valueLen - colon) == NULL)) {
+                hostLen = colon - value;
+            }
+        }
+        pos = eol + 2;
+    }
+    if (ok && (host != NULL)) {
+        ok = (paramAdd(r, "SERVER_NAME", 11, host, hostLen, 0) == SUCCESS);
+    }
+    recordEnd(r);
+    return ok ? SUCCESS : BAD_REQUEST;
+}
+
+/**
+ * cgiLine : the CGI header line at pos, without its line end.
+ * return: its length, 0 at the blank line ending the headers
+ */
+static size_t cgiLine(const char *pos, const char *end, const char **next)
+{
+    const char *eol = memchr(pos, '\n', end - pos);
+    size_t len;
+
+    if (eol == NULL) {
+        return 0;
+    }
+    *next = eol + 1;
+    len = eol - pos;
+    if ((len > 0) && (pos[len - 1] == '\r')) {
+        len--;
+    }
+    return len;
+}
+
+/**
+ * sendHead : turns the CGI headers the responder wrote, up to and with
+ * the blank line, into the response head and sends it.
+ * return: bytes sent, 0 if that failed; *code set to the status
+ */
+static size_t sendHead(int client_sock, const char *cgi, size_t len,
+                       int *code)
+{
+    const char *pos, *next, *end = cgi + len, *colon, *value;
+    const char *reason = NULL;
+    size_t lineLen, reasonLen = 0;
+    char *buf;
+    bufStruct head;
+    int location = 0;
+
+    *code = 0;
+    for (pos = cgi; (lineLen = cgiLine(pos, end, &next)) > 0; pos = next) {
+        if ((colon = memchr(pos, ':', lineLen)) == NULL) {
+            continue;
+        }
+        if ((colon - pos == 6) && !strncasecmp(pos, "Status", 6)) {
+            value = colon + 1;
+            while ((value < pos + lineLen) && (*value == ' ')) {
+                value++;
+            }
+            *code = atoi(value);
+            while ((value < pos + lineLen) &&
+                   (isdigit((unsigned char) *value) || (*value == ' '))) {
+                value++;
+            }
+            reason = value;
+            reasonLen = pos + lineLen - value;
+        } else if ((colon - pos == 8) && !strncasecmp(pos, "Location", 8)) {
+            location = 1;
+        }
+    }
+    if ((*code < 100) || (*code > 999)) {
+        *code = location ? 302 : 200;
+        reason = NULL;
+    }
+    if ((reason == NULL) || (reasonLen == 0)) {
+        reason = (*code == 302) ? "Found" : (*code == 200) ? "OK" : "";
+        reasonLen = strlen(reason);
+    }
+
+    /* The header lines, the status line and ours fit in a margin */
+    if ((buf = malloc(len + MAX_BUF_SIZE)) == NULL) {
+        return 0;
+    }
+    respInit(&head, buf, len + MAX_BUF_SIZE);
+    respLiteral(&head, "HTTP/1.0 ");
+    respUint(&head, *code);
+    respLiteral(&head, " ");
+    respAppend(&head, reason, reasonLen);
+    respLiteral(&head, "\r\n");
+    respLiteral(&head, server);
+    respDate(&head);
+    respLiteral(&head, connectionClose);
+    for (pos = cgi; (lineLen = cgiLine(pos, end, &next)) > 0; pos = next) {
+        colon = memchr(pos, ':', lineLen);
+        if ((colon != NULL) && !nameIn(ownHeaders, pos, colon - pos)) {
+            respAppend(&head, pos, lineLen);
+            respLiteral(&head, "\r\n");
+        }
+    }
+    respLiteral(&head, "\r\n");
+
+    len = 0;
+    if (!respFailed(&head) &&
+        (sendAll(client_sock, head.buffer, head.bufSize) == SUCCESS)) {
+        len = head.bufSize;
+    }
+    free(buf);
+    return len;
+}
+
+/**
+ * cgiHeadEnd : where the CGI headers in cgi end, after the blank line.
+ * return: NULL if they are not all in yet
+ */
+static const char *cgiHeadEnd(const char *cgi, size_t len)
+{
+    const char *crlf = memmem(cgi, len, "\r\n\r\n", 4);
+    const char *lf = memmem(cgi, len, "\n\n", 2);
+
+    if ((lf != NULL) && ((crlf == NULL) || (lf < crlf))) {
+        return lf + 2;
+    }
+    return (crlf != NULL) ? crlf + 4 : NULL;
+}
+
+/**
+*fcgiMatch : finds the route with the longest prefix matching the
+*request URI.
+*return:
+*       NULL : request is not for a FastCGI backend
+*/
+const fcgiRoute *fcgiMatch(const serverConfig *cfg, const char *request,
+                           int length)
+{
+    const fcgiRoute *match = NULL;
+    const char *target, *end;
+    size_t targetLen, prefixLen, best = 0;
+    int i;
+
+    if (cfg->numFcgis == 0) {
+        return NULL;
+    }
+    if ((target = memchr(request, ' ', length)) == NULL) {
+        return NULL;
+    }
+    target++;
+    if ((end = memchr(target, ' ', length - (target - request))) == NULL) {
+        return NULL;
+    }
+    targetLen = end - target;
+
+    for (i = 0; i < cfg->numFcgis; i++) {
+        prefixLen = strlen(cfg->fcgis[i].prefix);
+        if ((prefixLen <= targetLen) && (prefixLen > best) &&
+            !memcmp(target, cfg->fcgis[i].prefix, prefixLen)) {
+            match = &cfg->fcgis[i];
+            best = prefixLen;
+        }
+    }
+    return match;
+}
+
+/**
+*fcgiServe : passes a request to the FastCGI backend of route and
+*streams the response back to the client.
+*args:
+*       client_sock: client connection
+*       route: matching route from fcgiMatch
+*       request: received request, possibly with the start of its body
+*       length: bytes in request
+*       root: www root, for DOCUMENT_ROOT and SCRIPT_FILENAME
+*return:
+*       bytes sent to the client
+*/
+size_t fcgiServe(int client_sock, const fcgiRoute *route, char *request,
+                 int length, const serverConfig *cfg, const char *root)
+{
+    const char *lineEnd, *target, *version, *hdr, *cgiEnd;
+    fcgiRequest r;
+    char *params = NULL, *cgi = NULL;
+    size_t methodLen, paramsLen = 0, cgiLen = 0, sent = 0, n;
+    long reqBody = 0;
+    int headerEnd, method, code, attempt, reused = 0, bodyRead = 0;
+    int timedOut = 0, ended = 0, headSent = 0, clientGone = 0;
+    int type, id, len, pad, max, retryable;
+    backend *b;
+
+    if (((lineEnd = memmem(request, length, "\r\n", 2)) == NULL) ||
+        ((hdr = memmem(request, length, "\r\n\r\n", 4)) == NULL) ||
+        ((target = memchr(request, ' ', lineEnd - request)) == NULL) ||
+        ((version = memchr(target + 1, ' ', lineEnd - target - 1)) == NULL)) {
+        return fcgiError(client_sock, 400, GET);
+    }
+    headerEnd = hdr + 4 - request;
+    methodLen = target - request;
+    target++;
+    version++;
+    method = ((methodLen == 4) && !memcmp(request, "HEAD", 4)) ? HEAD : GET;
+    retryable = (method == HEAD) ||
+                ((methodLen == 3) && !memcmp(request, "GET", 3));
+
+    if ((lineEnd - version != 8) || memcmp(version, "HTTP/1.", 7)) {
+        return fcgiError(client_sock, 505, method);
+    }
+    for (hdr = lineEnd + 2; hdr < request + headerEnd - 2;
+         hdr = memmem(hdr, request + headerEnd - hdr, "\r\n", 2) + 2) {
+        if (!strncasecmp(hdr, "Content-Length:", 15)) {
+            reqBody = atol(hdr + 15);
+        } else if (!strncasecmp(hdr, "Transfer-Encoding:", 18)) {
+            /* Chunked request bodies are not supported */
+            return fcgiError(client_sock, 400, method);
+        }
+    }
+    reqBody -= length - headerEnd;
+    if (reqBody < 0) {
+        reqBody = 0;
+    }
+
+    if (memReserve(MEM_RECV, 2 * FASTCGI_BUF) != SUCCESS) {
+        return fcgiError(client_sock, 503, method);
+    }
+    r.fd = -1;
+    r.out = malloc(FASTCGI_BUF);
+    r.in = malloc(FASTCGI_BUF);
+    if ((r.out == NULL) || (r.in == NULL)) {
+        code = 500;
+        goto fail;
+    }
+
+    code = buildParams(&r, route, request, headerEnd, request, methodLen,
+                       target, version - 1 - target, version, client_sock,
+                       root);
+    if (code != SUCCESS) {
+        goto fail;
+    }
+    /* Kept aside, r.out is needed again to send them */
+    paramsLen = r.outLen;
+    if ((params = malloc(paramsLen ? paramsLen : 1)) == NULL) {
+        code = 500;
+        goto fail;
+    }
+    memcpy(params, r.out, paramsLen);
+
+    max = route->connections ? route->connections : cfg->fcgiConnections;
+    if ((b = backendGet(route->backend)) == NULL) {
+        code = 502;
+        goto fail;
+    }
+    if (backendAcquire(b, max, cfg->fcgiQueueTimeout) != SUCCESS) {
+        debug_log("FastCGI backend %s is busy", b->name);
+        code = 503;
+        goto fail;
+    }
+
+    /*
+     * A pooled connection may have been closed by the backend just as
+     * we picked it up. Retry once on a fresh connection if nothing came
+     * back and the request can safely be sent again.
+     */
+    for (attempt = 0; attempt < 2; attempt++) {
+        if ((r.fd = backendConnect(b, cfg->fcgiTimeout, &reused)) < 0) {
+            break;
+        }
+        traceMark(TRACE_OPEN);
+        if ((sendRequest(&r, params, paramsLen, request + headerEnd,
+                         length - headerEnd, reqBody, client_sock,
+                         &bodyRead) == SUCCESS) &&
+            (recvAll(r.fd, r.in, FCGI_HEADER_LEN, &timedOut) == SUCCESS)) {
+            break;
+        }
+        close(r.fd);
+        r.fd = -1;
+        if (!reused || bodyRead || timedOut || !retryable) {
+            break;
+        }
+    }
+    if (r.fd < 0) {
+        backendRelease(b, -1, 0);
+        code = timedOut ? 504 : 502;
+        goto fail;
+    }
+
+    /* The first record header is in, read records until the end one */
+    for (;;) {
+        type = (unsigned char) r.in[1];
+        id = ((unsigned char) r.in[2] << 8) | (unsigned char) r.in[3];
+        len = ((unsigned char) r.in[4] << 8) | (unsigned char) r.in[5];
+        pad = (unsigned char) r.in[6];
+        if ((r.in[0] != FCGI_VERSION_1) ||
+            (recvAll(r.fd, r.in, len + pad, &timedOut) != SUCCESS)) {
+            break;
+        }
+        if (id != FCGI_REQUEST_ID) {
+            /* Management records, FCGI_UNKNOWN_TYPE and the like */
+        } else if (type == FCGI_END_REQUEST) {
+            ended = (len >= 8) && (r.in[4] == FCGI_REQUEST_COMPLETE);
+            break;
+        } else if ((type == FCGI_STDERR) && (len > 0)) {
+            while ((len > 0) && isspace((unsigned char) r.in[len - 1])) {
+                len--;
+            }
+            error_log("FastCGI %s: %.*s", b->name, len, r.in);
+        } else if ((type == FCGI_STDOUT) && (len > 0) && headSent) {
+            if (method == HEAD) {
+                /* Read to the end all the same, to keep the connection */
+            } else if (sendAll(client_sock, r.in, len) == SUCCESS) {
+                sent += len;
+            } else {
+                /* Not worth reading the rest of the output for */
+                clientGone = 1;
+                break;
+            }
+        } else if ((type == FCGI_STDOUT) && (len > 0)) {
+            /* CGI headers, possibly spread over records */
+            if ((cgiLen + len > FASTCGI_BUF) ||
+                ((cgi == NULL) && ((cgi = malloc(FASTCGI_BUF)) == NULL))) {
+                break;
+            }
+            memcpy(cgi + cgiLen, r.in, len);
+            cgiLen += len;
+            if ((cgiEnd = cgiHeadEnd(cgi, cgiLen)) != NULL) {
+                traceMark(TRACE_READ);
+                headSent = 1;
+                if ((n = sendHead(client_sock, cgi, cgiEnd - cgi,
+                                  &code)) == 0) {
+                    clientGone = 1;
+                    break;
+                }
+                traceStatus(code);
+                sent += n;
+                if ((method != HEAD) && (cgiEnd < cgi + cgiLen)) {
+                    if (sendAll(client_sock, cgiEnd,
+                                cgi + cgiLen - cgiEnd) != SUCCESS) {
+                        clientGone = 1;
+                        break;
+                    }
+                    sent += cgi + cgiLen - cgiEnd;
+                }
+            }
+        }
+        if (recvAll(r.fd, r.in, FCGI_HEADER_LEN, &timedOut) != SUCCESS) {
+            break;
+        }
+    }
+
+    backendRelease(b, r.fd, ended && !clientGone);
+    if (!headSent && !clientGone) {
+        error_log("FastCGI %s sent no response", b->name);
+        code = timedOut ? 504 : 502;
+        goto fail;
+    }
+    free(cgi);
+    free(params);
+    free(r.out);
+    free(r.in);
+    memRelease(MEM_RECV, 2 * FASTCGI_BUF);
+    return sent;
+
+fail:
+    free(cgi);
+    free(params);
+    free(r.out);
+    free(r.in);
+    memRelease(MEM_RECV, 2 * FASTCGI_BUF);
+    return fcgiError(client_sock, code, method);
+}
+
+/**
+*fcgiDumpStats : writes the state of each backend pool to out.
+*/
+void fcgiDumpStats(FILE *out)
+{
+    backend *b;
+
+    pthread_mutex_lock(&backendsLock);
+    if (backends != NULL) {
+        fprintf(out, "%-32s%-8s%-8s%-12s%-10s%s\n", "fastcgi backend",
+                "active", "idle", "served", "queued", "rejected");
+    }
+    for (b = backends; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->lock);
+        fprintf(out, "%-32s%-8d%-8d%-12lu%-10lu%lu\n", b->name, b->active,
+                b->numIdle, b->served, b->queued, b->rejected);
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&backendsLock);
+    fflush(out);
+}
@@ -0,0 +1,179 @@
+/**
+ * @file    flight.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Single-flight file loads. When a popular file changes, or the
+ * server starts cold, many requests miss at once; rather than each of
+ * them stat()ing, opening and reading the file into a buffer of its
+ * own, the first one loads it and the others, whatever loop they run
+ * on, park until that load lands. They then share the file by
+ * reference count, or answer with the error the load ran into.
+ *
+ * Loads are keyed on the canonical path (see uri.c). Only loads in
+ * progress are kept, a request arriving after one landed starts the
+ * next. A file over the memory budget is streamed rather than loaded
+ * (see memgov.c), so each request then streams its own.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <flight.h>
+#include <memgov.h>
+
+struct flight {
+    struct flight *next;        /* in its bucket */
+    uint32_t hash;
+    int joined;
+    flightWait *waiters;
+    char *path;                 /* of the file, after the key */
+    char key[];
+};
+
+static pthread_mutex_t flightMutex = PTHREAD_MUTEX_INITIALIZER;
+static flight *buckets[FLIGHT_BUCKETS];
+
+static uint32_t hashKey(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*key != '\0') {
+        hash = (hash ^ (unsigned char) *key++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+*sharedAlloc : a file buffer of size bytes with one reference.
+*return:
+*       the buffer, NULL if out of memory
+*/
+sharedEntity *sharedAlloc(long size)
+{
+    sharedEntity *entity = malloc(sizeof(sharedEntity) + size);
+
+    if (entity != NULL) {
+        entity->refs = 1;
+        entity->size = size;
+        entity->length = 0;
+    }
+    return entity;
+}
+
+/**
+*sharedRelease : drops a reference to entity, NULL is ignored. The
+*last one gives its size back to the memory budget, which the caller
+*of sharedAlloc reserved.
+*/
+void sharedRelease(sharedEntity *entity)
+{
+    if ((entity != NULL) && (__sync_sub_and_fetch(&entity->refs, 1) == 0)) {
+        memRelease(MEM_RESPONSE, entity->size);
+        free(entity);
+    }
+}
+
+/**
+*flightJoin : joins the load of key if one is in progress, otherwise
+*starts it.
+*args:
+*       path: the file key names, kept for requests that joined to load
+*             it alone with
+*       wait: this request's part, its task must be set
+*return:
+*       0 : joined, the task is to park until woken and then take
+*           wait->status and wait->entity
+*       1 : this request loads the file and must call flightLand
+*/
+int flightJoin(const char *key, const char *path, flightWait *wait)
+{
+    uint32_t hash = hashKey(key);
+    flight **bucket = &buckets[hash & (FLIGHT_BUCKETS - 1)];
+    flight *f;
+    size_t len = strlen(key);
+    size_t pathLen = strlen(path);
+
+    wait->leading = NULL;
+    wait->joined = 0;
+    wait->entity = NULL;
+    wait->path = NULL;
+
+    pthread_mutex_lock(&flightMutex);
+    for (f = *bucket; f != NULL; f = f->next) {
+        if ((f->hash == hash) && !strcmp(f->key, key)) {
+            wait->next = f->waiters;
+            f->waiters = wait;
+            f->joined++;
+            wait->joined = 1;
+            pthread_mutex_unlock(&flightMutex);
+            return 0;
+        }
+    }
+
+    /* Out of memory the request loads alone */
+    if ((f = malloc(sizeof(flight) + len + 1 + pathLen + 1)) != NULL) {
+        f->hash = hash;
+        f->joined = 0;
+        f->waiters = NULL;
+        memcpy(f->key, key, len + 1);
+        f->path = f->key + len + 1;
+        memcpy(f->path, path, pathLen + 1);
+        f->next = *bucket;
+        *bucket = f;
+        wait->leading = f;
+    }
+    pthread_mutex_unlock(&flightMutex);
+    return 1;
+}
+
+/**
+*flightLand : ends the load wait leads and wakes the requests that
+*joined it, each with its own reference to entity, or with a copy of
+*the path for FLIGHT_ALONE. Does nothing if wait leads no load.
+*args:
+*       entity: the file, NULL if the load failed
+*       status: SUCCESS, the HTTP error code the load ran into, or
+*               FLIGHT_ALONE for a file too large to share
+*/
+void flightLand(flightWait *wait, sharedEntity *entity, int status)
+{
+    flight *f = wait->leading;
+    flight **pos;
+    flightWait *waiter, *next;
+
+    if (f == NULL) {
+        return;
+    }
+    wait->leading = NULL;
+
+    pthread_mutex_lock(&flightMutex);
+    for (pos = &buckets[f->hash & (FLIGHT_BUCKETS - 1)]; *pos != f;
+         pos = &(*pos)->next) {
+    }
+    *pos = f->next;
+    pthread_mutex_unlock(&flightMutex);
+
+    if (f->joined > 0) {
+        debug_log("Load of %s shared with %d requests", f->key, f->joined);
+    }
+    for (waiter = f->waiters; waiter != NULL; waiter = next) {
+        next = waiter->next;
+        waiter->status = status;
+        if ((status == SUCCESS) && (entity != NULL)) {
+            __sync_fetch_and_add(&entity->refs, 1);
+            waiter->entity = entity;
+        } else if ((status == FLIGHT_ALONE) &&
+                   ((waiter->path = strdup(f->path)) == NULL)) {
+            waiter->status = 500;
+        }
+        loopWake(waiter->task);
+    }
+    free(f);
+}
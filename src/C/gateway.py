@@ -0,0 +1,346 @@
+#!/usr/bin/env python3
+
+# gateway.py - Checks of the reverse proxy (proxy.c) and the FastCGI
+# gateway (fastcgi.c) against a stand-in upstream and FastCGI responder
+# run by this script
+#
+# Starts the server with proxy and fastcgi routes to the stand-ins and
+# to a port nothing listens on, then checks that backend connections
+# are kept alive and reused, what the response cache keeps and what it
+# must not (Set-Cookie, Vary, credentials), the 502 and 504 answers,
+# and the 503 of a FastCGI backend with no connection free.
+#
+# Usage: ./gateway.py [--server ./server] [--www <www path>]
+#        make gateway
+#
+# Exits 1 if any check fails, 0 otherwise.
+
+import argparse
+import http.server
+import os
+import socket
+import socketserver
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+# Seconds the server waits for a backend, the slow paths take longer
+TIMEOUT = 1
+
+# FastCGI record types and flags (FastCGI 1.0)
+FCGI_BEGIN_REQUEST = 1
+FCGI_END_REQUEST = 3
+FCGI_PARAMS = 4
+FCGI_STDIN = 5
+FCGI_STDOUT = 6
+FCGI_KEEP_CONN = 1
+
+
+def free_port():
+    sock = socket.socket()
+    sock.bind(('127.0.0.1', 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def wait_listening(port, proc, timeout=10.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def exchange(port, raw, timeout=10.0):
+    """Sends raw, reads until the server closes. Returns the response."""
+    sock = socket.create_connection(('127.0.0.1', port), timeout)
+    sock.settimeout(timeout)
+    data = []
+    try:
+        sock.sendall(raw)
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data.append(chunk)
+    except OSError as err:
+        data.append(('\n<%s>' % err).encode())
+    finally:
+        sock.close()
+    return b''.join(data)
+
+
+def get(port, path, headers=b''):
+    return exchange(port, b'GET ' + path.encode() + b' HTTP/1.1\r\n'
+                    b'Host: localhost\r\n' + headers + b'\r\n')
+
+
+def status_of(resp):
+    """The status code of the response, '-' if there is none."""
+    parts = resp.split(b' ', 2)
+    return parts[1].decode() if len(parts) > 1 else '-'
+
+
+def has_header(resp, name):
+    head = resp.partition(b'\r\n\r\n')[0].lower()
+    return (b'\r\n' + name.lower() + b':') in head
+
+
+class Upstream(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    """Stand-in upstream, counting connections and requests per path."""
+    daemon_threads = True
+
+    def __init__(self):
+        super().__init__(('127.0.0.1', 0), UpstreamHandler)
+        self.lock = threading.Lock()
+        self.connections = 0
+        self.hits = {}
+
+    def hit(self, path):
+        with self.lock:
+            self.hits[path] = self.hits.get(path, 0) + 1
+            return self.hits[path]
+
+    def handle_error(self, request, client_address):
+        # The server hangs up on the slow path before it is answered
+        pass
+
+
+class UpstreamHandler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    # Response headers by path, all cacheable but for what they add
+    HEADERS = {
+        '/api/plain': [],
+        '/api/cached': [('Cache-Control', 'max-age=60')],
+        '/api/cookie': [('Cache-Control', 'max-age=60'),
+                        ('Set-Cookie', 'session=1')],
+        '/api/vary': [('Cache-Control', 'max-age=60'), ('Vary', 'Accept')],
+        '/api/private': [('Cache-Control', 'max-age=60')],
+        '/api/public': [('Cache-Control', 'public, max-age=60')],
+    }
+
+    def setup(self):
+        super().setup()
+        with self.server.lock:
+            self.server.connections += 1
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        hits = self.server.hit(self.path)
+        if self.path == '/api/slow':
+            time.sleep(TIMEOUT + 1)
+        body = ('%s %d\n' % (self.path, hits)).encode()
+        self.send_response(200)
+        for name, value in self.HEADERS.get(self.path, []):
+            self.send_header(name, value)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+def fcgi_params(data):
+    """The name-value pairs of FCGI_PARAMS content, as a dict."""
+    params, pos = {}, 0
+    while pos < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[pos] & 0x80:
+                lengths.append(struct.unpack('>I', data[pos:pos + 4])[0]
+                               & 0x7fffffff)
+                pos += 4
+            else:
+                lengths.append(data[pos])
+                pos += 1
+        name = data[pos:pos + lengths[0]]
+        pos += lengths[0]
+        params[name] = data[pos:pos + lengths[1]]
+        pos += lengths[1]
+    return params
+
+
+class Responder(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    """Stand-in FastCGI responder, counting connections."""
+    daemon_threads = True
+
+    def __init__(self):
+        super().__init__(('127.0.0.1', 0), ResponderHandler)
+        self.lock = threading.Lock()
+        self.connections = 0
+
+    def handle_error(self, request, client_address):
+        # The server hangs up on the slow path before it is answered
+        pass
+
+
+class ResponderHandler(socketserver.StreamRequestHandler):
+
+    def record(self, kind, request_id, content=b''):
+        self.wfile.write(struct.pack('>BBHHBB', 1, kind, request_id,
+                                     len(content), 0, 0) + content)
+
+    def handle(self):
+        with self.server.lock:
+            self.server.connections += 1
+        keep = True
+        while keep:
+            params = b''
+            while True:
+                header = self.rfile.read(8)
+                if len(header) < 8:
+                    return
+                _, kind, request_id, length, padding, _ = \
+                    struct.unpack('>BBHHBB', header)
+                content = self.rfile.read(length + padding)[:length]
+                if kind == FCGI_BEGIN_REQUEST:
+                    keep = bool(content[2] & FCGI_KEEP_CONN)
+                elif kind == FCGI_PARAMS:
+                    params += content
+                elif kind == FCGI_STDIN and length == 0:
+                    break
+            uri = fcgi_params(params).get(b'REQUEST_URI', b'')
+            if uri.endswith(b'/slow'):
+                time.sleep(TIMEOUT + 1)
+            self.record(FCGI_STDOUT, request_id,
+                        b'Content-Type: text/plain\r\n\r\n' + uri + b'\n')
+            self.record(FCGI_STDOUT, request_id)
+            self.record(FCGI_END_REQUEST, request_id, b'\0' * 8)
+            self.wfile.flush()
+
+
+def check_keepalive(port, backend, path):
+    before = backend.connections
+    for _ in range(5):
+        resp = get(port, path)
+        if status_of(resp) != '200':
+            return 'status %s' % status_of(resp)
+    if backend.connections - before > 1:
+        return '%d backend connections for 5 requests' \
+            % (backend.connections - before)
+    return None
+
+
+def check_cached(port, upstream, path, headers, stored):
+    """Two requests for path, the second with no headers: stored tells
+    whether the first response is to be served from the cache."""
+    first = get(port, path, headers)
+    second = get(port, path)
+    if status_of(first) != '200' or status_of(second) != '200':
+        return 'status %s, %s' % (status_of(first), status_of(second))
+    hits = upstream.hits.get(path, 0)
+    if stored and (hits != 1 or not has_header(second, b'Age')):
+        return 'not served from the cache (%d upstream hits)' % hits
+    if not stored and hits != 2:
+        return 'served from the cache (%d upstream hits)' % hits
+    return None
+
+
+def check_status(port, path, code):
+    resp = get(port, path)
+    if status_of(resp) != code:
+        return 'status %s, expected %s' % (status_of(resp), code)
+    return None
+
+
+def check_busy(port, path):
+    """A request under path while the only connection to its backend is
+    taken by a slow one, which times out."""
+    slow = {}
+    thread = threading.Thread(target=lambda: slow.update(
+        resp=get(port, path + 'slow')))
+    thread.start()
+    time.sleep(TIMEOUT / 4)
+    error = check_status(port, path + 'x', '503')
+    thread.join()
+    if error is None and status_of(slow['resp']) != '504':
+        error = 'slow request status %s' % status_of(slow['resp'])
+    return error
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(
+        description="Check the reverse proxy and FastCGI gateway against "
+        "stand-in backends")
+    parser.add_argument('--server', default=os.path.join(here, 'server'))
+    parser.add_argument('--www', default=os.path.join(here, 'www'))
+    args = parser.parse_args()
+
+    upstream, responder, busy = Upstream(), Responder(), Responder()
+    for backend in (upstream, responder, busy):
+        threading.Thread(target=backend.serve_forever, daemon=True).start()
+    port, dead = free_port(), free_port()
+
+    conf = tempfile.NamedTemporaryFile('w', suffix='.conf', delete=False)
+    conf.write('proxy = /api/ 127.0.0.1:%d\n'
+               'proxy = /dead/ 127.0.0.1:%d\n'
+               'proxy_timeout = %d\n'
+               'fastcgi = /cgi/ 127.0.0.1:%d\n'
+               'fastcgi = /busy/ 127.0.0.1:%d connections=1\n'
+               'fastcgi = /deadcgi/ 127.0.0.1:%d\n'
+               'fastcgi_timeout = %d\n'
+               'fastcgi_queue_timeout = 0\n'
+               % (upstream.server_address[1], dead, TIMEOUT,
+                  responder.server_address[1], busy.server_address[1],
+                  dead, TIMEOUT))
+    conf.close()
+
+    checks = [
+        ('proxy-keepalive', lambda: check_keepalive(
+            port, upstream, '/api/plain')),
+        ('proxy-cache', lambda: check_cached(
+            port, upstream, '/api/cached', b'', True)),
+        ('proxy-cache-cookie', lambda: check_cached(
+            port, upstream, '/api/cookie', b'', False)),
+        ('proxy-cache-vary', lambda: check_cached(
+            port, upstream, '/api/vary', b'', False)),
+        ('proxy-cache-auth', lambda: check_cached(
+            port, upstream, '/api/private', b'Authorization: x\r\n', False)),
+        ('proxy-cache-auth-public', lambda: check_cached(
+            port, upstream, '/api/public', b'Authorization: x\r\n', True)),
+        ('proxy-502', lambda: check_status(port, '/dead/x', '502')),
+        ('proxy-504', lambda: check_status(port, '/api/slow', '504')),
+        ('fastcgi-keepalive', lambda: check_keepalive(
+            port, responder, '/cgi/hello')),
+        ('fastcgi-502', lambda: check_status(port, '/deadcgi/x', '502')),
+        ('fastcgi-504', lambda: check_status(port, '/cgi/slow', '504')),
+        ('fastcgi-503', lambda: check_busy(port, '/busy/')),
+    ]
+
+    server = subprocess.Popen([args.server, str(port),
+                               os.path.abspath(args.www), conf.name],
+                              stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    failures = 0
+    try:
+        if not wait_listening(port, server):
+            sys.exit('failed to start: %s' % args.server)
+        for name, check in checks:
+            error = check()
+            print('%-24s %s' % (name, 'FAIL: ' + error if error else 'ok'))
+            failures += error is not None
+        print('%d of %d checks failed' % (failures, len(checks)))
+    finally:
+        server.terminate()
+        server.wait()
+        for backend in (upstream, responder, busy):
+            backend.shutdown()
+        os.unlink(conf.name)
+
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
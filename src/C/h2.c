@@ -0,0 +1,1345 @@
+/**
+ * @file    h2.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief HTTP/2 over cleartext TCP (h2c, RFC 7540). A client gets here
+ * either by opening with the connection preface (prior knowledge) or
+ * by asking a GET/HEAD to be upgraded with "Upgrade: h2c", in which
+ * case that request becomes stream 1.
+ *
+ * The connection is served by its own thread like any other: a poll()
+ * loop reads frames and, between reads, lets every stream with data
+ * and window put one DATA frame into a shared output buffer in turn,
+ * so responses are interleaved rather than sent one after the other.
+ * Files are read with pread() straight into that buffer, one send()
+ * carries several frames. Requests resolve through the same code as
+ * HTTP/1 (resolveResource, get_mime, the error pages); routes of the
+ * reverse proxy and of the FastCGI gateway are answered with 501,
+ * proxy.c and fastcgi.c speak to HTTP/1 requests only. With a capture
+ * running every stream is recorded as the HTTP/1.1 request it stands
+ * for, so ./replay can send it again (see capture.c).
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <log.h>
+#include <helper.h>
+#include <httpparser.h>
+#include <response.h>
+#include <proxy.h>
+#include <fastcgi.h>
+#include <trace.h>
+#include <hpack.h>
+#include <cachepolicy.h>
+#include <h2.h>
+#include <memgov.h>
+#include <hints.h>
+#include <capture.h>
+
+/* Frame types */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/* Frame flags */
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+/* SETTINGS parameters */
+#define H2_SET_HEADER_TABLE_SIZE 0x1
+#define H2_SET_ENABLE_PUSH 0x2
+#define H2_SET_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SET_INITIAL_WINDOW_SIZE 0x4
+#define H2_SET_MAX_FRAME_SIZE 0x5
+
+/* Error codes */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+typedef struct h2Stream {
+    uint32_t id;            /* 0 while the slot is unused */
+    int fd;                 /* file being sent, or -1 */
+    const char *body;       /* in memory body of an error page */
+    off_t offset;
+    off_t remaining;        /* DATA bytes still to send */
+    off_t contentLength;
+    int64_t window;         /* what the peer lets us send */
+    int status;
+    const char *mime;
+    const cacheRule *policy;    /* caching headers, or NULL */
+    char *links;                /* preloads of a page, or NULL */
+    int headersSent;
+    int remoteClosed;       /* peer sent END_STREAM */
+    uint64_t startNs;       /* traceNow() when the request came in */
+    char *captured;         /* the request as HTTP/1.1, or NULL */
+} h2Stream;
+
+/* Pseudo-headers of a request being decoded */
+typedef struct h2Request {
+    char method[8];
+    char path[MAX_PATH];
+    int haveMethod;
+    int havePath;
+    int haveScheme;
+    int regular;            /* a regular field was seen */
+    int malformed;
+    int tooLong;
+} h2Request;
+
+typedef struct h2Conn {
+    int sock;
+    const serverConfig *cfg;
+    char *root;
+    uint64_t id;            /* of the connection, for the capture */
+
+    unsigned char *in;
+    size_t inLen;
+    size_t inCap;
+    size_t prefaceLeft;     /* preface bytes not checked yet */
+    char *out;
+    size_t outLen;
+
+    hpackTable decoder;
+    hpackTable encoder;
+
+    h2Stream *streams;
+    int maxStreams;
+    int open;
+    int next;               /* round robin position */
+    uint32_t lastStream;    /* highest stream the peer opened */
+
+    int64_t sendWindow;
+    int64_t initialWindow;  /* peer's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t frameSize;     /* largest DATA payload we send */
+
+    /* Header block spread over HEADERS and CONTINUATION frames */
+    unsigned char *block;
+    size_t blockLen;
+    uint32_t blockStream;
+    int blockEndStream;
+
+    int goaway;             /* no new streams, close when idle */
+    int failed;             /* stop as soon as the output is flushed */
+    size_t bytes;
+} h2Conn;
+
+static volatile int h2Stopping;
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/**
+*h2Shutdown : makes every h2 connection send GOAWAY, finish its open
+*streams and close, on restart or stop.
+*/
+void h2Shutdown(void)
+{
+    h2Stopping = 1;
+}
+
+/**
+*h2Preface : whether a connection opened with the HTTP/2 preface.
+*/
+int h2Preface(const char *buffer, int length)
+{
+    return (length >= H2_PREFACE_LEN) &&
+           !memcmp(buffer, H2_PREFACE, H2_PREFACE_LEN);
+}
+
+/**
+ * headerValue : finds field name among the request headers.
+ * return: the value, its length in *len, or NULL
+ */
+static const char *headerValue(const char *buffer, const char *end,
+                               const char *name, size_t *len)
+{
+    size_t nameLen = strlen(name);
+    const char *line, *eol, *value;
+
+    line = memmem(buffer, end - buffer, "\r\n", 2);
+    while ((line != NULL) && (line + 2 < end)) {
+        line += 2;
+        if ((eol = memmem(line, end - line, "\r\n", 2)) == NULL) {
+            eol = end;
+        }
+        if ((eol - line > (long) nameLen) && (line[nameLen] == ':') &&
+            !strncasecmp(line, name, nameLen)) {
+            value = line + nameLen + 1;
+            while ((value < eol) && ((*value == ' ') || (*value == '\t'))) {
+                value++;
+            }
+            *len = eol - value;
+            while ((*len > 0) &&
+                   ((value[*len - 1] == ' ') || (value[*len - 1] == '\t'))) {
+                (*len)--;
+            }
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+/**
+*h2UpgradeRequest : whether the request asks to be upgraded to h2c and
+*can be: a GET or HEAD on HTTP/1.1 without a body, carrying
+*HTTP2-Settings.
+*/
+int h2UpgradeRequest(const char *buffer, int length)
+{
+    const char *end, *value, *eol, *token;
+    size_t len;
+
+    if ((end = memmem(buffer, length, "\r\n\r\n", 4)) == NULL) {
+        return 0;
+    }
+    if (strncmp(buffer, "GET ", 4) && strncmp(buffer, "HEAD ", 5)) {
+        return 0;
+    }
+    eol = memmem(buffer, end + 2 - buffer, "\r\n", 2);
+    if ((eol - buffer < 10) || memcmp(eol - 9, " HTTP/1.1", 9)) {
+        return 0;
+    }
+    if (headerValue(buffer, end, "HTTP2-Settings", &len) == NULL) {
+        return 0;
+    }
+    if ((headerValue(buffer, end, "Transfer-Encoding", &len) != NULL) ||
+        (((value = headerValue(buffer, end, "Content-Length", &len))
+          != NULL) && ((len != 1) || (*value != '0')))) {
+        return 0;
+    }
+    if ((value = headerValue(buffer, end, "Upgrade", &len)) == NULL) {
+        return 0;
+    }
+
+    /* Upgrade lists protocols by preference, h2c anywhere will do */
+    for (token = value; token + 3 <= value + len; token++) {
+        if (!strncasecmp(token, "h2c", 3) &&
+            ((token == value) || (token[-1] == ' ') || (token[-1] == ',')) &&
+            ((token + 3 == value + len) || (token[3] == ' ') ||
+             (token[3] == ','))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * flush : sends the gathered frames.
+ * return: SUCCESS, FAILURE if the peer is gone or stopped reading
+ */
+static int flush(h2Conn *c)
+{
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < c->outLen) {
+        traceCall(TRACE_CALL_SEND);
+        n = send(c->sock, c->out + sent, c->outLen - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            c->failed = 1;
+            c->outLen = 0;
+            return FAILURE;
+        }
+        sent += n;
+    }
+    c->bytes += sent;
+    c->outLen = 0;
+    return SUCCESS;
+}
+
+/**
+ * frameStart : reserves room for a frame of len payload bytes and
+ * writes its header.
+ * return: where the payload goes, NULL if the connection failed
+ */
+static unsigned char *frameStart(h2Conn *c, size_t len, int type, int flags,
+                                 uint32_t stream)
+{
+    unsigned char *f;
+
+    if ((c->outLen + H2_FRAME_HEADER + len > H2_OUT_BUF) &&
+        (flush(c) != SUCCESS)) {
+        return NULL;
+    }
+    f = (unsigned char *) c->out + c->outLen;
+    f[0] = len >> 16;
+    f[1] = len >> 8;
+    f[2] = len;
+    f[3] = type;
+    f[4] = flags;
+    put32(f + 5, stream & H2_MAX_WINDOW);
+    c->outLen += H2_FRAME_HEADER + len;
+    return f + H2_FRAME_HEADER;
+}
+
+static void sendFrame(h2Conn *c, int type, int flags, uint32_t stream,
+                      const unsigned char *payload, size_t len)
+{
+    unsigned char *p = frameStart(c, len, type, flags, stream);
+
+    if ((p != NULL) && (len > 0)) {
+        memcpy(p, payload, len);
+    }
+}
+
+static void sendU32(h2Conn *c, int type, uint32_t stream, uint32_t value)
+{
+    unsigned char payload[4];
+
+    put32(payload, value);
+    sendFrame(c, type, 0, stream, payload, sizeof(payload));
+}
+
+/**
+ * connectionError : GOAWAY with code, the connection ends.
+ */
+static void connectionError(h2Conn *c, uint32_t code)
+{
+    unsigned char payload[8];
+
+    if (c->failed) {
+        return;
+    }
+    debug_log("h2 connection error %u on socket %d", code, c->sock);
+    put32(payload, c->lastStream);
+    put32(payload + 4, code);
+    sendFrame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->failed = 1;
+}
+
+static h2Stream *findStream(h2Conn *c, uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < c->maxStreams; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * closeStream : frees the slot of s, recording its request if a capture
+ * runs. The bytes recorded are those of the DATA frames sent.
+ */
+static void closeStream(h2Conn *c, h2Stream *s)
+{
+    if (s->captured != NULL) {
+        captureRequest(c->id, s->startNs, s->captured, strlen(s->captured),
+                       s->status, s->offset);
+        free(s->captured);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s->links);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    c->open--;
+}
+
+/**
+ * streamError : RST_STREAM with code for stream id.
+ */
+static void streamError(h2Conn *c, uint32_t id, uint32_t code)
+{
+    h2Stream *s = findStream(c, id);
+
+    sendU32(c, H2_RST_STREAM, id, code);
+    if (s != NULL) {
+        closeStream(c, s);
+    }
+}
+
+/**
+ * applySetting : one SETTINGS parameter from the peer.
+ * return: SUCCESS, or FAILURE once the connection has failed
+ */
+static int applySetting(h2Conn *c, int id, uint32_t value)
+{
+    int64_t delta;
+    int i;
+
+    switch (id) {
+    case H2_SET_HEADER_TABLE_SIZE:
+        hpackSetLimit(&c->encoder, value);
+        break;
+    case H2_SET_ENABLE_PUSH:
+        if (value > 1) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return FAILURE;
+        }
+        break;
+    case H2_SET_INITIAL_WINDOW_SIZE:
+        if (value > H2_MAX_WINDOW) {
+            connectionError(c, H2_FLOW_CONTROL_ERROR);
+            return FAILURE;
+        }
+        /* Open streams move by the difference (RFC 7540 6.9.2) */
+        delta = (int64_t) value - c->initialWindow;
+        c->initialWindow = value;
+        for (i = 0; i < c->maxStreams; i++) {
+            if (c->streams[i].id == 0) {
+                continue;
+            }
+            c->streams[i].window += delta;
+            if (c->streams[i].window > H2_MAX_WINDOW) {
+                connectionError(c, H2_FLOW_CONTROL_ERROR);
+                return FAILURE;
+            }
+        }
+        break;
+    case H2_SET_MAX_FRAME_SIZE:
+        if ((value < H2_FRAME_SIZE) || (value > 0xffffff)) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return FAILURE;
+        }
+        /* We keep sending 16k frames, the peer only allowed larger ones */
+        break;
+    default:
+        /* MAX_CONCURRENT_STREAMS limits pushes, which we never make */
+        break;
+    }
+    return SUCCESS;
+}
+
+static int applySettings(h2Conn *c, const unsigned char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 6 <= len; i += 6) {
+        if (applySetting(c, (p[i] << 8) | p[i + 1], get32(p + i + 2))
+            != SUCCESS) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * sendSettings : our half of the connection preface.
+ */
+static void sendSettings(h2Conn *c)
+{
+    unsigned char payload[12];
+    size_t len = 0;
+
+    payload[len++] = 0;
+    payload[len++] = H2_SET_MAX_CONCURRENT_STREAMS;
+    put32(payload + len, c->maxStreams);
+    len += 4;
+    if (c->cfg->h2HeaderTable != HPACK_DEFAULT_TABLE_SIZE) {
+        payload[len++] = 0;
+        payload[len++] = H2_SET_HEADER_TABLE_SIZE;
+        put32(payload + len, c->cfg->h2HeaderTable);
+        len += 4;
+    }
+    sendFrame(c, H2_SETTINGS, 0, 0, payload, len);
+}
+
+/**
+ * requestField : hpackEmit callback collecting the pseudo-headers.
+ */
+static void requestField(void *arg, const char *name, size_t nameLen,
+                         const char *value, size_t valueLen)
+{
+    h2Request *req = arg;
+    size_t i;
+
+    if ((nameLen > 0) && (name[0] == ':')) {
+        if (req->regular) {
+            req->malformed = 1;
+        } else if ((nameLen == 7) && !memcmp(name, ":method", 7) &&
+                   !req->haveMethod) {
+            req->haveMethod = 1;
+            if (valueLen < sizeof(req->method)) {
+                memcpy(req->method, value, valueLen);
+                req->method[valueLen] = '\0';
+            }
+        } else if ((nameLen == 5) && !memcmp(name, ":path", 5) &&
+                   !req->havePath && (valueLen > 0)) {
+            req->havePath = 1;
+            if (valueLen < sizeof(req->path)) {
+                memcpy(req->path, value, valueLen);
+                req->path[valueLen] = '\0';
+            } else {
+                req->tooLong = 1;
+            }
+        } else if ((nameLen == 7) && !memcmp(name, ":scheme", 7) &&
+                   !req->haveScheme) {
+            req->haveScheme = 1;
+        } else if ((nameLen != 10) || memcmp(name, ":authority", 10)) {
+            req->malformed = 1;
+        }
+        return;
+    }
+
+    req->regular = 1;
+    for (i = 0; i < nameLen; i++) {
+        if ((name[i] >= 'A') && (name[i] <= 'Z')) {
+            req->malformed = 1;
+        }
+    }
+    /* Connection specific fields have no place in HTTP/2 (8.1.2.2) */
+    if (((nameLen == 10) && !memcmp(name, "connection", 10)) ||
+        ((nameLen == 2) && !memcmp(name, "te", 2) &&
+         ((valueLen != 8) || memcmp(value, "trailers", 8)))) {
+        req->malformed = 1;
+    }
+}
+
+/**
+ * routeGateway : whether path belongs to a reverse proxy or a FastCGI
+ * route. Those are never served from the www root, the file there may
+ * well be the source of the script.
+ */
+static int routeGateway(h2Conn *c, const char *path)
+{
+    char line[MAX_PATH + 32];
+    int len;
+
+    if ((c->cfg->numProxies == 0) && (c->cfg->numFcgis == 0)) {
+        return 0;
+    }
+    len = snprintf(line, sizeof(line), "GET %s HTTP/1.1\r\n", path);
+    return (proxyMatch(c->cfg, line, len) != NULL) ||
+           (fcgiMatch(c->cfg, line, len) != NULL);
+}
+
+/**
+ * streamHints : the preloads of a page served on s, scanned from its
+ * start if it was not yet, see hints.c. They go in the Link header of
+ * the response; there is no 103 here, the response headers go out
+ * before any of the page is read anyway.
+ */
+static void streamHints(h2Stream *s, const char *canonical,
+                        const struct stat *st)
+{
+    char links[HINTS_LINK_MAX];
+    char *page;
+    ssize_t n;
+    int len;
+
+    if (!hintsIsPage(s->mime)) {
+        return;
+    }
+    len = hintsFind(canonical, st, links, sizeof(links));
+    if ((len < 0) && ((page = malloc(HINTS_SCAN)) != NULL)) {
+        traceCall(TRACE_CALL_FILE);
+        n = pread(s->fd, page, HINTS_SCAN, 0);
+        len = (n > 0) ? hintsScan(canonical, st, page, n, links,
+                                  sizeof(links)) : 0;
+        free(page);
+    }
+    if (len > 0) {
+        s->links = strdup(links);
+    }
+}
+
+/**
+ * startStream : resolves the request of stream id into a response.
+ */
+static void startStream(h2Conn *c, uint32_t id, const h2Request *req,
+                        int endStream)
+{
+    char resourcePath[MAX_PATH] = "";
+    char uri[MAX_PATH];
+    char canonical[MAX_PATH];
+    struct stat st;
+    h2Stream *s = NULL;
+    int isHead, code, i;
+
+    for (i = 0; i < c->maxStreams; i++) {
+        if (c->streams[i].id == 0) {
+            s = &c->streams[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        sendU32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        return;
+    }
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->fd = -1;
+    s->window = c->initialWindow;
+    s->remoteClosed = endStream;
+    s->startNs = traceNow();
+    c->open++;
+    if (captureEnabled() &&
+        ((s->captured = malloc(strlen(req->path) + 32)) != NULL)) {
+        sprintf(s->captured, "%s %s HTTP/1.1\r\n\r\n", req->method,
+                req->path);
+    }
+
+    isHead = !strcmp(req->method, "HEAD");
+    if (!isHead && strcmp(req->method, "GET")) {
+        code = 501;
+    } else if (req->tooLong) {
+        code = NOT_FOUND;
+    } else if (routeGateway(c, req->path)) {
+        code = 501;
+    } else {
+        strcpy(uri, req->path);
+        code = resolveResource(uri, c->root, resourcePath, canonical);
+    }
+
+    if (code == SUCCESS) {
+        traceCall(TRACE_CALL_FILE);
+        if (((s->fd = open(resourcePath, O_RDONLY | O_CLOEXEC)) < 0) ||
+            (fstat(s->fd, &st) != 0)) {
+            code = NOT_FOUND;
+        } else {
+            s->status = 200;
+            s->mime = get_mime(resourcePath);
+            s->policy = cachePolicyFind(c->cfg, canonical, resourcePath);
+            s->contentLength = st.st_size;
+            streamHints(s, canonical, &st);
+        }
+    }
+    if (code != SUCCESS) {
+        size_t len;
+
+        if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        s->status = code;
+        s->mime = "text/html";
+        s->body = errorBody(code, &len);
+        s->contentLength = len;
+    }
+    s->remaining = isHead ? 0 : s->contentLength;
+    traceStatus(s->status);
+}
+
+/**
+ * headerBlock : a complete header block arrived for stream id.
+ */
+static void headerBlock(h2Conn *c, uint32_t id, const unsigned char *block,
+                        size_t len, int endStream)
+{
+    h2Request req;
+    h2Stream *s;
+
+    memset(&req, 0, sizeof(req));
+    /* Decoded even when refused, the table has to stay in step */
+    if (hpackDecode(&c->decoder, block, len, requestField, &req) != SUCCESS) {
+        connectionError(c, H2_COMPRESSION_ERROR);
+        return;
+    }
+
+    if (id <= c->lastStream) {
+        /* Trailers of a request body, which we do not read */
+        if (((s = findStream(c, id)) != NULL) && !s->remoteClosed) {
+            if (!endStream) {
+                streamError(c, id, H2_PROTOCOL_ERROR);
+            } else {
+                s->remoteClosed = 1;
+            }
+            return;
+        }
+        connectionError(c, (s == NULL) ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+        return;
+    }
+    c->lastStream = id;
+
+    if (c->goaway) {
+        /* Past our GOAWAY, the peer knows it was not processed */
+        return;
+    }
+    if (req.malformed || !req.haveMethod || !req.havePath ||
+        !req.haveScheme) {
+        sendU32(c, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    startStream(c, id, &req, endStream);
+}
+
+/**
+ * onHeaders : HEADERS and CONTINUATION frames.
+ */
+static void onHeaders(h2Conn *c, int type, int flags, uint32_t id,
+                      const unsigned char *p, size_t len)
+{
+    size_t pad = 0;
+
+    if (type == H2_HEADERS) {
+        if ((id == 0) || !(id & 1)) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & H2_PADDED) {
+            if (len < 1) {
+                connectionError(c, H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            pad = p[0];
+            p++;
+            len--;
+        }
+        if (flags & H2_PRIORITY_FLAG) {
+            if (len < 5) {
+                connectionError(c, H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            p += 5;
+            len -= 5;
+        }
+        if (pad > len) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        len -= pad;
+        c->blockStream = id;
+        c->blockEndStream = flags & H2_END_STREAM;
+        c->blockLen = 0;
+    } else if ((c->blockStream == 0) || (id != c->blockStream)) {
+        connectionError(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    if (flags & H2_END_HEADERS) {
+        if (c->blockLen == 0) {
+            c->blockStream = 0;
+            headerBlock(c, id, p, len, c->blockEndStream);
+            return;
+        }
+    }
+    if (c->blockLen + len > H2_MAX_HEADER_BLOCK) {
+        connectionError(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (c->block == NULL) {
+        if ((c->block = malloc(H2_MAX_HEADER_BLOCK)) == NULL) {
+            connectionError(c, H2_INTERNAL_ERROR);
+            return;
+        }
+    }
+    memcpy(c->block + c->blockLen, p, len);
+    c->blockLen += len;
+    if (flags & H2_END_HEADERS) {
+        c->blockStream = 0;
+        headerBlock(c, id, c->block, c->blockLen, c->blockEndStream);
+    }
+}
+
+/**
+ * onData : request bodies are not read, but the windows are given
+ * back so the peer can finish sending.
+ */
+static void onData(h2Conn *c, int flags, uint32_t id, size_t len)
+{
+    h2Stream *s;
+
+    if (id == 0) {
+        connectionError(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (len > 0) {
+        sendU32(c, H2_WINDOW_UPDATE, 0, len);
+    }
+    s = findStream(c, id);
+    if ((s == NULL) || s->remoteClosed) {
+        if (id > c->lastStream) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else {
+            streamError(c, id, H2_STREAM_CLOSED);
+        }
+        return;
+    }
+    if (flags & H2_END_STREAM) {
+        s->remoteClosed = 1;
+    } else if (len > 0) {
+        sendU32(c, H2_WINDOW_UPDATE, id, len);
+    }
+}
+
+static void onWindowUpdate(h2Conn *c, uint32_t id, const unsigned char *p)
+{
+    uint32_t increment = get32(p) & H2_MAX_WINDOW;
+    h2Stream *s;
+
+    if (id == 0) {
+        if (increment == 0) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        c->sendWindow += increment;
+        if (c->sendWindow > H2_MAX_WINDOW) {
+            connectionError(c, H2_FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    if ((s = findStream(c, id)) == NULL) {
+        /* Closed streams may still see updates in flight */
+        if (id > c->lastStream) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        }
+        return;
+    }
+    if (increment == 0) {
+        streamError(c, id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    s->window += increment;
+    if (s->window > H2_MAX_WINDOW) {
+        streamError(c, id, H2_FLOW_CONTROL_ERROR);
+    }
+}
+
+/**
+ * onFrame : dispatches one complete frame.
+ */
+static void onFrame(h2Conn *c, int type, int flags, uint32_t id,
+                    const unsigned char *p, size_t len)
+{
+    h2Stream *s;
+
+    /* Nothing may come between HEADERS and its CONTINUATIONs */
+    if ((c->blockStream != 0) && (type != H2_CONTINUATION)) {
+        connectionError(c, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+    case H2_DATA:
+        onData(c, flags, id, len);
+        break;
+    case H2_HEADERS:
+    case H2_CONTINUATION:
+        onHeaders(c, type, flags, id, p, len);
+        break;
+    case H2_PRIORITY:
+        if (id == 0) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else if (len != 5) {
+            streamError(c, id, H2_FRAME_SIZE_ERROR);
+        }
+        break;
+    case H2_RST_STREAM:
+        if ((id == 0) || (id > c->lastStream)) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else if (len != 4) {
+            connectionError(c, H2_FRAME_SIZE_ERROR);
+        } else if ((s = findStream(c, id)) != NULL) {
+            closeStream(c, s);
+        }
+        break;
+    case H2_SETTINGS:
+        if (id != 0) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else if ((flags & H2_ACK) ? (len != 0) : (len % 6 != 0)) {
+            connectionError(c, H2_FRAME_SIZE_ERROR);
+        } else if (!(flags & H2_ACK) && (applySettings(c, p, len) == SUCCESS)) {
+            sendFrame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        }
+        break;
+    case H2_PING:
+        if (id != 0) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else if (len != 8) {
+            connectionError(c, H2_FRAME_SIZE_ERROR);
+        } else if (!(flags & H2_ACK)) {
+            sendFrame(c, H2_PING, H2_ACK, 0, p, len);
+        }
+        break;
+    case H2_GOAWAY:
+        if (id != 0) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+        } else {
+            c->goaway = 1;
+        }
+        break;
+    case H2_WINDOW_UPDATE:
+        if (len != 4) {
+            connectionError(c, H2_FRAME_SIZE_ERROR);
+        } else {
+            onWindowUpdate(c, id, p);
+        }
+        break;
+    case H2_PUSH_PROMISE:
+        connectionError(c, H2_PROTOCOL_ERROR);
+        break;
+    default:
+        /* Unknown frame types are ignored (RFC 7540 4.1) */
+        break;
+    }
+}
+
+/**
+ * consume : handles every complete frame in the input buffer.
+ */
+static void consume(h2Conn *c)
+{
+    size_t pos = 0, len;
+    unsigned char *f;
+
+    if (c->prefaceLeft > 0) {
+        len = (c->inLen < c->prefaceLeft) ? c->inLen : c->prefaceLeft;
+        if (memcmp(c->in, H2_PREFACE + H2_PREFACE_LEN - c->prefaceLeft, len)) {
+            connectionError(c, H2_PROTOCOL_ERROR);
+            return;
+        }
+        c->prefaceLeft -= len;
+        pos = len;
+    }
+
+    while (!c->failed && (c->prefaceLeft == 0) &&
+           (c->inLen - pos >= H2_FRAME_HEADER)) {
+        f = c->in + pos;
+        len = ((size_t) f[0] << 16) | (f[1] << 8) | f[2];
+        if (len > H2_FRAME_SIZE) {
+            connectionError(c, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->inLen - pos < H2_FRAME_HEADER + len) {
+            break;
+        }
+        onFrame(c, f[3], f[4], get32(f + 5) & H2_MAX_WINDOW,
+                f + H2_FRAME_HEADER, len);
+        pos += H2_FRAME_HEADER + len;
+    }
+
+    memmove(c->in, c->in + pos, c->inLen - pos);
+    c->inLen -= pos;
+}
+
+/**
+ * sendHeaders : the HEADERS frame of stream s.
+ */
+static void sendHeaders(h2Conn *c, h2Stream *s)
+{
+    char status[4], length[20], expires[RESP_DATE_LEN + 1];
+    unsigned char *p;
+    bufStruct block;
+    int room;
+
+    /* A response header block is well under a kilobyte */
+    if ((c->outLen + H2_FRAME_HEADER + 1024 > H2_OUT_BUF) &&
+        (flush(c) != SUCCESS)) {
+        return;
+    }
+    p = (unsigned char *) c->out + c->outLen;
+    room = H2_OUT_BUF - c->outLen - H2_FRAME_HEADER;
+    respInit(&block, (char *) p + H2_FRAME_HEADER, room);
+
+    snprintf(status, sizeof(status), "%03d", s->status);
+    snprintf(length, sizeof(length), "%lld", (long long) s->contentLength);
+    hpackEncodeStart(&c->encoder, &block);
+    hpackEncode(&c->encoder, &block, ":status", status, 3, 1);
+    hpackEncode(&c->encoder, &block, "server", "Simple/1.0", 10, 1);
+    hpackEncode(&c->encoder, &block, "date", respDateValue(),
+                RESP_DATE_LEN, 1);
+    hpackEncode(&c->encoder, &block, "content-type", s->mime,
+                strlen(s->mime), 1);
+    if (s->policy != NULL) {
+        hpackEncode(&c->encoder, &block, "cache-control", s->policy->control,
+                    s->policy->controlLen, 1);
+        if (s->policy->maxAge >= 0) {
+            cachePolicyExpires(s->policy, expires);
+            hpackEncode(&c->encoder, &block, "expires", expires,
+                        RESP_DATE_LEN, 0);
+        }
+    }
+    if (s->links != NULL) {
+        hpackEncode(&c->encoder, &block, "link", s->links,
+                    strlen(s->links), 0);
+    }
+    hpackEncode(&c->encoder, &block, "content-length", length,
+                strlen(length), 0);
+    if (respFailed(&block)) {
+        connectionError(c, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    frameStart(c, block.bufSize, H2_HEADERS,
+               H2_END_HEADERS | ((s->remaining == 0) ? H2_END_STREAM : 0),
+               s->id);
+    s->headersSent = 1;
+}
+
+/**
+ * sendData : the next DATA frame of stream s, as large as the windows
+ * and our frame size allow.
+ * return: SUCCESS if a frame went out
+ */
+static int sendData(h2Conn *c, h2Stream *s)
+{
+    int64_t chunk = s->remaining;
+    unsigned char *p;
+    ssize_t n;
+
+    if (chunk > c->frameSize) {
+        chunk = c->frameSize;
+    }
+    if (chunk > s->window) {
+        chunk = s->window;
+    }
+    if (chunk > c->sendWindow) {
+        chunk = c->sendWindow;
+    }
+    if (chunk <= 0) {
+        return FAILURE;
+    }
+    if ((p = frameStart(c, chunk, H2_DATA, 0, s->id)) == NULL) {
+        return FAILURE;
+    }
+
+    if (s->body != NULL) {
+        memcpy(p, s->body + s->offset, chunk);
+        n = chunk;
+    } else {
+        traceCall(TRACE_CALL_FILE);
+        n = pread(s->fd, p, chunk, s->offset);
+    }
+    if (n <= 0) {
+        /* The file shrank under us, the promised length cannot be kept */
+        c->outLen -= H2_FRAME_HEADER + chunk;
+        streamError(c, s->id, H2_INTERNAL_ERROR);
+        return FAILURE;
+    }
+    if (n < chunk) {
+        c->outLen -= chunk - n;
+        p[-H2_FRAME_HEADER] = n >> 16;
+        p[-H2_FRAME_HEADER + 1] = n >> 8;
+        p[-H2_FRAME_HEADER + 2] = n;
+    }
+
+    s->offset += n;
+    s->remaining -= n;
+    s->window -= n;
+    c->sendWindow -= n;
+    if (s->remaining == 0) {
+        p[-H2_FRAME_HEADER + 4] = H2_END_STREAM;
+    }
+    return SUCCESS;
+}
+
+/**
+ * schedule : one batch of output. Streams take turns putting a frame
+ * in the output buffer until it is full or none can send.
+ */
+static void schedule(h2Conn *c)
+{
+    h2Stream *s;
+    int i, progress;
+
+    do {
+        progress = 0;
+        for (i = 0; (i < c->maxStreams) && !c->failed; i++) {
+            s = &c->streams[(c->next + i) % c->maxStreams];
+            if (s->id == 0) {
+                continue;
+            }
+            if (!s->headersSent) {
+                sendHeaders(c, s);
+                progress = 1;
+            } else if ((s->remaining > 0) && (sendData(c, s) == SUCCESS)) {
+                progress = 1;
+            }
+            if ((s->id != 0) && s->headersSent && (s->remaining == 0)) {
+                /* Done with a request whose body is still coming */
+                if (!s->remoteClosed) {
+                    sendU32(c, H2_RST_STREAM, s->id, H2_NO_ERROR);
+                }
+                closeStream(c, s);
+            }
+        }
+        c->next = (c->next + 1) % c->maxStreams;
+    } while (progress && !c->failed &&
+             (c->outLen + H2_FRAME_HEADER + c->frameSize <= H2_OUT_BUF));
+}
+
+/**
+ * sendable : whether schedule() has anything to put out.
+ */
+static int sendable(h2Conn *c)
+{
+    const h2Stream *s;
+    int i;
+
+    for (i = 0; i < c->maxStreams; i++) {
+        s = &c->streams[i];
+        if ((s->id != 0) &&
+            (!s->headersSent ||
+             ((s->remaining > 0) && (s->window > 0) && (c->sendWindow > 0)))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * base64url : decodes the HTTP2-Settings value in place.
+ * return: the decoded length, -1 if it is not base64url
+ */
+static int base64url(const char *in, size_t len, unsigned char *out)
+{
+    unsigned int acc = 0;
+    int bits = 0, n = 0, v;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        char ch = in[i];
+
+        if ((ch >= 'A') && (ch <= 'Z')) {
+            v = ch - 'A';
+        } else if ((ch >= 'a') && (ch <= 'z')) {
+            v = ch - 'a' + 26;
+        } else if ((ch >= '0') && (ch <= '9')) {
+            v = ch - '0' + 52;
+        } else if (ch == '-') {
+            v = 62;
+        } else if (ch == '_') {
+            v = 63;
+        } else if (ch == '=') {
+            break;
+        } else {
+            return -1;
+        }
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+/**
+ * upgrade : answers 101 to the HTTP/1.1 request in buffer and makes it
+ * stream 1.
+ * return: offset of the bytes following the request, FAILURE if it
+ *         cannot be upgraded after all
+ */
+static int upgrade(h2Conn *c, const char *buffer, int length)
+{
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Connection: Upgrade\r\n"
+                                    "Upgrade: h2c\r\n\r\n";
+    const char *end, *value, *uri, *uriEnd;
+    unsigned char settings[CONF_MAX_LINE];
+    h2Request req;
+    size_t len;
+    int n;
+
+    end = (const char *) memmem(buffer, length, "\r\n\r\n", 4) + 2;
+    value = headerValue(buffer, end, "HTTP2-Settings", &len);
+    if ((len > sizeof(settings) * 4 / 3) ||
+        ((n = base64url(value, len, settings)) < 0) || (n % 6 != 0)) {
+        return FAILURE;
+    }
+
+    memset(&req, 0, sizeof(req));
+    uri = strchr(buffer, ' ') + 1;
+    uriEnd = memchr(uri, ' ', end - uri);
+    memcpy(req.method, buffer, uri - 1 - buffer);
+    if (uriEnd - uri < (long) sizeof(req.path)) {
+        memcpy(req.path, uri, uriEnd - uri);
+    } else {
+        req.tooLong = 1;
+    }
+
+    memcpy(c->out, switching, sizeof(switching) - 1);
+    c->outLen = sizeof(switching) - 1;
+    sendSettings(c);
+    if (applySettings(c, settings, n) != SUCCESS) {
+        return FAILURE;
+    }
+
+    /* The request was complete, stream 1 is half closed (remote) */
+    c->lastStream = 1;
+    startStream(c, 1, &req, 1);
+    c->prefaceLeft = H2_PREFACE_LEN;
+    return end + 2 - buffer;
+}
+
+static void h2Free(h2Conn *c)
+{
+    int i;
+
+    for (i = 0; (c->streams != NULL) && (i < c->maxStreams); i++) {
+        if (c->streams[i].id != 0) {
+            closeStream(c, &c->streams[i]);
+        }
+    }
+    hpackFree(&c->decoder);
+    hpackFree(&c->encoder);
+    free(c->streams);
+    free(c->block);
+    free(c->in);
+    free(c->out);
+    memRelease(MEM_RECV, c->inCap + H2_OUT_BUF);
+}
+
+/**
+*h2Serve : serves a connection as HTTP/2 until either side ends it.
+*args:
+*       buffer: what was received so far, starting with the connection
+*               preface or an upgradable request (h2UpgradeRequest)
+*       root: www root
+*       id: of the connection, its streams are captured under it
+*return:
+*       bytes sent
+*/
+size_t h2Serve(int client_sock, const char *buffer, int length,
+               const serverConfig *cfg, char *root, uint64_t id)
+{
+    struct timeval timeout = { cfg->h2IdleTimeout, 0 };
+    struct pollfd pfd;
+    h2Conn c;
+    int idle = 0, stopSeen = 0, start, i, ret;
+    ssize_t n;
+
+    memset(&c, 0, sizeof(c));
+    c.sock = client_sock;
+    c.cfg = cfg;
+    c.root = root;
+    c.id = id;
+    c.maxStreams = cfg->h2MaxStreams;
+    c.sendWindow = H2_DEFAULT_WINDOW;
+    c.initialWindow = H2_DEFAULT_WINDOW;
+    c.frameSize = H2_FRAME_SIZE;
+    c.inCap = H2_FRAME_HEADER + H2_FRAME_SIZE + length;
+    if (memReserve(MEM_RECV, c.inCap + H2_OUT_BUF) != SUCCESS) {
+        debug_log("Over the memory budget, closing h2 connection on "
+                  "socket %d", client_sock);
+        return 0;
+    }
+    c.in = malloc(c.inCap);
+    c.out = malloc(H2_OUT_BUF);
+    c.streams = calloc(c.maxStreams, sizeof(h2Stream));
+    if ((c.in == NULL) || (c.out == NULL) || (c.streams == NULL) ||
+        (hpackInit(&c.decoder, cfg->h2HeaderTable) != SUCCESS) ||
+        (hpackInit(&c.encoder, HPACK_DEFAULT_TABLE_SIZE) != SUCCESS)) {
+        error_log("%s", "Out of memory for an h2 connection");
+        h2Free(&c);
+        return 0;
+    }
+    for (i = 0; i < c.maxStreams; i++) {
+        c.streams[i].fd = -1;
+    }
+
+    /* A peer that stops reading must not hold the thread forever */
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+               sizeof(timeout));
+
+    if (h2Preface(buffer, length)) {
+        start = 0;
+        c.prefaceLeft = H2_PREFACE_LEN;
+        sendSettings(&c);
+    } else if ((start = upgrade(&c, buffer, length)) == FAILURE) {
+        h2Free(&c);
+        return 0;
+    }
+    memcpy(c.in, buffer + start, length - start);
+    c.inLen = length - start;
+    consume(&c);
+
+    while (!c.failed) {
+        if (h2Stopping && !stopSeen) {
+            stopSeen = 1;
+            if (!c.goaway) {
+                unsigned char payload[8];
+
+                put32(payload, c.lastStream);
+                put32(payload + 4, H2_NO_ERROR);
+                sendFrame(&c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+                c.goaway = 1;
+            }
+        }
+
+        schedule(&c);
+        if ((c.outLen > 0) && (flush(&c) != SUCCESS)) {
+            break;
+        }
+        if (c.goaway && (c.open == 0)) {
+            break;
+        }
+
+        /* Poll without waiting while responses still have data to go */
+        pfd.fd = client_sock;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, sendable(&c) ? 0 : 1000);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (ret == 0) {
+            if (!sendable(&c)) {
+                idle++;
+            }
+            if (idle >= cfg->h2IdleTimeout) {
+                connectionError(&c, H2_NO_ERROR);
+            }
+            continue;
+        }
+
+        traceCall(TRACE_CALL_RECV);
+        n = recv(client_sock, c.in + c.inLen, c.inCap - c.inLen, 0);
+        if (n <= 0) {
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        idle = 0;
+        c.inLen += n;
+        consume(&c);
+    }
+
+    if (c.outLen > 0) {
+        flush(&c);
+    }
+    debug_log("h2 connection on socket %d done, last stream %u",
+              client_sock, c.lastStream);
+    h2Free(&c);
+    return c.bytes;
+}
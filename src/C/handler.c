@@ -0,0 +1,463 @@
+/**
+ * @file    handler.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief In-process request handlers, the library side of simple.h.
+ * A program registers handlers on path prefixes, kept in a router (see
+ * router.c) matched against the canonical path of each request before
+ * it is served from the www root; a request no handler prefix matches
+ * is served as a file, as ever. HTTP/2 does not go through handlers,
+ * h2c is off while any are registered (handlerActive).
+ *
+ * Nothing is copied on the way in: the request a handler gets points
+ * into the buffer clientResume received it in, body included, read up
+ * to its Content-Length as long as it fits (413 otherwise). Nothing is
+ * copied on the way out either: the body passed to simpleRespond() is
+ * sent from where it is and handed back through its release function
+ * once sent, see respEntityFree().
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <response.h>
+#include <router.h>
+#include <trace.h>
+#include <uri.h>
+#include <handler.h>
+
+struct simpleServer {
+    router *routes;
+};
+
+typedef struct handlerRoute {
+    simpleHandler handler;
+    void *arg;
+    char prefix[];
+} handlerRoute;
+
+struct simpleResponse {
+    bufStruct *response;
+    int method;                 /* GET, or HEAD for no body */
+    int responded;
+    size_t headersLen;
+    char headers[HANDLER_HEADERS];
+};
+
+/* Reason phrases of the status codes handlers are likely to use */
+static const struct {
+    int code;
+    const char *reason;
+} reasons[] = {
+    { 200, "OK" }, { 201, "Created" }, { 202, "Accepted" },
+    { 204, "No Content" }, { 206, "Partial Content" },
+    { 301, "Moved Permanently" }, { 302, "Found" }, { 303, "See Other" },
+    { 304, "Not Modified" }, { 307, "Temporary Redirect" },
+    { 308, "Permanent Redirect" },
+    { 400, "Bad Request" }, { 401, "Unauthorized" }, { 403, "Forbidden" },
+    { 404, "Not Found" }, { 405, "Method Not Allowed" },
+    { 409, "Conflict" }, { 410, "Gone" }, { 413, "Payload Too Large" },
+    { 415, "Unsupported Media Type" }, { 422, "Unprocessable Entity" },
+    { 429, "Too Many Requests" },
+    { 500, "Internal Server Error" }, { 501, "Not Implemented" },
+    { 502, "Bad Gateway" }, { 503, "Service Unavailable" },
+    { 504, "Gateway Timeout" },
+};
+
+/* The server simpleRun() serves, its routes fixed from then on */
+static simpleServer *running;
+
+/**
+*simpleCreate : a server without handlers yet.
+*return:
+*       NULL if out of memory
+*/
+simpleServer *simpleCreate(void)
+{
+    simpleServer *srv = malloc(sizeof(simpleServer));
+
+    if ((srv != NULL) && ((srv->routes = routerCreate()) == NULL)) {
+        free(srv);
+        srv = NULL;
+    }
+    return srv;
+}
+
+/**
+*simpleHandle : has handler answer the requests whose canonical path
+*starts with prefix, unless a longer prefix has a handler of its own.
+*"/api/" takes "/api/x" but not "/api", "/api" takes both and "/apix".
+*A prefix registered again gets the new handler. Only before simpleRun.
+*args:
+*       prefix: starts with '/'
+*       arg: passed to handler as is
+*return:
+*       SUCCESS or FAILURE
+*/
+int simpleHandle(simpleServer *srv, const char *prefix, simpleHandler handler,
+                 void *arg)
+{
+    handlerRoute *route, *old;
+    size_t len = strlen(prefix);
+
+    if ((srv == NULL) || (srv == running) || (handler == NULL) ||
+        (prefix[0] != '/')) {
+        return FAILURE;
+    }
+    if ((route = malloc(sizeof(handlerRoute) + len + 1)) == NULL) {
+        return FAILURE;
+    }
+    route->handler = handler;
+    route->arg = arg;
+    memcpy(route->prefix, prefix, len + 1);
+
+    if (routerAdd(srv->routes, prefix, route, (void **) &old) != SUCCESS) {
+        free(route);
+        return FAILURE;
+    }
+    free(old);
+    return SUCCESS;
+}
+
+/**
+*handlerStart : makes srv the server whose handlers requests go to.
+*args:
+*       srv: NULL for none, only files are served
+*return:
+*       SUCCESS, FAILURE if a server was started already
+*/
+int handlerStart(simpleServer *srv)
+{
+    if (!__sync_bool_compare_and_swap(&running, NULL, srv)) {
+        return FAILURE;
+    }
+    if (srv != NULL) {
+        debug_log("Serving %d handler prefixes", srv->routes->count);
+    }
+    return SUCCESS;
+}
+
+/**
+*handlerActive : whether handlers were registered. h2.c knows nothing
+*of them, so h2c is refused while they are and their prefixes are only
+*ever served over HTTP/1.
+*/
+int handlerActive(void)
+{
+    return (running != NULL) && (running->routes->count > 0);
+}
+
+/**
+ * handlerLookup : the handler of the request whose headers end at
+ * length, with its request line split into req and its canonical path
+ * in canonical, req->headers set to the line after the request line.
+ * return: the route, NULL if the request is not for a handler
+ */
+static const handlerRoute *handlerLookup(const char *request, int length,
+                                         simpleRequest *req,
+                                         const char **version,
+                                         char *canonical, size_t size)
+{
+    const handlerRoute *route;
+    const char *lineEnd, *query;
+    size_t matched;
+
+    if ((running == NULL) || (running->routes->count == 0)) {
+        return NULL;
+    }
+    if (((lineEnd = memmem(request, length, "\r\n", 2)) == NULL) ||
+        ((req->target = memchr(request, ' ', lineEnd - request)) == NULL) ||
+        ((*version = memchr(req->target + 1, ' ',
+                            lineEnd - req->target - 1)) == NULL)) {
+        return NULL;
+    }
+    req->method = request;
+    req->methodLen = req->target - request;
+    req->target++;
+    req->targetLen = *version - req->target;
+    (*version)++;
+
+    /* Malformed targets get their error answered with the files */
+    if (uriNormalize(req->target, req->targetLen, canonical, size,
+                     &query) != SUCCESS) {
+        return NULL;
+    }
+    req->pathLen = strlen(canonical);
+    route = routerMatch(running->routes, canonical, req->pathLen, &matched);
+    if (route == NULL) {
+        return NULL;
+    }
+
+    req->path = canonical;
+    req->prefix = route->prefix;
+    req->query = (query != NULL) ? query + 1 : NULL;
+    req->queryLen = (query != NULL) ?
+                    (size_t) (req->target + req->targetLen - query - 1) : 0;
+    req->headers = lineEnd + 2;
+    return route;
+}
+
+/**
+ * bodyLength : the Content-Length of the header lines from pos to end.
+ * return: 0 without one, -1 if it is invalid or the body chunked
+ */
+static long bodyLength(const char *pos, const char *end)
+{
+    const char *eol;
+    char *num;
+    long len = 0;
+
+    for (; pos < end; pos = eol + 2) {
+        if ((eol = memmem(pos, end - pos, "\r\n", 2)) == NULL) {
+            eol = end;
+        }
+        if (!strncasecmp(pos, "Content-Length:", 15)) {
+            len = strtol(pos + 15, &num, 10);
+            if ((len < 0) || (num == pos + 15)) {
+                return -1;
+            }
+        } else if (!strncasecmp(pos, "Transfer-Encoding:", 18)) {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/**
+*handlerRequestLength : bytes of the request to receive before it is
+*served, its headers and, for a handler, its body too when it fits.
+*args:
+*       request, length: received so far
+*       cap: size of the receive buffer
+*return:
+*       0 while the headers are incomplete
+*/
+int handlerRequestLength(const char *request, int length, int cap)
+{
+    char canonical[MAX_BUF_SIZE];
+    simpleRequest req;
+    const char *version, *hdr;
+    int headerEnd;
+    long body;
+
+    if ((hdr = memmem(request, length, "\r\n\r\n", 4)) == NULL) {
+        return 0;
+    }
+    headerEnd = hdr + 4 - request;
+    if (handlerLookup(request, headerEnd, &req, &version, canonical,
+                      sizeof(canonical)) == NULL) {
+        return headerEnd;
+    }
+    body = bodyLength(req.headers, hdr + 2);
+    return ((body > 0) && (body <= cap - headerEnd)) ? headerEnd + body
+                                                     : headerEnd;
+}
+
+/**
+*handlerServe : has the handler of the request answer it into response.
+*args:
+*       request, length: the request received, NUL terminated
+*       response: initialised with a buffer of MAX_BUF_SIZE + 1 bytes
+*return:
+*       SUCCESS, 0 if the request is not for a handler
+*/
+int handlerServe(char *request, int length, bufStruct *response)
+{
+    char canonical[MAX_BUF_SIZE];
+    const handlerRoute *route;
+    simpleResponse resp;
+    simpleRequest req;
+    const char *version, *hdr;
+    int headerEnd;
+    long body;
+
+    if ((hdr = memmem(request, length, "\r\n\r\n", 4)) == NULL) {
+        return 0;
+    }
+    headerEnd = hdr + 4 - request;
+    route = handlerLookup(request, headerEnd, &req, &version, canonical,
+                          sizeof(canonical));
+    if (route == NULL) {
+        return 0;
+    }
+    traceMark(TRACE_PARSE);
+
+    resp.response = response;
+    resp.method = ((req.methodLen == 4) && !memcmp(req.method, "HEAD", 4)) ?
+                  HEAD : GET;
+    resp.responded = 0;
+    resp.headersLen = 0;
+
+    req.headersLen = hdr + 2 - req.headers;
+    body = bodyLength(req.headers, hdr + 2);
+    if ((req.headers - 2 - version != 8) || memcmp(version, "HTTP/1.", 7)) {
+        serveError(505, response, resp.method);
+    } else if (body < 0) {
+        serveError(400, response, resp.method);
+    } else if (body > length - headerEnd) {
+        serveError(413, response, resp.method);
+    } else {
+        req.body = request + headerEnd;
+        req.bodyLen = body;
+        route->handler(&req, &resp, route->arg);
+        if (!resp.responded) {
+            error_log("Handler of %s did not respond", route->prefix);
+            serveError(500, response, resp.method);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+*simpleHeader : the value of the request header name, without the
+*whitespace around it.
+*args:
+*       len: set to the length of the value, it is not NUL terminated
+*return:
+*       the value, NULL if the request has no such header
+*/
+const char *simpleHeader(const simpleRequest *req, const char *name,
+                         size_t *len)
+{
+    const char *pos = req->headers, *end = req->headers + req->headersLen;
+    const char *eol, *value, *last;
+    size_t nameLen = strlen(name);
+
+    for (; pos < end; pos = eol + 2) {
+        if ((eol = memmem(pos, end - pos, "\r\n", 2)) == NULL) {
+            eol = end;
+        }
+        if (((size_t) (eol - pos) <= nameLen) || (pos[nameLen] != ':') ||
+            strncasecmp(pos, name, nameLen)) {
+            continue;
+        }
+        for (value = pos + nameLen + 1;
+             (value < eol) && ((*value == ' ') || (*value == '\t'));
+             value++) {
+        }
+        for (last = eol;
+             (last > value) && ((last[-1] == ' ') || (last[-1] == '\t'));
+             last--) {
+        }
+        *len = last - value;
+        return value;
+    }
+    return NULL;
+}
+
+/**
+*simpleAddHeader : adds the header name: value to the response, before
+*simpleRespond().
+*return:
+*       SUCCESS, FAILURE if it holds a line break or does not fit
+*/
+int simpleAddHeader(simpleResponse *resp, const char *name,
+                    const char *value)
+{
+    size_t nameLen = strlen(name), valueLen = strlen(value);
+
+    if (resp->responded || (nameLen == 0) ||
+        (strcspn(name, ":\r\n") != nameLen) ||
+        (strcspn(value, "\r\n") != valueLen) ||
+        (nameLen + valueLen + 4 > HANDLER_HEADERS - resp->headersLen)) {
+        return FAILURE;
+    }
+    memcpy(resp->headers + resp->headersLen, name, nameLen);
+    resp->headersLen += nameLen;
+    memcpy(resp->headers + resp->headersLen, ": ", 2);
+    resp->headersLen += 2;
+    memcpy(resp->headers + resp->headersLen, value, valueLen);
+    resp->headersLen += valueLen;
+    memcpy(resp->headers + resp->headersLen, "\r\n", 2);
+    resp->headersLen += 2;
+    return SUCCESS;
+}
+
+/**
+ * bodyKept : release of bodies that outlive the server, e.g. literals.
+ */
+static void bodyKept(void *arg)
+{
+}
+
+/**
+*simpleRespond : answers the request, once. The body is sent from
+*where it is, not copied: it has to stay as it is until release(arg)
+*is called, which happens once it is sent or, HEAD requests or
+*failure, right away.
+*args:
+*       status: 200 to 599
+*       type: Content-Type, NULL for none
+*       release: NULL for a body that outlives the server
+*return:
+*       SUCCESS, FAILURE if already answered or the headers do not fit,
+*       then the response is a 500
+*/
+int simpleRespond(simpleResponse *resp, int status, const char *type,
+                  const void *body, size_t len, void (*release)(void *arg),
+                  void *arg)
+{
+    bufStruct *response = resp->response;
+    const char *reason = "";
+    size_t i;
+
+    if (release == NULL) {
+        release = bodyKept;
+    }
+    if (resp->responded || (status < 200) || (status > 599)) {
+        release(arg);
+        return FAILURE;
+    }
+    resp->responded = 1;
+    for (i = 0; i < sizeof(reasons) / sizeof(reasons[0]); i++) {
+        if (reasons[i].code == status) {
+            reason = reasons[i].reason;
+            break;
+        }
+    }
+
+    respLiteral(response, "HTTP/1.0 ");
+    respUint(response, status);
+    respLiteral(response, " ");
+    respAppend(response, reason, strlen(reason));
+    respLiteral(response, "\r\n");
+    respLiteral(response, server);
+    respDate(response);
+    respLiteral(response, connectionClose);
+    if (type != NULL) {
+        respLiteral(response, "Content-Type: ");
+        respAppend(response, type, strlen(type));
+        respLiteral(response, "\r\n");
+    }
+    respAppend(response, resp->headers, resp->headersLen);
+    /* 204 and 304 carry no body */
+    if ((status == 204) || (status == 304)) {
+        len = 0;
+    } else {
+        respLiteral(response, "Content-Length: ");
+        respUint(response, len);
+        respLiteral(response, "\r\n");
+    }
+    respLiteral(response, "\r\n");
+
+    if (respFailed(response)) {
+        serveError(500, response, resp->method);
+        release(arg);
+        return FAILURE;
+    }
+    if ((resp->method == HEAD) || (len == 0)) {
+        release(arg);
+        return SUCCESS;
+    }
+    response->entityBuffer = (char *) body;
+    response->entitySize = len;
+    response->entityRelease = release;
+    response->entityReleaseArg = arg;
+    return SUCCESS;
+}
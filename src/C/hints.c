@@ -0,0 +1,307 @@
+/**
+ * @file    hints.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Preload hints for HTML pages. A browser only learns of the
+ * stylesheets, scripts and images of a page once it has the page and
+ * has parsed it. The first time a page is read whole it is scanned for
+ * them, and from then on its responses carry a Link header listing
+ * them with rel=preload, after a 103 Early Hints response with the
+ * same header. The browser fetches them while it waits for the page.
+ *
+ * What a page references is remembered with its size and modification
+ * time, a changed page is scanned again. URLs are kept as written:
+ * Link URLs resolve against the request URL just like those in the
+ * page do. Only same origin URLs are preloaded, other origins would
+ * need CORS attributes the page may not have.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include <httpparser.h>
+#include <hints.h>
+
+typedef struct hintsEntry {
+    uint32_t hash;
+    time_t mtime;
+    long mtimeNsec;
+    off_t size;
+    char path[HINTS_PATH];
+    int linksLen;
+    char links[HINTS_LINK_MAX];
+} hintsEntry;
+
+#define HINTS_LOCKS 16
+
+static hintsEntry hintsCache[HINTS_SLOTS];
+static pthread_mutex_t hintsLocks[HINTS_LOCKS] = {
+    [0 ... HINTS_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint32_t hashPath(const char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*path != '\0') {
+        hash = (hash ^ (unsigned char) *path++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+*hintsIsPage : whether a response of type mime is scanned for hints.
+*/
+int hintsIsPage(const char *mime)
+{
+    return (mime != NULL) && !strncmp(mime, "text/html", 9);
+}
+
+/**
+*hintsFind : the Link header value remembered for the page canonical,
+*as long as the file st describes did not change since it was scanned.
+*args:
+*       links, size: filled with the NUL terminated value
+*return:
+*       its length, 0 for a page without subresources, -1 if the page
+*       is to be scanned
+*/
+int hintsFind(const char *canonical, const struct stat *st, char *links,
+              size_t size)
+{
+    uint32_t hash = hashPath(canonical);
+    hintsEntry *e = &hintsCache[hash & (HINTS_SLOTS - 1)];
+    pthread_mutex_t *lock = &hintsLocks[hash % HINTS_LOCKS];
+    int len = -1;
+
+    pthread_mutex_lock(lock);
+    if ((e->hash == hash) && (e->size == st->st_size) &&
+        (e->mtime == st->st_mtim.tv_sec) &&
+        (e->mtimeNsec == st->st_mtim.tv_nsec) &&
+        !strcmp(e->path, canonical) && ((size_t) e->linksLen < size)) {
+        len = e->linksLen;
+        memcpy(links, e->links, len + 1);
+    }
+    pthread_mutex_unlock(lock);
+    return len;
+}
+
+/**
+ * attrValue : the value of the attribute name in the tag running from
+ * p to end, quoted or not.
+ * return: the value, its length in *len, or NULL if not there
+ */
+static const char *attrValue(const char *p, const char *end,
+                             const char *name, size_t *len)
+{
+    size_t nameLen = strlen(name), n;
+    const char *value;
+    char quote;
+
+    /* Past the tag name */
+    while ((p < end) && !isspace((unsigned char) *p)) {
+        p++;
+    }
+    while (p < end) {
+        while ((p < end) && (isspace((unsigned char) *p) || (*p == '/'))) {
+            p++;
+        }
+        for (n = 0; (p + n < end) && (p[n] != '=') && (p[n] != '/') &&
+             !isspace((unsigned char) p[n]); n++) {
+        }
+        if (n == 0) {
+            return NULL;
+        }
+        value = p + n;
+        while ((value < end) && isspace((unsigned char) *value)) {
+            value++;
+        }
+        if ((value == end) || (*value != '=')) {
+            /* An attribute without a value */
+            p = value;
+            continue;
+        }
+        value++;
+        while ((value < end) && isspace((unsigned char) *value)) {
+            value++;
+        }
+        quote = ((value < end) && ((*value == '"') || (*value == '\''))) ?
+                *value++ : '\0';
+        for (*len = 0; (value + *len < end) &&
+             (quote ? (value[*len] != quote) :
+                      !isspace((unsigned char) value[*len])); (*len)++) {
+        }
+        if ((n == nameLen) && !strncasecmp(p, name, n)) {
+            return value;
+        }
+        p = value + *len + (quote ? 1 : 0);
+    }
+    return NULL;
+}
+
+/**
+ * hasToken : whether the space separated list value holds token.
+ */
+static int hasToken(const char *value, size_t len, const char *token)
+{
+    size_t tokenLen = strlen(token), i = 0, n;
+
+    while (i < len) {
+        while ((i < len) && isspace((unsigned char) value[i])) {
+            i++;
+        }
+        for (n = 0; (i + n < len) && !isspace((unsigned char) value[i + n]);
+             n++) {
+        }
+        if ((n == tokenLen) && !strncasecmp(value + i, token, n)) {
+            return 1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+/**
+ * sameOriginUrl : whether url can be preloaded as written: a path or a
+ * relative reference, nothing a Link header would need escaped.
+ * return: its length without a fragment, 0 if it cannot
+ */
+static size_t sameOriginUrl(const char *url, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (url[i] == '#') {
+            len = i;
+            break;
+        }
+        if ((url[i] <= ' ') || (url[i] >= 0x7f) ||
+            strchr("<>\"',;\\&", url[i])) {
+            return 0;
+        }
+    }
+    if ((len == 0) || !strncmp(url, "//", 2)) {
+        return 0;
+    }
+    /* A scheme comes before any '/', '?' */
+    for (i = 0; (i < len) && (url[i] != '/') && (url[i] != '?'); i++) {
+        if (url[i] == ':') {
+            return 0;
+        }
+    }
+    return len;
+}
+
+/**
+ * addLink : appends a preload of url as kind to links, unless it is
+ * there already or does not fit.
+ * return: SUCCESS if it is in links
+ */
+static int addLink(char *links, size_t size, size_t *used, const char *url,
+                   size_t len, const char *kind)
+{
+    char entry[HINTS_LINK_MAX];
+    int n;
+
+    n = snprintf(entry, sizeof(entry), "%s<%.*s>; rel=preload; as=%s",
+                 (*used > 0) ? ", " : "", (int) len, url, kind);
+    if ((n < 0) || (*used + n >= size)) {
+        return FAILURE;
+    }
+    if (memmem(links, *used, entry + ((*used > 0) ? 2 : 0),
+               len + 2) != NULL) {
+        return SUCCESS;
+    }
+    memcpy(links + *used, entry, n + 1);
+    *used += n;
+    return SUCCESS;
+}
+
+/**
+*hintsScan : finds the stylesheets, classic scripts and images of the
+*page canonical in the first HINTS_SCAN bytes of html, in document
+*order, and remembers them along with the file st describes.
+*args:
+*       links, size: filled with the Link header value
+*return:
+*       its length, 0 if the page references nothing to preload
+*/
+int hintsScan(const char *canonical, const struct stat *st,
+              const char *html, size_t len, char *links, size_t size)
+{
+    const char *p = html, *end = html + ((len < HINTS_SCAN) ? len : HINTS_SCAN);
+    const char *tagEnd, *close, *url, *rel, *type, *kind;
+    size_t used = 0, urlLen, relLen, typeLen;
+    uint32_t hash = hashPath(canonical);
+    hintsEntry *e = &hintsCache[hash & (HINTS_SLOTS - 1)];
+    pthread_mutex_t *lock = &hintsLocks[hash % HINTS_LOCKS];
+    int count = 0;
+
+    links[0] = '\0';
+    while ((count < HINTS_MAX_LINKS) &&
+           ((p = memchr(p, '<', end - p)) != NULL)) {
+        if ((end - p > 4) && !strncmp(p, "<!--", 4)) {
+            close = memmem(p + 4, end - p - 4, "-->", 3);
+            if (close == NULL) {
+                break;
+            }
+            p = close + 3;
+            continue;
+        }
+        if ((tagEnd = memchr(p, '>', end - p)) == NULL) {
+            break;
+        }
+        p++;
+        url = NULL;
+        kind = NULL;
+        if ((tagEnd - p > 5) && !strncasecmp(p, "link", 4) &&
+            isspace((unsigned char) p[4])) {
+            rel = attrValue(p, tagEnd, "rel", &relLen);
+            if ((rel != NULL) && hasToken(rel, relLen, "stylesheet") &&
+                !hasToken(rel, relLen, "alternate")) {
+                url = attrValue(p, tagEnd, "href", &urlLen);
+                kind = "style";
+            }
+        } else if ((tagEnd - p > 7) && !strncasecmp(p, "script", 6) &&
+                   isspace((unsigned char) p[6])) {
+            /* Modules would need rel=modulepreload */
+            type = attrValue(p, tagEnd, "type", &typeLen);
+            if ((type == NULL) || (typeLen != 6) ||
+                strncasecmp(type, "module", 6)) {
+                url = attrValue(p, tagEnd, "src", &urlLen);
+                kind = "script";
+            }
+        } else if ((tagEnd - p > 4) && !strncasecmp(p, "img", 3) &&
+                   isspace((unsigned char) p[3])) {
+            url = attrValue(p, tagEnd, "src", &urlLen);
+            kind = "image";
+        }
+        if ((url != NULL) && ((urlLen = sameOriginUrl(url, urlLen)) > 0)) {
+            if (addLink(links, size, &used, url, urlLen, kind) != SUCCESS) {
+                break;
+            }
+            count++;
+        }
+        p = tagEnd + 1;
+    }
+
+    if ((strlen(canonical) < HINTS_PATH) && (used < HINTS_LINK_MAX)) {
+        pthread_mutex_lock(lock);
+        e->hash = hash;
+        e->size = st->st_size;
+        e->mtime = st->st_mtim.tv_sec;
+        e->mtimeNsec = st->st_mtim.tv_nsec;
+        strcpy(e->path, canonical);
+        e->linksLen = used;
+        memcpy(e->links, links, used + 1);
+        pthread_mutex_unlock(lock);
+    }
+    return used;
+}
@@ -0,0 +1,584 @@
+/**
+ * @file    hpack.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief HPACK header compression for HTTP/2 (RFC 7541). The decoder
+ * understands every representation, Huffman coded strings included,
+ * and keeps a dynamic table bounded by the size we advertise. The
+ * encoder indexes headers that repeat across responses into its own
+ * dynamic table, so from the second response on they cost a byte,
+ * and writes strings as plain literals.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <httpparser.h>
+#include <response.h>
+#include <hpack.h>
+
+typedef struct hpackStatic {
+    const char *name;
+    size_t nameLen;
+    const char *value;
+    size_t valueLen;
+} hpackStatic;
+
+#define S(name, value) { name, sizeof(name) - 1, value, sizeof(value) - 1 }
+
+/* RFC 7541 Appendix A */
+static const hpackStatic staticTable[HPACK_STATIC_ENTRIES] = {
+    S(":authority", ""),
+    S(":method", "GET"),
+    S(":method", "POST"),
+    S(":path", "/"),
+    S(":path", "/index.html"),
+    S(":scheme", "http"),
+    S(":scheme", "https"),
+    S(":status", "200"),
+    S(":status", "204"),
+    S(":status", "206"),
+    S(":status", "304"),
+    S(":status", "400"),
+    S(":status", "404"),
+    S(":status", "500"),
+    S("accept-charset", ""),
+    S("accept-encoding", "gzip, deflate"),
+    S("accept-language", ""),
+    S("accept-ranges", ""),
+    S("accept", ""),
+    S("access-control-allow-origin", ""),
+    S("age", ""),
+    S("allow", ""),
+    S("authorization", ""),
+    S("cache-control", ""),
+    S("content-disposition", ""),
+    S("content-encoding", ""),
+    S("content-language", ""),
+    S("content-length", ""),
+    S("content-location", ""),
+    S("content-range", ""),
+    S("content-type", ""),
+    S("cookie", ""),
+    S("date", ""),
+    S("etag", ""),
+    S("expect", ""),
+    S("expires", ""),
+    S("from", ""),
+    S("host", ""),
+    S("if-match", ""),
+    S("if-modified-since", ""),
+    S("if-none-match", ""),
+    S("if-range", ""),
+    S("if-unmodified-since", ""),
+    S("last-modified", ""),
+    S("link", ""),
+    S("location", ""),
+    S("max-forwards", ""),
+    S("proxy-authenticate", ""),
+    S("proxy-authorization", ""),
+    S("range", ""),
+    S("referer", ""),
+    S("refresh", ""),
+    S("retry-after", ""),
+    S("server", ""),
+    S("set-cookie", ""),
+    S("strict-transport-security", ""),
+    S("transfer-encoding", ""),
+    S("user-agent", ""),
+    S("vary", ""),
+    S("via", ""),
+    S("www-authenticate", ""),
+};
+
+/* RFC 7541 Appendix B, codes of symbols 0-255, EOS is all ones */
+static const uint32_t huffmanCodes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffmanBits[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HUFFMAN_EOS 256
+
+/* Decoding tree, leaves are stored as -(symbol + 1) */
+static int16_t huffmanTree[HUFFMAN_EOS][2];
+static pthread_once_t huffmanOnce = PTHREAD_ONCE_INIT;
+
+static void huffmanBuild(void)
+{
+    int nodes = 1;
+    int sym, bit, node, len;
+    uint32_t code;
+
+    for (sym = 0; sym <= HUFFMAN_EOS; sym++) {
+        code = (sym == HUFFMAN_EOS) ? 0x3fffffff : huffmanCodes[sym];
+        len = (sym == HUFFMAN_EOS) ? 30 : huffmanBits[sym];
+        node = 0;
+        while (--len > 0) {
+            bit = (code >> len) & 1;
+            if (huffmanTree[node][bit] == 0) {
+                huffmanTree[node][bit] = nodes++;
+            }
+            node = huffmanTree[node][bit];
+        }
+        huffmanTree[node][code & 1] = -(sym + 1);
+    }
+}
+
+/**
+ * huffmanDecode : decodes len bytes into out, which has room for
+ * len * 8 / 5 bytes (the shortest code is 5 bits).
+ * return: decoded length, or -1 on invalid input
+ */
+static long huffmanDecode(const unsigned char *in, size_t len, char *out)
+{
+    long outLen = 0;
+    int node = 0, pad = 0, ones = 1;
+    int bit, next, i;
+    size_t pos;
+
+    pthread_once(&huffmanOnce, huffmanBuild);
+    for (pos = 0; pos < len; pos++) {
+        for (i = 7; i >= 0; i--) {
+            bit = (in[pos] >> i) & 1;
+            next = huffmanTree[node][bit];
+            if (next < 0) {
+                if (next == -(HUFFMAN_EOS + 1)) {
+                    return -1;
+                }
+                out[outLen++] = (char) (-next - 1);
+                node = 0;
+                pad = 0;
+                ones = 1;
+            } else {
+                node = next;
+                pad++;
+                ones &= bit;
+            }
+        }
+    }
+
+    /* Only a prefix of EOS, shorter than a byte, may pad the end */
+    return ((pad < 8) && ones) ? outLen : -1;
+}
+
+/**
+*hpackInit : sets up an empty dynamic table of at most limit bytes.
+*return:
+*       SUCCESS or FAILURE
+*/
+int hpackInit(hpackTable *table, size_t limit)
+{
+    memset(table, 0, sizeof(*table));
+    table->cap = limit / HPACK_ENTRY_OVERHEAD + 1;
+    table->entries = calloc(table->cap, sizeof(hpackEntry));
+    table->maxSize = table->limit = limit;
+    return (table->entries != NULL) ? SUCCESS : FAILURE;
+}
+
+static void tableEvict(hpackTable *table, size_t room)
+{
+    hpackEntry *e;
+
+    while ((table->count > 0) && (table->size + room > table->maxSize)) {
+        e = &table->entries[(table->head + table->count - 1) % table->cap];
+        table->size -= e->nameLen + e->valueLen + HPACK_ENTRY_OVERHEAD;
+        free(e->name);
+        e->name = NULL;
+        table->count--;
+    }
+}
+
+/**
+*hpackFree : releases the dynamic table.
+*/
+void hpackFree(hpackTable *table)
+{
+    table->maxSize = 0;
+    tableEvict(table, 0);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+/**
+*hpackSetLimit : encoder side, the peer's SETTINGS_HEADER_TABLE_SIZE.
+*The table never grows past the size it was created with.
+*/
+void hpackSetLimit(hpackTable *table, size_t limit)
+{
+    table->maxSize = (limit < table->limit) ? limit : table->limit;
+    tableEvict(table, 0);
+    table->pendingUpdate = 1;
+}
+
+/**
+ * tableInsert : adds a copy of the field as the newest entry. A field
+ * larger than the table empties it (RFC 7541 4.4).
+ * return: SUCCESS, FAILURE if out of memory
+ */
+static int tableInsert(hpackTable *table, const char *name, size_t nameLen,
+                       const char *value, size_t valueLen)
+{
+    size_t need = nameLen + valueLen + HPACK_ENTRY_OVERHEAD;
+    hpackEntry *e;
+    char *copy;
+
+    if (need > table->maxSize) {
+        tableEvict(table, table->maxSize + 1);
+        return SUCCESS;
+    }
+
+    /* Copied first, name may point at an entry about to be evicted */
+    if ((copy = malloc(nameLen + valueLen + 1)) == NULL) {
+        return FAILURE;
+    }
+    memcpy(copy, name, nameLen);
+    memcpy(copy + nameLen, value, valueLen);
+
+    tableEvict(table, need);
+    table->head = (table->head + table->cap - 1) % table->cap;
+    e = &table->entries[table->head];
+    e->name = copy;
+    e->nameLen = nameLen;
+    e->value = copy + nameLen;
+    e->valueLen = valueLen;
+    table->count++;
+    table->size += need;
+    return SUCCESS;
+}
+
+/**
+ * tableGet : field at index, 1-61 static, from 62 dynamic newest first.
+ * return: SUCCESS or FAILURE if there is no such entry
+ */
+static int tableGet(const hpackTable *table, uint64_t index,
+                    const char **name, size_t *nameLen,
+                    const char **value, size_t *valueLen)
+{
+    const hpackEntry *e;
+
+    if ((index >= 1) && (index <= HPACK_STATIC_ENTRIES)) {
+        *name = staticTable[index - 1].name;
+        *nameLen = staticTable[index - 1].nameLen;
+        *value = staticTable[index - 1].value;
+        *valueLen = staticTable[index - 1].valueLen;
+        return SUCCESS;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if ((index >= (uint64_t) table->count)) {
+        return FAILURE;
+    }
+    e = &table->entries[(table->head + index) % table->cap];
+    *name = e->name;
+    *nameLen = e->nameLen;
+    *value = e->value;
+    *valueLen = e->valueLen;
+    return SUCCESS;
+}
+
+/**
+ * decodeInt : integer with an n bit prefix (RFC 7541 5.1).
+ */
+static int decodeInt(const unsigned char **pos, const unsigned char *end,
+                     int prefix, uint64_t *out)
+{
+    uint64_t max = (1 << prefix) - 1;
+    uint64_t value = **pos & max;
+    int shift = 0;
+    unsigned char b;
+
+    (*pos)++;
+    if (value < max) {
+        *out = value;
+        return SUCCESS;
+    }
+    while ((*pos < end) && (shift <= 28)) {
+        b = *(*pos)++;
+        value += (uint64_t) (b & 0x7f) << shift;
+        shift += 7;
+        if (!(b & 0x80)) {
+            *out = value;
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+/**
+ * decodeString : string literal (RFC 7541 5.2), Huffman coded ones
+ * are decoded into scratch.
+ */
+static int decodeString(const unsigned char **pos, const unsigned char *end,
+                        char **scratch, const char **str, size_t *len)
+{
+    int huffman;
+    uint64_t n;
+    long decoded;
+
+    if (*pos >= end) {
+        return FAILURE;
+    }
+    huffman = **pos & 0x80;
+    if ((decodeInt(pos, end, 7, &n) != SUCCESS) ||
+        (n > (uint64_t) (end - *pos))) {
+        return FAILURE;
+    }
+    if (!huffman) {
+        *str = (const char *) *pos;
+        *len = n;
+    } else {
+        if ((decoded = huffmanDecode(*pos, n, *scratch)) < 0) {
+            return FAILURE;
+        }
+        *str = *scratch;
+        *len = decoded;
+        *scratch += decoded;
+    }
+    *pos += n;
+    return SUCCESS;
+}
+
+/**
+*hpackDecode : decodes a complete header block, calling emit for each
+*field in order.
+*return:
+*       SUCCESS, or FAILURE on a compression error, after which the
+*       table can no longer be used
+*/
+int hpackDecode(hpackTable *table, const unsigned char *in, size_t len,
+                hpackEmit emit, void *arg)
+{
+    const unsigned char *pos = in, *end = in + len;
+    const char *name, *value;
+    size_t nameLen, valueLen;
+    char *scratch, *buf;
+    uint64_t index;
+    int fields = 0, ret = FAILURE;
+    int prefix, indexing;
+
+    /* Room for every string in the block Huffman decoded */
+    if ((scratch = malloc(len * 8 / 5 + 1)) == NULL) {
+        return FAILURE;
+    }
+
+    while (pos < end) {
+        buf = scratch;
+        if (*pos & 0x80) {
+            /* Indexed field */
+            if ((decodeInt(&pos, end, 7, &index) != SUCCESS) ||
+                (tableGet(table, index, &name, &nameLen,
+                          &value, &valueLen) != SUCCESS)) {
+                goto out;
+            }
+            emit(arg, name, nameLen, value, valueLen);
+            fields++;
+            continue;
+        }
+
+        if ((*pos & 0xe0) == 0x20) {
+            /* Table size update, only ahead of the first field */
+            if ((fields > 0) ||
+                (decodeInt(&pos, end, 5, &index) != SUCCESS) ||
+                (index > table->limit)) {
+                goto out;
+            }
+            table->maxSize = index;
+            tableEvict(table, 0);
+            continue;
+        }
+
+        /* Literal, with incremental indexing, without or never indexed */
+        indexing = (*pos & 0x40) != 0;
+        prefix = indexing ? 6 : 4;
+        if (decodeInt(&pos, end, prefix, &index) != SUCCESS) {
+            goto out;
+        }
+        if (index == 0) {
+            if (decodeString(&pos, end, &buf, &name, &nameLen) != SUCCESS) {
+                goto out;
+            }
+        } else if (tableGet(table, index, &name, &nameLen,
+                            &value, &valueLen) != SUCCESS) {
+            goto out;
+        }
+        if (decodeString(&pos, end, &buf, &value, &valueLen) != SUCCESS) {
+            goto out;
+        }
+        emit(arg, name, nameLen, value, valueLen);
+        fields++;
+        if (indexing &&
+            (tableInsert(table, name, nameLen, value, valueLen) != SUCCESS)) {
+            goto out;
+        }
+    }
+    ret = SUCCESS;
+
+out:
+    free(scratch);
+    return ret;
+}
+
+/**
+ * encodeInt : integer with an n bit prefix, first holds the bits
+ * above the prefix.
+ */
+static void encodeInt(bufStruct *out, unsigned char first, int prefix,
+                      uint64_t value)
+{
+    uint64_t max = (1 << prefix) - 1;
+    char bytes[12];
+    int n = 0;
+
+    if (value < max) {
+        bytes[n++] = first | value;
+    } else {
+        bytes[n++] = first | max;
+        value -= max;
+        while (value >= 0x80) {
+            bytes[n++] = 0x80 | (value & 0x7f);
+            value >>= 7;
+        }
+        bytes[n++] = value;
+    }
+    respAppend(out, bytes, n);
+}
+
+static void encodeString(bufStruct *out, const char *str, size_t len)
+{
+    encodeInt(out, 0, 7, len);
+    respAppend(out, str, len);
+}
+
+/**
+*hpackEncodeStart : begins a header block, announcing a changed table
+*size first.
+*/
+void hpackEncodeStart(hpackTable *table, bufStruct *out)
+{
+    if (table->pendingUpdate) {
+        encodeInt(out, 0x20, 5, table->maxSize);
+        table->pendingUpdate = 0;
+    }
+}
+
+/**
+*hpackEncode : appends a field to the header block in out.
+*args:
+*       name: lower case field name
+*       index: add the field to the dynamic table if not there yet
+*return:
+*       SUCCESS, or FAILURE if out overflowed
+*/
+int hpackEncode(hpackTable *table, bufStruct *out, const char *name,
+                const char *value, size_t valueLen, int index)
+{
+    size_t nameLen = strlen(name);
+    uint64_t nameIndex = 0;
+    const hpackEntry *e;
+    int i;
+
+    for (i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if ((staticTable[i].nameLen != nameLen) ||
+            memcmp(staticTable[i].name, name, nameLen)) {
+            continue;
+        }
+        if ((staticTable[i].valueLen == valueLen) &&
+            !memcmp(staticTable[i].value, value, valueLen)) {
+            encodeInt(out, 0x80, 7, i + 1);
+            return respFailed(out) ? FAILURE : SUCCESS;
+        }
+        if (nameIndex == 0) {
+            nameIndex = i + 1;
+        }
+    }
+    for (i = 0; i < table->count; i++) {
+        e = &table->entries[(table->head + i) % table->cap];
+        if ((e->nameLen != nameLen) || memcmp(e->name, name, nameLen)) {
+            continue;
+        }
+        if ((e->valueLen == valueLen) && !memcmp(e->value, value, valueLen)) {
+            encodeInt(out, 0x80, 7, HPACK_STATIC_ENTRIES + 1 + i);
+            return respFailed(out) ? FAILURE : SUCCESS;
+        }
+        if (nameIndex == 0) {
+            nameIndex = HPACK_STATIC_ENTRIES + 1 + i;
+        }
+    }
+
+    /* The peer indexes the field too, so only announce it if we could */
+    index = index && (tableInsert(table, name, nameLen, value,
+                                  valueLen) == SUCCESS);
+    if (index) {
+        encodeInt(out, 0x40, 6, nameIndex);
+    } else {
+        encodeInt(out, 0x00, 4, nameIndex);
+    }
+    if (nameIndex == 0) {
+        encodeString(out, name, nameLen);
+    }
+    encodeString(out, value, valueLen);
+    return respFailed(out) ? FAILURE : SUCCESS;
+}
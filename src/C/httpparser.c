@@ -10,38 +10,60 @@
  */
 
 #include <httpparser.h>
+#include <response.h>
+#include <trace.h>
+#include <cachepolicy.h>
+#include <uri.h>
+#include <iopool.h>
+#include <flight.h>
+#include <memgov.h>
+#include <hints.h>
+
+static void earlyHints(bufStruct *response, const char *links, int len);
 
 /**
 * parseRequest : parses the given http request and generates the
 * appropriate response
 * args: 
-	buffer: incoming http request
+	buffer: incoming http request, NUL terminated at buffer[length]
+	length: number of bytes in the request
 	responseBuffer: buffer to fill the response
+	cfg: configuration, for the caching rules
+	wait: this request's part in loads shared by concurrent GETs, or
+		NULL to load alone. If wait->joined is set on return no
+		response was framed yet, see serveShared.
 * return:
 	none
 */
-void parseRequest(char *buffer, bufStruct *response,char *rootDirPath) {
+void parseRequest(char *buffer, int length, bufStruct *response,char *rootDirPath,
+		  const serverConfig *cfg, flightWait *wait) {
 
 	int size = 0;
-	int uriLength = 0;
-	int httpLength = 0;
-	char methodName[MAX_BUF_SIZE + 1];
-	char uri[MAX_BUF_SIZE + 1];
-	char httpVersion[MAX_BUF_SIZE + 1];
-	char ch;
+	char *methodName;
+	char *uri;
+	char *httpVersion;
+	char saved;
 	FILE *fp = NULL;
 	int method = -1;
 	char resourcePath[MAX_PATH] = "";
-	char finalURI[MAX_PATH]="";
-
-	while((size < MAX_BUF_SIZE ) && ( (ch = buffer[size]) != ' ')) 
+	char canonical[MAX_PATH] = "";
+	const cacheRule *policy;
+	char links[HINTS_LINK_MAX];
+	int linksLen;
+	struct stat st;
+
+	/*
+	 * The request line is tokenized in place, so its size is only
+	 * bounded by the configured max_buf_size.
+	 */
+	methodName = buffer;
+	while((size < length ) && (buffer[size] != ' ')) 
 	{
-		methodName[size] = ch;
 		size++;
 	}
 	
 	
-	methodName[size] = '\0';
+	buffer[size] = '\0';
 	
 	//check Get method 
 	response->entitySize = 0;
@@ -54,60 +76,52 @@ void parseRequest(char *buffer, bufStruct *response,char *rootDirPath) {
 
 
 	/*increment size to skip space delimiter*/
-	size++;
+	if(size < length)
+		size++;
 	
 	/*check uri*/
-	while((size < MAX_BUF_SIZE) && ((ch = buffer[size]) != ' ')) 
+	uri = buffer + size;
+	while((size < length) && (buffer[size] != ' ')) 
 	{
-		uri[uriLength] = ch;
-		uriLength++;
 		size++;
 
 	}
 	
-	uri[uriLength] = '\0';
-	
-
-	getFinalURI(uri,finalURI);
-	strcpy(resourcePath,rootDirPath);
-	strcat(resourcePath,finalURI);
+	buffer[size] = '\0';
 
 	//Check resource path:
-	int fileError = checkFile(resourcePath);
+	int fileError = uriResolve(uri,rootDirPath,canonical,resourcePath);
+	traceMark(TRACE_PARSE);
 	if(fileError != SUCCESS)
 	{
 		serveError(fileError,response,method);
 		return;
 	}
 
-	//finding resource
-	if((fp = openFile(resourcePath)) == NULL )
-	{
-		serveError(404,response,method);
-		return;
-	}
-
 
 	/*increment size to skip space delimiter*/
-    size++;
+	if(size < length)
+		size++;
 
-	while((size < MAX_BUF_SIZE ) && ( (ch = buffer[size]) != '\r')) 
+	httpVersion = buffer + size;
+	while((size < length ) && (buffer[size] != '\r')) 
 	{
-        httpVersion[httpLength] = ch;
-		httpLength++;
-        size++;
+		size++;
 	}
 
-	httpVersion[httpLength] = '\0';
+	/* terminate the version in place, checkHeader needs the '\r' back */
+	saved = buffer[size];
+	buffer[size] = '\0';
 
 	if(checkHttpVersion(httpVersion) == -1)
 	{		
 		serveError(505,response,method);
 		return;
 	}
+	buffer[size] = saved;
 
 	/*increment the size and check for '\n' */
-	int returnVal = checkHeader(buffer,size);
+	int returnVal = checkHeader(buffer,size,length);
 	if(returnVal == FAILURE)
 	{
 		serveError(400,response,method);
@@ -117,15 +131,67 @@ void parseRequest(char *buffer, bufStruct *response,char *rootDirPath) {
 
 	/*Parse header if needed*/
 	/*file return*/
+	policy = cachePolicyFind(cfg,canonical,resourcePath);
+
+	/*
+	 * The request is sound, the file is all that is left. A GET for a
+	 * file another request is loading waits for that load, see
+	 * flight.c; the caller parks until it lands and calls serveShared.
+	 */
+	if((method == GET) && (wait != NULL) &&
+	   !flightJoin(canonical,resourcePath,wait))
+	{
+		wait->mime = get_mime(resourcePath);
+		wait->policy = policy;
+		return;
+	}
+
+	//finding resource
+	fileError = checkFile(resourcePath);
+	if((fileError == SUCCESS) && ((fp = openFile(resourcePath)) == NULL))
+	{
+		fileError = 404;
+	}
+	if(fileError != SUCCESS)
+	{
+		if(wait != NULL)
+		{
+			flightLand(wait,NULL,fileError);
+		}
+		serveError(fileError,response,method);
+		return;
+	}
+	traceMark(TRACE_OPEN);
+
+	/* Pages tell what they need ahead of themselves, see hints.c */
+	linksLen = 0;
+	if(hintsIsPage(get_mime(resourcePath)) && (fstat(fileno(fp),&st) == 0))
+	{
+		linksLen = hintsFind(canonical,&st,links,sizeof(links));
+		if((linksLen > 0) && (method == GET))
+		{
+			earlyHints(response,links,linksLen);
+		}
+	}
 
 	if(method == GET) 
 	{
-		serveGet(response,fp,resourcePath);
+		serveGet(response,fp,resourcePath,policy,
+			 (linksLen > 0) ? links : NULL,wait);
+		//scanned once read whole, later responses carry the hints
+		if((linksLen < 0) &&
+		   (response->entityShared != NULL) &&
+		   (response->entityFile == NULL))
+		{
+			hintsScan(canonical,&st,response->entityBuffer,
+				  response->entitySize,links,sizeof(links));
+		}
 		return;
 	}
 	else if( method == HEAD) 
 	{
-		serveHead(response,fp,resourcePath);
+		serveHead(response,fp,resourcePath,policy,
+			  (linksLen > 0) ? links : NULL);
 		return;
 	} 
 
@@ -138,6 +204,31 @@ void parseRequest(char *buffer, bufStruct *response,char *rootDirPath) {
 }
 
 
+/**
+*resolveResource: Maps a request uri onto the file under the root
+*directory that serves it, see uri.c.
+*args :
+*	uri: request target
+*	rootDirPath: www root
+*	resourcePath: MAX_PATH bytes, filled with the file path
+*	canonical: MAX_PATH bytes, filled with the canonical request path,
+*		the key for anything looked up per resource
+*return:
+*	SUCCESS, or the HTTP error code to answer with
+*/
+int resolveResource(char *uri,char *rootDirPath,char *resourcePath,
+		    char *canonical)
+{
+	int code = uriResolve(uri,rootDirPath,canonical,resourcePath);
+
+	traceMark(TRACE_PARSE);
+	if(code != SUCCESS)
+	{
+		return code;
+	}
+	return checkFile(resourcePath);
+}
+
 /**
 *checkMethod: Checks if the given method is supported by Server.
 *args : 
@@ -178,6 +269,7 @@ int checkMethod(char *methodName)
 */
 FILE *openFile(char *filePath) {
 	
+	traceCall(TRACE_CALL_FILE);
 	FILE *fp = fopen(filePath,"r");
 	return fp;
 }
@@ -196,6 +288,7 @@ int checkFile(char *filePath) {
 	
 	//directory check
 	struct stat buf;
+	traceCall(TRACE_CALL_FILE);
 	int status = stat(filePath,&buf);
 	if(status == 0)
 	{
@@ -203,9 +296,11 @@ int checkFile(char *filePath) {
 			return NOT_PERMITTED;
 	}
 
+	traceCall(TRACE_CALL_FILE);
 	int fd = open(filePath,O_RDONLY);
 	if(fd > 0)
 	{
+		traceCall(TRACE_CALL_FILE);
 		close(fd);
 		return SUCCESS;
 	}
@@ -253,140 +348,329 @@ int checkHttpVersion(char *httpVersion) {
 }
 
 /**
- * getFinalURI: validates the URI, makes changes to it
- * if necessary.
- * Assuming that the uri only starts with /
- * The final URI contains the result.
- */
-
-void getFinalURI(char *uri,char *finalURI)
+*frameHeaders : builds the header block common to every response,
+*the status line followed by Server, Date, Connection, Content-Type
+*(unless mime is NULL), the caching headers of policy (unless NULL),
+*the preloads of links (unless NULL) and Content-Length.
+*args:
+*	response: response struct to be filled
+*	status: status line, statusLen bytes including its CRLF
+*	mime: content type of the entity or NULL
+*	contentLength: size of the entity
+*	policy: caching rule of the file served, see cachepolicy.c
+*	links: Link header value, see hints.c
+*return:
+*	SUCCESS, or FAILURE if the headers do not fit the buffer
+*/
+static int frameHeaders(bufStruct *response, const char *status,
+			size_t statusLen, const char *mime, size_t contentLength,
+			const cacheRule *policy, const char *links)
 {
-	//uri validation
-	strcpy(finalURI,uri);
-
-	//add index.html
-	if(!strcmp(uri,"/"))
+	respAppend(response,status,statusLen);
+	respLiteral(response,server);
+	respDate(response);
+	respLiteral(response,connectionClose);
+	if(mime != NULL)
 	{
-	
-		strcat(finalURI,boilerPlatePage);
+		respLiteral(response,"Content-Type: ");
+		respAppend(response,mime,strlen(mime));
+		respLiteral(response,"\r\n");
 	}
+	cachePolicyAppend(response,policy);
+	if(links != NULL)
+	{
+		respLiteral(response,"Link: ");
+		respAppend(response,links,strlen(links));
+		respLiteral(response,"\r\n");
+	}
+	respLiteral(response,"Content-Length: ");
+	respUint(response,contentLength);
+	respLiteral(response,"\r\n\r\n");
 
-	return;	
-	
+	return respFailed(response) ? FAILURE : SUCCESS;
 }
 
+/**
+*earlyHints : starts the response with a 103 Early Hints carrying the
+*Link header of the 200 that follows. clientResume sends it on its
+*own when the rest of the response is not ready yet.
+*/
+static void earlyHints(bufStruct *response, const char *links, int len)
+{
+	respLiteral(response,response103);
+	respLiteral(response,"Link: ");
+	respAppend(response,links,len);
+	respLiteral(response,"\r\n\r\n");
+	response->hintsLen = response->bufSize;
+}
+
+/**
+*fileSize : size of the open file, the position is left at the start.
+*/
+static long fileSize(FILE *fp)
+{
+	long size;
+
+	fseek(fp,0,SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	return (size < 0) ? 0 : size;
+}
 
+/**
+*serveStream : sets up a file over the memory budget to be sent a
+*chunk at a time through a small buffer, see clientResume. Requests
+*that joined its load stream their own.
+*/
+static void serveStream(bufStruct *response,FILE *fp,long size,
+			flightWait *wait) {
 
+	if(wait != NULL)
+	{
+		flightLand(wait,NULL,FLIGHT_ALONE);
+	}
+	if(memReserve(MEM_RESPONSE,MEM_STREAM_CHUNK) != SUCCESS)
+	{
+		//not even a chunk fits, shed the request
+		fclose(fp);
+		serveError(503,response,GET);
+		return;
+	}
+	response->entityReserved = MEM_STREAM_CHUNK;
+	if((response->entityBuffer = malloc(MEM_STREAM_CHUNK)) == NULL)
+	{
+		fclose(fp);
+		respEntityFree(response);
+		serveError(500,response,GET);
+		return;
+	}
+	response->entityFile = fp;
+	response->streamLeft = size;
+}
 
 /**
-*serveGet : serves the client with the requested GET METHOD
+*serveGet : serves the client with the requested GET METHOD. Only what
+*the page cache holds of the file is read here; if that is not all of
+*it, response->entityFile is left open for the caller to read the rest
+*off the event loop, from response->entityRead on, and land the load.
+*The file is read into a shared entity, handed to the requests that
+*joined the load of wait. A file over the memory budget is streamed
+*instead, response->streamLeft is set then.
 * args:
 *	response: response struct to be filled
 *	fp : File pointer of the file to be sent
+*	policy : caching rule of the file or NULL
+*	links : Link header value or NULL, see hints.c
+*	wait : load this request leads or NULL
 *return:
 *	none
 */
-void serveGet(bufStruct *response,FILE *fp,char *uri) {
-	
-	char *mimeBuf;
-	char mimeHeader[MAX_PATH] ="Content-Type: ";
-
-	
+void serveGet(bufStruct *response,FILE *fp,char *uri,const cacheRule *policy,
+	      const char *links,flightWait *wait) {
 
-	//currently sending 200 OK
-	// fill the file transfer
-	strcpy(((response->buffer)+(response->bufSize)),response200);
-	response->bufSize += strlen(response200);
-
-	//Server
-	strcpy(((response->buffer)+(response->bufSize)),server);
-	response->bufSize += strlen(server);
-
-	//Get content type
-	mimeBuf = get_mime(uri);
-	strcat(mimeHeader,mimeBuf);
-	strcat(mimeHeader,"\r\n");
-	strcpy(((response->buffer)+(response->bufSize)),mimeHeader);
-	response->bufSize += strlen(mimeHeader);
-
-	//Add Connection:close
-	strcpy(((response->buffer)+(response->bufSize)),connectionClose);
-	response->bufSize += strlen(connectionClose);
-	
-	//ending CRLF
-	strcpy(((response->buffer)+(response->bufSize)),"\r\n");
-	response->bufSize += strlen("\r\n");
-
-	//Entity Body
-	
-	//Getting filesize
-	fseek(fp,0,SEEK_END);
-	response->entitySize = ftell(fp);
-	rewind(fp);
+	long size = fileSize(fp);
+	sharedEntity *entity = NULL;
+	ssize_t cached;
 
+	//currently sending 200 OK, the file is the entity body
+	if(frameHeaders(response,response200,sizeof(response200) - 1,
+			get_mime(uri),size,policy,links) == SUCCESS)
+	{
+		if(memReserve(MEM_RESPONSE,size) != SUCCESS)
+		{
+			serveStream(response,fp,size,wait);
+			return;
+		}
+		if((entity = sharedAlloc(size)) == NULL)
+		{
+			memRelease(MEM_RESPONSE,size);
+		}
+	}
+	if(entity == NULL)
+	{
+		fclose(fp);
+		if(wait != NULL)
+		{
+			flightLand(wait,NULL,500);
+		}
+		serveError(500,response,GET);
+		return;
+	}
+	response->entityShared = entity;
+	response->entityBuffer = entity->data;
 
-	response->entityBuffer = malloc(response->entitySize);
-	fread(response->entityBuffer,sizeof(char),response->entitySize,fp);
+	traceCall(TRACE_CALL_FILE);
+	cached = (size > 0) ?
+		ioReadCached(fileno(fp),entity->data,size,0) : 0;
+	if((cached >= 0) && (cached < size))
+	{
+		//the rest is on disk
+		response->entitySize = size;
+		response->entityRead = cached;
+		response->entityFile = fp;
+		return;
+	}
+	response->entitySize = (cached > 0) ? cached : 0;
+	entity->length = response->entitySize;
 
 	//file is in buffer now
 	fclose(fp);
+	traceMark(TRACE_READ);
+	if(wait != NULL)
+	{
+		flightLand(wait,entity,SUCCESS);
+	}
 
 	//end response
 	return;
 }
 
+/**
+*serveShared : serves a GET that joined the load of another request
+*once it landed, with the file that load read or the error it ran into.
+* args:
+*	response: response struct to be filled
+*	wait : the request's part in the load, its reference is taken over
+*return:
+*	none
+*/
+void serveShared(bufStruct *response,flightWait *wait) {
+
+	sharedEntity *entity = wait->entity;
+	FILE *fp;
+	int code;
+
+	wait->entity = NULL;
+	wait->joined = 0;
+	if(wait->status == FLIGHT_ALONE)
+	{
+		//too large to share: stream it like the request that loaded it
+		code = checkFile(wait->path);
+		if((code == SUCCESS) && ((fp = openFile(wait->path)) != NULL))
+		{
+			serveGet(response,fp,wait->path,wait->policy,NULL,NULL);
+		}
+		else
+		{
+			serveError((code == SUCCESS) ? 404 : code,response,GET);
+		}
+		free(wait->path);
+		wait->path = NULL;
+		return;
+	}
+	if(wait->status != SUCCESS)
+	{
+		serveError(wait->status,response,GET);
+		return;
+	}
+	if(frameHeaders(response,response200,sizeof(response200) - 1,
+			wait->mime,entity->size,wait->policy,NULL) == FAILURE)
+	{
+		sharedRelease(entity);
+		serveError(500,response,GET);
+		return;
+	}
+	response->entityShared = entity;
+	response->entityBuffer = entity->data;
+	response->entitySize = entity->length;
+	traceMark(TRACE_READ);
+}
+
 
 /**
 *serveHead : serves the client with the requested HEAD METHOD
 * args:
 *       response: response struct to be filled
 *       fp : File pointer of the file to be sent
+*       policy : caching rule of the file or NULL
+*       links : Link header value or NULL, see hints.c
 *return:
 *       none
 */
-void serveHead(bufStruct *response, FILE *fp,char *uri) {
-	char *mimeBuf;
-	char mimeHeader[MAX_PATH] ="Content-Type: ";
-
-
-	//currently sending 200 OK
-	// fill the file transfer
-	strcpy(((response->buffer)+(response->bufSize)),response200);
-	response->bufSize += strlen(response200);
-
-	//Server
-	strcpy(((response->buffer)+(response->bufSize)),server);
-	response->bufSize += strlen(server);
-
-	//Get content type
-	mimeBuf = get_mime(uri);
-	strcat(mimeHeader,mimeBuf);
-	strcat(mimeHeader,"\r\n");
-	strcpy(((response->buffer)+(response->bufSize)),mimeHeader);
-	response->bufSize += strlen(mimeHeader);
-
-	//Add Connection:close
-	strcpy(((response->buffer)+(response->bufSize)),connectionClose);
-	response->bufSize += strlen(connectionClose);
-	
-	//ending CRLF
-	strcpy(((response->buffer)+(response->bufSize)),"\r\n");
-	response->bufSize += strlen("\r\n");
-        
-	//No- entity
-    response->entitySize =0;
-
-    fclose(fp);
-    return;
+void serveHead(bufStruct *response, FILE *fp,char *uri,const cacheRule *policy,
+	       const char *links) {
+
+	long size = fileSize(fp);
+
+	fclose(fp);
+
+	//Same headers as GET, no entity
+	if(frameHeaders(response,response200,sizeof(response200) - 1,
+			get_mime(uri),size,policy,links) == FAILURE)
+	{
+		serveError(500,response,HEAD);
+	}
+	return;
+}
+
+
+/* Status line and body of each error response */
+typedef struct errorPage {
+	int code;
+	const char *status;
+	size_t statusLen;
+	const char *body;
+	size_t bodyLen;
+} errorPage;
+
+#define ERROR_PAGE(code, status, body) \
+	{ code, status, sizeof(status) - 1, body, sizeof(body) - 1 }
+
+static const errorPage errorPages[] = {
+	//Server Errors, 500 first as the fallback
+	ERROR_PAGE(500, response500, "500: Internal Server Error\n"),
+	ERROR_PAGE(501, response501, "501: Method Not Implemented\n"),
+	ERROR_PAGE(502, response502, "502: Bad Gateway\n"),
+	ERROR_PAGE(503, response503, "503: Service Unavailable\n"),
+	ERROR_PAGE(504, response504, "504: Gateway Timeout\n"),
+	ERROR_PAGE(505, response505, "505: HTTP Version Not Supported\n"),
+
+	//Client Errors
+	ERROR_PAGE(400, response400, "400: Bad Request\n"),
+	ERROR_PAGE(403, response403, "403: Forbidden\n"),
+	ERROR_PAGE(404, response404, "404: Not Found\n"),
+	ERROR_PAGE(413, response413, "413: Payload Too Large\n"),
+	ERROR_PAGE(429, response429, "429: Too Many Requests\n"),
+};
+
+/**
+*findErrorPage : error page for errorCode, the 500 one for unknown codes.
+*/
+static const errorPage *findErrorPage(int errorCode)
+{
+	size_t i;
+
+	for(i = 0; i < sizeof(errorPages) / sizeof(errorPages[0]); i++)
+	{
+		if(errorPages[i].code == errorCode)
+		{
+			return &errorPages[i];
+		}
+	}
+	return &errorPages[0];
 }
 
+/**
+*errorBody : entity body of the error response for errorCode.
+*args:
+*	errorCode: HTTP error Code, unknown codes get the 500 body
+*	length: filled with the body length
+*return:
+*	the body, not NUL terminated
+*/
+const char *errorBody(int errorCode, size_t *length)
+{
+	const errorPage *page = findErrorPage(errorCode);
 
+	*length = page->bodyLen;
+	return page->body;
+}
 
 /**
 *serveError : Formulates the error response to be sent to the
-*client.
+*client. Anything already in the response is discarded.
 *args:
-*       errorCode: HTTP error Code
+*       errorCode: HTTP error Code, unknown codes are sent as 500
 *       response: to be sent to the client
 *       requestType: GET/HEAD/ OTHER
 *return:
@@ -394,77 +678,21 @@ void serveHead(bufStruct *response, FILE *fp,char *uri) {
 */
 void serveError(int errorCode, bufStruct *response,int requestType )
 {
-	char errorBody[MAX_PATH];
-
-	switch(errorCode)
-	{
-		//Client Errors
-		case 400: 	strcpy(((response->buffer)+(response->bufSize)),response400);
-					response->bufSize += strlen(response404);
-					strcpy(errorBody,"400: Bad Request\n");
-					break;
-
-		case 403:	strcpy(((response->buffer)+(response->bufSize)),response403);
-					response->bufSize += strlen(response403);
-					strcpy(errorBody,"403: Forbidden\n");
-					break;
+	const errorPage *page = findErrorPage(errorCode);
 
-		case 404:	strcpy(((response->buffer)+(response->bufSize)),response404);
-					response->bufSize += strlen(response404);
-					strcpy(errorBody,"404: Not Found\n");
-					break;
+	respInit(response,response->buffer,response->bufCap);
+	frameHeaders(response,page->status,page->statusLen,NULL,page->bodyLen,
+		     NULL,NULL);
 
-		//Server Errors
-		case 500:	strcpy(((response->buffer)+(response->bufSize)),response500);
-					response->bufSize += strlen(response500);
-					strcpy(errorBody,"500: Internal Server Error\n");
-					break;
-
-		case 501:	strcpy(((response->buffer)+(response->bufSize)),response501);
-					response->bufSize += strlen(response501);
-					strcpy(errorBody,"501: Method Not Implemented\n");
-					break;
-
-		case 503:	strcpy(((response->buffer)+(response->bufSize)),response503);
-					response->bufSize += strlen(response503);
-					strcpy(errorBody,"503: Service Unavailable\n");
-					break;
-
-		case 505: 	strcpy(((response->buffer)+(response->bufSize)),response505);
-					response->bufSize += strlen(response505);
-					strcpy(errorBody,"505: HTTP Version Not Supported\n");
-					break;
-
-
-	};
+	//Entity Body, not supposed to be sent if the request is HEAD
+	if((requestType == GET) &&
+	   ((response->entityBuffer = malloc(page->bodyLen)) != NULL))
+	{
+		memcpy(response->entityBuffer,page->body,page->bodyLen);
+		response->entitySize = page->bodyLen;
+	}
 
-	//Server
-	strcpy(((response->buffer)+(response->bufSize)),server);
-	response->bufSize += strlen(server);
-		
-	//Connection: Close
-	strcpy(((response->buffer)+(response->bufSize)),connectionClose);
-	response->bufSize += strlen(connectionClose);
-
-	//CRLF
-	strcpy(((response->buffer)+(response->bufSize)),"\r\n");
-	response->bufSize += strlen("\r\n");
- 
-
-	//Entity Body
-	if(requestType == GET)
-	{
-		//Not supposed to send if the request is HEAD
-		response->entityBuffer = malloc(strlen(errorBody)+1);
-		strcpy(response->entityBuffer,errorBody);
- 		response->entitySize = strlen(errorBody)+1;
- 	}
- 	else
- 	{
- 		response->entitySize = 0;
- 	}
-
-    return;
+	return;
 
 }
 
@@ -475,16 +703,17 @@ void serveError(int errorCode, bufStruct *response,int requestType )
 *args:
 *	buffer: pointer to request buffer
 *	size :	position till where the buffer is read by parser
+*	length: number of bytes in the request
 *
 *return: 
 *	0 : if header is proper.
 *      -1 : if the header is malformed 
 */
-int checkHeader(char *buffer,int size) {
+int checkHeader(char *buffer,int size,int length) {
 
 	int ret = FAILURE;
 
-	while(size < MAX_BUF_SIZE) {
+	while(size < length) {
 		
 		if(buffer[size] == '\r') {
 			if((strncmp((buffer + size),"\r\n\r\n",4)) == 0) {
@@ -0,0 +1,35 @@
+/**
+ * @file    affinity.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for affinity.c
+ *
+ */
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+/* Environment variable holding the worker CPU list, e.g. "0-3,8" */
+#define ENV_WORKER_CPUS "SIMPLE_CPUS"
+
+/* Response buffers kept per NUMA node for reuse */
+#define POOL_BUFFERS_PER_NODE 64
+/* Buffer sizes pooled per node: responses, and requests (max_buf_size) */
+#define POOL_SIZES 2
+
+int affinityInit(const char *cpuList);
+int affinityPickCpu(int client_sock);
+int affinityApply(pthread_attr_t *attr, int cpu);
+int affinityWorkerCount(void);
+int affinityWorkerCpu(int index);
+char *affinityBufferGet(int cpu, size_t size);
+void affinityBufferPut(int cpu, char *buf, size_t size);
+void affinityRecord(int cpu, size_t bytes);
+void affinityDumpStats(FILE *out);
+
+#endif
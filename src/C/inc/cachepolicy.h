@@ -0,0 +1,26 @@
+/**
+ * @file    cachepolicy.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for cachepolicy.c
+ *
+ */
+
+#ifndef _CACHEPOLICY_H_
+#define _CACHEPOLICY_H_
+
+#include <conf.h>
+#include <httpparser.h>
+
+/* Shortest hash taken for a fingerprint, e.g. app.3f2a9c1b.js */
+#define CACHE_FINGERPRINT_MIN 8
+#define CACHE_FINGERPRINT_MAX 64
+
+const cacheRule *cachePolicyFind(const serverConfig *cfg, const char *uri,
+                                 const char *resourcePath);
+int cachePolicyAppend(bufStruct *response, const cacheRule *rule);
+void cachePolicyExpires(const cacheRule *rule, char *expires);
+
+#endif
@@ -0,0 +1,47 @@
+/**
+ * @file    capture.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for capture.c
+ *
+ * A capture file starts with CAPTURE_MAGIC, followed by one
+ * captureRecord per request and the request bytes it was sent with.
+ * Numbers are in host byte order. See replay.c for a reader.
+ *
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <conf.h>
+
+#define CAPTURE_MAGIC "SIMCAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+
+/* Milliseconds the writer sleeps once it has caught up */
+#define CAPTURE_POLL_MS 10
+/* Records written out per writev() at most */
+#define CAPTURE_BATCH 64
+
+typedef struct captureRecord {
+    uint64_t arrivalNs;     /* accept(), ns since the epoch */
+    uint64_t durationNs;    /* from accept() until the response was sent */
+    uint64_t conn;          /* connection id, in order of accept */
+    uint64_t bytes;         /* of the response */
+    uint32_t status;        /* 0 if none was sent */
+    uint32_t length;        /* request bytes following the record */
+} captureRecord;
+
+int captureInit(const serverConfig *cfg, const sigset_t *blocked);
+int captureEnabled(void);
+void captureRequest(uint64_t conn, uint64_t acceptedNs, const char *request,
+                    int length, int status, uint64_t bytes);
+void captureStop(void);
+void captureDumpStats(FILE *out);
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * @file    conf.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for conf.c
+ *
+ */
+
+#ifndef _CONF_H_
+#define _CONF_H_
+
+#define CONF_MAX_LINE 512
+#define CONF_MAX_VALUE 256
+
+/* so_sndbuf value asking for a buffer sized from each response */
+#define SNDBUF_AUTO -1
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_PREFIX 128
+#define PROXY_MAX_UPSTREAM 128
+
+/* URI prefix forwarded to an upstream "host:port" or "unix:/path" */
+typedef struct proxyRoute {
+    char prefix[PROXY_MAX_PREFIX];
+    char upstream[PROXY_MAX_UPSTREAM];
+} proxyRoute;
+
+#define FASTCGI_MAX_ROUTES 16
+/* Upper bound of fastcgi_connections */
+#define FASTCGI_CONNS_MAX 256
+
+/* URI prefix served by a FastCGI backend "host:port" or "unix:/path" */
+typedef struct fcgiRoute {
+    char prefix[PROXY_MAX_PREFIX];
+    char backend[PROXY_MAX_UPSTREAM];
+    int connections;        /* 0 for the "fastcgi_connections" setting */
+} fcgiRoute;
+
+#define LISTEN_MAX 8
+#define LISTEN_MAX_ADDR 108
+
+/* A "listen" line, see listen.c for the address forms */
+typedef struct listenSpec {
+    char addr[LISTEN_MAX_ADDR];
+    int proxyProtocol;      /* clients are behind a PROXY protocol balancer */
+    int v6only;
+    int backlog;            /* 0 for the "backlog" setting */
+    int mode;               /* permissions of a unix socket file, 0 leaves them */
+} listenSpec;
+
+#define RATE_MAX_ALLOW 32
+
+#define CACHE_MAX_RULES 16
+#define CACHE_MAX_MATCH 64
+#define CACHE_MAX_CONTROL 128
+
+enum cacheMatch {
+    CACHE_PREFIX,       /* "/static/", the request path */
+    CACHE_EXTENSION,    /* ".css" */
+    CACHE_MIME          /* "image/png", or "image/" and any subtype */
+};
+
+/* Caching headers for the responses a rule matches */
+typedef struct cacheRule {
+    char match[CACHE_MAX_MATCH];
+    int kind;
+    char control[CACHE_MAX_CONTROL];    /* Cache-Control value */
+    int controlLen;
+    long maxAge;                        /* for Expires, -1 for none */
+} cacheRule;
+
+/* Client network exempt from per client limits, IPv4 kept v4-mapped */
+typedef struct allowNet {
+    unsigned char addr[16];
+    int prefixLen;
+} allowNet;
+
+typedef struct serverConfig {
+    /* Limits */
+    int minPort;
+    int backlog;
+    int connectionLimit;
+    int maxLine;
+    int maxBufSize;
+    int restartTimeout;
+    int drainTimeout;
+    char workerCpus[CONF_MAX_VALUE];
+    int eventThreads;
+    int ioThreads;
+    int ioQueue;
+    int memoryBudget;           /* megabytes, see memgov.c */
+    int pathIndex;              /* paths at most, see pathindex.c */
+
+    /* Listening sockets, the port argument alone if there are none */
+    listenSpec listens[LISTEN_MAX];
+    int numListens;
+    int deferAccept;
+    int fastOpen;
+
+    /* Client sockets, 0 leaves the kernel default */
+    int noDelay;
+    int notSentLowat;
+    int rcvBuf;
+    int sndBuf;
+    int sndBufMax;
+    int busyPoll;
+    int sendQuantum;            /* see loop.c, 0 for no limit */
+
+    /* Reverse proxy */
+    proxyRoute proxies[PROXY_MAX_ROUTES];
+    int numProxies;
+    int proxyIdle;
+    int proxyTimeout;
+    int proxyCacheSize;
+    int proxyCacheMaxObject;
+
+    /* FastCGI, see fastcgi.c */
+    fcgiRoute fcgis[FASTCGI_MAX_ROUTES];
+    int numFcgis;
+    int fcgiConnections;
+    int fcgiTimeout;
+    int fcgiQueueTimeout;
+
+    /* Per client limits, see ratelimit.c */
+    int rateLimit;
+    int rateBurst;
+    int clientConnectionLimit;
+    int fairQueue;
+    allowNet allow[RATE_MAX_ALLOW];
+    int numAllow;
+
+    /* Cache-Control and Expires, see cachepolicy.c */
+    cacheRule cacheRules[CACHE_MAX_RULES];
+    int numCacheRules;
+    int cacheFingerprint;
+    cacheRule fingerprintRule;
+
+    /* Request tracing, see trace.c */
+    int traceSample;
+    int traceSlowMs;
+    char traceFile[CONF_MAX_VALUE];
+
+    /* Traffic capture, see capture.c */
+    char captureFile[CONF_MAX_VALUE];
+    int captureBuffer;          /* megabytes */
+
+    /* HTTP/2 over cleartext, see h2.c */
+    int h2c;
+    int h2MaxStreams;
+    int h2IdleTimeout;
+    int h2HeaderTable;
+} serverConfig;
+
+int confInit(const char *file);
+int confReload(void);
+void confSnapshot(serverConfig *cfg);
+int confRefresh(serverConfig *cfg, unsigned int *gen);
+int confConnectionLimit(void);
+
+#endif
@@ -11,4 +11,67 @@
 #define MIN_PORT 1024
 #define BACKLOG 1024
 
+/*
+ * Defaults for the runtime configuration, see conf.c
+ * and simple.conf
+ */
+#define CONNECTION_LIMIT 25
+#define DEFAULT_MAX_LINE 4096
+/* Upper bound of an adaptively sized send buffer */
+#define SNDBUF_MAX (4 * 1024 * 1024)
+/* Bytes a response sends before smaller ones get a turn */
+#define SEND_QUANTUM 65536
+
+/* Reverse proxy: idle keep-alive connections kept per upstream */
+#define PROXY_IDLE_CONNECTIONS 8
+/* Seconds to wait on an upstream before answering 504 */
+#define PROXY_TIMEOUT 30
+/* Bytes of upstream responses cached in memory, 0 disables */
+#define PROXY_CACHE_SIZE (16 * 1024 * 1024)
+#define PROXY_CACHE_MAX_OBJECT (1024 * 1024)
+
+/* FastCGI: requests, each on its own connection, sent a backend at once */
+#define FASTCGI_CONNECTIONS 16
+/* Seconds to wait on a backend before answering 504 */
+#define FASTCGI_TIMEOUT 30
+/* Seconds a request waits for a free connection before answering 503 */
+#define FASTCGI_QUEUE_TIMEOUT 5
+
+/* Requests a client may send at once above rate_limit */
+#define RATE_BURST 20
+/* Connections waiting for a slot when the server is full */
+#define FAIR_QUEUE 64
+
+/* max-age of fingerprinted assets, e.g. app.3f2a9c1b.js */
+#define CACHE_FINGERPRINT 31536000
+
+/* Where SIGUSR1 writes sampled request traces */
+#define TRACE_FILE "simple-trace.json"
+
+/* Megabytes of requests captured waiting to be written out */
+#define CAPTURE_BUFFER 4
+
+/* HTTP/2: concurrent streams per connection */
+#define H2_MAX_STREAMS 100
+/* Seconds an HTTP/2 connection may sit without a request */
+#define H2_IDLE_TIMEOUT 30
+/* Bytes of HPACK dynamic table we keep for request headers */
+#define H2_HEADER_TABLE 4096
+
+/* Threads reading files not in the page cache, 0 reads inline */
+#define IO_THREADS 4
+/* Reads waiting for an I/O thread before requests get 503 */
+#define IO_QUEUE 1024
+
+/* Megabytes of file bodies, cache entries and buffers, 0 for no limit */
+#define MEMORY_BUDGET 512
+
+/* Paths under the root indexed to turn away 404s early, 0 for none */
+#define PATH_INDEX 1000000
+
+/* Seconds a restarted process may take to start accepting */
+#define RESTART_TIMEOUT 10
+/* Seconds in-flight connections get to finish on restart/stop */
+#define DRAIN_TIMEOUT 30
+
 #endif
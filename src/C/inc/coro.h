@@ -0,0 +1,41 @@
+/**
+ * @file    coro.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Stackless coroutines. A handler keeps whatever must survive a
+ * suspension in its own struct, next to a coroState, and reads like
+ * straight line code:
+ *
+ *   CORO_BEGIN(&conn->coro);
+ *   while ((n = recv(fd, ...)) < 0 && errno == EAGAIN) {
+ *       CORO_YIELD(&conn->coro, LOOP_READ);
+ *   }
+ *   ...
+ *   CORO_END(&conn->coro);
+ *
+ * CORO_YIELD returns from the handler; calling it again resumes right
+ * after that CORO_YIELD. Locals do not survive a yield, and there must
+ * be no switch statement around a CORO_YIELD.
+ *
+ */
+
+#ifndef _CORO_H_
+#define _CORO_H_
+
+/* Line of the last yield, 0 before the first run */
+typedef unsigned int coroState;
+
+#define CORO_BEGIN(state) switch (*(state)) { case 0:
+
+#define CORO_YIELD(state, value)                                        \
+    do {                                                                \
+        *(state) = __LINE__;                                            \
+        return (value);                                                 \
+        case __LINE__: ;                                                \
+    } while (0)
+
+#define CORO_END(state) } *(state) = 0
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file    fastcgi.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for fastcgi.c
+ *
+ */
+
+#ifndef _FASTCGI_H_
+#define _FASTCGI_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <conf.h>
+
+/* Bytes buffered each way per request, room for the largest record */
+#define FASTCGI_BUF (8 + 65535 + 255)
+
+const fcgiRoute *fcgiMatch(const serverConfig *cfg, const char *request,
+                           int length);
+size_t fcgiServe(int client_sock, const fcgiRoute *route, char *request,
+                 int length, const serverConfig *cfg, const char *root);
+void fcgiDumpStats(FILE *out);
+
+#endif
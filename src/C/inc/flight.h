@@ -0,0 +1,53 @@
+/**
+ * @file    flight.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for flight.c
+ *
+ */
+
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#include <stddef.h>
+#include <conf.h>
+#include <loop.h>
+#include <httpparser.h>
+
+/* Loads in progress are found by hash, a power of two */
+#define FLIGHT_BUCKETS 64
+
+/* Status of a load too large to share, each request loads alone */
+#define FLIGHT_ALONE 0
+
+/* A file as read once for every request that wanted it */
+typedef struct sharedEntity {
+    int refs;
+    long size;              /* size of the file, the Content-Length */
+    size_t length;          /* bytes read, less if the read failed */
+    char data[];
+} sharedEntity;
+
+typedef struct flight flight;
+
+/* A request taking part in a load */
+typedef struct flightWait {
+    loopTask *task;             /* woken when the load it joined lands */
+    struct flightWait *next;
+    flight *leading;            /* load this request does for the others */
+    int joined;                 /* waits for the load of another request */
+    int status;                 /* then SUCCESS, FLIGHT_ALONE or an HTTP error */
+    sharedEntity *entity;       /* and a reference to the file */
+    const char *mime;
+    const cacheRule *policy;
+    char *path;                 /* of the file to load alone, see flightLand */
+} flightWait;
+
+sharedEntity *sharedAlloc(long size);
+void sharedRelease(sharedEntity *entity);
+int flightJoin(const char *key, const char *path, flightWait *wait);
+void flightLand(flightWait *wait, sharedEntity *entity, int status);
+
+#endif
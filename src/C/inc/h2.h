@@ -0,0 +1,38 @@
+/**
+ * @file    h2.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for h2.c
+ *
+ */
+
+#ifndef _H2_H_
+#define _H2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <conf.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+/* Largest frame we accept, and send */
+#define H2_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+/* Largest header block (HEADERS plus CONTINUATION) we accept */
+#define H2_MAX_HEADER_BLOCK 65536
+/* Upper bound of h2_max_streams */
+#define H2_STREAMS_MAX 256
+/* Frames gathered before a send() */
+#define H2_OUT_BUF (4 * (H2_FRAME_HEADER + H2_FRAME_SIZE))
+
+int h2Preface(const char *buffer, int length);
+int h2UpgradeRequest(const char *buffer, int length);
+size_t h2Serve(int client_sock, const char *buffer, int length,
+               const serverConfig *cfg, char *root, uint64_t id);
+void h2Shutdown(void);
+
+#endif
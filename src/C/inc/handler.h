@@ -0,0 +1,25 @@
+/**
+ * @file    handler.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for handler.c
+ *
+ */
+
+#ifndef _HANDLER_H_
+#define _HANDLER_H_
+
+#include <httpparser.h>
+#include <simple.h>
+
+/* Bytes of header lines a handler may add with simpleAddHeader() */
+#define HANDLER_HEADERS 1024
+
+int handlerStart(simpleServer *srv);
+int handlerActive(void);
+int handlerRequestLength(const char *request, int length, int cap);
+int handlerServe(char *request, int length, bufStruct *response);
+
+#endif
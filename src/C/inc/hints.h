@@ -0,0 +1,34 @@
+/**
+ * @file    hints.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for hints.c
+ *
+ */
+
+#ifndef _HINTS_H_
+#define _HINTS_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* Pages whose subresources are remembered, a power of two */
+#define HINTS_SLOTS 256
+/* Longest page path remembered */
+#define HINTS_PATH 120
+/* Link header value, the preloads that fit are kept */
+#define HINTS_LINK_MAX 512
+/* Subresources preloaded per page */
+#define HINTS_MAX_LINKS 8
+/* Bytes of a page scanned, what a page needs first is near its top */
+#define HINTS_SCAN (64 * 1024)
+
+int hintsIsPage(const char *mime);
+int hintsFind(const char *canonical, const struct stat *st, char *links,
+              size_t size);
+int hintsScan(const char *canonical, const struct stat *st,
+              const char *html, size_t len, char *links, size_t size);
+
+#endif
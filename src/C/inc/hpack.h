@@ -0,0 +1,56 @@
+/**
+ * @file    hpack.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for hpack.c
+ *
+ */
+
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <httpparser.h>
+
+#define HPACK_STATIC_ENTRIES 61
+/* SETTINGS_HEADER_TABLE_SIZE until the peer says otherwise */
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+/* Per entry overhead counted against the table size (RFC 7541 4.1) */
+#define HPACK_ENTRY_OVERHEAD 32
+
+typedef struct hpackEntry {
+    char *name;             /* name and value share one allocation */
+    char *value;
+    size_t nameLen;
+    size_t valueLen;
+} hpackEntry;
+
+/* Dynamic table, newest entry first */
+typedef struct hpackTable {
+    hpackEntry *entries;    /* ring of cap entries */
+    int cap;
+    int count;
+    int head;               /* slot of the newest entry */
+    size_t size;            /* RFC 7541 size of the entries */
+    size_t maxSize;         /* current maximum */
+    size_t limit;           /* bound from SETTINGS_HEADER_TABLE_SIZE */
+    int pendingUpdate;      /* encoder: announce maxSize in the next block */
+} hpackTable;
+
+/* Called for every decoded field, the strings are only valid meanwhile */
+typedef void (*hpackEmit)(void *arg, const char *name, size_t nameLen,
+                          const char *value, size_t valueLen);
+
+int hpackInit(hpackTable *table, size_t limit);
+void hpackFree(hpackTable *table);
+void hpackSetLimit(hpackTable *table, size_t limit);
+int hpackDecode(hpackTable *table, const unsigned char *in, size_t len,
+                hpackEmit emit, void *arg);
+void hpackEncodeStart(hpackTable *table, bufStruct *out);
+int hpackEncode(hpackTable *table, bufStruct *out, const char *name,
+                const char *value, size_t valueLen, int index);
+
+#endif
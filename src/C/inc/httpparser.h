@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <helper.h>
+#include <conf.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -24,6 +25,7 @@
 #define SERVER_ERROR 505
 #define NOT_FOUND 404
 #define NOT_PERMITTED 403
+#define BAD_REQUEST 400
 
 #define MAX_BUF_SIZE 4096
 #define MAX_PATH 1024
@@ -33,15 +35,21 @@
 #define HEAD 2
 
 
+/* Interim responses only exist from HTTP/1.1 on */
+static const char response103[] = "HTTP/1.1 103 Early Hints\r\n";
 static const char response200[] = "HTTP/1.0 200 OK\r\n";
 
 static const char response400[] = "HTTP/1.0 400 Bad Request\r\n";
 static const char response403[] = "HTTP/1.0 403 Forbidden\r\n";
 static const char response404[] = "HTTP/1.0 404 Not Found\r\n";
+static const char response413[] = "HTTP/1.0 413 Payload Too Large\r\n";
+static const char response429[] = "HTTP/1.0 429 Too Many Requests\r\n";
 
 static const char response500[] = "HTTP/1.0 500 Internal Server Error\r\n";
 static const char response501[] = "HTTP/1.0 501 Not Implemented\r\n";
+static const char response502[] = "HTTP/1.0 502 Bad Gateway\r\n";
 static const char response503[] = "HTTP/1.0 503 Service Unavailable\r\n";
+static const char response504[] = "HTTP/1.0 504 Gateway Timeout\r\n";
 static const char response505[] = "HTTP/1.0 505 HTTP Version Not Supported\r\n";
 
 static const char server[] = "Server: Simple/1.0\r\n";
@@ -49,23 +57,42 @@ static const char boilerPlatePage[] = "index.html";
 
 static const char connectionClose[] = "Connection: close\r\n";
 
+/* Response under construction, see response.c */
 typedef struct bufStruct{
 	char *buffer;
 	int bufSize;
+	int bufCap;
+	int overflow;
 	char *entityBuffer;
 	size_t entitySize;
+	FILE *entityFile;	/* not all read yet, see iopool.c */
+	size_t entityRead;
+	struct sharedEntity *entityShared;	/* owns entityBuffer, see flight.c */
+	size_t entityReserved;	/* of the memory budget, see memgov.c */
+	size_t streamLeft;	/* of entityFile, sent a chunk at a time */
+	int hintsLen;		/* 103 Early Hints leading buffer, see hints.c */
+	void (*entityRelease)(void *arg);	/* owns entityBuffer, see handler.c */
+	void *entityReleaseArg;
 }bufStruct;
 
+struct flightWait;
 
-void parseRequest(char *buffer, bufStruct *response,char *rootDirPath);
+
+void parseRequest(char *buffer, int length, bufStruct *response,char *rootDirPath,
+		  const serverConfig *cfg, struct flightWait *wait);
+int resolveResource(char *uri,char *rootDirPath,char *resourcePath,
+		    char *canonical);
+const char *errorBody(int errorCode, size_t *length);
 int checkMethod(char *methodName);
 FILE *openFile(char *uri);
 int checkHttpVersion(char *httpVersion);
-void serveGet(bufStruct *response,FILE *fp,char *uri);
-void serveHead(bufStruct *response,FILE *fp,char *uri);
-void getFinalURI(char *uri,char *finalURI);
+void serveGet(bufStruct *response,FILE *fp,char *uri,const cacheRule *policy,
+	      const char *links,struct flightWait *wait);
+void serveShared(bufStruct *response,struct flightWait *wait);
+void serveHead(bufStruct *response,FILE *fp,char *uri,const cacheRule *policy,
+	       const char *links);
 void serveError(int errorCode, bufStruct *response,int requestType );
 int checkFile(char *path);
-int checkHeader(char *buffer,int size);
+int checkHeader(char *buffer,int size,int length);
 #endif
 
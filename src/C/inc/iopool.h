@@ -0,0 +1,37 @@
+/**
+ * @file    iopool.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for iopool.c
+ *
+ */
+
+#ifndef _IOPOOL_H_
+#define _IOPOOL_H_
+
+#include <signal.h>
+#include <sys/types.h>
+#include <loop.h>
+
+/* Reads this large are announced as sequential for more readahead */
+#define IO_SEQUENTIAL_MIN (256 * 1024)
+
+/* A read handed to the I/O threads */
+typedef struct ioJob {
+    loopTask *task;         /* woken once the read is done */
+    int fd;
+    char *buf;
+    size_t len;
+    off_t offset;
+    ssize_t done;           /* bytes read, -1 on error */
+    struct ioJob *next;
+} ioJob;
+
+int ioInit(int threads, int queue, const sigset_t *blocked);
+ssize_t ioReadCached(int fd, char *buf, size_t len, off_t offset);
+void ioRead(ioJob *job);
+int ioSubmit(ioJob *job);
+
+#endif
@@ -0,0 +1,36 @@
+/**
+ * @file    listen.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for listen.c
+ *
+ */
+
+#ifndef _LISTEN_H_
+#define _LISTEN_H_
+
+#include <sys/socket.h>
+#include <conf.h>
+
+/* "[ffff:...:ffff]:65535" or a unix socket path, for logs */
+#define LISTEN_NAME_MAX 112
+
+/* A socket the accept loop takes connections from */
+typedef struct listener {
+    int fd;
+    int family;
+    int proxyProtocol;          /* connections start with a PROXY header */
+    char name[LISTEN_NAME_MAX];
+} listener;
+
+int listenAddress(const char *spec, struct sockaddr_storage *addr,
+                  socklen_t *len);
+int listenOpen(listener *l, const listenSpec *spec, const serverConfig *cfg,
+               int *inherited, int numInherited);
+int listenApply(const listener *l, const listenSpec *spec,
+                const serverConfig *cfg);
+void listenAddrString(const struct sockaddr *addr, char *out, size_t len);
+
+#endif
@@ -0,0 +1,48 @@
+/**
+ * @file    loop.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for loop.c
+ *
+ */
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <signal.h>
+#include <conf.h>
+
+/* What a task waits for when its resume function returns */
+#define LOOP_DONE 0
+#define LOOP_READ 1
+#define LOOP_WRITE 2
+/* Waits for loopWake(), e.g. from an I/O thread */
+#define LOOP_PARKED 3
+/* Can write more, once responses with fewer bytes left had a turn */
+#define LOOP_YIELD 4
+
+/* Events taken from epoll per wakeup */
+#define LOOP_MAX_EVENTS 64
+/* Every so many turns the writer waiting longest goes, whatever its size */
+#define LOOP_FAIR_EVERY 8
+
+typedef struct loopTask {
+    int fd;
+    int loop;               /* index of the loop it is registered with */
+    /* Runs the task until it would block, or is done with fd */
+    int (*resume)(struct loopTask *task);
+    struct loopTask *wakeNext;  /* on its loop's list of woken tasks */
+    int wait;                   /* what it waits for, as last returned */
+    size_t remaining;           /* bytes left to write, orders writers */
+    unsigned long readySeq;     /* when it became ready to write */
+} loopTask;
+
+int loopInit(int threads, const sigset_t *blocked);
+int loopAdd(loopTask *task, int cpu);
+void loopDetach(loopTask *task);
+void loopWake(loopTask *task);
+const serverConfig *loopConfig(void);
+
+#endif
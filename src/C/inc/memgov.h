@@ -0,0 +1,33 @@
+/**
+ * @file    memgov.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for memgov.c
+ *
+ */
+
+#ifndef _MEMGOV_H_
+#define _MEMGOV_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Files over the budget are sent through a buffer of this size */
+#define MEM_STREAM_CHUNK (256 * 1024)
+
+/* What the memory is held for */
+enum memKind {
+    MEM_RESPONSE,       /* file bodies, whole or the chunk streamed */
+    MEM_CACHE,          /* proxy cache entries */
+    MEM_RECV,           /* request and HTTP/2 connection buffers */
+    MEM_KINDS
+};
+
+void memSetBudget(size_t bytes);
+int memReserve(int kind, size_t bytes);
+void memRelease(int kind, size_t bytes);
+void memDumpStats(FILE *out);
+
+#endif
@@ -0,0 +1,32 @@
+/**
+ * @file    pathindex.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for pathindex.c
+ *
+ */
+
+#ifndef _PATHINDEX_H_
+#define _PATHINDEX_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <signal.h>
+
+/* Bits per path; with PATH_INDEX_PROBES about 1% false positives */
+#define PATH_INDEX_BITS_PER_PATH 10
+#define PATH_INDEX_PROBES 7
+/* Smallest filter, in bits, a power of two */
+#define PATH_INDEX_MIN_BITS (1 << 16)
+/* Bits for symbolic links to directories, whose contents are not indexed */
+#define PATH_INDEX_LINK_BITS (1 << 12)
+/* Directory levels walked below the root */
+#define PATH_INDEX_DEPTH 32
+
+int pathIndexInit(const char *root, long maxPaths, const sigset_t *blocked);
+int pathIndexMayExist(const char *path, size_t len);
+void pathIndexDumpStats(FILE *out);
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file    proxy.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for proxy.c
+ *
+ */
+
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <stddef.h>
+#include <conf.h>
+
+/* Hash buckets of the upstream response cache */
+#define PROXY_CACHE_BUCKETS 1024
+/* Bytes moved per splice() call */
+#define PROXY_SPLICE_CHUNK 65536
+
+const proxyRoute *proxyMatch(const serverConfig *cfg, const char *request,
+                             int length);
+size_t proxyServe(int client_sock, const proxyRoute *route, char *request,
+                  int length, const serverConfig *cfg);
+
+#endif
@@ -0,0 +1,25 @@
+/**
+ * @file    proxyhdr.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for proxyhdr.c
+ *
+ */
+
+#ifndef _PROXYHDR_H_
+#define _PROXYHDR_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Longest v1 header, "PROXY TCP6 <39> <39> 65535 65535\r\n" */
+#define PROXYHDR_V1_MAX 107
+/* Longest v2 header taken, 16 bytes and the addresses with some TLVs */
+#define PROXYHDR_MAX 536
+
+int proxyHeaderParse(const unsigned char *buf, size_t len,
+                     struct sockaddr_storage *src, int *known);
+
+#endif
@@ -0,0 +1,40 @@
+/**
+ * @file    ratelimit.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for ratelimit.c
+ *
+ */
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <conf.h>
+
+/* Clients tracked at once, a power of two */
+#define RATE_TABLE_SIZE 8192
+/* Slots searched for a client before giving up */
+#define RATE_PROBE 16
+
+typedef struct rateClient {
+    volatile uint64_t key;  /* 0 = free slot */
+    uint64_t tat;           /* theoretical arrival time, ns */
+    int active;             /* connections being served */
+    int queued;             /* connections waiting for a slot */
+    int pins;               /* lookups not yet counted in either */
+} __attribute__((aligned(32))) rateClient;
+
+rateClient *rateLookup(const struct sockaddr *addr);
+void rateUnpin(rateClient *client);
+int rateAllowListed(const serverConfig *cfg, const struct sockaddr *addr);
+int rateAdmit(rateClient *client, const serverConfig *cfg);
+void rateAcquire(rateClient *client);
+void rateRelease(rateClient *client);
+void rateQueued(rateClient *client, int delta);
+int rateFairShare(const serverConfig *cfg);
+
+#endif
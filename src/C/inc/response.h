@@ -0,0 +1,36 @@
+/**
+ * @file    response.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for response.c
+ *
+ */
+
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <stddef.h>
+#include <time.h>
+#include <httpparser.h>
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define RESP_DATE_LEN 29
+
+void respInit(bufStruct *response, char *buf, int cap);
+void respEntityFree(bufStruct *response);
+int respAppend(bufStruct *response, const char *data, size_t len);
+int respUint(bufStruct *response, unsigned long long value);
+int respDate(bufStruct *response);
+const char *respDateValue(void);
+void respFormatDate(time_t when, char *d);
+
+/* Appends a string literal or char array, its size known at compile time */
+#define respLiteral(response, lit) \
+    respAppend((response), (lit), sizeof(lit) - 1)
+
+/* True once an append did not fit, nothing is appended after that */
+#define respFailed(response) ((response)->overflow)
+
+#endif
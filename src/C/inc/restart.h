@@ -0,0 +1,33 @@
+/**
+ * @file    restart.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for restart.c
+ *
+ */
+
+#ifndef _RESTART_H_
+#define _RESTART_H_
+
+#include <sys/types.h>
+
+/* Environment variables used to hand state to the new binary */
+#define ENV_LISTEN_FD       "SIMPLE_LISTEN_FD"     /* "3,4,5" */
+#define ENV_READY_FD        "SIMPLE_READY_FD"
+#define ENV_HANDOFF_FD      "SIMPLE_HANDOFF_FD"
+#define ENV_INHERITED_CONNS "SIMPLE_INHERITED_CONNS"
+
+/* Most listening sockets handed over */
+#define RESTART_MAX_LISTEN 16
+
+int restartInheritListeners(int *fds, int max);
+int restartInheritedConnections(void);
+void restartAdoptConnections(void (*release)(void));
+void restartNotifyReady(void);
+pid_t restartSpawn(char **argv, const int *listenFds, int numListen,
+                   int inflight, int timeout, int *handoffFd);
+void restartConnectionDone(int handoffFd);
+
+#endif
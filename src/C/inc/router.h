@@ -0,0 +1,35 @@
+/**
+ * @file    router.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for router.c
+ *
+ */
+
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <stddef.h>
+
+typedef struct routerNode {
+    char *label;                /* bytes on the edge from the parent */
+    size_t labelLen;
+    struct routerNode *child;   /* first child, by first label byte */
+    struct routerNode *sibling;
+    int hasValue;
+    void *value;
+} routerNode;
+
+typedef struct router {
+    routerNode root;
+    int count;
+} router;
+
+router *routerCreate(void);
+int routerAdd(router *r, const char *prefix, void *value, void **old);
+void *routerMatch(const router *r, const char *path, size_t len,
+                  size_t *matched);
+
+#endif
@@ -0,0 +1,81 @@
+/**
+ * @file    simple.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Public interface of libsimple, the server as a library.
+ *
+ * A program links libsimple.a (or libsimple.so), registers handlers
+ * on path prefixes and hands over to simpleRun(), which takes the same
+ * arguments as ./server and serves until stopped:
+ *
+ *      static void hello(const simpleRequest *req, simpleResponse *resp,
+ *                        void *arg)
+ *      {
+ *          simpleRespond(resp, 200, "text/plain", "hello\n", 6, NULL, NULL);
+ *      }
+ *
+ *      int main(int argc, char **argv)
+ *      {
+ *          simpleServer *srv = simpleCreate();
+ *
+ *          simpleHandle(srv, "/hello", hello, NULL);
+ *          return simpleRun(srv, argc, argv);
+ *      }
+ *
+ * Requests whose path no handler prefix matches are served from the
+ * www root as ever; proxy and fastcgi routes of the config file come
+ * before handlers. Handlers run on the event loop threads, any number
+ * at once, and must not block. Handlers are served over HTTP/1 only:
+ * while any is registered, h2c is off whatever the config file says.
+ *
+ */
+
+#ifndef _SIMPLE_H_
+#define _SIMPLE_H_
+
+#include <stddef.h>
+
+typedef struct simpleServer simpleServer;
+typedef struct simpleResponse simpleResponse;
+
+/*
+ * A request, as views into the buffer it was received in: nothing is
+ * copied and nothing is NUL terminated unless said so. The views are
+ * valid until the handler returns.
+ */
+typedef struct simpleRequest {
+    const char *method;
+    size_t methodLen;
+    const char *target;         /* as sent, with the query */
+    size_t targetLen;
+    const char *path;           /* canonical, NUL terminated */
+    size_t pathLen;
+    const char *query;          /* after the '?', NULL if none */
+    size_t queryLen;
+    const char *headers;        /* the header lines, CRLF separated */
+    size_t headersLen;
+    const char *body;           /* Content-Length bytes */
+    size_t bodyLen;
+    const char *prefix;         /* of the handler, NUL terminated */
+} simpleRequest;
+
+/* Answers req through resp, unanswered requests get a 500 */
+typedef void (*simpleHandler)(const simpleRequest *req, simpleResponse *resp,
+                              void *arg);
+
+simpleServer *simpleCreate(void);
+int simpleHandle(simpleServer *srv, const char *prefix, simpleHandler handler,
+                 void *arg);
+int simpleRun(simpleServer *srv, int argc, char **argv);
+
+const char *simpleHeader(const simpleRequest *req, const char *name,
+                         size_t *len);
+int simpleAddHeader(simpleResponse *resp, const char *name,
+                    const char *value);
+int simpleRespond(simpleResponse *resp, int status, const char *type,
+                  const void *body, size_t len, void (*release)(void *arg),
+                  void *arg);
+
+#endif
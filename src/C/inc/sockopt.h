@@ -0,0 +1,22 @@
+/**
+ * @file    sockopt.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for sockopt.c
+ *
+ */
+
+#ifndef _SOCKOPT_H_
+#define _SOCKOPT_H_
+
+#include <stddef.h>
+#include <conf.h>
+
+void sockoptListener(int serv_sock, const serverConfig *cfg);
+void sockoptClient(int client_sock, const serverConfig *cfg);
+void sockoptSizeSendBuffer(int client_sock, size_t responseSize,
+                           const serverConfig *cfg);
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * @file    trace.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for trace.c
+ *
+ * Every phase boundary of a request is a static probe (provider
+ * "simple") when the build finds <sys/sdt.h>, so bpftrace or perf can
+ * attach to a running server:
+ *
+ *   simple:request__start  (fd, cpu)
+ *   simple:phase           (fd, phase)
+ *   simple:request__done   (fd, status, bytes, duration ns)
+ *
+ * phase is one of the tracePhase values below. Without <sys/sdt.h>
+ * the probes compile to nothing.
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <conf.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_USDT
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(simple, name, a, b)
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(simple, name, a, b, c, d)
+#else
+#define TRACE_PROBE2(name, a, b) do { } while (0)
+#define TRACE_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+/* Sampled requests kept for export, oldest are overwritten */
+#define TRACE_RING_SIZE 1024
+/* Bytes of the request line kept with a record */
+#define TRACE_REQUEST_LINE 96
+
+/* Each phase is stamped when it ends */
+enum tracePhase {
+    TRACE_ACCEPT,       /* accept() returned */
+    TRACE_DISPATCH,     /* client thread running */
+    TRACE_RECV,         /* request headers received */
+    TRACE_PARSE,        /* request line parsed, or proxy route matched */
+    TRACE_OPEN,         /* checkFile/openFile done, or upstream connected */
+    TRACE_READ,         /* body read into memory, or upstream headers in */
+    TRACE_SEND,         /* response sent */
+    TRACE_CLOSE,        /* connection closed */
+    TRACE_PHASES
+};
+
+/* I/O calls made on behalf of the request */
+enum traceCallKind {
+    TRACE_CALL_RECV,
+    TRACE_CALL_SEND,
+    TRACE_CALL_FILE,
+    TRACE_CALLS
+};
+
+typedef struct traceRecord {
+    uint64_t stamp[TRACE_PHASES];   /* ns, 0 if the phase was skipped */
+    uint32_t calls[TRACE_CALLS];
+    uint64_t cpuNs;                 /* CPU time spent on the request */
+    uint64_t sliceNs;               /* thread CPU clock at the start of
+                                       the running slice, 0 if none */
+    uint64_t userUs;                /* thread CPU time, if ownThread */
+    uint64_t sysUs;
+    uint32_t volCtx;                /* context switches, if ownThread */
+    uint32_t involCtx;
+    uint64_t bytes;
+    uint64_t slowNs;
+    int fd;
+    int cpu;
+    int tid;
+    int status;
+    int active;                     /* phases are being stamped */
+    int sampled;
+    int ownThread;                  /* served on a thread of its own */
+    char request[TRACE_REQUEST_LINE];
+} traceRecord;
+
+/* The request the calling thread is serving, NULL outside of one */
+extern __thread traceRecord *traceCurrent;
+
+static inline uint64_t traceNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define traceMark(p)                                                    \
+    do {                                                                \
+        if (traceCurrent != NULL) {                                     \
+            TRACE_PROBE2(phase, traceCurrent->fd, p);                   \
+            if (traceCurrent->active) {                                 \
+                traceCurrent->stamp[p] = traceNow();                    \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+#define traceCall(kind)                                                 \
+    do {                                                                \
+        if ((traceCurrent != NULL) && traceCurrent->active) {           \
+            traceCurrent->calls[kind]++;                                \
+        }                                                               \
+    } while (0)
+
+#define traceStatus(code)                                               \
+    do {                                                                \
+        if (traceCurrent != NULL) {                                     \
+            traceCurrent->status = (code);                              \
+        }                                                               \
+    } while (0)
+
+void traceBegin(traceRecord *rec, int fd, int cpu, uint64_t acceptedNs,
+                const serverConfig *cfg);
+void traceRequestLine(const char *request, int length);
+void traceThread(traceRecord *rec);
+void traceResume(traceRecord *rec);
+void traceSuspend(traceRecord *rec);
+void traceEnd(traceRecord *rec, size_t bytes);
+int traceExport(const char *file);
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file    uri.h
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief header file for uri.c
+ *
+ */
+
+#ifndef _URI_H_
+#define _URI_H_
+
+#include <stddef.h>
+
+/* Directory lookups remembered, a power of two */
+#define URI_INDEX_SLOTS 256
+/* Longest path remembered, longer ones are looked up every time */
+#define URI_INDEX_PATH 120
+/* Seconds a lookup is trusted before the file system is asked again */
+#define URI_INDEX_TTL 2
+
+int uriNormalize(const char *uri, size_t len, char *out, size_t outSize,
+                 const char **query);
+int uriResolve(const char *uri, const char *root, char *canonical,
+               char *resourcePath);
+
+#endif
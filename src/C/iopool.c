@@ -0,0 +1,195 @@
+/**
+ * @file    iopool.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Reads of files that are not in the page cache. A loop thread
+ * must never wait for the disk, every other connection on it would
+ * wait too. Files are first read with preadv2(RWF_NOWAIT), which only
+ * copies what is cached; whatever is left goes to a few I/O threads
+ * and the connection parks until its read is done (see loopWake).
+ *
+ * The queue of pending reads is bounded by io_queue; beyond it the
+ * request is answered 503 like any other overload, rather than a cold
+ * read being done on a loop thread. Where RWF_NOWAIT is not supported
+ * (old kernels, some file systems) files are read inline as before.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <iopool.h>
+
+static pthread_mutex_t ioMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioCond = PTHREAD_COND_INITIALIZER;
+static ioJob *ioHead, *ioTail;
+static int ioQueued;
+static int ioLimit;
+static int ioThreads;
+/* Cleared once preadv2 says it cannot do RWF_NOWAIT here */
+static int nowaitWorks = 1;
+
+/**
+*ioRead : reads all of job, blocking. Large reads are announced as
+*sequential so the kernel reads further ahead.
+*/
+void ioRead(ioJob *job)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    if (job->len >= IO_SEQUENTIAL_MIN) {
+        posix_fadvise(job->fd, job->offset, job->len, POSIX_FADV_SEQUENTIAL);
+    }
+    while (got < job->len) {
+        n = pread(job->fd, job->buf + got, job->len - got, job->offset + got);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    job->done = ((got == 0) && (job->len > 0)) ? -1 : (ssize_t) got;
+}
+
+static void *ioThread(void *arg)
+{
+    ioJob *job;
+
+    for (;;) {
+        pthread_mutex_lock(&ioMutex);
+        while (ioHead == NULL) {
+            pthread_cond_wait(&ioCond, &ioMutex);
+        }
+        job = ioHead;
+        ioHead = job->next;
+        if (ioHead == NULL) {
+            ioTail = NULL;
+        }
+        ioQueued--;
+        pthread_mutex_unlock(&ioMutex);
+
+        ioRead(job);
+        loopWake(job->task);
+    }
+    return NULL;
+}
+
+/**
+*ioInit : starts the I/O threads.
+*args:
+*       threads: number of threads, 0 to read every file inline
+*       queue: reads that may wait for a thread
+*       blocked: signals the threads keep blocked
+*return:
+*       SUCCESS or FAILURE
+*/
+int ioInit(int threads, int queue, const sigset_t *blocked)
+{
+    pthread_t tid;
+    sigset_t oldMask;
+    int i;
+
+    ioLimit = queue;
+    pthread_sigmask(SIG_BLOCK, blocked, &oldMask);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tid, NULL, ioThread, NULL) != 0) {
+            error_log("%s", "Unable to start I/O thread");
+            break;
+        }
+        pthread_detach(tid);
+        ioThreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    debug_log("Running %d I/O threads", ioThreads);
+    return ((threads == 0) || (ioThreads > 0)) ? SUCCESS : FAILURE;
+}
+
+/**
+*ioReadCached : reads what the page cache holds of len bytes at
+*offset, never waiting for the disk. Without I/O threads, or where
+*that cannot be told, everything is read.
+*return:
+*       bytes read, from 0 to len, -1 on error
+*/
+ssize_t ioReadCached(int fd, char *buf, size_t len, off_t offset)
+{
+    struct iovec iov;
+    size_t got = 0;
+    ssize_t n;
+    ioJob job;
+
+    while (nowaitWorks && (ioThreads > 0) && (got < len)) {
+        iov.iov_base = buf + got;
+        iov.iov_len = len - got;
+        n = preadv2(fd, &iov, 1, offset + got, RWF_NOWAIT);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if ((n < 0) && ((errno == EOPNOTSUPP) || (errno == ENOSYS))) {
+            debug_log("%s", "RWF_NOWAIT not supported, reading inline");
+            nowaitWorks = 0;
+            break;
+        }
+        if ((n < 0) && (errno == EAGAIN)) {
+            return got;
+        }
+        if (n < 0) {
+            return (got > 0) ? (ssize_t) got : -1;
+        }
+        if (n == 0) {
+            /* The file got shorter, the rest is an error for the caller */
+            return got;
+        }
+        got += n;
+    }
+    if (got == len) {
+        return got;
+    }
+
+    job.fd = fd;
+    job.buf = buf + got;
+    job.len = len - got;
+    job.offset = offset + got;
+    ioRead(&job);
+    return (job.done < 0) ? ((got > 0) ? (ssize_t) got : -1) :
+           (ssize_t) (got + job.done);
+}
+
+/**
+*ioSubmit : queues job for the I/O threads, its task is woken once
+*job->done is set.
+*return:
+*       SUCCESS, or FAILURE if the queue is full
+*/
+int ioSubmit(ioJob *job)
+{
+    pthread_mutex_lock(&ioMutex);
+    if ((ioThreads == 0) || (ioQueued >= ioLimit)) {
+        pthread_mutex_unlock(&ioMutex);
+        return FAILURE;
+    }
+    job->next = NULL;
+    if (ioTail != NULL) {
+        ioTail->next = job;
+    } else {
+        ioHead = job;
+    }
+    ioTail = job;
+    ioQueued++;
+    pthread_cond_signal(&ioCond);
+    pthread_mutex_unlock(&ioMutex);
+    return SUCCESS;
+}
@@ -0,0 +1,309 @@
+/**
+ * @file    listen.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Listening sockets from the "listen" lines of the
+ * configuration: IPv4, IPv6 (dual-stack unless v6only) and Unix
+ * stream sockets, by path or in the abstract namespace. A listener
+ * handed down by the process we replace is reused when its address
+ * matches, so a restart keeps every backlog.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <sockopt.h>
+#include <listen.h>
+
+/**
+*listenAddress : resolves a listen address: "8080", "10.0.0.1:8080",
+*"[::]:8080", "unix:/run/simple.sock" or "unix:@simple" (abstract).
+*return:
+*       SUCCESS or FAILURE
+*/
+int listenAddress(const char *spec, struct sockaddr_storage *addr,
+                  socklen_t *len)
+{
+    struct sockaddr_in *in4 = (struct sockaddr_in *) addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+    struct sockaddr_un *un = (struct sockaddr_un *) addr;
+    char host[INET6_ADDRSTRLEN];
+    const char *port, *sep;
+    char *end;
+    long num;
+    size_t n;
+
+    memset(addr, 0, sizeof(*addr));
+
+    if (!strncmp(spec, "unix:", 5)) {
+        spec += 5;
+        n = strlen(spec);
+        if ((n < 2) || (n >= sizeof(un->sun_path))) {
+            return FAILURE;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, spec, n);
+        if (spec[0] == '@') {
+            /* Abstract names are not NUL terminated */
+            un->sun_path[0] = '\0';
+            *len = offsetof(struct sockaddr_un, sun_path) + n;
+        } else if (spec[0] == '/') {
+            *len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+        } else {
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    host[0] = '\0';
+    port = spec;
+    if (spec[0] == '[') {
+        if (((sep = strchr(spec, ']')) == NULL) || (sep[1] != ':') ||
+            ((n = sep - spec - 1) >= sizeof(host))) {
+            return FAILURE;
+        }
+        memcpy(host, spec + 1, n);
+        host[n] = '\0';
+        port = sep + 2;
+    } else if ((sep = strrchr(spec, ':')) != NULL) {
+        if ((n = sep - spec) >= sizeof(host)) {
+            return FAILURE;
+        }
+        memcpy(host, spec, n);
+        host[n] = '\0';
+        port = sep + 1;
+    }
+
+    errno = 0;
+    num = strtol(port, &end, 10);
+    if ((errno != 0) || (end == port) || (*end != '\0') ||
+        (num < 1) || (num > 65535)) {
+        return FAILURE;
+    }
+
+    if (spec[0] == '[') {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(num);
+        if (inet_pton(AF_INET6, host, &in6->sin6_addr) != 1) {
+            return FAILURE;
+        }
+        *len = sizeof(*in6);
+        return SUCCESS;
+    }
+
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons(num);
+    in4->sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((host[0] != '\0') && (inet_pton(AF_INET, host, &in4->sin_addr) != 1)) {
+        return FAILURE;
+    }
+    *len = sizeof(*in4);
+    return SUCCESS;
+}
+
+/**
+*listenAddrString : formats addr for logs, "1.2.3.4:80", "[::1]:80"
+*or the path of a Unix socket.
+*/
+void listenAddrString(const struct sockaddr *addr, char *out, size_t len)
+{
+    const struct sockaddr_in *in4 = (const struct sockaddr_in *) addr;
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+    const struct sockaddr_un *un = (const struct sockaddr_un *) addr;
+    char host[INET6_ADDRSTRLEN];
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &in4->sin_addr, host, sizeof(host));
+        snprintf(out, len, "%s:%d", host, ntohs(in4->sin_port));
+        break;
+    case AF_INET6:
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(out, len, "[%s]:%d", host, ntohs(in6->sin6_port));
+        break;
+    case AF_UNIX:
+        if (un->sun_path[0] != '\0') {
+            snprintf(out, len, "unix:%s", un->sun_path);
+        } else if (un->sun_path[1] != '\0') {
+            snprintf(out, len, "unix:@%s", un->sun_path + 1);
+        } else {
+            snprintf(out, len, "unix");
+        }
+        break;
+    default:
+        snprintf(out, len, "unknown");
+        break;
+    }
+}
+
+/**
+ * sameAddress : whether the socket fd is bound to addr.
+ */
+static int sameAddress(int fd, const struct sockaddr_storage *addr,
+                       socklen_t len)
+{
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    const struct sockaddr_in *a4, *b4;
+    const struct sockaddr_in6 *a6, *b6;
+
+    memset(&bound, 0, sizeof(bound));
+    if ((getsockname(fd, (struct sockaddr *) &bound, &boundLen) < 0) ||
+        (bound.ss_family != addr->ss_family)) {
+        return 0;
+    }
+    switch (addr->ss_family) {
+    case AF_INET:
+        a4 = (const struct sockaddr_in *) addr;
+        b4 = (const struct sockaddr_in *) &bound;
+        return (a4->sin_port == b4->sin_port) &&
+               (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+    case AF_INET6:
+        a6 = (const struct sockaddr_in6 *) addr;
+        b6 = (const struct sockaddr_in6 *) &bound;
+        return (a6->sin6_port == b6->sin6_port) &&
+               !memcmp(&a6->sin6_addr, &b6->sin6_addr, 16);
+    case AF_UNIX:
+        return (boundLen == len) && !memcmp(addr, &bound, len);
+    }
+    return 0;
+}
+
+/**
+ * unlinkStale : removes a socket file left behind by a server that is
+ * gone. A path something still listens on is left alone, bind() then
+ * fails with EADDRINUSE.
+ */
+static void unlinkStale(const struct sockaddr_un *un, socklen_t len)
+{
+    struct stat st;
+    int probe;
+
+    if ((stat(un->sun_path, &st) < 0) || !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return;
+    }
+    if ((connect(probe, (const struct sockaddr *) un, len) < 0) &&
+        (errno == ECONNREFUSED)) {
+        unlink(un->sun_path);
+    }
+    close(probe);
+}
+
+/**
+*listenApply : applies the options of spec to a listener, again after
+*a reload.
+*return:
+*       SUCCESS, FAILURE if listen() failed, the socket is not
+*       accepting connections then unless it was before
+*/
+int listenApply(const listener *l, const listenSpec *spec,
+                const serverConfig *cfg)
+{
+    if (l->family != AF_UNIX) {
+        sockoptListener(l->fd, cfg);
+    }
+    if (listen(l->fd, (spec->backlog > 0) ? spec->backlog
+                                          : cfg->backlog) < 0) {
+        error_log("listen(%s) error: %s", l->name, strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+*listenOpen : sets up the listener for spec, taking over an inherited
+*socket bound to the same address if there is one.
+*args:
+*       inherited: sockets handed down on restart, the one taken over
+*                  is replaced by -1
+*return:
+*       SUCCESS or FAILURE
+*/
+int listenOpen(listener *l, const listenSpec *spec, const serverConfig *cfg,
+               int *inherited, int numInherited)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int optval = 1, i;
+
+    if (listenAddress(spec->addr, &addr, &len) != SUCCESS) {
+        error_log("Invalid listen address %s", spec->addr);
+        return FAILURE;
+    }
+    memset(l, 0, sizeof(*l));
+    l->fd = -1;
+    l->family = addr.ss_family;
+    l->proxyProtocol = spec->proxyProtocol;
+    listenAddrString((struct sockaddr *) &addr, l->name, sizeof(l->name));
+
+    for (i = 0; i < numInherited; i++) {
+        if ((inherited[i] >= 0) && sameAddress(inherited[i], &addr, len)) {
+            l->fd = inherited[i];
+            inherited[i] = -1;
+            debug_log("Reusing inherited listener %s", l->name);
+            break;
+        }
+    }
+
+    if (l->fd < 0) {
+        if ((l->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC,
+                            0)) < 0) {
+            error_log("socket() error: %s", strerror(errno));
+            return FAILURE;
+        }
+
+        if (addr.ss_family == AF_UNIX) {
+            if (((struct sockaddr_un *) &addr)->sun_path[0] != '\0') {
+                unlinkStale((struct sockaddr_un *) &addr, len);
+            }
+        } else {
+            /* SO_REUSEADDR only has an effect if set before bind() */
+            setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                       sizeof(optval));
+        }
+        if (addr.ss_family == AF_INET6) {
+            /* Dual-stack unless asked otherwise: IPv4 arrives v4-mapped */
+            optval = spec->v6only;
+            setsockopt(l->fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval,
+                       sizeof(optval));
+        }
+
+        if (bind(l->fd, (struct sockaddr *) &addr, len) < 0) {
+            error_log("bind(%s) error: %s", l->name, strerror(errno));
+            close(l->fd);
+            return FAILURE;
+        }
+        if ((addr.ss_family == AF_UNIX) && (spec->mode > 0) &&
+            (chmod(((struct sockaddr_un *) &addr)->sun_path,
+                   spec->mode) < 0)) {
+            error_log("chmod(%s) error: %s", l->name, strerror(errno));
+        }
+    }
+
+    /* Receive buffer must be sized before listen() for window scaling */
+    if (listenApply(l, spec, cfg) != SUCCESS) {
+        close(l->fd);
+        return FAILURE;
+    }
+
+    /* The accept loop polls every listener and must never block */
+    fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+    return SUCCESS;
+}
@@ -0,0 +1,379 @@
+/**
+ * @file    loop.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Event loops running the connection coroutines. Each loop is
+ * one thread around an epoll instance; with worker CPUs configured
+ * there is a loop pinned to each of them and a connection goes to the
+ * loop of the CPU affinityPickCpu() chose, otherwise loops take
+ * connections in turn.
+ *
+ * Tasks are registered one-shot: when its fd is ready the loop calls
+ * the task's resume function, which runs until it would block again
+ * and says whether it now waits to read or to write. A task is only
+ * ever run by one loop thread at a time and needs no locking.
+ *
+ * A task may also park, waiting on work done elsewhere, e.g. a file
+ * read by the I/O threads. Whoever finishes that work hands it back
+ * with loopWake(): the task goes on its loop's list of woken tasks and
+ * an eventfd in the epoll set makes the loop resume it.
+ *
+ * Tasks ready to write are not resumed in the order epoll reports
+ * them. They wait in a heap ordered by the bytes they have left to
+ * send, and the loop resumes one per turn, polling epoll in between:
+ * shortest remaining first. A task writing a large response gives up
+ * its turn after send_quantum bytes (LOOP_YIELD) and goes back in the
+ * heap, so small responses and those nearly done go out ahead of bulk
+ * downloads instead of queueing behind them. So that a steady stream
+ * of small responses cannot hold a large one back forever, every
+ * LOOP_FAIR_EVERY turns goes to the task that has been ready longest.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <affinity.h>
+#include <loop.h>
+
+typedef struct eventLoop {
+    int epfd;
+    int wakefd;             /* eventfd, readable while tasks were woken */
+    int cpu;                /* pinned to, or -1 */
+    pthread_t tid;
+    pthread_mutex_t wakeLock;
+    loopTask *woken;        /* most recently woken first */
+    loopTask **ready;       /* min-heap on remaining, ready to write */
+    int numReady;
+    int readyCap;
+    unsigned long turns;
+} eventLoop;
+
+static eventLoop *loops;
+static int numLoops;
+static unsigned int nextLoop;
+
+/* The configuration as of the current wakeup of this loop */
+static __thread serverConfig *loopCfg;
+static __thread unsigned int loopCfgGen;
+
+/**
+*loopConfig : the configuration tasks of the calling loop run with,
+*brought up to date on a wakeup after a reload.
+*/
+const serverConfig *loopConfig(void)
+{
+    return loopCfg;
+}
+
+static void heapSwap(loopTask **heap, int i, int j)
+{
+    loopTask *t = heap[i];
+
+    heap[i] = heap[j];
+    heap[j] = t;
+}
+
+/* Restores the heap order around heap[i] */
+static void heapFix(loopTask **heap, int n, int i)
+{
+    int child;
+
+    while ((i > 0) && (heap[i]->remaining < heap[(i - 1) / 2]->remaining)) {
+        heapSwap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < n) {
+        if ((child + 1 < n) &&
+            (heap[child + 1]->remaining < heap[child]->remaining)) {
+            child++;
+        }
+        if (heap[i]->remaining <= heap[child]->remaining) {
+            break;
+        }
+        heapSwap(heap, i, child);
+        i = child;
+    }
+}
+
+/**
+ * loopReady : queues task for its turn to write.
+ * return: SUCCESS, FAILURE if there was no memory to queue it
+ */
+static int loopReady(eventLoop *loop, loopTask *task)
+{
+    loopTask **grown;
+    int cap;
+
+    if (loop->numReady == loop->readyCap) {
+        cap = loop->readyCap ? loop->readyCap * 2 : LOOP_MAX_EVENTS;
+        if ((grown = realloc(loop->ready, cap * sizeof(loopTask *))) == NULL) {
+            return FAILURE;
+        }
+        loop->ready = grown;
+        loop->readyCap = cap;
+    }
+    task->readySeq = loop->turns;
+    loop->ready[loop->numReady++] = task;
+    heapFix(loop->ready, loop->numReady, loop->numReady - 1);
+    return SUCCESS;
+}
+
+/**
+ * loopNextReady : takes the task whose turn it is off the heap, the one
+ * with the fewest bytes left or, every LOOP_FAIR_EVERY turns, the one
+ * ready the longest.
+ */
+static loopTask *loopNextReady(eventLoop *loop)
+{
+    loopTask *task;
+    int i, pick = 0;
+
+    if ((++loop->turns % LOOP_FAIR_EVERY) == 0) {
+        for (i = 1; i < loop->numReady; i++) {
+            if (loop->ready[i]->readySeq < loop->ready[pick]->readySeq) {
+                pick = i;
+            }
+        }
+    }
+    task = loop->ready[pick];
+    loop->ready[pick] = loop->ready[--loop->numReady];
+    if (pick < loop->numReady) {
+        heapFix(loop->ready, loop->numReady, pick);
+    }
+    return task;
+}
+
+/**
+ * loopRun : resumes task and registers what it waits for next.
+ */
+static void loopRun(eventLoop *loop, loopTask *task)
+{
+    struct epoll_event ev;
+    int wait = task->resume(task);
+
+    /* Done, task is freed; parked, it belongs to whoever wakes it */
+    if ((wait == LOOP_DONE) || (wait == LOOP_PARKED)) {
+        return;
+    }
+    task->wait = wait;
+    if ((wait == LOOP_YIELD) && (loopReady(loop, task) == SUCCESS)) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((wait == LOOP_READ) ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+    ev.data.ptr = task;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, task->fd, &ev) < 0) {
+        error_log("epoll_ctl() error: %s", strerror(errno));
+    }
+}
+
+/**
+ * loopRunWoken : resumes the tasks woken since the last time, in the
+ * order they were woken.
+ */
+static void loopRunWoken(eventLoop *loop)
+{
+    loopTask *list, *prev = NULL, *next;
+    uint64_t count;
+
+    if (read(loop->wakefd, &count, sizeof(count)) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&loop->wakeLock);
+    list = loop->woken;
+    loop->woken = NULL;
+    pthread_mutex_unlock(&loop->wakeLock);
+
+    while (list != NULL) {
+        next = list->wakeNext;
+        list->wakeNext = prev;
+        prev = list;
+        list = next;
+    }
+    for (; prev != NULL; prev = next) {
+        next = prev->wakeNext;
+        loopRun(loop, prev);
+    }
+}
+
+static void *loopThread(void *arg)
+{
+    eventLoop *loop = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    loopTask *task;
+    int n, i;
+
+    if ((loopCfg = malloc(sizeof(serverConfig))) == NULL) {
+        error_log("%s", "Unable to allocate event loop state");
+        exit(EXIT_FAILURE);
+    }
+
+    confRefresh(loopCfg, &loopCfgGen);
+    for (;;) {
+        /* Writers waiting for their turn only leave time for a look */
+        n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS,
+                       (loop->numReady > 0) ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_log("epoll_wait() error: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0) {
+            confRefresh(loopCfg, &loopCfgGen);
+        }
+
+        for (i = 0; i < n; i++) {
+            task = events[i].data.ptr;
+            if (task == NULL) {
+                loopRunWoken(loop);
+            } else if ((task->wait != LOOP_WRITE) ||
+                       (loopReady(loop, task) != SUCCESS)) {
+                loopRun(loop, task);
+            }
+        }
+        if (loop->numReady > 0) {
+            loopRun(loop, loopNextReady(loop));
+        }
+    }
+    return NULL;
+}
+
+/**
+*loopInit : starts the event loops.
+*args:
+*       threads: number of loops, 0 for one per worker CPU, or per
+*                online CPU when workers are not pinned
+*       blocked: signals the loop threads keep blocked
+*return:
+*       SUCCESS or FAILURE
+*/
+int loopInit(int threads, const sigset_t *blocked)
+{
+    pthread_attr_t attr;
+    struct epoll_event ev;
+    sigset_t oldMask;
+    int workers = affinityWorkerCount();
+    int i;
+
+    if (threads == 0) {
+        threads = (workers > 0) ? workers : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((loops = calloc(threads, sizeof(eventLoop))) == NULL) {
+        return FAILURE;
+    }
+
+    pthread_sigmask(SIG_BLOCK, blocked, &oldMask);
+    for (i = 0; i < threads; i++) {
+        loops[i].cpu = (workers > 0) ? affinityWorkerCpu(i % workers) : -1;
+        if ((loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            error_log("epoll_create1() error: %s", strerror(errno));
+            break;
+        }
+        if ((loops[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            error_log("eventfd() error: %s", strerror(errno));
+            close(loops[i].epfd);
+            break;
+        }
+        pthread_mutex_init(&loops[i].wakeLock, NULL);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev);
+        pthread_attr_init(&attr);
+        if (affinityApply(&attr, loops[i].cpu) != 0) {
+            error_log("Unable to pin event loop to CPU %d", loops[i].cpu);
+        }
+        if (pthread_create(&loops[i].tid, &attr, loopThread, &loops[i])) {
+            error_log("%s", "Unable to start event loop thread");
+            close(loops[i].epfd);
+            close(loops[i].wakefd);
+            pthread_attr_destroy(&attr);
+            break;
+        }
+        pthread_attr_destroy(&attr);
+        numLoops++;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+
+    debug_log("Running %d event loops", numLoops);
+    return (numLoops > 0) ? SUCCESS : FAILURE;
+}
+
+/**
+*loopAdd : hands task to the loop of cpu, or the next loop in turn if
+*cpu is -1 or has none. The task is resumed once its fd is readable.
+*return:
+*       SUCCESS, FAILURE if the loop cannot watch the fd; the task is
+*       still the caller's then
+*/
+int loopAdd(loopTask *task, int cpu)
+{
+    struct epoll_event ev;
+    int i;
+
+    task->loop = -1;
+    task->wait = LOOP_READ;
+    for (i = 0; (cpu >= 0) && (i < numLoops); i++) {
+        if (loops[i].cpu == cpu) {
+            task->loop = i;
+            break;
+        }
+    }
+    if (task->loop < 0) {
+        task->loop = __sync_fetch_and_add(&nextLoop, 1) % numLoops;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = task;
+    if (epoll_ctl(loops[task->loop].epfd, EPOLL_CTL_ADD, task->fd, &ev) < 0) {
+        error_log("epoll_ctl() error: %s", strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+*loopDetach : takes task off its loop, from within its resume
+*function, before its fd is handed elsewhere. The task's resume must
+*then return LOOP_DONE.
+*/
+void loopDetach(loopTask *task)
+{
+    epoll_ctl(loops[task->loop].epfd, EPOLL_CTL_DEL, task->fd, NULL);
+}
+
+/**
+*loopWake : resumes a task that returned LOOP_PARKED, on its loop.
+*Safe to call from any thread.
+*/
+void loopWake(loopTask *task)
+{
+    eventLoop *loop = &loops[task->loop];
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->wakeLock);
+    task->wakeNext = loop->woken;
+    loop->woken = task;
+    pthread_mutex_unlock(&loop->wakeLock);
+
+    if (write(loop->wakefd, &one, sizeof(one)) < 0) {
+        error_log("eventfd write error: %s", strerror(errno));
+    }
+}
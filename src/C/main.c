@@ -0,0 +1,17 @@
+/**
+ * @file   main.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief ./server, libsimple without handlers of its own: every
+ * request is served from the www root.
+ *
+ */
+
+#include <simple.h>
+
+int main(int argc, char **argv)
+{
+    return simpleRun(NULL, argc, argv);
+}
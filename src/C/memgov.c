@@ -0,0 +1,92 @@
+/**
+ * @file    memgov.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Process wide memory budget. Everything that grows with the
+ * load or with file sizes (file bodies, proxy cache entries, request
+ * buffers) is reserved here before it is allocated, so the footprint
+ * stays under memory_budget however many requests come in and
+ * however large the files are. What does not fit is not allocated:
+ * files are streamed through a small buffer instead, and requests that
+ * cannot get even that are answered 503.
+ *
+ */
+
+#include <log.h>
+#include <httpparser.h>
+#include <memgov.h>
+
+typedef struct memGauge {
+    size_t used;
+    size_t peak;
+    unsigned long denied;       /* reservations over the budget */
+} memGauge;
+
+static const char *kindNames[MEM_KINDS] = { "response", "cache", "recv" };
+
+static size_t memBudget;        /* 0 for none */
+static size_t memUsed;
+static memGauge gauges[MEM_KINDS];
+
+/**
+*memSetBudget : sets the budget, again on reload. Memory already held
+*over a lowered budget is kept until released.
+*args:
+*       bytes: the budget, 0 for none
+*/
+void memSetBudget(size_t bytes)
+{
+    __sync_lock_test_and_set(&memBudget, bytes);
+}
+
+/**
+*memReserve : reserves bytes of the budget for kind.
+*return:
+*       SUCCESS, or FAILURE if they do not fit; nothing is reserved then
+*/
+int memReserve(int kind, size_t bytes)
+{
+    memGauge *g = &gauges[kind];
+    size_t used, budget = memBudget, peak;
+
+    do {
+        used = memUsed;
+        if ((budget != 0) && (used + bytes > budget)) {
+            __sync_fetch_and_add(&g->denied, 1);
+            return FAILURE;
+        }
+    } while (!__sync_bool_compare_and_swap(&memUsed, used, used + bytes));
+
+    used = __sync_add_and_fetch(&g->used, bytes);
+    while ((peak = g->peak) < used) {
+        __sync_bool_compare_and_swap(&g->peak, peak, used);
+    }
+    return SUCCESS;
+}
+
+/**
+*memRelease : gives back bytes memReserve reserved for kind.
+*/
+void memRelease(int kind, size_t bytes)
+{
+    __sync_fetch_and_sub(&gauges[kind].used, bytes);
+    __sync_fetch_and_sub(&memUsed, bytes);
+}
+
+/**
+*memDumpStats : writes the use of the budget to out.
+*/
+void memDumpStats(FILE *out)
+{
+    int kind;
+
+    fprintf(out, "memory budget %zu used %zu\n", memBudget, memUsed);
+    fprintf(out, "%-10s%-14s%-14s%s\n", "kind", "used", "peak", "denied");
+    for (kind = 0; kind < MEM_KINDS; kind++) {
+        fprintf(out, "%-10s%-14zu%-14zu%lu\n", kindNames[kind],
+                gauges[kind].used, gauges[kind].peak, gauges[kind].denied);
+    }
+    fflush(out);
+}
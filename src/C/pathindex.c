@@ -0,0 +1,531 @@
+/**
+ * @file    pathindex.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Index of the paths under the www root. Scanners ask for
+ * thousands of paths that were never there; each of them used to cost
+ * a stat() and an open() before its 404. At start every file and
+ * directory under the root is put in a Bloom filter, and uriResolve
+ * answers 404 for a path the filter has never seen without a single
+ * system call. A path the filter may hold is looked up as before, so
+ * a false positive (about 1%) only costs what every request used to.
+ *
+ * An inotify thread adds what is created or moved in. A Bloom filter
+ * cannot forget, so what is removed stays "maybe" until the filter is
+ * rebuilt, once enough has changed or the event queue overflowed.
+ * Readers never lock: bits are only ever set, and a rebuilt filter is
+ * swapped in whole; the one it replaced is freed at the next rebuild,
+ * long after any lookup still on it finished.
+ *
+ * The contents of directories reached through symbolic links are not
+ * walked; such links go in a second small filter and anything below
+ * them is looked up as before. A file created under the root may be
+ * answered 404 until its inotify event is read, a few milliseconds.
+ * Without inotify, or beyond path_index paths, the index is off and
+ * every path is looked up.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <pathindex.h>
+
+#define HASH_INIT 14695981039346656037ULL
+#define HASH_PRIME 1099511628211ULL
+
+#define WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | \
+                      IN_ONLYDIR)
+
+typedef struct pathFilter {
+    uint64_t *bits;
+    uint64_t mask;                  /* bits in the filter - 1 */
+    uint64_t links[PATH_INDEX_LINK_BITS / 64];
+    int hasLinks;
+    unsigned long paths;
+    unsigned long capacity;         /* paths before false positives climb */
+} pathFilter;
+
+static pathFilter *volatile current;    /* NULL while the index is off */
+static pathFilter *retired;
+static char indexRoot[MAX_PATH];
+static size_t rootLen;
+static long indexMax;
+static int inotifyFd = -1;
+static char **watchPaths;               /* by watch descriptor */
+static int numWatchPaths;
+static unsigned long removed;           /* since the filter was built */
+static unsigned long rejected, builds;
+
+/**
+ * filterSet, filterTest : the probes of a path hash, double hashing
+ * the two halves of its 64 bit FNV-1a.
+ */
+static void filterSet(uint64_t *bits, uint64_t mask, uint64_t hash)
+{
+    uint64_t h1 = (uint32_t) hash, h2 = (hash >> 32) | 1, bit;
+    int i;
+
+    for (i = 0; i < PATH_INDEX_PROBES; i++) {
+        bit = (h1 + i * h2) & mask;
+        __sync_fetch_and_or(&bits[bit >> 6], 1ULL << (bit & 63));
+    }
+}
+
+static int filterTest(const uint64_t *bits, uint64_t mask, uint64_t hash)
+{
+    uint64_t h1 = (uint32_t) hash, h2 = (hash >> 32) | 1, bit;
+    int i;
+
+    for (i = 0; i < PATH_INDEX_PROBES; i++) {
+        bit = (h1 + i * h2) & mask;
+        if (!(bits[bit >> 6] & (1ULL << (bit & 63)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint64_t hashPath(const char *path, size_t len)
+{
+    uint64_t hash = HASH_INIT;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) path[i]) * HASH_PRIME;
+    }
+    return hash;
+}
+
+static pathFilter *filterNew(unsigned long expect)
+{
+    pathFilter *f;
+    uint64_t bits = PATH_INDEX_MIN_BITS;
+
+    while (bits < (uint64_t) expect * PATH_INDEX_BITS_PER_PATH) {
+        bits <<= 1;
+    }
+    if ((f = calloc(1, sizeof(pathFilter))) == NULL) {
+        return NULL;
+    }
+    if ((f->bits = calloc(bits / 64, sizeof(uint64_t))) == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->mask = bits - 1;
+    f->capacity = bits / PATH_INDEX_BITS_PER_PATH;
+    return f;
+}
+
+static void filterFree(pathFilter *f)
+{
+    if (f != NULL) {
+        free(f->bits);
+        free(f);
+    }
+}
+
+/**
+ * filterAdd : puts the path relative to the root in f, and in its
+ * links if nothing below it is indexed.
+ * return: SUCCESS, FAILURE once there are more than path_index paths
+ */
+static int filterAdd(pathFilter *f, const char *rel, size_t len, int link)
+{
+    uint64_t hash = hashPath(rel, len);
+
+    if (++f->paths > (unsigned long) indexMax) {
+        return FAILURE;
+    }
+    filterSet(f->bits, f->mask, hash);
+    if (link) {
+        filterSet(f->links, PATH_INDEX_LINK_BITS - 1, hash);
+        __sync_synchronize();
+        f->hasLinks = 1;
+    }
+    return SUCCESS;
+}
+
+/**
+ * watchAdd : watches the directory rel for changes.
+ * return: SUCCESS, FAILURE if the inotify watch limit is reached
+ */
+static int watchAdd(const char *full, const char *rel)
+{
+    char **grown;
+    int wd, num;
+
+    wd = inotify_add_watch(inotifyFd, full, WATCH_EVENTS);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            error_log("%s", "Out of inotify watches, see "
+                      "fs.inotify.max_user_watches; path index off");
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+    if (wd >= numWatchPaths) {
+        num = (wd + 1) * 2;
+        if ((grown = realloc(watchPaths, num * sizeof(char *))) == NULL) {
+            return FAILURE;
+        }
+        memset(grown + numWatchPaths, 0,
+               (num - numWatchPaths) * sizeof(char *));
+        watchPaths = grown;
+        numWatchPaths = num;
+    }
+    /* A directory moved within the root keeps its descriptor */
+    free(watchPaths[wd]);
+    if ((watchPaths[wd] = strdup(rel)) == NULL) {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * entryKind : DT_DIR, DT_LNK to a directory, or DT_REG for anything
+ * else under the directory dirFd.
+ */
+static int entryKind(int dirFd, const char *name, int type)
+{
+    struct stat st;
+
+    if ((type == DT_UNKNOWN) &&
+        (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR :
+               S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+    }
+    if (type == DT_LNK) {
+        return ((fstatat(dirFd, name, &st, 0) == 0) && S_ISDIR(st.st_mode)) ?
+               DT_LNK : DT_REG;
+    }
+    return (type == DT_DIR) ? DT_DIR : DT_REG;
+}
+
+/**
+ * walkDir : adds everything below the directory rel (MAX_PATH bytes,
+ * relLen long, restored on return) to f and watches its directories.
+ * return: SUCCESS or FAILURE if the index cannot be kept
+ */
+static int walkDir(pathFilter *f, char *rel, size_t relLen, int depth)
+{
+    char full[MAX_PATH];
+    struct dirent *d;
+    DIR *dir;
+    size_t n;
+    int kind, ret = SUCCESS;
+
+    memcpy(full, indexRoot, rootLen);
+    memcpy(full + rootLen, rel, relLen + 1);
+    if (watchAdd(full, rel) != SUCCESS) {
+        return FAILURE;
+    }
+    if ((dir = opendir(full)) == NULL) {
+        return SUCCESS;
+    }
+    while ((ret == SUCCESS) && ((d = readdir(dir)) != NULL)) {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
+            continue;
+        }
+        /* Longer paths are never served, see uriResolve */
+        n = strlen(d->d_name);
+        if (rootLen + relLen + n + 2 > MAX_PATH) {
+            continue;
+        }
+        rel[relLen] = '/';
+        memcpy(rel + relLen + 1, d->d_name, n + 1);
+
+        kind = entryKind(dirfd(dir), d->d_name, d->d_type);
+        if ((kind == DT_DIR) && (depth < PATH_INDEX_DEPTH)) {
+            ret = filterAdd(f, rel, relLen + 1 + n, 0);
+            if (ret == SUCCESS) {
+                ret = walkDir(f, rel, relLen + 1 + n, depth + 1);
+            }
+        } else {
+            ret = filterAdd(f, rel, relLen + 1 + n, kind != DT_REG);
+        }
+    }
+    rel[relLen] = '\0';
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * indexOff : stops using the index, every path is looked up again.
+ */
+static void indexOff(void)
+{
+    pathFilter *old = current;
+
+    current = NULL;
+    filterFree(retired);
+    retired = old;
+}
+
+/**
+ * indexBuild : walks the root into a new filter sized for what is
+ * there, and swaps it in.
+ * return: SUCCESS, or FAILURE and the index is off
+ */
+static int indexBuild(void)
+{
+    char rel[MAX_PATH];
+    pathFilter *f, *old = current;
+    unsigned long expect = (old != NULL) ? old->paths * 2 : 0;
+
+    for (;;) {
+        if ((f = filterNew(expect)) == NULL) {
+            indexOff();
+            return FAILURE;
+        }
+        rel[0] = '\0';
+        if (walkDir(f, rel, 0, 0) != SUCCESS) {
+            if (f->paths > (unsigned long) indexMax) {
+                error_log("More than %ld paths under %s; path index off",
+                          indexMax, indexRoot);
+            }
+            filterFree(f);
+            indexOff();
+            return FAILURE;
+        }
+        if (f->paths <= f->capacity) {
+            break;
+        }
+        /* Grew past its size while walking, again with room to grow */
+        expect = f->paths * 2;
+        filterFree(f);
+    }
+
+    __sync_synchronize();
+    current = f;
+    filterFree(retired);
+    retired = old;
+    removed = 0;
+    builds++;
+    debug_log("Path index of %s: %lu paths in %lu bits", indexRoot,
+              f->paths, (unsigned long) f->mask + 1);
+    return SUCCESS;
+}
+
+/**
+ * indexEvent : takes one inotify event into the current filter.
+ * return: whether the filter is to be rebuilt
+ */
+static int indexEvent(const struct inotify_event *ev)
+{
+    pathFilter *f = current;
+    char rel[MAX_PATH], full[MAX_PATH];
+    size_t dirLen, len, n;
+    int kind, depth, dirFd;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        return 1;
+    }
+    if ((ev->wd < 0) || (ev->wd >= numWatchPaths) ||
+        (watchPaths[ev->wd] == NULL)) {
+        return 0;
+    }
+    if (ev->mask & IN_IGNORED) {
+        free(watchPaths[ev->wd]);
+        watchPaths[ev->wd] = NULL;
+        return 0;
+    }
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        removed++;
+        return (f != NULL) && (removed > f->paths / 2);
+    }
+    if ((f == NULL) || !(ev->mask & (IN_CREATE | IN_MOVED_TO)) ||
+        (ev->len == 0)) {
+        return 0;
+    }
+
+    dirLen = strlen(watchPaths[ev->wd]);
+    n = strlen(ev->name);
+    if (rootLen + dirLen + n + 2 > MAX_PATH) {
+        return 0;
+    }
+    memcpy(rel, watchPaths[ev->wd], dirLen);
+    rel[dirLen] = '/';
+    memcpy(rel + dirLen + 1, ev->name, n + 1);
+    len = dirLen + 1 + n;
+
+    kind = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+    if (kind != DT_DIR) {
+        memcpy(full, indexRoot, rootLen);
+        memcpy(full + rootLen, rel, dirLen);
+        full[rootLen + dirLen] = '\0';
+        dirFd = open(full, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        kind = (dirFd >= 0) ? entryKind(dirFd, ev->name, DT_UNKNOWN) : DT_REG;
+        if (dirFd >= 0) {
+            close(dirFd);
+        }
+    }
+
+    for (depth = 0, n = 0; n < len; n++) {
+        depth += (rel[n] == '/');
+    }
+    if ((kind == DT_DIR) && (depth <= PATH_INDEX_DEPTH)) {
+        /* It may already hold what was made in it before the watch */
+        if ((filterAdd(f, rel, len, 0) != SUCCESS) ||
+            (walkDir(f, rel, len, depth) != SUCCESS)) {
+            return 1;
+        }
+    } else if (filterAdd(f, rel, len, kind != DT_REG) != SUCCESS) {
+        return 1;
+    }
+    return f->paths > f->capacity;
+}
+
+/**
+ * indexThread : keeps the index up to date with the inotify events.
+ */
+static void *indexThread(void *arg)
+{
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    int rebuild;
+
+    (void) arg;
+    while (current != NULL) {
+        n = read(inotifyFd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_log("inotify read() error: %s; path index off",
+                      strerror(errno));
+            indexOff();
+            break;
+        }
+        rebuild = 0;
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) p;
+            rebuild |= indexEvent(ev);
+        }
+        if (rebuild) {
+            indexBuild();
+        }
+    }
+    close(inotifyFd);
+    inotifyFd = -1;
+    return NULL;
+}
+
+/**
+*pathIndexInit : builds the index of root and starts keeping it up to
+*date.
+*args:
+*       maxPaths: paths indexed at most, 0 leaves the index off
+*       blocked: signals the index thread must not take
+*return:
+*       SUCCESS, or FAILURE if it could not be built; it is off then
+*/
+int pathIndexInit(const char *root, long maxPaths, const sigset_t *blocked)
+{
+    pthread_t tid;
+    sigset_t oldMask;
+    int ret;
+
+    if (maxPaths == 0) {
+        return SUCCESS;
+    }
+    rootLen = strlen(root);
+    if (rootLen >= MAX_PATH) {
+        return FAILURE;
+    }
+    memcpy(indexRoot, root, rootLen + 1);
+    indexMax = maxPaths;
+
+    if ((inotifyFd = inotify_init1(IN_CLOEXEC)) < 0) {
+        error_log("inotify_init1() error: %s; path index off",
+                  strerror(errno));
+        return FAILURE;
+    }
+    if (indexBuild() != SUCCESS) {
+        close(inotifyFd);
+        inotifyFd = -1;
+        return FAILURE;
+    }
+
+    pthread_sigmask(SIG_BLOCK, blocked, &oldMask);
+    ret = pthread_create(&tid, NULL, indexThread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if (ret != 0) {
+        error_log("%s", "Unable to start the path index thread");
+        indexOff();
+        return FAILURE;
+    }
+    pthread_detach(tid);
+    return SUCCESS;
+}
+
+/**
+*pathIndexMayExist : whether the canonical path may name something
+*under the root. Never makes a system call.
+*args:
+*       path: canonical request path, see uri.c
+*       len: its length
+*return:
+*       0 if it surely does not exist, 1 if it may, or the index is off
+*/
+int pathIndexMayExist(const char *path, size_t len)
+{
+    const pathFilter *f = current;
+    uint64_t hash = HASH_INIT;
+    size_t i;
+
+    if (f == NULL) {
+        return 1;
+    }
+    while ((len > 1) && (path[len - 1] == '/')) {
+        len--;
+    }
+    if (len <= 1) {
+        return 1;
+    }
+    for (i = 0; i < len; i++) {
+        /* Nothing below a link to a directory is indexed */
+        if ((i > 0) && (path[i] == '/') && f->hasLinks &&
+            filterTest(f->links, PATH_INDEX_LINK_BITS - 1, hash)) {
+            return 1;
+        }
+        hash = (hash ^ (unsigned char) path[i]) * HASH_PRIME;
+    }
+    if (filterTest(f->bits, f->mask, hash)) {
+        return 1;
+    }
+    __sync_fetch_and_add(&rejected, 1);
+    return 0;
+}
+
+/**
+*pathIndexDumpStats : writes the size of the index and the paths it
+*turned away to out.
+*/
+void pathIndexDumpStats(FILE *out)
+{
+    const pathFilter *f = current;
+
+    if (f == NULL) {
+        fprintf(out, "path index off\n");
+    } else {
+        fprintf(out, "path index %lu paths, %lu bits, %lu builds, "
+                "%lu rejected\n", f->paths, (unsigned long) f->mask + 1,
+                builds, rejected);
+    }
+    fflush(out);
+}
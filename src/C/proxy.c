@@ -0,0 +1,969 @@
+/**
+ * @file    proxy.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Reverse proxy mode. Requests whose URI starts with a
+ * configured prefix are forwarded to an upstream HTTP server over
+ * TCP ("host:port") or a Unix socket ("unix:/path", "unix:@name"
+ * for the abstract namespace).
+ *
+ * Upstream requests are sent as HTTP/1.0 with "Connection:
+ * keep-alive", so the upstream either frames its response with a
+ * Content-Length (and the connection goes back to the idle pool of
+ * that upstream) or closes it; chunked encoding never shows up.
+ * Bodies are streamed between the sockets with splice().
+ *
+ * Responses to GET that upstream marks cacheable (Cache-Control
+ * max-age or s-maxage, and none of no-store, no-cache, private)
+ * are kept in an LRU cache bounded by proxy_cache_size and served
+ * with an Age header until they expire. Responses setting a cookie or
+ * carrying Vary are never kept, nor are responses to requests with
+ * Authorization unless marked public, s-maxage or must-revalidate. They are keyed on the
+ * canonical path (see uri.c) and the query, which upstream may act on.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <proxy.h>
+#include <trace.h>
+#include <response.h>
+#include <uri.h>
+#include <memgov.h>
+
+typedef struct header {
+    const char *name;
+    size_t nameLen;
+    const char *value;
+    size_t valueLen;
+    const char *line;
+    size_t lineLen;
+} header;
+
+typedef struct upstream {
+    char name[PROXY_MAX_UPSTREAM];
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    int resolved;
+    pthread_mutex_t lock;
+    int *idle;
+    int numIdle;
+    int maxIdle;
+    struct upstream *next;
+} upstream;
+
+typedef struct cacheEntry {
+    struct cacheEntry *hashNext;
+    struct cacheEntry *lruPrev;
+    struct cacheEntry *lruNext;
+    unsigned int hash;
+    char *key;
+    char *head;
+    size_t headLen;
+    char *body;
+    size_t bodyLen;
+    size_t size;
+    time_t stored;
+    time_t expires;
+    int refs;
+    int linked;
+} cacheEntry;
+
+static pthread_mutex_t upstreamsLock = PTHREAD_MUTEX_INITIALIZER;
+static upstream *upstreams;
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static cacheEntry *cacheTable[PROXY_CACHE_BUCKETS];
+static cacheEntry *lruHead;
+static cacheEntry *lruTail;
+static size_t cacheBytes;
+
+/* Hop-by-hop headers, never forwarded in either direction */
+static const char *hopHeaders[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Upgrade", "Transfer-Encoding", NULL
+};
+
+static int sendAll(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        traceCall(TRACE_CALL_SEND);
+        n = send(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FAILURE;
+        }
+        buf += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+static int findHeaderEnd(const char *buf, size_t len)
+{
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+
+    return (end == NULL) ? -1 : (int) (end - buf) + 4;
+}
+
+/**
+ * nextHeader : reads the header line at *pos, stops at the blank line.
+ * return: 1 if a header was read, 0 at the end of the headers
+ */
+static int nextHeader(const char **pos, const char *end, header *h)
+{
+    const char *p = *pos;
+    const char *eol, *colon;
+
+    eol = memmem(p, end - p, "\r\n", 2);
+    if ((eol == NULL) || (eol == p)) {
+        return 0;
+    }
+
+    h->line = p;
+    h->lineLen = eol + 2 - p;
+    h->name = p;
+    colon = memchr(p, ':', eol - p);
+    if (colon == NULL) {
+        h->nameLen = eol - p;
+        h->value = eol;
+        h->valueLen = 0;
+    } else {
+        h->nameLen = colon - p;
+        h->value = colon + 1;
+        while ((h->value < eol) && (*h->value == ' ' || *h->value == '\t')) {
+            h->value++;
+        }
+        h->valueLen = eol - h->value;
+        while ((h->valueLen > 0) && (h->value[h->valueLen - 1] == ' ')) {
+            h->valueLen--;
+        }
+    }
+
+    *pos = eol + 2;
+    return 1;
+}
+
+static int headerIs(const header *h, const char *name)
+{
+    return (strlen(name) == h->nameLen) &&
+           !strncasecmp(h->name, name, h->nameLen);
+}
+
+static int isHopHeader(const header *h)
+{
+    int i;
+
+    for (i = 0; hopHeaders[i] != NULL; i++) {
+        if (headerIs(h, hopHeaders[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * valueFind : case insensitive search for token in a header value.
+ * return: pointer just past the token, NULL if absent
+ */
+static const char *valueFind(const header *h, const char *token)
+{
+    size_t len = strlen(token);
+    size_t i;
+
+    for (i = 0; i + len <= h->valueLen; i++) {
+        if (!strncasecmp(h->value + i, token, len)) {
+            return h->value + i + len;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * cacheMaxAge : freshness lifetime allowed by a response
+ * Cache-Control header for a shared cache. The response to a request
+ * with credentials is only kept if it says it may be shared (RFC 9111
+ * 3.5).
+ * return: seconds, 0 if the response must not be cached
+ */
+static long cacheMaxAge(const header *h, int authorized)
+{
+    const char *val;
+
+    if (valueFind(h, "no-store") || valueFind(h, "no-cache") ||
+        valueFind(h, "private")) {
+        return 0;
+    }
+    if (authorized && !valueFind(h, "public") &&
+        !valueFind(h, "s-maxage=") && !valueFind(h, "must-revalidate")) {
+        return 0;
+    }
+    if ((val = valueFind(h, "s-maxage=")) != NULL) {
+        return atol(val);
+    }
+    if ((val = valueFind(h, "max-age=")) != NULL) {
+        return atol(val);
+    }
+    return 0;
+}
+
+static unsigned int hashKey(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key != '\0') {
+        hash = (hash ^ (unsigned char) *key++) * 16777619u;
+    }
+    return hash;
+}
+
+static void cacheFree(cacheEntry *e)
+{
+    free(e->key);
+    free(e->head);
+    free(e->body);
+    memRelease(MEM_CACHE, e->bodyLen);
+    free(e);
+}
+
+/* Called with cacheLock held */
+static void cacheUnlink(cacheEntry *e)
+{
+    cacheEntry **pp = &cacheTable[e->hash % PROXY_CACHE_BUCKETS];
+
+    while (*pp != e) {
+        pp = &(*pp)->hashNext;
+    }
+    *pp = e->hashNext;
+
+    if (e->lruPrev != NULL) {
+        e->lruPrev->lruNext = e->lruNext;
+    } else {
+        lruHead = e->lruNext;
+    }
+    if (e->lruNext != NULL) {
+        e->lruNext->lruPrev = e->lruPrev;
+    } else {
+        lruTail = e->lruPrev;
+    }
+
+    cacheBytes -= e->size;
+    e->linked = 0;
+    if (e->refs == 0) {
+        cacheFree(e);
+    }
+}
+
+/* Called with cacheLock held */
+static void cacheTouch(cacheEntry *e)
+{
+    if (lruHead == e) {
+        return;
+    }
+    e->lruPrev->lruNext = e->lruNext;
+    if (e->lruNext != NULL) {
+        e->lruNext->lruPrev = e->lruPrev;
+    } else {
+        lruTail = e->lruPrev;
+    }
+    e->lruPrev = NULL;
+    e->lruNext = lruHead;
+    lruHead->lruPrev = e;
+    lruHead = e;
+}
+
+/**
+ * cacheLookup : returns a fresh entry for key with a reference held,
+ * to be dropped with cachePut.
+ */
+static cacheEntry *cacheLookup(const char *key)
+{
+    unsigned int hash = hashKey(key);
+    cacheEntry *e;
+
+    pthread_mutex_lock(&cacheLock);
+    for (e = cacheTable[hash % PROXY_CACHE_BUCKETS]; e != NULL;
+         e = e->hashNext) {
+        if ((e->hash == hash) && !strcmp(e->key, key)) {
+            break;
+        }
+    }
+    if (e != NULL) {
+        if (e->expires <= time(NULL)) {
+            cacheUnlink(e);
+            e = NULL;
+        } else {
+            cacheTouch(e);
+            e->refs++;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return e;
+}
+
+static void cachePut(cacheEntry *e)
+{
+    pthread_mutex_lock(&cacheLock);
+    if ((--e->refs == 0) && !e->linked) {
+        cacheFree(e);
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * cacheInsert : stores a response, evicting the least recently used
+ * entries to stay within proxy_cache_size. Takes ownership of body
+ * and of the bodyLen bytes of memory budget reserved for it.
+ */
+static void cacheInsert(const char *key, const char *head, size_t headLen,
+                        char *body, size_t bodyLen, long maxAge,
+                        const serverConfig *cfg)
+{
+    cacheEntry *e, *old;
+
+    e = calloc(1, sizeof(cacheEntry));
+    if (e == NULL) {
+        free(body);
+        memRelease(MEM_CACHE, bodyLen);
+        return;
+    }
+    e->key = strdup(key);
+    e->head = malloc(headLen);
+    e->body = body;
+    e->bodyLen = bodyLen;
+    if ((e->key == NULL) || (e->head == NULL)) {
+        cacheFree(e);
+        return;
+    }
+    memcpy(e->head, head, headLen);
+    e->headLen = headLen;
+    e->size = headLen + bodyLen + strlen(key);
+    e->hash = hashKey(key);
+    e->stored = time(NULL);
+    e->expires = e->stored + maxAge;
+    e->linked = 1;
+
+    pthread_mutex_lock(&cacheLock);
+    for (old = cacheTable[e->hash % PROXY_CACHE_BUCKETS]; old != NULL;
+         old = old->hashNext) {
+        if ((old->hash == e->hash) && !strcmp(old->key, key)) {
+            cacheUnlink(old);
+            break;
+        }
+    }
+    while ((lruTail != NULL) &&
+           (cacheBytes + e->size > (size_t) cfg->proxyCacheSize)) {
+        cacheUnlink(lruTail);
+    }
+
+    e->hashNext = cacheTable[e->hash % PROXY_CACHE_BUCKETS];
+    cacheTable[e->hash % PROXY_CACHE_BUCKETS] = e;
+    e->lruNext = lruHead;
+    if (lruHead != NULL) {
+        lruHead->lruPrev = e;
+    } else {
+        lruTail = e;
+    }
+    lruHead = e;
+    cacheBytes += e->size;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * upstreamResolve : fills in the socket address of an upstream.
+ */
+static int upstreamResolve(upstream *u)
+{
+    struct sockaddr_un *sun = (struct sockaddr_un *) &u->addr;
+    struct addrinfo hints, *res;
+    char host[PROXY_MAX_UPSTREAM];
+    const char *path;
+    char *port;
+    int status;
+
+    if (!strncmp(u->name, "unix:", 5)) {
+        path = u->name + 5;
+        if (strlen(path) >= sizeof(sun->sun_path)) {
+            return FAILURE;
+        }
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path);
+        u->addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+        if (path[0] == '@') {
+            /* Abstract namespace */
+            sun->sun_path[0] = '\0';
+        } else {
+            u->addrLen++;
+        }
+        u->resolved = 1;
+        return SUCCESS;
+    }
+
+    strcpy(host, u->name);
+    if ((port = strrchr(host, ':')) == NULL) {
+        return FAILURE;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((status = getaddrinfo(host, port, &hints, &res)) != 0) {
+        error_log("Unable to resolve upstream %s: %s",
+                  u->name, gai_strerror(status));
+        return FAILURE;
+    }
+    memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+    u->addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+    u->resolved = 1;
+    return SUCCESS;
+}
+
+/**
+ * upstreamGet : finds the connection pool of an upstream, creating it
+ * on first use. Pools live as long as the process, across reloads.
+ */
+static upstream *upstreamGet(const char *name, int maxIdle)
+{
+    upstream *u;
+
+    pthread_mutex_lock(&upstreamsLock);
+    for (u = upstreams; u != NULL; u = u->next) {
+        if (!strcmp(u->name, name)) {
+            break;
+        }
+    }
+    if (u == NULL) {
+        u = calloc(1, sizeof(upstream));
+        if ((u != NULL) && (maxIdle > 0) &&
+            ((u->idle = calloc(maxIdle, sizeof(int))) == NULL)) {
+            free(u);
+            u = NULL;
+        }
+        if (u != NULL) {
+            strcpy(u->name, name);
+            u->maxIdle = maxIdle;
+            pthread_mutex_init(&u->lock, NULL);
+            u->next = upstreams;
+            upstreams = u;
+        }
+    }
+    if ((u != NULL) && !u->resolved && (upstreamResolve(u) != SUCCESS)) {
+        u = NULL;
+    }
+    pthread_mutex_unlock(&upstreamsLock);
+    return u;
+}
+
+/**
+ * upstreamConnect : returns a connection to the upstream, an idle one
+ * from the pool if there is a usable one.
+ */
+static int upstreamConnect(upstream *u, int timeout, int *reused)
+{
+    struct timeval tv;
+    int optval = 1;
+    char probe;
+    int fd;
+
+    pthread_mutex_lock(&u->lock);
+    while (u->numIdle > 0) {
+        fd = u->idle[--u->numIdle];
+        pthread_mutex_unlock(&u->lock);
+
+        /* Readable while idle means the upstream closed it (or worse) */
+        if ((recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT) < 0) &&
+            ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        pthread_mutex_lock(&u->lock);
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    *reused = 0;
+    if ((fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        error_log("socket() error: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Bounds connect(), every recv() and every send() on the upstream */
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *) &u->addr, u->addrLen) < 0) {
+        error_log("connect() to upstream %s error: %s",
+                  u->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (u->addr.ss_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+    return fd;
+}
+
+static void upstreamRelease(upstream *u, int fd, int reusable)
+{
+    pthread_mutex_lock(&u->lock);
+    if (reusable && (u->numIdle < u->maxIdle)) {
+        u->idle[u->numIdle++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/**
+ * spliceCopy : moves len bytes (or everything up to EOF if untilEof)
+ * from one socket to another through a pipe, without copying them
+ * through user space.
+ * return: bytes moved, *complete set if all of them were
+ */
+static size_t spliceCopy(int from, int to, size_t len, int untilEof,
+                         int *complete)
+{
+    int pipefd[2];
+    size_t moved = 0;
+    size_t want;
+    ssize_t n, m;
+
+    *complete = 0;
+    if (!untilEof && (len == 0)) {
+        *complete = 1;
+        return 0;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        error_log("pipe2() error: %s", strerror(errno));
+        return 0;
+    }
+
+    while (untilEof || (moved < len)) {
+        want = untilEof ? PROXY_SPLICE_CHUNK :
+               ((len - moved < PROXY_SPLICE_CHUNK) ? len - moved :
+                PROXY_SPLICE_CHUNK);
+        traceCall(TRACE_CALL_RECV);
+        n = splice(from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n == 0) {
+            *complete = untilEof;
+            break;
+        }
+        if (n < 0) {
+            break;
+        }
+        while (n > 0) {
+            traceCall(TRACE_CALL_SEND);
+            m = splice(pipefd[0], NULL, to, NULL, n, SPLICE_F_MOVE);
+            if ((m < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (m <= 0) {
+                goto out;
+            }
+            n -= m;
+            moved += m;
+        }
+    }
+    if (!untilEof && (moved == len)) {
+        *complete = 1;
+    }
+
+out:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return moved;
+}
+
+static size_t proxyError(int client_sock, int code, int method)
+{
+    char buf[MAX_BUF_SIZE + 1];
+    bufStruct response;
+    size_t sent = 0;
+
+    respInit(&response, buf, sizeof(buf));
+    serveError(code, &response, method);
+    traceStatus(code);
+
+    if (sendAll(client_sock, response.buffer, response.bufSize) == SUCCESS) {
+        sent += response.bufSize;
+        if ((response.entitySize != 0) &&
+            (sendAll(client_sock, response.entityBuffer,
+                     response.entitySize) == SUCCESS)) {
+            sent += response.entitySize;
+        }
+    }
+    respEntityFree(&response);
+    return sent;
+}
+
+static size_t proxyServeCached(int client_sock, cacheEntry *e, int isHead)
+{
+    char age[64];
+    int ageLen;
+    size_t sent = 0;
+
+    traceStatus(atoi(e->head + 9));
+    ageLen = snprintf(age, sizeof(age), "Age: %ld\r\n\r\n",
+                      (long) (time(NULL) - e->stored));
+    if ((sendAll(client_sock, e->head, e->headLen) == SUCCESS) &&
+        (sendAll(client_sock, age, ageLen) == SUCCESS)) {
+        sent = e->headLen + ageLen;
+        if (!isHead &&
+            (sendAll(client_sock, e->body, e->bodyLen) == SUCCESS)) {
+            sent += e->bodyLen;
+        }
+    }
+    return sent;
+}
+
+/**
+*proxyMatch : finds the route with the longest prefix matching the
+*request URI.
+*return:
+*       NULL : request is not proxied
+*/
+const proxyRoute *proxyMatch(const serverConfig *cfg, const char *request,
+                             int length)
+{
+    const proxyRoute *match = NULL;
+    const char *target, *end;
+    size_t targetLen, prefixLen, best = 0;
+    int i;
+
+    if (cfg->numProxies == 0) {
+        return NULL;
+    }
+    if ((target = memchr(request, ' ', length)) == NULL) {
+        return NULL;
+    }
+    target++;
+    if ((end = memchr(target, ' ', length - (target - request))) == NULL) {
+        return NULL;
+    }
+    targetLen = end - target;
+
+    for (i = 0; i < cfg->numProxies; i++) {
+        prefixLen = strlen(cfg->proxies[i].prefix);
+        if ((prefixLen <= targetLen) && (prefixLen > best) &&
+            !memcmp(target, cfg->proxies[i].prefix, prefixLen)) {
+            match = &cfg->proxies[i];
+            best = prefixLen;
+        }
+    }
+    return match;
+}
+
+/**
+*proxyServe : forwards a request to the upstream of route and streams
+*the response back to the client.
+*args:
+*       client_sock: client connection
+*       route: matching route from proxyMatch
+*       request: received request, possibly with the start of its body
+*       length: bytes in request
+*return:
+*       bytes sent to the client
+*/
+size_t proxyServe(int client_sock, const proxyRoute *route, char *request,
+                  int length, const serverConfig *cfg)
+{
+    const char *pos, *lineEnd, *target, *version, *statusLine, *query;
+    char key[PROXY_MAX_UPSTREAM + MAX_BUF_SIZE];
+    char canonical[MAX_BUF_SIZE];
+    char *fwd = NULL, *resp = NULL, *head = NULL, *body = NULL;
+    size_t fwdLen = 0, headLen = 0, sent = 0;
+    size_t methodLen, targetLen;
+    long reqBody = 0, bodyLen = -1, maxAge = 0;
+    int headerEnd, respEnd, got, n, attempt, code, complete;
+    int isGet, isHead, cacheOk, reused = 0, timedOut = 0, fd = -1;
+    int keepAlive, closeHdr = 0, keepAliveHdr = 0, chunked = 0;
+    int authorized = 0, personal = 0;
+    upstream *u;
+    cacheEntry *e;
+    header h;
+
+    if (((headerEnd = findHeaderEnd(request, length)) < 0) ||
+        ((lineEnd = memmem(request, length, "\r\n", 2)) == NULL) ||
+        ((target = memchr(request, ' ', lineEnd - request)) == NULL) ||
+        ((version = memchr(target + 1, ' ', lineEnd - target - 1)) == NULL)) {
+        return proxyError(client_sock, 400, GET);
+    }
+    methodLen = target - request;
+    target++;
+    targetLen = version - target;
+    version++;
+    isGet = (methodLen == 3) && !memcmp(request, "GET", 3);
+    isHead = (methodLen == 4) && !memcmp(request, "HEAD", 4);
+
+    if ((lineEnd - version != 8) || memcmp(version, "HTTP/1.", 7)) {
+        return proxyError(client_sock, 505, isHead ? HEAD : GET);
+    }
+
+    /*
+     * Requests carrying credentials or asking to revalidate are not
+     * served from the cache; the response to the former may still be
+     * kept for others, see cacheMaxAge
+     */
+    cacheOk = (isGet || isHead) && (cfg->proxyCacheSize > 0);
+    pos = lineEnd + 2;
+    while (nextHeader(&pos, request + headerEnd, &h)) {
+        if (headerIs(&h, "Authorization")) {
+            authorized = 1;
+        } else if (headerIs(&h, "Cache-Control") &&
+                   (valueFind(&h, "no-cache") || valueFind(&h, "no-store"))) {
+            cacheOk = 0;
+        } else if (headerIs(&h, "Content-Length")) {
+            reqBody = atol(h.value);
+        } else if (headerIs(&h, "Transfer-Encoding")) {
+            /* Chunked request bodies are not supported */
+            return proxyError(client_sock, 400, isHead ? HEAD : GET);
+        }
+    }
+
+    if ((uriNormalize(target, targetLen, canonical, sizeof(canonical),
+                      &query) != SUCCESS) ||
+        (snprintf(key, sizeof(key), "%s %s%.*s", route->upstream, canonical,
+                  query ? (int) (version - 1 - query) : 0,
+                  query ? query : "") >= (int) sizeof(key))) {
+        cacheOk = 0;
+    }
+    if (cacheOk && !authorized && ((e = cacheLookup(key)) != NULL)) {
+        debug_log("Proxy cache hit for %s", key);
+        sent = proxyServeCached(client_sock, e, isHead);
+        cachePut(e);
+        return sent;
+    }
+
+    if ((u = upstreamGet(route->upstream, cfg->proxyIdle)) == NULL) {
+        return proxyError(client_sock, 502, isHead ? HEAD : GET);
+    }
+
+    /*
+     * Request line with the version lowered to HTTP/1.0, end to end
+     * headers, our own Connection header and whatever part of the body
+     * was read along with the headers.
+     */
+    fwd = malloc(length + 64);
+    resp = malloc(cfg->maxBufSize + 1);
+    if ((fwd == NULL) || (resp == NULL)) {
+        free(fwd);
+        free(resp);
+        return proxyError(client_sock, 500, isHead ? HEAD : GET);
+    }
+    memcpy(fwd, request, version - request);
+    fwdLen = version - request;
+    memcpy(fwd + fwdLen, "HTTP/1.0\r\n", 10);
+    fwdLen += 10;
+    pos = lineEnd + 2;
+    while (nextHeader(&pos, request + headerEnd, &h)) {
+        if (!isHopHeader(&h)) {
+            memcpy(fwd + fwdLen, h.line, h.lineLen);
+            fwdLen += h.lineLen;
+        }
+    }
+    memcpy(fwd + fwdLen, "Connection: keep-alive\r\n\r\n", 26);
+    fwdLen += 26;
+    memcpy(fwd + fwdLen, request + headerEnd, length - headerEnd);
+    fwdLen += length - headerEnd;
+    reqBody -= length - headerEnd;
+    if (reqBody < 0) {
+        reqBody = 0;
+    }
+
+    /*
+     * A pooled connection may have been closed by the upstream just as
+     * we picked it up. Retry once on a fresh connection if nothing came
+     * back and the request can safely be sent again.
+     */
+    for (attempt = 0; attempt < 2; attempt++) {
+        got = 0;
+        respEnd = -1;
+        complete = 0;
+        if ((fd = upstreamConnect(u, cfg->proxyTimeout, &reused)) < 0) {
+            break;
+        }
+        traceMark(TRACE_OPEN);
+        if (sendAll(fd, fwd, fwdLen) == SUCCESS) {
+            spliceCopy(client_sock, fd, reqBody, 0, &complete);
+        }
+        if (complete) {
+            while ((got < cfg->maxBufSize) && (respEnd < 0)) {
+                traceCall(TRACE_CALL_RECV);
+                n = recv(fd, resp + got, cfg->maxBufSize - got, 0);
+                if ((n < 0) && (errno == EINTR)) {
+                    continue;
+                }
+                if (n <= 0) {
+                    timedOut = (n < 0) &&
+                               ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+                    break;
+                }
+                got += n;
+                respEnd = findHeaderEnd(resp, got);
+            }
+        }
+        if ((respEnd >= 0) || (got > 0) || !reused ||
+            (reqBody > 0) || !(isGet || isHead)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    free(fwd);
+    traceMark(TRACE_READ);
+
+    if (respEnd < 0) {
+        code = timedOut ? 504 : 502;
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(resp);
+        return proxyError(client_sock, code, isHead ? HEAD : GET);
+    }
+    resp[got] = '\0';
+
+    if ((got < 12) || memcmp(resp, "HTTP/1.", 7)) {
+        close(fd);
+        free(resp);
+        return proxyError(client_sock, 502, isHead ? HEAD : GET);
+    }
+    code = atoi(resp + 9);
+    traceStatus(code);
+    statusLine = memmem(resp, respEnd, "\r\n", 2);
+
+    /* Status line as HTTP/1.0, end to end headers, Connection: close */
+    head = malloc(respEnd + 32);
+    if (head == NULL) {
+        close(fd);
+        free(resp);
+        return proxyError(client_sock, 500, isHead ? HEAD : GET);
+    }
+    memcpy(head, "HTTP/1.0", 8);
+    memcpy(head + 8, resp + 8, statusLine + 2 - (resp + 8));
+    headLen = statusLine + 2 - resp;
+    pos = statusLine + 2;
+    while (nextHeader(&pos, resp + respEnd, &h)) {
+        if (headerIs(&h, "Content-Length")) {
+            bodyLen = atol(h.value);
+        } else if (headerIs(&h, "Connection")) {
+            closeHdr = (valueFind(&h, "close") != NULL);
+            keepAliveHdr = (valueFind(&h, "keep-alive") != NULL);
+        } else if (headerIs(&h, "Transfer-Encoding")) {
+            chunked = 1;
+        } else if (headerIs(&h, "Cache-Control")) {
+            maxAge = cacheMaxAge(&h, authorized);
+        } else if (headerIs(&h, "Set-Cookie") || headerIs(&h, "Vary")) {
+            /* Meant for this client only, or for requests like it */
+            personal = 1;
+        }
+        if (!isHopHeader(&h)) {
+            memcpy(head + headLen, h.line, h.lineLen);
+            headLen += h.lineLen;
+        }
+    }
+    memcpy(head + headLen, connectionClose, strlen(connectionClose));
+    headLen += strlen(connectionClose);
+
+    keepAlive = !closeHdr && !chunked &&
+                ((resp[7] == '1') || keepAliveHdr);
+    if (isHead || (code < 200) || (code == 204) || (code == 304)) {
+        bodyLen = 0;
+    }
+    if (bodyLen < 0) {
+        keepAlive = 0;
+    }
+    n = got - respEnd;
+    if ((bodyLen >= 0) && (n > bodyLen)) {
+        /* More than the body arrived; the connection is out of sync */
+        keepAlive = 0;
+        n = bodyLen;
+    }
+
+    cacheOk = cacheOk && isGet && (code == 200) && (maxAge > 0) &&
+              !personal && (bodyLen >= 0) &&
+              (headLen + bodyLen <= (size_t) cfg->proxyCacheMaxObject);
+
+    /* Over the memory budget the response is passed on, not kept */
+    if (cacheOk && (memReserve(MEM_CACHE, bodyLen) == SUCCESS) &&
+        ((body = malloc(bodyLen ? bodyLen : 1)) == NULL)) {
+        memRelease(MEM_CACHE, bodyLen);
+    }
+    if (body != NULL) {
+        /* Small and cacheable: read it whole, then send and keep it */
+        memcpy(body, resp + respEnd, n);
+        while (n < bodyLen) {
+            traceCall(TRACE_CALL_RECV);
+            got = recv(fd, body + n, bodyLen - n, 0);
+            if ((got < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (got <= 0) {
+                break;
+            }
+            n += got;
+        }
+        complete = (n == bodyLen);
+        if ((sendAll(client_sock, head, headLen) == SUCCESS) &&
+            (sendAll(client_sock, "\r\n", 2) == SUCCESS) &&
+            (sendAll(client_sock, body, n) == SUCCESS)) {
+            sent = headLen + 2 + n;
+        }
+        if (complete) {
+            cacheInsert(key, head, headLen, body, bodyLen, maxAge, cfg);
+        } else {
+            free(body);
+            memRelease(MEM_CACHE, bodyLen);
+        }
+    } else {
+        complete = 0;
+        if ((sendAll(client_sock, head, headLen) == SUCCESS) &&
+            (sendAll(client_sock, "\r\n", 2) == SUCCESS) &&
+            (sendAll(client_sock, resp + respEnd, n) == SUCCESS)) {
+            sent = headLen + 2 + n;
+            sent += spliceCopy(fd, client_sock,
+                               (bodyLen < 0) ? 0 : bodyLen - n,
+                               bodyLen < 0, &complete);
+        }
+    }
+
+    upstreamRelease(u, fd, keepAlive && complete);
+    free(head);
+    free(resp);
+    return sent;
+}
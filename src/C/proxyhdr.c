@@ -0,0 +1,167 @@
+/**
+ * @file    proxyhdr.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief The PROXY protocol header a load balancer puts in front of
+ * each connection on a "proxy_protocol" listener, carrying the address
+ * of the client it accepted. Both the text form (v1) and the binary
+ * form (v2) are read. The header is mandatory on such a listener, a
+ * connection without one is closed.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <httpparser.h>
+#include <proxyhdr.h>
+
+static const unsigned char v2Signature[12] = {
+    0x0d, 0x0a, 0x0d, 0x0a, 0x00, 0x0d, 0x0a, 0x51, 0x55, 0x49, 0x54, 0x0a
+};
+
+/**
+ * parseV1 : "PROXY TCP4 1.2.3.4 5.6.7.8 1234 80\r\n" or
+ * "PROXY UNKNOWN ...\r\n".
+ */
+static int parseV1(const unsigned char *buf, size_t len,
+                   struct sockaddr_storage *src, int *known)
+{
+    struct sockaddr_in *in4 = (struct sockaddr_in *) src;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) src;
+    char line[PROXYHDR_V1_MAX + 1];
+    char proto[8], srcAddr[INET6_ADDRSTRLEN], dstAddr[INET6_ADDRSTRLEN];
+    const unsigned char *eol;
+    unsigned int srcPort, dstPort;
+    size_t n;
+
+    if (memcmp(buf, "PROXY ", (len < 6) ? len : 6)) {
+        return FAILURE;
+    }
+    eol = memmem(buf, (len < PROXYHDR_V1_MAX) ? len : PROXYHDR_V1_MAX,
+                 "\r\n", 2);
+    if (eol == NULL) {
+        return (len < PROXYHDR_V1_MAX) ? 0 : FAILURE;
+    }
+    n = eol - buf;
+    memcpy(line, buf, n);
+    line[n] = '\0';
+
+    if (!strncmp(line, "PROXY UNKNOWN", 13)) {
+        *known = 0;
+        return n + 2;
+    }
+    if ((sscanf(line, "PROXY %7s %45s %45s %u %u", proto, srcAddr, dstAddr,
+                &srcPort, &dstPort) != 5) ||
+        (srcPort > 65535) || (dstPort > 65535)) {
+        return FAILURE;
+    }
+
+    memset(src, 0, sizeof(*src));
+    if (!strcmp(proto, "TCP4") &&
+        (inet_pton(AF_INET, srcAddr, &in4->sin_addr) == 1)) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(srcPort);
+    } else if (!strcmp(proto, "TCP6") &&
+               (inet_pton(AF_INET6, srcAddr, &in6->sin6_addr) == 1)) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(srcPort);
+    } else {
+        return FAILURE;
+    }
+    *known = 1;
+    return n + 2;
+}
+
+/**
+ * parseV2 : the binary header, a signature, version and command,
+ * address family and the length of the addresses that follow.
+ */
+static int parseV2(const unsigned char *buf, size_t len,
+                   struct sockaddr_storage *src, int *known)
+{
+    struct sockaddr_in *in4 = (struct sockaddr_in *) src;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) src;
+    size_t total;
+
+    if (memcmp(buf, v2Signature, (len < 12) ? len : 12)) {
+        return FAILURE;
+    }
+    if (len < 16) {
+        return 0;
+    }
+    if ((buf[12] & 0xf0) != 0x20) {
+        return FAILURE;
+    }
+    total = 16 + ((buf[14] << 8) | buf[15]);
+    if (total > PROXYHDR_MAX) {
+        return FAILURE;
+    }
+    if (len < total) {
+        return 0;
+    }
+
+    *known = 0;
+    /* LOCAL: health checks of the balancer itself */
+    if ((buf[12] & 0x0f) == 0x00) {
+        return total;
+    }
+    if ((buf[12] & 0x0f) != 0x01) {
+        return FAILURE;
+    }
+
+    switch (buf[13]) {
+    case 0x11:      /* TCP over IPv4 */
+        if (total < 16 + 12) {
+            return FAILURE;
+        }
+        memset(src, 0, sizeof(*src));
+        in4->sin_family = AF_INET;
+        memcpy(&in4->sin_addr, buf + 16, 4);
+        memcpy(&in4->sin_port, buf + 24, 2);
+        *known = 1;
+        break;
+    case 0x21:      /* TCP over IPv6 */
+        if (total < 16 + 36) {
+            return FAILURE;
+        }
+        memset(src, 0, sizeof(*src));
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, buf + 16, 16);
+        memcpy(&in6->sin6_port, buf + 48, 2);
+        *known = 1;
+        break;
+    default:
+        /* UDP, unix or unspecified: the connection keeps its own address */
+        break;
+    }
+    return total;
+}
+
+/**
+*proxyHeaderParse : reads the PROXY header at the start of buf.
+*args:
+*       src: filled with the client address the header carries
+*       known: set to 1 if it carries one, 0 for LOCAL or UNKNOWN
+*return:
+*       length of the header, 0 if more bytes are needed, or FAILURE
+*/
+int proxyHeaderParse(const unsigned char *buf, size_t len,
+                     struct sockaddr_storage *src, int *known)
+{
+    if (len == 0) {
+        return 0;
+    }
+    if (buf[0] == 'P') {
+        return parseV1(buf, len, src, known);
+    }
+    if (buf[0] == v2Signature[0]) {
+        return parseV2(buf, len, src, known);
+    }
+    return FAILURE;
+}
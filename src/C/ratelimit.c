@@ -0,0 +1,332 @@
+/**
+ * @file    ratelimit.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Per client accounting for the accept loop. Every source
+ * address (IPv6 clients by their /64) owns a slot in a fixed, lock
+ * free open addressing table holding its connection counts and a
+ * token bucket. The bucket is kept as a GCRA theoretical arrival
+ * time, a single word updated with compare-and-swap: a client may
+ * send rate_burst requests at once and rate_limit per second after
+ * that.
+ *
+ * Slots are claimed with compare-and-swap on the key and never freed,
+ * only reclaimed once a client has no connections and a full bucket,
+ * i.e. when the slot holds nothing a fresh one would not. The accept
+ * loop and the event loops (for clients named by a PROXY header) look
+ * clients up at the same time. rateLookup returns the slot pinned, and
+ * the caller unpins it once the connection is counted active or
+ * queued. A connection is counted active before it stops being counted
+ * queued, so a slot cannot change owner while any of its connections is
+ * accounted for.
+ *
+ * A new client takes a free slot by compare-and-swap on its key, and a
+ * failed swap looks again, so two threads cannot each claim a slot for
+ * the same client. Slots are never emptied, so a client only takes
+ * over a quiet slot when every slot around its hash is in use.
+ * Takeovers are serialised on takeoverLock, which keeps them from
+ * creating a second slot for a client. The taker marks the key
+ * RATE_KEY_MOVING before it checks the pins, and a pinner counts its
+ * pin before it checks the key again, so one of them always sees the
+ * other.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <ratelimit.h>
+
+/* Key of a slot while it changes owner */
+#define RATE_KEY_MOVING (~0ULL)
+
+static rateClient clients[RATE_TABLE_SIZE];
+static pthread_mutex_t takeoverLock = PTHREAD_MUTEX_INITIALIZER;
+/* Clients with at least one connection being served */
+static int activeClients;
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * v6Bytes : the address as 16 bytes, IPv4 as v4-mapped IPv6.
+ * return: SUCCESS or FAILURE for other families
+ */
+static int v6Bytes(const struct sockaddr *addr, unsigned char *out)
+{
+    if (addr->sa_family == AF_INET) {
+        memset(out, 0, 10);
+        out[10] = out[11] = 0xff;
+        memcpy(out + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+        return SUCCESS;
+    }
+    if (addr->sa_family == AF_INET6) {
+        memcpy(out, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+        return SUCCESS;
+    }
+    return FAILURE;
+}
+
+/**
+ * clientKey : IPv4 clients by address, IPv6 clients by /64, never 0.
+ */
+static uint64_t clientKey(const unsigned char *v6)
+{
+    static const unsigned char mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+    };
+    uint64_t key = 0;
+    int i;
+
+    if (!memcmp(v6, mapped, sizeof(mapped))) {
+        for (i = 12; i < 16; i++) {
+            key = (key << 8) | v6[i];
+        }
+        return (2ULL << 32) | key;
+    }
+    for (i = 0; i < 8; i++) {
+        key = (key << 8) | v6[i];
+    }
+    /* Maps 8000::/64, not a unicast prefix, onto the empty key */
+    key ^= 1ULL << 63;
+    /* and 7fff:ffff:ffff:ffff::/64, unassigned, onto its neighbour */
+    return (key == RATE_KEY_MOVING) ? key - 1 : key;
+}
+
+/**
+ * ratePin : holds c for key until rateUnpin, see the top of the file.
+ * return: SUCCESS, or FAILURE if c went to another client meanwhile
+ */
+static int ratePin(rateClient *c, uint64_t key)
+{
+    __sync_fetch_and_add(&c->pins, 1);
+    if (c->key == key) {
+        return SUCCESS;
+    }
+    __sync_fetch_and_sub(&c->pins, 1);
+    return FAILURE;
+}
+
+/**
+ * rateFind : the slot of key, or the first free one claimed for it,
+ * pinned. NULL if every slot around start belongs to another client.
+ */
+static rateClient *rateFind(uint64_t key, unsigned int start)
+{
+    rateClient *c;
+    uint64_t seen;
+    unsigned int i;
+
+retry:
+    for (i = 0; i < RATE_PROBE; i++) {
+        c = &clients[(start + i) & (RATE_TABLE_SIZE - 1)];
+        seen = c->key;
+        if (seen == RATE_KEY_MOVING) {
+            /* It may be moving to key, wait for the taker to decide */
+            goto retry;
+        }
+        if ((seen == key) ||
+            ((seen == 0) && __sync_bool_compare_and_swap(&c->key, 0, key))) {
+            if (ratePin(c, key) == SUCCESS) {
+                return c;
+            }
+            goto retry;
+        }
+        if (seen == 0) {
+            /* Claimed by someone else just now, perhaps for key */
+            goto retry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * rateTakeOver : gives c, found holding seen, to key if its client has
+ * gone quiet. Called with takeoverLock held.
+ */
+static int rateTakeOver(rateClient *c, uint64_t seen, uint64_t key,
+                        uint64_t now)
+{
+    if ((c->active != 0) || (c->queued != 0) || (c->pins != 0) ||
+        (c->tat > now) ||
+        !__sync_bool_compare_and_swap(&c->key, seen, RATE_KEY_MOVING)) {
+        return FAILURE;
+    }
+    if ((c->pins != 0) || (c->active != 0) || (c->queued != 0) ||
+        (c->tat > now)) {
+        /* Its client came back meanwhile and keeps the slot */
+        __sync_bool_compare_and_swap(&c->key, RATE_KEY_MOVING, seen);
+        return FAILURE;
+    }
+    __sync_fetch_and_add(&c->pins, 1);
+    __sync_bool_compare_and_swap(&c->key, RATE_KEY_MOVING, key);
+    return SUCCESS;
+}
+
+/**
+*rateLookup : finds or claims the slot of the client at addr and pins
+*it, see rateUnpin. Safe to call from any thread.
+*return:
+*       NULL if the table has no room around its hash
+*/
+rateClient *rateLookup(const struct sockaddr *addr)
+{
+    unsigned char v6[16];
+    rateClient *c;
+    uint64_t key, now;
+    unsigned int start, i;
+
+    if (v6Bytes(addr, v6) != SUCCESS) {
+        return NULL;
+    }
+    key = clientKey(v6);
+    start = (unsigned int) ((key * 0x9E3779B97F4A7C15ULL) >> 40);
+
+    /* Existing slot, or the first free one */
+    if ((c = rateFind(key, start)) != NULL) {
+        return c;
+    }
+
+    /* Take over the slot of a client that has gone quiet */
+    pthread_mutex_lock(&takeoverLock);
+    if ((c = rateFind(key, start)) == NULL) {
+        now = nowNs();
+        for (i = 0; i < RATE_PROBE; i++) {
+            c = &clients[(start + i) & (RATE_TABLE_SIZE - 1)];
+            if (rateTakeOver(c, c->key, key, now) == SUCCESS) {
+                break;
+            }
+        }
+        if (i == RATE_PROBE) {
+            c = NULL;
+        }
+    }
+    pthread_mutex_unlock(&takeoverLock);
+
+    if (c == NULL) {
+        error_log("%s", "Client table full, not rate limiting a client");
+    }
+    return c;
+}
+
+/**
+*rateUnpin : lets go of the slot rateLookup returned, once its
+*connection is counted active or queued, or turned away.
+*/
+void rateUnpin(rateClient *client)
+{
+    if (client != NULL) {
+        __sync_fetch_and_sub(&client->pins, 1);
+    }
+}
+
+/**
+*rateAllowListed : whether addr is in one of the rate_allow networks.
+*/
+int rateAllowListed(const serverConfig *cfg, const struct sockaddr *addr)
+{
+    unsigned char v6[16];
+    const allowNet *net;
+    int i, bytes, bits;
+
+    if (v6Bytes(addr, v6) != SUCCESS) {
+        return 0;
+    }
+    for (i = 0; i < cfg->numAllow; i++) {
+        net = &cfg->allow[i];
+        bytes = net->prefixLen / 8;
+        bits = net->prefixLen % 8;
+        if (memcmp(v6, net->addr, bytes)) {
+            continue;
+        }
+        if ((bits == 0) ||
+            !((v6[bytes] ^ net->addr[bytes]) & (0xff << (8 - bits)))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+*rateAdmit : takes a token from the client's bucket.
+*return:
+*       SUCCESS, or FAILURE if the client is over rate_limit
+*/
+int rateAdmit(rateClient *client, const serverConfig *cfg)
+{
+    uint64_t interval, tolerance, now, tat, next;
+
+    if (cfg->rateLimit <= 0) {
+        return SUCCESS;
+    }
+    interval = 1000000000ULL / cfg->rateLimit;
+    tolerance = interval * (cfg->rateBurst - 1);
+    now = nowNs();
+
+    do {
+        tat = client->tat;
+        next = (tat > now) ? tat : now;
+        if (next - now > tolerance) {
+            return FAILURE;
+        }
+    } while (!__sync_bool_compare_and_swap(&client->tat, tat,
+                                           next + interval));
+    return SUCCESS;
+}
+
+/**
+*rateAcquire : counts a connection of client as being served.
+*/
+void rateAcquire(rateClient *client)
+{
+    if ((client != NULL) &&
+        (__sync_fetch_and_add(&client->active, 1) == 0)) {
+        __sync_fetch_and_add(&activeClients, 1);
+    }
+}
+
+/**
+*rateRelease : a connection of client has finished.
+*/
+void rateRelease(rateClient *client)
+{
+    if ((client != NULL) &&
+        (__sync_fetch_and_sub(&client->active, 1) == 1)) {
+        __sync_fetch_and_sub(&activeClients, 1);
+    }
+}
+
+/**
+*rateQueued : adjusts the count of client's connections waiting for a
+*slot by delta.
+*/
+void rateQueued(rateClient *client, int delta)
+{
+    if (client != NULL) {
+        __sync_fetch_and_add(&client->queued, delta);
+    }
+}
+
+/**
+*rateFairShare : connection slots each client is entitled to when the
+*server is full, at least one.
+*/
+int rateFairShare(const serverConfig *cfg)
+{
+    int clientsNow = activeClients;
+    int share;
+
+    share = cfg->connectionLimit / ((clientsNow > 0) ? clientsNow : 1);
+    return (share > 0) ? share : 1;
+}
@@ -0,0 +1,654 @@
+/**
+ * @file   replay.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Replays a traffic capture (see capture.c) against a server and
+ * compares replays of two builds.
+ *
+ *   ./replay [-H host] [-x speed] [-t timeout] [-o results] <capture> <port>
+ *   ./replay -c <results A> <results B>
+ *
+ * Every captured request is sent again on a connection of its own,
+ * opened as long after the first as it was in the capture (divided by
+ * speed), so the arrival times and with them the concurrency of the
+ * captured traffic are reproduced; start times are kept by a timerfd,
+ * not by sleeping. The latency of a request runs from its connect()
+ * to the end of the response. A summary goes to stdout and, with -o,
+ * a line per request to the results file.
+ *
+ * With -c two results files of the same capture, e.g. of the build
+ * before and after a change, are compared request by request: the
+ * latency percentiles of both, those of the per-request difference and
+ * the requests that got slowest.
+ *
+ */
+
+/* Standard includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Includes related to socket programming */
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netdb.h>
+#include <fcntl.h>
+
+/* Local includes from ./inc */
+#include <log.h>
+#include <capture.h>
+
+/* Events taken from epoll per wakeup */
+#define REPLAY_EVENTS 256
+/* Bytes of the request line kept for the report */
+#define REPLAY_LINE 120
+/* Starts this much behind schedule are reported as late */
+#define REPLAY_LATE_NS 1000000ULL
+/* Requests listed as the biggest regressions */
+#define REPLAY_TOP 10
+
+/* A captured request and what replaying it gave */
+typedef struct replayReq {
+    captureRecord rec;
+    const char *request;
+    char line[REPLAY_LINE];
+    uint64_t dueNs;         /* from the start of the replay */
+    uint64_t lateNs;
+    uint64_t startNs;
+    uint64_t firstNs;       /* first byte of the response */
+    uint64_t endNs;
+    uint64_t bytes;
+    size_t sent;
+    int fd;
+    int status;             /* -1 if the connection failed */
+    char head[16];          /* start of the status line */
+    int headLen;
+} replayReq;
+
+static uint64_t monoNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int byArrival(const void *a, const void *b)
+{
+    const replayReq *x = a, *y = b;
+
+    return (x->rec.arrivalNs > y->rec.arrivalNs) -
+           (x->rec.arrivalNs < y->rec.arrivalNs);
+}
+
+static int byValue(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * percentile : the p-th percentile of the n values, sorted in place.
+ */
+static double percentile(double *values, size_t n, double p)
+{
+    if (n == 0) {
+        return 0;
+    }
+    return values[(size_t) ((n - 1) * p / 100 + 0.5)];
+}
+
+/**
+ * loadCapture : maps the capture file and lists its requests in order of
+ * arrival. Records without request bytes, connections that sent none,
+ * cannot be replayed and are only counted.
+ * return: the number of requests, -1 if the file is not a capture
+ */
+static long loadCapture(const char *file, replayReq **reqs, long *skipped)
+{
+    const char *map, *pos, *end, *eol;
+    captureRecord rec;
+    struct stat st;
+    replayReq *r;
+    long n = 0, cap = 1024;
+    size_t len;
+    int fd;
+
+    *skipped = 0;
+    if (((fd = open(file, O_RDONLY)) < 0) || (fstat(fd, &st) < 0)) {
+        error_log("Unable to open %s: %s", file, strerror(errno));
+        return -1;
+    }
+    if ((st.st_size < CAPTURE_MAGIC_LEN) ||
+        ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+         MAP_FAILED) || memcmp(map, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+        error_log("%s is not a capture", file);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if ((*reqs = malloc(cap * sizeof(replayReq))) == NULL) {
+        return -1;
+    }
+
+    end = map + st.st_size;
+    /* Records follow each other unaligned, they are copied out */
+    for (pos = map + CAPTURE_MAGIC_LEN;
+         pos + sizeof(captureRecord) <= end;
+         pos += sizeof(captureRecord) + rec.length) {
+        memcpy(&rec, pos, sizeof(rec));
+        if (pos + sizeof(captureRecord) + rec.length > end) {
+            error_log("%s ends in a partial record", file);
+            break;
+        }
+        if (rec.length == 0) {
+            (*skipped)++;
+            continue;
+        }
+        if (n == cap) {
+            if ((r = realloc(*reqs, 2 * cap * sizeof(replayReq))) == NULL) {
+                return -1;
+            }
+            *reqs = r;
+            cap *= 2;
+        }
+        r = &(*reqs)[n++];
+        memset(r, 0, sizeof(*r));
+        r->rec = rec;
+        r->request = pos + sizeof(captureRecord);
+        r->fd = -1;
+        eol = memchr(r->request, '\r', rec.length);
+        len = (eol != NULL) ? (size_t) (eol - r->request) : rec.length;
+        if (len >= REPLAY_LINE) {
+            len = REPLAY_LINE - 1;
+        }
+        memcpy(r->line, r->request, len);
+        r->line[len] = '\0';
+    }
+
+    qsort(*reqs, n, sizeof(replayReq), byArrival);
+    for (r = *reqs; r < *reqs + n; r++) {
+        r->dueNs = r->rec.arrivalNs - (*reqs)[0].rec.arrivalNs;
+    }
+    return n;
+}
+
+/**
+ * captureConcurrency : the most captured connections open at once.
+ */
+static int captureConcurrency(const replayReq *reqs, long n)
+{
+    double *ends = malloc((n + 1) * sizeof(double));
+    int open = 0, peak = 0;
+    long i, done = 0;
+
+    if (ends == NULL) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        ends[i] = (double) reqs[i].rec.arrivalNs + reqs[i].rec.durationNs;
+    }
+    qsort(ends, n, sizeof(double), byValue);
+    for (i = 0; i < n; i++) {
+        while ((done < n) && (ends[done] <= reqs[i].rec.arrivalNs)) {
+            done++;
+            open--;
+        }
+        if (++open > peak) {
+            peak = open;
+        }
+    }
+    free(ends);
+    return peak;
+}
+
+/**
+ * replayStart : opens the connection of r, the request goes out once
+ * it is connected.
+ */
+static void replayStart(int epfd, replayReq *r, const struct addrinfo *ai)
+{
+    struct epoll_event ev;
+
+    r->startNs = monoNow();
+    r->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                   ai->ai_protocol);
+    if ((r->fd < 0) ||
+        ((connect(r->fd, ai->ai_addr, ai->ai_addrlen) < 0) &&
+         (errno != EINPROGRESS))) {
+        r->status = -1;
+        r->endNs = monoNow();
+        if (r->fd >= 0) {
+            close(r->fd);
+        }
+        r->fd = -1;
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = r;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, r->fd, &ev);
+}
+
+/**
+ * replayFinish : closes the connection of r, status -1 if it failed.
+ */
+static void replayFinish(replayReq *r, int failed)
+{
+    r->endNs = monoNow();
+    if (failed) {
+        r->status = -1;
+    } else if ((r->headLen > 9) && !memcmp(r->head, "HTTP/", 5)) {
+        r->status = atoi(r->head + 9);
+    }
+    close(r->fd);
+    r->fd = -1;
+}
+
+/**
+ * replayEvent : moves r along once its socket is ready.
+ * return: 1 once r is done, 0 otherwise
+ */
+static int replayEvent(int epfd, replayReq *r)
+{
+    struct epoll_event ev;
+    char buf[65536];
+    ssize_t ret;
+    int len;
+
+    while (r->sent < r->rec.length) {
+        ret = send(r->fd, r->request + r->sent, r->rec.length - r->sent,
+                   MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            replayFinish(r, 1);
+            return 1;
+        }
+        r->sent += ret;
+        if (r->sent == r->rec.length) {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = r;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, r->fd, &ev);
+            return 0;
+        }
+    }
+
+    for (;;) {
+        ret = recv(r->fd, buf, sizeof(buf), 0);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+            replayFinish(r, 1);
+            return 1;
+        }
+        if (ret == 0) {
+            replayFinish(r, r->bytes == 0);
+            return 1;
+        }
+        if (r->bytes == 0) {
+            r->firstNs = monoNow();
+        }
+        if (r->headLen < (int) sizeof(r->head) - 1) {
+            len = sizeof(r->head) - 1 - r->headLen;
+            if (len > ret) {
+                len = ret;
+            }
+            memcpy(r->head + r->headLen, buf, len);
+            r->headLen += len;
+        }
+        r->bytes += ret;
+    }
+}
+
+/**
+ * replayRun : sends the requests on schedule until all are answered or
+ * timed out.
+ * return: the most connections open at once
+ */
+static int replayRun(replayReq *reqs, long n, const struct addrinfo *ai,
+                     double speed, int timeout)
+{
+    struct epoll_event ev, events[REPLAY_EVENTS];
+    struct itimerspec when;
+    replayReq *r;
+    uint64_t base, now, due, expired, lastCheck = 0;
+    long next = 0, i, done = 0;
+    int epfd, tfd, ready, open = 0, peak = 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ((epfd < 0) || (tfd < 0)) {
+        error_log("Unable to set up the replay: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    base = monoNow();
+    while (done < n) {
+        /* Start everything due, then sleep until the next one is */
+        now = monoNow();
+        while ((next < n) &&
+               ((due = base + reqs[next].dueNs / speed) <= now)) {
+            reqs[next].lateNs = now - due;
+            replayStart(epfd, &reqs[next], ai);
+            if (reqs[next].fd < 0) {
+                done++;
+            } else if (++open > peak) {
+                peak = open;
+            }
+            next++;
+        }
+        if (next < n) {
+            memset(&when, 0, sizeof(when));
+            due = base + reqs[next].dueNs / speed;
+            when.it_value.tv_sec = due / 1000000000ULL;
+            when.it_value.tv_nsec = due % 1000000000ULL;
+            timerfd_settime(tfd, TFD_TIMER_ABSTIME, &when, NULL);
+        }
+
+        ready = epoll_wait(epfd, events, REPLAY_EVENTS, 1000);
+        for (i = 0; i < ready; i++) {
+            r = events[i].data.ptr;
+            if (r == NULL) {
+                if (read(tfd, &expired, sizeof(expired)) < 0) {
+                    continue;
+                }
+            } else if (replayEvent(epfd, r)) {
+                open--;
+                done++;
+            }
+        }
+
+        /* Once a second, give up on requests past the timeout */
+        now = monoNow();
+        if (now - lastCheck >= 1000000000ULL) {
+            lastCheck = now;
+            for (i = 0; i < next; i++) {
+                if ((reqs[i].fd >= 0) &&
+                    (now - reqs[i].startNs > timeout * 1000000000ULL)) {
+                    replayFinish(&reqs[i], 1);
+                    open--;
+                    done++;
+                }
+            }
+        }
+    }
+    close(tfd);
+    close(epfd);
+    return peak;
+}
+
+/**
+ * replayReport : prints the summary of the replay and writes the
+ * results file, if any.
+ */
+static void replayReport(const replayReq *reqs, long n, long skipped,
+                         int capturePeak, int replayPeak, const char *out)
+{
+    double *lat = malloc((n + 1) * sizeof(double));
+    double *orig = malloc((n + 1) * sizeof(double));
+    long i, errors = 0, differ = 0, late = 0;
+    uint64_t maxLate = 0;
+    FILE *fp = NULL;
+
+    if ((lat == NULL) || (orig == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    if ((out != NULL) && ((fp = fopen(out, "w")) == NULL)) {
+        error_log("Unable to write %s: %s", out, strerror(errno));
+    }
+    if (fp != NULL) {
+        fprintf(fp, "# seq conn status bytes latency_us ttfb_us late_us "
+                "capture_status capture_bytes capture_us request\n");
+    }
+
+    for (i = 0; i < n; i++) {
+        lat[i] = (reqs[i].endNs - reqs[i].startNs) / 1000.0;
+        orig[i] = reqs[i].rec.durationNs / 1000.0;
+        errors += (reqs[i].status < 0);
+        differ += (reqs[i].status != (int) reqs[i].rec.status);
+        late += (reqs[i].lateNs > REPLAY_LATE_NS);
+        if (reqs[i].lateNs > maxLate) {
+            maxLate = reqs[i].lateNs;
+        }
+        if (fp != NULL) {
+            fprintf(fp, "%ld %llu %d %llu %.1f %.1f %.1f %u %llu %.1f %s\n",
+                    i, (unsigned long long) reqs[i].rec.conn,
+                    reqs[i].status, (unsigned long long) reqs[i].bytes,
+                    lat[i], reqs[i].firstNs ?
+                    (reqs[i].firstNs - reqs[i].startNs) / 1000.0 : 0.0,
+                    reqs[i].lateNs / 1000.0, reqs[i].rec.status,
+                    (unsigned long long) reqs[i].rec.bytes, orig[i],
+                    reqs[i].line);
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    qsort(lat, n, sizeof(double), byValue);
+    qsort(orig, n, sizeof(double), byValue);
+    printf("requests      %ld replayed, %ld without a request skipped\n",
+           n, skipped);
+    printf("failed        %ld, status other than captured %ld\n",
+           errors, differ);
+    printf("concurrency   %d captured, %d replayed\n",
+           capturePeak, replayPeak);
+    printf("late starts   %ld over %llu ms, at most %.3f ms\n", late,
+           REPLAY_LATE_NS / 1000000ULL, maxLate / 1e6);
+    printf("latency us    %10s %10s %10s %10s\n", "p50", "p90", "p99", "max");
+    printf("  captured    %10.1f %10.1f %10.1f %10.1f\n",
+           percentile(orig, n, 50), percentile(orig, n, 90),
+           percentile(orig, n, 99), percentile(orig, n, 100));
+    printf("  replayed    %10.1f %10.1f %10.1f %10.1f\n",
+           percentile(lat, n, 50), percentile(lat, n, 90),
+           percentile(lat, n, 99), percentile(lat, n, 100));
+    free(lat);
+    free(orig);
+}
+
+/* A request of a results file */
+typedef struct resultLine {
+    long seq;
+    int status;
+    double latency;
+    char request[REPLAY_LINE];
+} resultLine;
+
+/**
+ * loadResults : reads a results file written with -o.
+ * return: the number of requests, -1 if it cannot be read
+ */
+static long loadResults(const char *file, resultLine **lines)
+{
+    char buf[512];
+    resultLine *r;
+    long n = 0, cap = 1024;
+    int used;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        error_log("Unable to open %s: %s", file, strerror(errno));
+        return -1;
+    }
+    if ((*lines = malloc(cap * sizeof(resultLine))) == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        if (buf[0] == '#') {
+            continue;
+        }
+        if (n == cap) {
+            if ((r = realloc(*lines, (cap *= 2) * sizeof(resultLine))) ==
+                NULL) {
+                fclose(fp);
+                return -1;
+            }
+            *lines = r;
+        }
+        r = &(*lines)[n];
+        if (sscanf(buf, "%ld %*u %d %*u %lf %*f %*f %*u %*u %*f %n",
+                   &r->seq, &r->status, &r->latency, &used) < 3) {
+            continue;
+        }
+        snprintf(r->request, sizeof(r->request), "%s", buf + used);
+        r->request[strcspn(r->request, "\n")] = '\0';
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+static int byDiff(const void *a, const void *b)
+{
+    const double *x = *(const double * const *) a;
+    const double *y = *(const double * const *) b;
+
+    return (*x < *y) - (*x > *y);
+}
+
+/**
+ * replayCompare : compares the results of two replays of one capture,
+ * request by request.
+ */
+static int replayCompare(const char *fileA, const char *fileB)
+{
+    resultLine *a, *b;
+    double *latA, *latB, *diff, **slowest;
+    long nA, nB, n, i, statusDiffer = 0;
+
+    if (((nA = loadResults(fileA, &a)) < 0) ||
+        ((nB = loadResults(fileB, &b)) < 0)) {
+        return EXIT_FAILURE;
+    }
+    n = (nA < nB) ? nA : nB;
+    if (nA != nB) {
+        error_log("%s has %ld requests, %s %ld: comparing the first %ld",
+                  fileA, nA, fileB, nB, n);
+    }
+    latA = malloc((n + 1) * sizeof(double));
+    latB = malloc((n + 1) * sizeof(double));
+    diff = malloc((n + 1) * sizeof(double));
+    slowest = malloc((n + 1) * sizeof(double *));
+    if ((latA == NULL) || (latB == NULL) || (diff == NULL) ||
+        (slowest == NULL)) {
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < n; i++) {
+        if ((a[i].seq != b[i].seq) || strcmp(a[i].request, b[i].request)) {
+            error_log("Request %ld differs, not replays of one capture", i);
+            return EXIT_FAILURE;
+        }
+        latA[i] = a[i].latency;
+        latB[i] = b[i].latency;
+        diff[i] = b[i].latency - a[i].latency;
+        slowest[i] = &diff[i];
+        statusDiffer += (a[i].status != b[i].status);
+    }
+
+    /* Before diff is sorted, slowest points into it by request */
+    qsort(slowest, n, sizeof(double *), byDiff);
+    printf("requests      %ld, status differs in %ld\n", n, statusDiffer);
+    printf("biggest regressions, us:\n");
+    for (i = 0; (i < n) && (i < REPLAY_TOP) && (*slowest[i] > 0); i++) {
+        printf("  %+10.1f  %10.1f -> %-10.1f %s\n", *slowest[i],
+               a[slowest[i] - diff].latency, b[slowest[i] - diff].latency,
+               a[slowest[i] - diff].request);
+    }
+
+    qsort(latA, n, sizeof(double), byValue);
+    qsort(latB, n, sizeof(double), byValue);
+    qsort(diff, n, sizeof(double), byValue);
+    printf("latency us    %10s %10s %10s %10s\n", "p50", "p90", "p99", "max");
+    printf("  A           %10.1f %10.1f %10.1f %10.1f\n",
+           percentile(latA, n, 50), percentile(latA, n, 90),
+           percentile(latA, n, 99), percentile(latA, n, 100));
+    printf("  B           %10.1f %10.1f %10.1f %10.1f\n",
+           percentile(latB, n, 50), percentile(latB, n, 90),
+           percentile(latB, n, 99), percentile(latB, n, 100));
+    printf("  B - A       %10.1f %10.1f %10.1f %10.1f\n",
+           percentile(diff, n, 50), percentile(diff, n, 90),
+           percentile(diff, n, 99), percentile(diff, n, 100));
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "127.0.0.1", *out = NULL;
+    struct addrinfo hints, *ai;
+    replayReq *reqs;
+    double speed = 1;
+    long n, skipped;
+    int opt, timeout = 30, compare = 0, peak, status;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((opt = getopt(argc, argv, "H:x:t:o:c")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'c':
+            compare = 1;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if ((argc - optind != 2) || (speed <= 0) || (timeout <= 0)) {
+        error_log("%s", "Incorrect arguments provided\n"
+                  "usage: ./replay [-H host] [-x speed] [-t timeout] "
+                  "[-o results] <capture> <port>\n"
+                  "       ./replay -c <results A> <results B>");
+        exit(EXIT_FAILURE);
+    }
+    if (compare) {
+        return replayCompare(argv[optind], argv[optind + 1]);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((status = getaddrinfo(host, argv[optind + 1], &hints, &ai)) != 0) {
+        error_log("getaddrinfo error: %s", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+    if ((n = loadCapture(argv[optind], &reqs, &skipped)) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    peak = replayRun(reqs, n, ai, speed, timeout);
+    replayReport(reqs, n, skipped, captureConcurrency(reqs, n), peak, out);
+    freeaddrinfo(ai);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file    response.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Bounded builder for response headers. bufStruct tracks the
+ * length and capacity of its buffer, every append is a single memcpy
+ * after a bounds check and the buffer always stays NUL terminated.
+ * An append that does not fit marks the response as overflowed and
+ * leaves the buffer as it was; every later append fails too, so a
+ * sequence of appends needs a single respFailed() check at its end.
+ *
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <httpparser.h>
+#include <response.h>
+#include <flight.h>
+#include <memgov.h>
+
+static const char weekDays[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* The Date value only changes once a second, format it once per thread */
+static __thread time_t dateCachedAt = -1;
+static __thread char dateCached[RESP_DATE_LEN + 1];
+
+/**
+*respInit : starts an empty response in buf.
+*args:
+*       cap: size of buf in bytes, including the terminating NUL
+*/
+void respInit(bufStruct *response, char *buf, int cap)
+{
+    response->buffer = buf;
+    response->bufSize = 0;
+    response->bufCap = cap;
+    response->overflow = (buf == NULL) || (cap < 1);
+    response->entityBuffer = NULL;
+    response->entitySize = 0;
+    response->entityFile = NULL;
+    response->entityRead = 0;
+    response->entityShared = NULL;
+    response->entityRelease = NULL;
+    response->entityReleaseArg = NULL;
+    response->entityReserved = 0;
+    response->streamLeft = 0;
+    response->hintsLen = 0;
+    if (!response->overflow) {
+        buf[0] = '\0';
+    }
+}
+
+/**
+*respEntityFree : frees the entity of the response, drops its
+*reference if it is a file shared with other requests, or hands it back
+*to the handler that lent it.
+*/
+void respEntityFree(bufStruct *response)
+{
+    if (response->entityShared != NULL) {
+        sharedRelease(response->entityShared);
+    } else if (response->entityRelease != NULL) {
+        response->entityRelease(response->entityReleaseArg);
+    } else {
+        free(response->entityBuffer);
+        memRelease(MEM_RESPONSE, response->entityReserved);
+    }
+    response->entityShared = NULL;
+    response->entityRelease = NULL;
+    response->entityReserved = 0;
+    response->entityBuffer = NULL;
+    response->entitySize = 0;
+}
+
+/**
+*respAppend : appends len bytes of data.
+*return:
+*       SUCCESS or FAILURE if the data does not fit
+*/
+int respAppend(bufStruct *response, const char *data, size_t len)
+{
+    if (response->overflow ||
+        (len >= (size_t) (response->bufCap - response->bufSize))) {
+        response->overflow = 1;
+        return FAILURE;
+    }
+    memcpy(response->buffer + response->bufSize, data, len);
+    response->bufSize += len;
+    response->buffer[response->bufSize] = '\0';
+    return SUCCESS;
+}
+
+/**
+*respUint : appends value in decimal.
+*return:
+*       SUCCESS or FAILURE if the digits do not fit
+*/
+int respUint(bufStruct *response, unsigned long long value)
+{
+    char digits[20];
+    char *pos = digits + sizeof(digits);
+
+    do {
+        *--pos = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    return respAppend(response, pos, digits + sizeof(digits) - pos);
+}
+
+static void putTwo(char *dst, int value)
+{
+    dst[0] = '0' + (value / 10) % 10;
+    dst[1] = '0' + value % 10;
+}
+
+/**
+*respFormatDate : formats when as an IMF-fixdate.
+*args:
+*       d: RESP_DATE_LEN + 1 bytes
+*/
+void respFormatDate(time_t when, char *d)
+{
+    struct tm tm;
+
+    gmtime_r(&when, &tm);
+    memcpy(d, weekDays[tm.tm_wday], 3);
+    memcpy(d + 3, ", ", 2);
+    putTwo(d + 5, tm.tm_mday);
+    d[7] = ' ';
+    memcpy(d + 8, months[tm.tm_mon], 3);
+    d[11] = ' ';
+    putTwo(d + 12, (tm.tm_year + 1900) / 100);
+    putTwo(d + 14, tm.tm_year % 100);
+    d[16] = ' ';
+    putTwo(d + 17, tm.tm_hour);
+    d[19] = ':';
+    putTwo(d + 20, tm.tm_min);
+    d[22] = ':';
+    putTwo(d + 23, tm.tm_sec);
+    memcpy(d + 25, " GMT", 4);
+    d[RESP_DATE_LEN] = '\0';
+}
+
+/**
+*respDateValue : the current time as an IMF-fixdate, RESP_DATE_LEN
+*bytes. Valid until the calling thread asks again.
+*/
+const char *respDateValue(void)
+{
+    time_t now = time(NULL);
+
+    if (now != dateCachedAt) {
+        respFormatDate(now, dateCached);
+        dateCachedAt = now;
+    }
+    return dateCached;
+}
+
+/**
+*respDate : appends a Date header with the current time.
+*return:
+*       SUCCESS or FAILURE if the header does not fit
+*/
+int respDate(bufStruct *response)
+{
+    respLiteral(response, "Date: ");
+    respAppend(response, respDateValue(), RESP_DATE_LEN);
+    return respLiteral(response, "\r\n");
+}
@@ -0,0 +1,390 @@
+/**
+ * @file    restart.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Zero-downtime restart support. On SIGUSR2 the running
+ * server execs a fresh copy of its binary which inherits the
+ * listening sockets, so queued SYNs are never answered with a RST.
+ * The old process stops accepting once the new one reports ready,
+ * drains its in-flight connections and exits.
+ *
+ * Connection accounting is handed over through a pipe: the new
+ * process starts with the old process's in-flight count charged
+ * against its connection limit and is sent one byte every time
+ * one of those connections finishes. EOF on the pipe (old process
+ * exited) releases whatever is left.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <log.h>
+#include <restart.h>
+
+static int handoffReadFd = -1;
+static int inheritedLeft = 0;
+static void (*releaseConnection)(void);
+
+/**
+ * envFd : reads a file descriptor number passed by the old process
+ * and removes it from the environment, so that it is not passed on
+ * to the next generation by accident.
+ */
+static int envFd(const char *name)
+{
+    char *val = getenv(name);
+    int fd;
+
+    if (val == NULL) {
+        return -1;
+    }
+    fd = atoi(val);
+    unsetenv(name);
+
+    if ((fd < 0) || (fcntl(fd, F_GETFD) < 0)) {
+        error_log("Ignoring invalid descriptor %s=%s", name, val);
+        return -1;
+    }
+    return fd;
+}
+
+static int setCloexec(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFD);
+
+    if (flags < 0) {
+        return -1;
+    }
+    flags = on ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC);
+    return fcntl(fd, F_SETFD, flags);
+}
+
+/**
+*restartInheritListeners : picks up the listening sockets handed down
+*by the previous server process.
+*args:
+*       fds: filled with the inherited sockets
+*       max: room in fds
+*return:
+*       number of sockets inherited, 0 if the caller must create them
+*/
+int restartInheritListeners(int *fds, int max)
+{
+    char *val = getenv(ENV_LISTEN_FD);
+    char *pos, *end;
+    int listening, fd, count = 0;
+    socklen_t len;
+
+    if (val == NULL) {
+        return 0;
+    }
+
+    for (pos = val; *pos != '\0'; pos = (*end == ',') ? end + 1 : end) {
+        fd = strtol(pos, &end, 10);
+        if (end == pos) {
+            error_log("Ignoring invalid descriptor list %s=%s",
+                      ENV_LISTEN_FD, val);
+            break;
+        }
+        listening = 0;
+        len = sizeof(listening);
+        if ((fd < 0) || (fcntl(fd, F_GETFD) < 0)) {
+            error_log("Ignoring invalid descriptor %d in %s", fd, ENV_LISTEN_FD);
+            continue;
+        }
+        if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0) ||
+            !listening || (count == max)) {
+            error_log("Inherited descriptor %d is not a listening socket", fd);
+            close(fd);
+            continue;
+        }
+        setCloexec(fd, 1);
+        debug_log("Inherited listening socket %d", fd);
+        fds[count++] = fd;
+    }
+    unsetenv(ENV_LISTEN_FD);
+    return count;
+}
+
+/**
+*restartInheritedConnections : returns the number of connections the
+*previous process still had in flight when it handed over. These
+*count against the connection limit until the old process reports
+*them finished.
+*/
+int restartInheritedConnections(void)
+{
+    char *val = getenv(ENV_INHERITED_CONNS);
+    int count;
+
+    handoffReadFd = envFd(ENV_HANDOFF_FD);
+    if (val == NULL) {
+        return 0;
+    }
+    count = atoi(val);
+    unsetenv(ENV_INHERITED_CONNS);
+
+    if ((handoffReadFd < 0) || (count < 0)) {
+        return 0;
+    }
+    setCloexec(handoffReadFd, 1);
+    inheritedLeft = count;
+    return count;
+}
+
+static void *handoffWatcher(void *vargp)
+{
+    char buf[64];
+    ssize_t n, i;
+
+    pthread_detach(pthread_self());
+
+    while (inheritedLeft > 0) {
+        n = read(handoffReadFd, buf, sizeof(buf));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (i = 0; (i < n) && (inheritedLeft > 0); i++) {
+            inheritedLeft--;
+            releaseConnection();
+        }
+    }
+
+    /* The old process is gone; whatever it still held died with it */
+    debug_log("Previous process exited, releasing %d inherited slots",
+              inheritedLeft);
+    while (inheritedLeft > 0) {
+        inheritedLeft--;
+        releaseConnection();
+    }
+
+    close(handoffReadFd);
+    handoffReadFd = -1;
+    return NULL;
+}
+
+/**
+*restartAdoptConnections : starts watching the handoff pipe and calls
+*release once for every inherited connection as it finishes.
+*/
+void restartAdoptConnections(void (*release)(void))
+{
+    pthread_t tid;
+    sigset_t all, oldMask;
+
+    if ((handoffReadFd < 0) || (inheritedLeft == 0)) {
+        if (handoffReadFd >= 0) {
+            close(handoffReadFd);
+            handoffReadFd = -1;
+        }
+        return;
+    }
+
+    releaseConnection = release;
+
+    /* Leave signal delivery to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &oldMask);
+    if (pthread_create(&tid, NULL, handoffWatcher, NULL) != 0) {
+        error_log("Unable to watch handoff pipe: %s", strerror(errno));
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+/**
+*restartNotifyReady : tells the old process that this one is
+*accepting connections and the old one may stop.
+*/
+void restartNotifyReady(void)
+{
+    int fd = envFd(ENV_READY_FD);
+
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, "R", 1) != 1) {
+        error_log("Unable to notify previous process: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+/* Variables restartSpawn passes on, and room for each, see restartEnv */
+#define RESTART_ENV_VARS 4
+#define RESTART_ENV_LEN (16 * RESTART_MAX_LISTEN + 32)
+
+/**
+ * restartEnv : the environment of the new process, ours without any
+ * variable of a previous handover plus the RESTART_ENV_VARS in vars.
+ * The strings stay ours, only the array is allocated.
+ * return: NULL if out of memory
+ */
+static char **restartEnv(char vars[][RESTART_ENV_LEN])
+{
+    static const char *names[] = { ENV_LISTEN_FD, ENV_READY_FD,
+                                   ENV_HANDOFF_FD, ENV_INHERITED_CONNS };
+    char **envp;
+    size_t len;
+    int n, i, j, count = 0;
+
+    for (n = 0; environ[n] != NULL; n++)
+        ;
+    if ((envp = malloc((n + RESTART_ENV_VARS + 1) * sizeof(char *))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < RESTART_ENV_VARS; j++) {
+            len = strlen(names[j]);
+            if (!strncmp(environ[i], names[j], len) &&
+                (environ[i][len] == '=')) {
+                break;
+            }
+        }
+        if (j == RESTART_ENV_VARS) {
+            envp[count++] = environ[i];
+        }
+    }
+    for (j = 0; j < RESTART_ENV_VARS; j++) {
+        envp[count++] = vars[j];
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+/**
+*restartSpawn : execs a new copy of the server which inherits the
+*listening sockets and waits up to timeout seconds for it to become
+*ready. Everything the new process needs is prepared before the fork,
+*the child only clears close-on-exec and execs.
+*args:
+*       argv: command line to exec, argv[0] is the binary
+*       listenFds, numListen: listening sockets to hand over
+*       inflight: connections this process still has to finish
+*       handoffFd: filled with the pipe used to report finished connections
+*return:
+*       -1 : the new process failed to start, keep serving
+*      pid : pid of the new process
+*/
+pid_t restartSpawn(char **argv, const int *listenFds, int numListen,
+                   int inflight, int timeout, int *handoffFd)
+{
+    int readyPipe[2], handoffPipe[2];
+    char vars[RESTART_ENV_VARS][RESTART_ENV_LEN];
+    char **envp;
+    size_t used;
+    int i;
+    struct pollfd pfd;
+    char ready;
+    pid_t pid;
+    int ret;
+
+    if (numListen > RESTART_MAX_LISTEN) {
+        numListen = RESTART_MAX_LISTEN;
+    }
+    if (pipe(readyPipe) < 0) {
+        error_log("pipe() error: %s", strerror(errno));
+        return -1;
+    }
+    if (pipe(handoffPipe) < 0) {
+        error_log("pipe() error: %s", strerror(errno));
+        close(readyPipe[0]);
+        close(readyPipe[1]);
+        return -1;
+    }
+
+    used = snprintf(vars[0], sizeof(vars[0]), "%s=", ENV_LISTEN_FD);
+    for (i = 0; i < numListen; i++) {
+        used += snprintf(vars[0] + used, sizeof(vars[0]) - used, "%s%d",
+                         i ? "," : "", listenFds[i]);
+    }
+    snprintf(vars[1], sizeof(vars[1]), "%s=%d", ENV_READY_FD, readyPipe[1]);
+    snprintf(vars[2], sizeof(vars[2]), "%s=%d", ENV_HANDOFF_FD,
+             handoffPipe[0]);
+    snprintf(vars[3], sizeof(vars[3]), "%s=%d", ENV_INHERITED_CONNS,
+             inflight);
+    if ((envp = restartEnv(vars)) == NULL) {
+        error_log("Unable to allocate the environment of %s", argv[0]);
+        pid = -1;
+    } else if ((pid = fork()) < 0) {
+        error_log("fork() error: %s", strerror(errno));
+    }
+    if (pid < 0) {
+        free(envp);
+        close(readyPipe[0]);
+        close(readyPipe[1]);
+        close(handoffPipe[0]);
+        close(handoffPipe[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        /*
+         * Only the listeners and two pipe ends survive the exec. Other
+         * threads may have held any lock at the fork, so nothing but
+         * async-signal-safe calls from here on; a failed exec shows as
+         * EOF on the ready pipe.
+         */
+        close(readyPipe[0]);
+        close(handoffPipe[1]);
+        for (i = 0; i < numListen; i++) {
+            setCloexec(listenFds[i], 0);
+        }
+        setCloexec(readyPipe[1], 0);
+        setCloexec(handoffPipe[0], 0);
+        execve(argv[0], argv, envp);
+        _exit(EXIT_FAILURE);
+    }
+    free(envp);
+
+    close(readyPipe[1]);
+    close(handoffPipe[0]);
+
+    pfd.fd = readyPipe[0];
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, timeout * 1000);
+    } while ((ret < 0) && (errno == EINTR));
+
+    if ((ret <= 0) || (read(readyPipe[0], &ready, 1) != 1)) {
+        error_log("New server process %d did not become ready", (int) pid);
+        close(readyPipe[0]);
+        close(handoffPipe[1]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    close(readyPipe[0]);
+    setCloexec(handoffPipe[1], 1);
+    *handoffFd = handoffPipe[1];
+    return pid;
+}
+
+/**
+*restartConnectionDone : reports one finished connection to the
+*process that took over from us.
+*/
+void restartConnectionDone(int handoffFd)
+{
+    if (handoffFd < 0) {
+        return;
+    }
+    if (write(handoffFd, "D", 1) < 0) {
+        debug_log("Handoff pipe write failed: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,163 @@
+/**
+ * @file    router.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Prefix router for in-process handlers, a compressed radix
+ * trie: every edge carries the run of bytes its subtree shares, so a
+ * lookup compares each byte of the path at most once however many
+ * routes there are, and stops at the first edge that does not match.
+ * The longest registered prefix of the path wins.
+ *
+ * Routes are added before the server starts and only read after, by
+ * any number of threads at once; there is no locking.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <httpparser.h>
+#include <router.h>
+
+/**
+*routerCreate : an empty router.
+*return:
+*       NULL if out of memory
+*/
+router *routerCreate(void)
+{
+    return calloc(1, sizeof(router));
+}
+
+/**
+ * findChild : the child of node whose label starts with c.
+ */
+static routerNode *findChild(const routerNode *node, char c)
+{
+    routerNode *child;
+
+    for (child = node->child; child != NULL; child = child->sibling) {
+        if (child->label[0] == c) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * newNode : a node for the len bytes at label, not linked anywhere.
+ */
+static routerNode *newNode(const char *label, size_t len)
+{
+    routerNode *node = calloc(1, sizeof(routerNode));
+
+    if ((node == NULL) || ((node->label = malloc(len)) == NULL)) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->labelLen = len;
+    return node;
+}
+
+/**
+ * splitNode : cuts the label of child after len bytes; child keeps the
+ * rest under a new node holding the first len, which takes its place
+ * among the children of parent.
+ * return: the new node, NULL if out of memory
+ */
+static routerNode *splitNode(routerNode *parent, routerNode *child,
+                             size_t len)
+{
+    routerNode *mid = newNode(child->label, len);
+    routerNode **link = &parent->child;
+
+    if (mid == NULL) {
+        return NULL;
+    }
+    while (*link != child) {
+        link = &(*link)->sibling;
+    }
+    *link = mid;
+    mid->sibling = child->sibling;
+    mid->child = child;
+    child->sibling = NULL;
+    memmove(child->label, child->label + len, child->labelLen - len);
+    child->labelLen -= len;
+    return mid;
+}
+
+/**
+*routerAdd : routes paths starting with prefix to value.
+*args:
+*       old: set to the value prefix had before, NULL if it was new
+*return:
+*       SUCCESS, FAILURE if out of memory
+*/
+int routerAdd(router *r, const char *prefix, void *value, void **old)
+{
+    routerNode *node = &r->root, *child;
+    size_t len = strlen(prefix), common;
+
+    while (len > 0) {
+        child = findChild(node, *prefix);
+        if (child == NULL) {
+            if ((child = newNode(prefix, len)) == NULL) {
+                return FAILURE;
+            }
+            child->sibling = node->child;
+            node->child = child;
+            node = child;
+            break;
+        }
+        for (common = 1; (common < child->labelLen) && (common < len) &&
+             (child->label[common] == prefix[common]); common++) {
+        }
+        if ((common < child->labelLen) &&
+            ((child = splitNode(node, child, common)) == NULL)) {
+            return FAILURE;
+        }
+        node = child;
+        prefix += common;
+        len -= common;
+    }
+
+    *old = node->hasValue ? node->value : NULL;
+    if (!node->hasValue) {
+        r->count++;
+    }
+    node->hasValue = 1;
+    node->value = value;
+    return SUCCESS;
+}
+
+/**
+*routerMatch : the value of the longest prefix of path routed.
+*args:
+*       path, len: the path, not necessarily NUL terminated
+*       matched: set to the length of that prefix
+*return:
+*       the value, NULL if no prefix of path is routed
+*/
+void *routerMatch(const router *r, const char *path, size_t len,
+                  size_t *matched)
+{
+    const routerNode *node = &r->root;
+    void *best = node->hasValue ? node->value : NULL;
+    size_t used = 0;
+
+    *matched = 0;
+    while ((used < len) &&
+           ((node = findChild(node, path[used])) != NULL) &&
+           (node->labelLen <= len - used) &&
+           !memcmp(node->label, path + used, node->labelLen)) {
+        used += node->labelLen;
+        if (node->hasValue) {
+            best = node->value;
+            *matched = used;
+        }
+    }
+    return best;
+}
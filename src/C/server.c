@@ -4,11 +4,34 @@
  *          Srikanth Sedimbi (ssedimbi)
  * @date   Fri, 29 February 2015 
  *
- * @brief A simple web server that handles each client's 
- * requests using a seperate thread. The connection limit
- * for this server is set  at 25, after which the server
- * sends 503- Service Unavailable response to any client
- * that tries to connect to it.
+ * @brief A simple web server that handles each client's
+ * request in a coroutine run by a few event loop threads
+ * (see loop.c); HTTP/2 and proxied connections get a thread
+ * of their own. The connection limit
+ * for this server is set  at 25. Connections beyond it wait
+ * in a short queue that hands freed slots to the clients
+ * holding the fewest, a client over its fair share or a full
+ * queue gets 503- Service Unavailable. Clients over their
+ * request rate or connection cap get 429 (see ratelimit.c).
+ *
+ * It listens on the port given on the command line, or on the
+ * "listen" lines of the configuration: IPv4, IPv6 and Unix
+ * sockets, optionally behind a load balancer speaking the PROXY
+ * protocol (see listen.c and proxyhdr.c).
+ *
+ * SIGUSR2 restarts the server without dropping connections:
+ * a new copy of the binary inherits the listening sockets and
+ * this process drains its connections and exits. SIGTERM stops
+ * accepting and drains before exiting.
+ *
+ * SIGUSR1 dumps per CPU statistics and the use of the memory budget
+ * to stderr and writes the sampled request traces to trace_file, see
+ * trace.c. With capture_file set every request is recorded for
+ * ./replay, see capture.c.
+ *
+ * The server is also a library, libsimple: simpleRun() is what
+ * ./server runs (see main.c), with the handlers a program registered
+ * (see simple.h and handler.c) answering the paths routed to them.
  *
  */
 /* Standard includes */
@@ -20,12 +43,16 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <time.h>
 /* Includes related to socket programming */
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 
 /*Includes for thread*/
@@ -36,27 +63,113 @@
 #include <helper.h>
 #include <config.h>
 #include <httpparser.h>
+#include <restart.h>
+#include <affinity.h>
+#include <conf.h>
+#include <sockopt.h>
+#include <proxy.h>
+#include <fastcgi.h>
+#include <trace.h>
+#include <response.h>
+#include <ratelimit.h>
+#include <h2.h>
+#include <coro.h>
+#include <loop.h>
+#include <listen.h>
+#include <proxyhdr.h>
+#include <iopool.h>
+#include <flight.h>
+#include <memgov.h>
+#include <pathindex.h>
+#include <handler.h>
+#include <capture.h>
 
 #define ARGS_NUM 2
-#define MAX_LINE 4096
-#define CONNECTION_LIMIT 25
+/* Connections taken from a ready listener before polling again */
+#define ACCEPT_BATCH 64
 
 static char path[MAX_PATH];
 
+/* A connection, from accept() until it is closed */
+typedef struct clientConn {
+    loopTask task;              /* first, the loop hands it back */
+    int cpu;
+    uint64_t acceptedNs;
+    rateClient *client;
+    struct clientConn *next;    /* in the wait queue */
+    int family;
+    int proxyProtocol;          /* PROXY header not read yet */
+    int rejectCode;             /* answered without reading the request */
+    uint64_t id;                /* in order of accept, for the capture */
+    int h2;                     /* served as HTTP/2, h2.c captures */
+
+    /* Kept across suspensions of clientResume */
+    coroState coro;
+    char *buffer;               /* request, only while it is read */
+    int bufCap;
+    int received;
+    int requestLen;             /* to receive, once the headers are in */
+    char *captured;             /* copy of the request, see capture.c */
+    size_t sent;
+    size_t bytesTotal;
+    bufStruct response;
+    ioJob io;                   /* rest of a file not in the page cache */
+    flightWait flight;          /* load shared with concurrent requests */
+    traceRecord trace;
+} clientConn;
+
 void *newClientThread(void *vargp);
-static pthread_mutex_t connMutex;
+static int clientResume(loopTask *task);
+static pthread_mutex_t connMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connCond = PTHREAD_COND_INITIALIZER;
 static int globalConnectionCount = 0;
+static int handoffFd = -1;
+/* Connections waiting for a slot, oldest first */
+static clientConn *waitHead = NULL;
+static int waitCount = 0;
+static uint64_t connSeq = 0;
+
+static volatile sig_atomic_t restartRequested = 0;
+static volatile sig_atomic_t shutdownRequested = 0;
+static volatile sig_atomic_t statsRequested = 0;
+static volatile sig_atomic_t reloadRequested = 0;
+static sigset_t ctlSignals;
+
+static void connectionRelease(void);
+static void admitConnection(clientConn *conn, const serverConfig *cfg,
+                            int allowListed);
+static void dispatchConnection(clientConn *conn);
+static void clientFinish(clientConn *conn);
+static void rejectConnection(clientConn *conn, int code);
+static void ctlSignalHandler(int sig);
+static int openListeners(listener *listeners, listenSpec *specs,
+                         const serverConfig *cfg, int port);
+static void acceptClients(const listener *l, const serverConfig *cfg);
+static int gracefulRestart(char **argv, const listener *listeners,
+                           int numListeners);
+static void drainConnections(int timeout);
 
 
-int main(int argc, char **argv)
+/**
+*simpleRun : runs the server until it is stopped, serving the requests
+*for the handlers of srv in process and the rest from the www root.
+*args:
+*       srv: from simpleCreate(), NULL to serve files only
+*       argc, argv: as given to ./server, <port> <www root> [config file]
+*return:
+*       exit status of the server
+*/
+int simpleRun(simpleServer *srv, int argc, char **argv)
 {
     int port;
-    int serv_sock;
-    int optval = 1; 
-    socklen_t len;
-    struct sockaddr_in addr, client_addr;
-    char *client_addr_string;
+    listener listeners[LISTEN_MAX];
+    listenSpec specs[LISTEN_MAX];
+    struct pollfd pfds[LISTEN_MAX];
+    int numListeners, i, ready;
     DIR *rootDir;
+    struct sigaction sa;
+    int inherited;
+    serverConfig cfg;
 
     /*
      * ignore SIGPIPE, will be handled
@@ -64,24 +177,48 @@ int main(int argc, char **argv)
      */
     signal(SIGPIPE, SIG_IGN);
 
-    if (argc != (ARGS_NUM + 1)) {
+    /*
+     * SIGUSR2 (restart), SIGTERM (stop), SIGHUP (reload config) and
+     * SIGUSR1 (dump per CPU stats) only set a flag; installing them
+     * without SA_RESTART makes the blocked poll() return EINTR so the
+     * main loop can act on it. Client threads keep them blocked.
+     */
+    sigemptyset(&ctlSignals);
+    sigaddset(&ctlSignals, SIGUSR2);
+    sigaddset(&ctlSignals, SIGTERM);
+    sigaddset(&ctlSignals, SIGHUP);
+    sigaddset(&ctlSignals, SIGUSR1);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ctlSignalHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if ((argc != (ARGS_NUM + 1)) && (argc != (ARGS_NUM + 2))) {
         error_log("%s","Incorrect arguments provided\n"
-                  "usage: ./server <port>");
+                  "usage: ./server <port> <www root> [config file]");
 
         exit(EXIT_FAILURE);
     }
 
-    client_addr_string = (char *) malloc(INET_ADDRSTRLEN);
-    if (NULL == client_addr_string) {
-        error_log("Unable to allocate memory for client_addr due to malloc() "
-                  "error: %s", strerror(errno));
+    if (handlerStart(srv) != SUCCESS) {
+        error_log("%s", "Only one server runs per process");
+        return EXIT_FAILURE;
+    }
+
+    /* Optional config file, re-read on SIGHUP */
+    if (confInit((argc > ARGS_NUM + 1) ? argv[ARGS_NUM + 1] : NULL)
+        != SUCCESS) {
         exit(EXIT_FAILURE);
     }
+    confSnapshot(&cfg);
 
     /* Parse the port */
     port = atoi(argv[1]); 
-    if ((port > MAX_PORT) || (port < MIN_PORT)) {
-        error_log("%s", "Port must be in range 1024 to 65535");
+    if ((port > MAX_PORT) || (port < cfg.minPort)) {
+        error_log("Port must be in range %d to %d", cfg.minPort, MAX_PORT);
         exit(EXIT_FAILURE);
     }
 
@@ -100,214 +237,1048 @@ int main(int argc, char **argv)
         closedir(rootDir);
     }
 
-    /* Create a socket for listening */
-    if ((serv_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        error_log("socket() error: %s", strerror(errno));
+    /*
+     * Optional worker pinning, e.g. worker_cpus = 0-3. The environment
+     * variable SIMPLE_CPUS is used if the config file does not set it.
+     */
+    if (affinityInit(cfg.workerCpus[0] ? cfg.workerCpus :
+                     getenv(ENV_WORKER_CPUS)) < 0) {
         exit(EXIT_FAILURE);
     }
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port        = htons(port);
+    /* Event loops serving the connections, see loop.c */
+    if (loopInit(cfg.eventThreads, &ctlSignals) != SUCCESS) {
+        error_log("%s", "Unable to start the event loops");
+        exit(EXIT_FAILURE);
+    }
+    memSetBudget((size_t) cfg.memoryBudget << 20);
+    /* Without the index every path is looked up, as before */
+    pathIndexInit(path, cfg.pathIndex, &ctlSignals);
 
-    /*
-     * bind() the socket to the ip address and the port. This actually
-     * created the mapping between the socket and the IP:Port pair
-     */
-    if (bind(serv_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        error_log("bind() error: %s", strerror(errno));
+    /* And the threads reading files for them, see iopool.c */
+    if (ioInit(cfg.ioThreads, cfg.ioQueue, &ctlSignals) != SUCCESS) {
+        error_log("%s", "Unable to start the I/O threads");
         exit(EXIT_FAILURE);
     }
 
-    if (setsockopt(serv_sock, SOL_SOCKET, SO_REUSEADDR,
-                   (const void *)&optval, sizeof(int)) < 0) {
-        error_log("setsockopt() error: %s", strerror(errno));
+    /* Requests recorded for ./replay, see capture.c */
+    if (captureInit(&cfg, &ctlSignals) != SUCCESS) {
         exit(EXIT_FAILURE);
     }
 
     /*
-     * listen() for incoming connections.
-     * The server accepts SYN packets after this call succeeds. If a client
-     * calls connect() before this, the OS kernel will response with a RST and
-     * terminate the connection. The BACKLOG is the total amount of connections
-     * that can be in ESTABLISHED state (SYN-SYN/ACK-ACK complete at the server
-     * before accept() is called.
+     * A restarted server picks up the sockets of the process it replaces,
+     * so connections queued in the backlogs survive the restart.
      */
-    if (listen(serv_sock, BACKLOG) < 0) {
-        error_log("listen() error: %s", strerror(errno));
+    numListeners = openListeners(listeners, specs, &cfg, port);
+    if (numListeners == 0) {
         exit(EXIT_FAILURE);
     }
+    for (i = 0; i < numListeners; i++) {
+        pfds[i].fd = listeners[i].fd;
+        pfds[i].events = POLLIN;
+        debug_log("Now listening on %s%s", listeners[i].name,
+                  listeners[i].proxyProtocol ? " (PROXY protocol)" : "");
+    }
+
+    /*
+     * Connections the previous process is still draining keep their
+     * slots until it reports them done.
+     */
+    inherited = restartInheritedConnections();
+    if (inherited > 0) {
+        pthread_mutex_lock(&connMutex);
+        globalConnectionCount += inherited;
+        pthread_mutex_unlock(&connMutex);
+        restartAdoptConnections(connectionRelease);
+    }
+    restartNotifyReady();
+
+    while(!shutdownRequested) {
+
+        if (restartRequested) {
+            restartRequested = 0;
+            if (gracefulRestart(argv, listeners, numListeners)) {
+                break;
+            }
+            continue;
+        }
+
+        if (statsRequested) {
+            statsRequested = 0;
+            affinityDumpStats(stderr);
+            memDumpStats(stderr);
+            pathIndexDumpStats(stderr);
+            fcgiDumpStats(stderr);
+            captureDumpStats(stderr);
+            if (cfg.traceSample || cfg.traceSlowMs) {
+                traceExport(cfg.traceFile);
+            }
+        }
+
+        if (reloadRequested) {
+            reloadRequested = 0;
+            /*
+             * New limits and client socket options apply to connections
+             * accepted from now on. listen() on a listening socket only
+             * updates its backlog. Listeners, worker CPUs and the
+             * capture file need a restart.
+             */
+            if (confReload() == SUCCESS) {
+                confSnapshot(&cfg);
+                memSetBudget((size_t) cfg.memoryBudget << 20);
+                for (i = 0; i < numListeners; i++) {
+                    listenApply(&listeners[i], &specs[i], &cfg);
+                }
+            }
+            continue;
+        }
+
+        /* Wait for a connection on any listener */
+        ready = poll(pfds, numListeners, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_log("poll() error: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < numListeners; i++) {
+            if (pfds[i].revents & POLLIN) {
+                acceptClients(&listeners[i], &cfg);
+            }
+        }
+    }
+
+    /*
+     * Stop accepting and let the in-flight connections finish. Socket
+     * files stay, a restarted server still listens on them.
+     */
+    for (i = 0; i < numListeners; i++) {
+        close(listeners[i].fd);
+    }
+    confSnapshot(&cfg);
+    /* HTTP/2 connections would otherwise stay open until idle */
+    h2Shutdown();
+    drainConnections(cfg.drainTimeout);
+    captureStop();
+
+    return 0;
+}
+
+/**
+*openListeners : sets up the listeners of the "listen" lines, or one on
+*port if there are none. Inherited sockets no line asks for any more
+*are closed.
+*args:
+*       specs: filled with the line each listener was opened for
+*return:
+*       number of listeners, 0 on failure
+*/
+static int openListeners(listener *listeners, listenSpec *specs,
+                         const serverConfig *cfg, int port)
+{
+    int inherited[RESTART_MAX_LISTEN];
+    int numInherited, num, i;
 
-    debug_log("Now listening on port %d", port);
+    numInherited = restartInheritListeners(inherited, RESTART_MAX_LISTEN);
+
+    if (cfg->numListens > 0) {
+        num = cfg->numListens;
+        memcpy(specs, cfg->listens, num * sizeof(listenSpec));
+    } else {
+        num = 1;
+        memset(specs, 0, sizeof(listenSpec));
+        snprintf(specs[0].addr, sizeof(specs[0].addr), "%d", port);
+    }
 
-    while(1) {
-        
-        /* Accept the client connection  */
+    for (i = 0; i < num; i++) {
+        if (listenOpen(&listeners[i], &specs[i], cfg, inherited,
+                       numInherited) != SUCCESS) {
+            return 0;
+        }
+    }
+    for (i = 0; i < numInherited; i++) {
+        if (inherited[i] >= 0) {
+            debug_log("Closing inherited listener %d", inherited[i]);
+            close(inherited[i]);
+        }
+    }
+    return num;
+}
+
+/**
+*acceptClients : takes the connections waiting on l, at most a batch so
+*the other listeners and the signal flags get their turn.
+*/
+static void acceptClients(const listener *l, const serverConfig *cfg)
+{
+    struct sockaddr_storage client_addr;
+    char client_addr_string[LISTEN_NAME_MAX];
+    socklen_t len;
+    clientConn *conn;
+    rateClient *client;
+    int allowListed, n;
+
+    for (n = 0; n < ACCEPT_BATCH; n++) {
         len = sizeof(client_addr);
 
         /* Get a socket to actually communicate withe client
          * The client_sock returned by accept() is used for further
-         * communication with the client while the serv_sock is still used for
-         * new connections. accept() blocks if no connections are present
+         * communication with the client while the listener is still used
+         * for new connections. Listeners are non-blocking, accept()
+         * fails with EAGAIN once no connection is left.
+         * Client sockets are close-on-exec so a restarted server never
+         * holds on to connections owned by this process.
          */
-        
-        int* client_sock = malloc(sizeof(int));
-
-        *client_sock = accept(serv_sock,
-                             (struct sockaddr *) &client_addr, &len);
-        if (client_sock < 0) {
+        conn = calloc(1, sizeof(clientConn));
+        if (conn == NULL) {
+            error_log("%s", "Unable to allocate a client connection");
+            exit(EXIT_FAILURE);
+        }
+        conn->task.fd = accept4(l->fd, (struct sockaddr *) &client_addr,
+                                &len, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (conn->task.fd < 0) {
+            free(conn);
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                (errno == EINTR)) {
+                return;
+            }
             error_log("Unable to add client due to accept() "
                       "error: %s", strerror(errno));
             exit(EXIT_FAILURE);
         }
+        conn->acceptedNs = traceNow();
+        conn->id = ++connSeq;
+        conn->family = l->family;
 
-        
+        listenAddrString((struct sockaddr *) &client_addr,
+                         client_addr_string, sizeof(client_addr_string));
+        debug_log("Accepted connection from %s on %s",
+                  client_addr_string, l->name);
 
-        inet_ntop(AF_INET, &(client_addr.sin_addr),
-                  client_addr_string, INET_ADDRSTRLEN);
-        debug_log("Accepted connection from %s:%d",
-                  client_addr_string, ntohs(client_addr.sin_port));
+        if (l->proxyProtocol) {
+            /*
+             * The peer is the balancer, the client is only known once
+             * the PROXY header is read; clientResume throttles it then.
+             */
+            conn->proxyProtocol = 1;
+            conn->cpu = affinityPickCpu(conn->task.fd);
+            admitConnection(conn, cfg, 1);
+            continue;
+        }
 
+        /*
+         * Throttle clients over their request rate or connection cap
+         * here, before they cost a thread. Each connection carries a
+         * single request, so the rate applies to connections.
+         */
+        conn->client = client = rateLookup((struct sockaddr *) &client_addr);
+        allowListed = rateAllowListed(cfg, (struct sockaddr *) &client_addr);
+        if (!allowListed && (client != NULL) &&
+            ((rateAdmit(client, cfg) != SUCCESS) ||
+             ((cfg->clientConnectionLimit > 0) &&
+              (client->active + client->queued >=
+               cfg->clientConnectionLimit)))) {
+            debug_log("Throttling %s", client_addr_string);
+            rejectConnection(conn, 429);
+            rateUnpin(client);
+            continue;
+        }
 
-        pthread_t tid;
-        pthread_create(&tid,NULL,newClientThread,client_sock);
+        /* Serve the connection on the CPU its packets arrive on */
+        conn->cpu = affinityPickCpu(conn->task.fd);
+        admitConnection(conn, cfg, allowListed);
+        rateUnpin(client);
+    }
+}
 
-        
+/**
+*ctlSignalHandler : records restart/stop/reload/stats requests for the
+*main loop.
+*/
+static void ctlSignalHandler(int sig)
+{
+    if (sig == SIGUSR2) {
+        restartRequested = 1;
+    } else if (sig == SIGUSR1) {
+        statsRequested = 1;
+    } else if (sig == SIGHUP) {
+        reloadRequested = 1;
+    } else {
+        shutdownRequested = 1;
     }
+}
 
-    return 0;
+/**
+*gracefulRestart : hands the listening sockets over to a new copy of
+*the server. No connection is accepted while the new process starts,
+*pending ones wait in the listen backlog.
+*return:
+*       true : the new process is accepting, this one should drain
+*       false: restart failed, keep serving
+*/
+static int gracefulRestart(char **argv, const listener *listeners,
+                           int numListeners)
+{
+    serverConfig cfg;
+    int fds[LISTEN_MAX];
+    int inflight, i;
+    int fd = -1;
+    pid_t pid;
+
+    confSnapshot(&cfg);
+
+    pthread_mutex_lock(&connMutex);
+    inflight = globalConnectionCount;
+    pthread_mutex_unlock(&connMutex);
+
+    for (i = 0; i < numListeners; i++) {
+        fds[i] = listeners[i].fd;
+    }
+    pid = restartSpawn(argv, fds, numListeners, inflight, cfg.restartTimeout,
+                       &fd);
+    if (pid < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&connMutex);
+    handoffFd = fd;
+    pthread_mutex_unlock(&connMutex);
+
+    debug_log("Handed over to pid %d, draining %d connections",
+              (int) pid, inflight);
+    return true;
 }
 
 /**
-*newClientThread : Services the client's request.
-*args: client connection socket file descriptor.
+*drainConnections : waits up to timeout seconds for the in-flight
+*connections to finish.
+*/
+static void drainConnections(int timeout)
+{
+    struct timespec deadline;
+    int remaining;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&connMutex);
+    while (globalConnectionCount > 0) {
+        if (pthread_cond_timedwait(&connCond, &connMutex,
+                                   &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    remaining = globalConnectionCount;
+    pthread_mutex_unlock(&connMutex);
+
+    if (remaining > 0) {
+        error_log("Drain deadline reached with %d connections open",
+                  remaining);
+    }
+}
+
+/**
+*admitConnection : gives conn a slot if one is free. Otherwise conn
+*waits for one if the queue has room and its client holds less than
+*its fair share of the slots, allow-listed clients always may.
+*/
+static void admitConnection(clientConn *conn, const serverConfig *cfg,
+                            int allowListed)
+{
+    clientConn **tail;
+    rateClient *client = conn->client;
+
+    pthread_mutex_lock(&connMutex);
+    if (globalConnectionCount < cfg->connectionLimit) {
+        globalConnectionCount++;
+        pthread_mutex_unlock(&connMutex);
+        rateAcquire(client);
+        dispatchConnection(conn);
+        return;
+    }
+
+    if ((waitCount < cfg->fairQueue) &&
+        (allowListed || (client == NULL) ||
+         (client->active + client->queued < rateFairShare(cfg)))) {
+        for (tail = &waitHead; *tail != NULL; tail = &(*tail)->next) {
+        }
+        conn->next = NULL;
+        *tail = conn;
+        waitCount++;
+        rateQueued(client, 1);
+        pthread_mutex_unlock(&connMutex);
+        return;
+    }
+    pthread_mutex_unlock(&connMutex);
+
+    rejectConnection(conn, 503);
+}
+
+/**
+*dispatchConnection : hands conn to the event loop of its CPU, where
+*clientResume serves it once the request starts to arrive. A loop that
+*cannot take it closes it, its slot given back.
+*/
+static void dispatchConnection(clientConn *conn)
+{
+    conn->task.resume = clientResume;
+    if (loopAdd(&conn->task, conn->cpu) != SUCCESS) {
+        clientFinish(conn);
+    }
+}
+
+/**
+*rejectConnection : answers conn with an error without reading the
+*request and closes it. The response fits an empty socket buffer, so
+*the send never blocks the accept loop.
+*/
+static void rejectConnection(clientConn *conn, int code)
+{
+    char buf[MAX_BUF_SIZE + 1];
+    bufStruct response;
+
+    respInit(&response, buf, sizeof(buf));
+    serveError(code, &response, FAILURE);
+    send(conn->task.fd, response.buffer, response.bufSize,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(conn->task.fd);
+    free(conn);
+}
+
+/**
+*connectionRelease : frees one connection slot. The slot goes to the
+*waiting connection whose client is served on the fewest, oldest
+*first; if none waits, the process that took over from us (if any) is
+*told that it can reuse the slot.
+*/
+static void connectionRelease(void)
+{
+    clientConn **pos, **best = NULL;
+    clientConn *next = NULL;
+    int limit = confConnectionLimit();
+
+    pthread_mutex_lock(&connMutex);
+    if ((waitHead != NULL) && (globalConnectionCount <= limit)) {
+        for (pos = &waitHead; *pos != NULL; pos = &(*pos)->next) {
+            if ((best == NULL) ||
+                (((*pos)->client ? (*pos)->client->active : 0) <
+                 ((*best)->client ? (*best)->client->active : 0))) {
+                best = pos;
+            }
+        }
+        next = *best;
+        *best = next->next;
+        waitCount--;
+    } else {
+        if(globalConnectionCount>0)
+        {
+            globalConnectionCount--;
+        }
+        restartConnectionDone(handoffFd);
+        pthread_cond_broadcast(&connCond);
+    }
+    pthread_mutex_unlock(&connMutex);
+
+    if (next != NULL) {
+        /* Active before no longer queued, see ratelimit.c */
+        rateAcquire(next->client);
+        rateQueued(next->client, -1);
+        dispatchConnection(next);
+    }
+}
+
+/**
+*clientBufferFree : frees the request buffer and gives its memory back
+*to the budget.
+*/
+static void clientBufferFree(clientConn *conn)
+{
+    if (conn->buffer != NULL) {
+        affinityBufferPut(conn->cpu, conn->buffer, conn->bufCap + 1);
+        memRelease(MEM_RECV, conn->bufCap + 1);
+        conn->buffer = NULL;
+    }
+}
+
+/**
+*clientFinish : closes conn and gives back everything it held.
+*/
+static void clientFinish(clientConn *conn)
+{
+    int cpu = conn->cpu;
+    rateClient *client = conn->client;
+    size_t bytes_total = conn->bytesTotal;
+
+    debug_log("Closing connection on socket %d", conn->task.fd);
+    /* Our work here is done. Close the connection to the client */
+    close(conn->task.fd);
+    if (!conn->h2) {
+        captureRequest(conn->id, conn->acceptedNs, conn->captured,
+                       conn->received, conn->trace.status, bytes_total);
+    }
+    free(conn->captured);
+    traceEnd(&conn->trace, bytes_total);
+    clientBufferFree(conn);
+    free(conn);
+    affinityRecord(cpu, bytes_total);
+
+    rateRelease(client);
+    connectionRelease();
+}
+
+/**
+*newClientThread : Services a request that keeps the connection for
+*long, HTTP/2 or forwarded to an upstream or FastCGI backend, on a
+*thread of its own.
+*args: client connection, its request received by clientResume.
 *
 *return: NULL
 */
 void *newClientThread(void *vargp)
 {
     pthread_detach(pthread_self());
-    int client_sock = *((int*) vargp);
-    free(vargp);
-    bool connLimitFlag = false;
-    pthread_mutex_lock(&connMutex);
-    if(globalConnectionCount<CONNECTION_LIMIT)
+    clientConn *conn = (clientConn *) vargp;
+    int client_sock = conn->task.fd;
+    char *buffer = conn->buffer;
+    int bytes_received = conn->received;
+    const proxyRoute *route;
+    const fcgiRoute *fcgi;
+    serverConfig cfg;
+
+    confSnapshot(&cfg);
+    traceThread(&conn->trace);
+
+    /* proxy.c, fastcgi.c and h2.c expect a blocking socket */
+    fcntl(client_sock, F_SETFL,
+          fcntl(client_sock, F_GETFL) & ~O_NONBLOCK);
+
+    if (cfg.h2c && !handlerActive() && h2Preface(buffer, bytes_received))
     {
-        globalConnectionCount++;
+        /* HTTP/2 with prior knowledge, see h2.c */
+        conn->h2 = 1;
+        conn->bytesTotal += h2Serve(client_sock, buffer, bytes_received,
+                                    &cfg, path, conn->id);
+    }
+    else if ((route = proxyMatch(&cfg, buffer, bytes_received)) != NULL)
+    {
+        /* Forwarded to an upstream, see proxy.c */
+        traceMark(TRACE_PARSE);
+        conn->bytesTotal += proxyServe(client_sock, route, buffer,
+                                       bytes_received, &cfg);
+    }
+    else if ((fcgi = fcgiMatch(&cfg, buffer, bytes_received)) != NULL)
+    {
+        /* Served by a FastCGI backend, see fastcgi.c */
+        traceMark(TRACE_PARSE);
+        conn->bytesTotal += fcgiServe(client_sock, fcgi, buffer,
+                                      bytes_received, &cfg, path);
     }
     else
     {
-        connLimitFlag=true;    
-    }
-    pthread_mutex_unlock(&connMutex);   
-    int bytes_received, bytes_sent, total_sent;
-    char buffer[MAX_LINE];
-    int ret = 0;
-    total_sent = bytes_received = bytes_sent = 0;
-
-    /* Read the date sent from the client */
-    
-     if(!connLimitFlag) {
-        while((( ret= recv(client_sock,(buffer + bytes_received), MAX_LINE - 1, 0)) > 0) && 
-            (bytes_received < MAX_BUF_SIZE)) 
-        {
-          bytes_received += ret;
-          if(strncmp((buffer+ (bytes_received -4)),"\r\n\r\n",4) == 0) {
-               break;
-          }
+        conn->h2 = 1;
+        conn->bytesTotal += h2Serve(client_sock, buffer, bytes_received,
+                                    &cfg, path, conn->id);
+    }
+    traceMark(TRACE_SEND);
+
+    clientFinish(conn);
+    return NULL;
+}
+
+/**
+*clientLongLived : whether the request belongs on a thread of its own,
+*see newClientThread.
+*/
+static int clientLongLived(const serverConfig *cfg, const char *buffer,
+                           int length)
+{
+    int h2c = cfg->h2c && !handlerActive();
+
+    return (h2c && h2Preface(buffer, length)) ||
+           (proxyMatch(cfg, buffer, length) != NULL) ||
+           (fcgiMatch(cfg, buffer, length) != NULL) ||
+           (h2c && h2UpgradeRequest(buffer, length));
+}
+
+/**
+*clientProxyHeader : takes the PROXY header off the start of the
+*received bytes, then applies the per client limits the accept loop
+*could not, to the client the header names.
+*return:
+*       0 : more bytes are needed
+*       SUCCESS : the request follows in conn->buffer
+*       FAILURE : no valid header, close the connection
+*       429 : the client is throttled
+*/
+static int clientProxyHeader(clientConn *conn, const serverConfig *cfg)
+{
+    struct sockaddr_storage src;
+    char name[LISTEN_NAME_MAX];
+    int known = 0, len;
+
+    len = proxyHeaderParse((unsigned char *) conn->buffer, conn->received,
+                           &src, &known);
+    if (len <= 0) {
+        return ((len == 0) && (conn->received < conn->bufCap)) ? 0 : FAILURE;
+    }
+    conn->received -= len;
+    memmove(conn->buffer, conn->buffer + len, conn->received);
+    conn->proxyProtocol = 0;
+
+    /* LOCAL or UNKNOWN: the balancer's own checks go unlimited */
+    if (!known) {
+        return SUCCESS;
+    }
+    listenAddrString((struct sockaddr *) &src, name, sizeof(name));
+    debug_log("Connection on socket %d is for %s", conn->task.fd, name);
+
+    conn->client = rateLookup((struct sockaddr *) &src);
+    if (!rateAllowListed(cfg, (struct sockaddr *) &src) &&
+        (conn->client != NULL) &&
+        ((rateAdmit(conn->client, cfg) != SUCCESS) ||
+         ((cfg->clientConnectionLimit > 0) &&
+          (conn->client->active + conn->client->queued >=
+           cfg->clientConnectionLimit)))) {
+        debug_log("Throttling %s", name);
+        rateUnpin(conn->client);
+        conn->client = NULL;
+        return 429;
+    }
+    rateAcquire(conn->client);
+    rateUnpin(conn->client);
+    return SUCCESS;
+}
+
+/**
+*clientEntityRead : queues the part of the file serveGet found on disk
+*for the I/O threads, or turns the response into a 503 if they are
+*too far behind.
+*return:
+*       SUCCESS if the read was queued
+*/
+static int clientEntityRead(clientConn *conn)
+{
+    bufStruct *response = &conn->response;
+
+    conn->io.task = &conn->task;
+    conn->io.fd = fileno(response->entityFile);
+    conn->io.buf = response->entityBuffer + response->entityRead;
+    conn->io.len = response->entitySize - response->entityRead;
+    conn->io.offset = response->entityRead;
+    if (ioSubmit(&conn->io) == SUCCESS) {
+        return SUCCESS;
+    }
+
+    debug_log("I/O queue full, rejecting request on socket %d",
+              conn->task.fd);
+    fclose(response->entityFile);
+    respEntityFree(response);
+    respInit(response, response->buffer, MAX_BUF_SIZE + 1);
+    serveError(503, response, FAILURE);
+    flightLand(&conn->flight, NULL, 503);
+    return FAILURE;
+}
+
+/**
+*clientEarlyHints : sends the 103 Early Hints leading the response
+*while the page itself is still being read, so the browser can start
+*on what the page needs. It fits an empty socket buffer, if it does
+*not go out now it goes with the rest.
+*/
+static void clientEarlyHints(clientConn *conn)
+{
+    ssize_t ret;
+
+    if ((conn->response.hintsLen > 0) && (conn->sent == 0)) {
+        traceCall(TRACE_CALL_SEND);
+        ret = send(conn->task.fd, conn->response.buffer,
+                   conn->response.hintsLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret > 0) {
+            conn->sent = ret;
         }
+    }
+}
 
-        /*
-         * Echo - Write (send) the data back to the client taking care of short
-         * counts
-         */
-        if (bytes_received > 0)
+/**
+*clientEntityDone : takes the result of the read clientEntityRead
+*queued and lands the load for the requests waiting on it. A short
+*read leaves a short body, as fread() did.
+*/
+static void clientEntityDone(clientConn *conn)
+{
+    bufStruct *response = &conn->response;
+
+    if (conn->io.done > 0) {
+        response->entityRead += conn->io.done;
+    }
+    response->entitySize = response->entityRead;
+    response->entityShared->length = response->entityRead;
+    fclose(response->entityFile);
+    response->entityFile = NULL;
+    traceMark(TRACE_READ);
+    flightLand(&conn->flight, response->entityShared, SUCCESS);
+}
+
+/**
+*clientStreamDone : takes the chunk clientStreamRead read. Nothing read
+*ends the stream, the client sees a short body.
+*/
+static void clientStreamDone(clientConn *conn)
+{
+    bufStruct *response = &conn->response;
+
+    if (conn->io.done > 0) {
+        response->entitySize += conn->io.done;
+    }
+    response->entityRead += response->entitySize;
+    if (response->entitySize == 0) {
+        response->streamLeft = 0;
+    } else {
+        response->streamLeft -= response->entitySize;
+    }
+}
+
+/**
+*clientStreamRead : reads the next chunk of a streamed file once the
+*chunk before it is sent. What is not in the page cache is left to
+*the I/O threads. If they are too far behind the chunk is cut short to
+*what was cached, or, with nothing cached, tried again on a later turn
+*of the loop; the loop thread never waits for the disk.
+*return:
+*       LOOP_PARKED if the connection is to wait for the read, then
+*       finished by clientStreamDone
+*       LOOP_YIELD if nothing could be read yet, call again later
+*/
+static int clientStreamRead(clientConn *conn)
+{
+    bufStruct *response = &conn->response;
+    size_t len = response->streamLeft;
+    ssize_t cached;
+
+    if (len > MEM_STREAM_CHUNK) {
+        len = MEM_STREAM_CHUNK;
+    }
+    conn->bytesTotal += response->entitySize;
+    conn->sent -= response->entitySize;
+
+    cached = ioReadCached(fileno(response->entityFile),
+                          response->entityBuffer, len, response->entityRead);
+    response->entitySize = (cached > 0) ? cached : 0;
+    conn->io.done = 0;
+    if ((cached >= 0) && ((size_t) cached < len)) {
+        conn->io.task = &conn->task;
+        conn->io.fd = fileno(response->entityFile);
+        conn->io.buf = response->entityBuffer + cached;
+        conn->io.len = len - cached;
+        conn->io.offset = response->entityRead + cached;
+        if (ioSubmit(&conn->io) == SUCCESS) {
+            return LOOP_PARKED;
+        }
+        if (cached == 0) {
+            debug_log("I/O queue full, socket %d retries its chunk",
+                      conn->task.fd);
+            return LOOP_YIELD;
+        }
+    }
+    clientStreamDone(conn);
+    return SUCCESS;
+}
+
+/**
+*clientServe : Services the client's request. Runs as a coroutine on
+*an event loop: recv() and send() suspend it when the socket is not
+*ready, so a waiting connection costs its clientConn and nothing else.
+*The request buffer is only taken once the first bytes are readable
+*and given back before the response goes out.
+*args: the clientConn, through its loop task
+*
+*return: what the connection waits for, LOOP_DONE once closed
+*/
+static int clientServe(loopTask *task)
+{
+    clientConn *conn = (clientConn *) task;
+    const serverConfig *cfg = loopConfig();
+    struct iovec iov[2];
+    size_t headerSize;
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t oldMask;
+    size_t turnSent = 0, total;
+    int chunk, scanFrom;
+    ssize_t ret;
+
+    CORO_BEGIN(&conn->coro);
+
+    traceBegin(&conn->trace, task->fd, conn->cpu, conn->acceptedNs, cfg);
+    if (conn->family != AF_UNIX) {
+        sockoptClient(task->fd, cfg);
+    }
+
+    /*
+     * Read the date sent from the client, 503 if over the memory budget.
+     * The buffer comes from the pool of the loop's node, like the
+     * response buffer.
+     */
+    conn->bufCap = cfg->maxBufSize;
+    if (memReserve(MEM_RECV, conn->bufCap + 1) == SUCCESS) {
+        conn->buffer = affinityBufferGet(conn->cpu, conn->bufCap + 1);
+        if (conn->buffer == NULL) {
+            memRelease(MEM_RECV, conn->bufCap + 1);
+        }
+    }
+
+    /* Behind a balancer the request starts with a PROXY header */
+    while ((conn->buffer != NULL) && conn->proxyProtocol)
+    {
+        chunk = conn->bufCap - conn->received;
+        if (chunk > cfg->maxLine)
+            chunk = cfg->maxLine;
+        traceCall(TRACE_CALL_RECV);
+        ret = recv(task->fd, conn->buffer + conn->received, chunk, 0);
+        if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+            CORO_YIELD(&conn->coro, LOOP_READ);
+            continue;
+        }
+        if (ret > 0) {
+            conn->received += ret;
+            ret = clientProxyHeader(conn, cfg);
+        } else {
+            ret = FAILURE;
+        }
+        if (ret == FAILURE) {
+            debug_log("No PROXY header on socket %d", task->fd);
+            clientFinish(conn);
+            return LOOP_DONE;
+        }
+        if (ret == 429) {
+            clientBufferFree(conn);
+            conn->rejectCode = 429;
+        }
+    }
+
+    if (conn->buffer != NULL) {
+        /* The request may have come in along with a PROXY header */
+        conn->requestLen = handlerRequestLength(conn->buffer, conn->received,
+                                                conn->bufCap);
+        if ((conn->requestLen == 0) || (conn->received < conn->requestLen))
         {
-            buffer[bytes_received] = '\0';
-        
-            bufStruct response;
-            response.buffer = (char *) malloc(sizeof(char)*(MAX_BUF_SIZE + 1));
-            response.bufSize = 0;
-            response.entitySize=0;
-            parseRequest(buffer,&response,path);
-           
-            while (total_sent != response.bufSize) 
+            /* recv() at most max_line bytes at a time, never past the buffer */
+            while (conn->received < conn->bufCap)
             {
-                bytes_sent = send(client_sock, response.buffer + total_sent,
-                                  response.bufSize - total_sent, 0);
-                if (bytes_sent <= 0) {
+                chunk = conn->bufCap - conn->received;
+                if (chunk > cfg->maxLine)
+                    chunk = cfg->maxLine;
+                traceCall(TRACE_CALL_RECV);
+                ret = recv(task->fd, conn->buffer + conn->received, chunk, 0);
+                if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+                    CORO_YIELD(&conn->coro, LOOP_READ);
+                    continue;
+                }
+                if (ret <= 0)
                     break;
-                } else {
-                    total_sent += bytes_sent;
+                /* The end of the headers may arrive together with a body */
+                scanFrom = (conn->received > 3) ? conn->received - 3 : 0;
+                conn->received += ret;
+                if ((conn->requestLen == 0) &&
+                    (memmem(conn->buffer + scanFrom, conn->received - scanFrom,
+                            "\r\n\r\n", 4) != NULL)) {
+                    /* A handler gets its body, as much as the buffer holds */
+                    conn->requestLen = handlerRequestLength(conn->buffer,
+                                                            conn->received,
+                                                            conn->bufCap);
                 }
-            }
-
-            //reset for file transfer
-            total_sent = 0;
-
-            //Send file if applicable
-            while (total_sent != response.entitySize) {
-                bytes_sent = send(client_sock, response.entityBuffer + total_sent,
-                                  response.entitySize - total_sent, 0);
-                if (bytes_sent <= 0) {
+                if ((conn->requestLen > 0) &&
+                    (conn->received >= conn->requestLen)) {
                     break;
-                } else {
-                    total_sent += bytes_sent;
                 }
+            }
+        }
+        traceMark(TRACE_RECV);
+        traceRequestLine(conn->buffer, conn->received);
 
+        if (conn->received > 0) {
+            conn->buffer[conn->received] = '\0';
+        }
+        /* Parsing splits the request up in place, the capture gets it whole */
+        if (captureEnabled() && (conn->received > 0) &&
+            ((conn->captured = malloc(conn->received)) != NULL)) {
+            memcpy(conn->captured, conn->buffer, conn->received);
+        }
+        if ((conn->received > 0) &&
+            clientLongLived(cfg, conn->buffer, conn->received))
+        {
+            loopDetach(task);
+            pthread_attr_init(&attr);
+            if (affinityApply(&attr, conn->cpu) != 0) {
+                error_log("Unable to pin client thread to CPU %d", conn->cpu);
+            }
+            traceSuspend(&conn->trace);
+            pthread_sigmask(SIG_BLOCK, &ctlSignals, &oldMask);
+            ret = pthread_create(&tid, &attr, newClientThread, conn);
+            pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+            pthread_attr_destroy(&attr);
+            if (ret != 0) {
+                error_log("%s", "Unable to start client thread");
+                clientFinish(conn);
             }
+            return LOOP_DONE;
+        }
 
+        respInit(&conn->response, NULL, 0);
+        if (conn->received > 0)
+        {
+            respInit(&conn->response,
+                     affinityBufferGet(conn->cpu, MAX_BUF_SIZE + 1),
+                     MAX_BUF_SIZE + 1);
+            conn->flight.task = task;
+            if (handlerServe(conn->buffer, conn->received,
+                             &conn->response) == 0) {
+                parseRequest(conn->buffer, conn->received, &conn->response,
+                             path, cfg, &conn->flight);
+            }
 
-            if(response.entitySize !=0)
-            {
-                free(response.entityBuffer);
+            /* Another request is loading the file, wait until it lands */
+            if (conn->flight.joined) {
+                CORO_YIELD(&conn->coro, LOOP_PARKED);
+                serveShared(&conn->response, &conn->flight);
             }
 
-            free(response.buffer);
+            /* Park while the I/O threads read what was not cached */
+            if ((conn->response.entityFile != NULL) &&
+                (conn->response.streamLeft == 0) &&
+                (clientEntityRead(conn) == SUCCESS)) {
+                clientEarlyHints(conn);
+                CORO_YIELD(&conn->coro, LOOP_PARKED);
+                clientEntityDone(conn);
+            }
+            /* The final status line, past any 103 Early Hints */
+            if (conn->response.bufSize > conn->response.hintsLen + 9) {
+                traceStatus(atoi(conn->response.buffer +
+                                 conn->response.hintsLen + 9));
+            }
 
+            /* Let the whole response sit in the socket buffer */
+            sockoptSizeSendBuffer(task->fd, conn->response.bufSize +
+                                  conn->response.entitySize +
+                                  conn->response.streamLeft, cfg);
         }
-
+        clientBufferFree(conn);
     }
     else
     {
-        //Send 503- Service Unavailable.
-        bufStruct response;
-        response.buffer = (char *) malloc(sizeof(char)*(MAX_BUF_SIZE + 1));
-        response.bufSize = 0;
-        response.entitySize=0;
-
-        serveError(503,&response,FAILURE);
-        while (total_sent != response.bufSize) 
+        //Throttled, or out of memory: send 503- Service Unavailable.
+        if (conn->rejectCode == 0)
+            conn->rejectCode = 503;
+        respInit(&conn->response,
+                 affinityBufferGet(conn->cpu, MAX_BUF_SIZE + 1),
+                 MAX_BUF_SIZE + 1);
+        serveError(conn->rejectCode, &conn->response, FAILURE);
+        traceStatus(conn->rejectCode);
+    }
+
+    /*
+     * Headers and file go out together, taking care of short counts.
+     * A file streamed for being over the memory budget goes out a
+     * chunk at a time, each read once the one before is sent. Past
+     * send_quantum bytes in one turn the loop lets responses with
+     * fewer bytes left go first, see loop.c.
+     */
+    for (;;)
+    {
+        while (conn->sent != conn->response.bufSize + conn->response.entitySize)
         {
-            bytes_sent = send(client_sock, response.buffer + total_sent,
-                              response.bufSize - total_sent, 0);
-            if (bytes_sent <= 0) {
-                break;
+            total = conn->response.bufSize + conn->response.entitySize +
+                    conn->response.streamLeft;
+            task->remaining = total - conn->sent;
+            if ((cfg->sendQuantum > 0) &&
+                (turnSent >= (size_t) cfg->sendQuantum)) {
+                CORO_YIELD(&conn->coro, LOOP_YIELD);
+                continue;
+            }
+            headerSize = conn->response.bufSize;
+            if (conn->sent < headerSize) {
+                iov[0].iov_base = conn->response.buffer + conn->sent;
+                iov[0].iov_len = headerSize - conn->sent;
+                iov[1].iov_base = conn->response.entityBuffer;
+                iov[1].iov_len = conn->response.entitySize;
             } else {
-                total_sent += bytes_sent;
+                iov[0].iov_base = conn->response.entityBuffer +
+                                  (conn->sent - headerSize);
+                iov[0].iov_len = conn->response.entitySize -
+                                 (conn->sent - headerSize);
+                iov[1].iov_len = 0;
+            }
+            if ((cfg->sendQuantum > 0) &&
+                (iov[0].iov_len >= (size_t) cfg->sendQuantum - turnSent)) {
+                iov[0].iov_len = cfg->sendQuantum - turnSent;
+                iov[1].iov_len = 0;
+            } else if ((cfg->sendQuantum > 0) &&
+                       (iov[1].iov_len > cfg->sendQuantum - turnSent -
+                                         iov[0].iov_len)) {
+                iov[1].iov_len = cfg->sendQuantum - turnSent - iov[0].iov_len;
+            }
+            traceCall(TRACE_CALL_SEND);
+            ret = writev(task->fd, iov, (iov[1].iov_len > 0) ? 2 : 1);
+            if ((ret < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+                CORO_YIELD(&conn->coro, LOOP_WRITE);
+                continue;
+            }
+            if (ret <= 0) {
+                break;
             }
+            conn->sent += ret;
+            turnSent += ret;
         }
-
-        if(response.entitySize !=0)
-        {
-            free(response.entityBuffer);
+        if ((conn->response.streamLeft == 0) ||
+            (conn->sent != conn->response.bufSize +
+                           conn->response.entitySize)) {
+            break;
+        }
+        while ((chunk = clientStreamRead(conn)) == LOOP_YIELD) {
+            CORO_YIELD(&conn->coro, LOOP_YIELD);
+        }
+        if (chunk == LOOP_PARKED) {
+            CORO_YIELD(&conn->coro, LOOP_PARKED);
+            clientStreamDone(conn);
+        }
+        if (conn->response.entitySize == 0) {
+            break;
         }
-        free(response.buffer);
-            
-        
     }
+    conn->bytesTotal += conn->sent;
+    traceMark(TRACE_SEND);
 
-    debug_log("Closing connection %s:%d",
-              client_addr_string, ntohs(client_addr.sin_port));
-    /* Our work here is done. Close the connection to the client */
-    close(client_sock);
-    pthread_mutex_lock(&connMutex);
-    if(globalConnectionCount>0)
-    {
-        globalConnectionCount--;
+    if (conn->response.entityFile != NULL) {
+        fclose(conn->response.entityFile);
     }
-    pthread_mutex_unlock(&connMutex);
+    respEntityFree(&conn->response);
+    affinityBufferPut(conn->cpu, conn->response.buffer, MAX_BUF_SIZE + 1);
 
-    return NULL;
+    CORO_END(&conn->coro);
+
+    clientFinish(conn);
+    return LOOP_DONE;
+}
+
+/**
+*clientResume : resumes clientServe for the loop, charging the CPU time
+*of the slice to the connection's trace.
+*/
+static int clientResume(loopTask *task)
+{
+    clientConn *conn = (clientConn *) task;
+    int wait;
+
+    traceResume(&conn->trace);
+    wait = clientServe(task);
+    /* Done, conn is gone; its trace was ended with the last slice */
+    if (wait != LOOP_DONE) {
+        traceSuspend(&conn->trace);
+    }
+    return wait;
 }
@@ -0,0 +1,98 @@
+/**
+ * @file    sockopt.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Applies the socket level tuning from the configuration to
+ * the listening socket and to accepted client sockets. A failing
+ * option is logged and otherwise ignored, the server still works
+ * with the kernel defaults.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <log.h>
+#include <sockopt.h>
+
+static void setIntOpt(int sock, int level, int name, int val,
+                      const char *what)
+{
+    if (setsockopt(sock, level, name, &val, sizeof(val)) < 0) {
+        error_log("setsockopt(%s=%d) error: %s", what, val, strerror(errno));
+    }
+}
+
+/**
+*sockoptListener : applies listener options. Safe to call again
+*after a reload; accepted sockets inherit SO_RCVBUF from here so the
+*TCP window scale is negotiated with the configured size.
+*/
+void sockoptListener(int serv_sock, const serverConfig *cfg)
+{
+    setIntOpt(serv_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, cfg->deferAccept,
+              "TCP_DEFER_ACCEPT");
+    if (cfg->fastOpen > 0) {
+        setIntOpt(serv_sock, IPPROTO_TCP, TCP_FASTOPEN, cfg->fastOpen,
+                  "TCP_FASTOPEN");
+    }
+    if (cfg->rcvBuf > 0) {
+        setIntOpt(serv_sock, SOL_SOCKET, SO_RCVBUF, cfg->rcvBuf, "SO_RCVBUF");
+    }
+}
+
+/**
+*sockoptClient : applies per connection options to an accepted socket.
+*/
+void sockoptClient(int client_sock, const serverConfig *cfg)
+{
+    if (cfg->noDelay) {
+        setIntOpt(client_sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (cfg->notSentLowat > 0) {
+        setIntOpt(client_sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                  cfg->notSentLowat, "TCP_NOTSENT_LOWAT");
+    }
+    if (cfg->sndBuf > 0) {
+        setIntOpt(client_sock, SOL_SOCKET, SO_SNDBUF, cfg->sndBuf,
+                  "SO_SNDBUF");
+    }
+    if (cfg->busyPoll > 0) {
+        /* Raising this above net.core.busy_poll needs CAP_NET_ADMIN */
+        setIntOpt(client_sock, SOL_SOCKET, SO_BUSY_POLL, cfg->busyPoll,
+                  "SO_BUSY_POLL");
+    }
+}
+
+/**
+*sockoptSizeSendBuffer : with so_sndbuf = auto, sizes the send buffer
+*so the whole response fits, up to so_sndbuf_max. Small responses keep
+*the kernel default, which is already large enough for them.
+*/
+void sockoptSizeSendBuffer(int client_sock, size_t responseSize,
+                           const serverConfig *cfg)
+{
+    int current = 0;
+    socklen_t len = sizeof(current);
+    size_t want;
+
+    if (cfg->sndBuf != SNDBUF_AUTO) {
+        return;
+    }
+
+    want = (responseSize > (size_t) cfg->sndBufMax) ?
+           (size_t) cfg->sndBufMax : responseSize;
+
+    /* The kernel reports (and allocates) twice the requested size */
+    if ((getsockopt(client_sock, SOL_SOCKET, SO_SNDBUF, &current, &len) == 0)
+        && ((size_t) current >= 2 * want)) {
+        return;
+    }
+    setIntOpt(client_sock, SOL_SOCKET, SO_SNDBUF, (int) want, "SO_SNDBUF");
+}
@@ -0,0 +1,316 @@
+/**
+ * @file    trace.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Per-request phase tracing. Each connection carries a
+ * traceRecord with a monotonic timestamp at the end of every phase,
+ * counts of the recv/send/file calls it made and the CPU time spent
+ * on it: the thread CPU clock is read whenever the request is resumed
+ * and suspended (traceResume, traceSuspend), as an event loop thread
+ * serves many connections at once. A request served on a thread of its
+ * own also gets the thread's user/system split and context switches. One request in trace_sample, and any
+ * request slower than trace_slow_ms, is kept in a ring that SIGUSR1
+ * writes to trace_file in Chrome trace-event JSON (chrome://tracing,
+ * Perfetto).
+ *
+ * With both settings at 0 nothing is stamped; only the static probes
+ * remain, and those are a nop until a tracer attaches.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <log.h>
+#include <httpparser.h>
+#include <trace.h>
+
+__thread traceRecord *traceCurrent;
+
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static traceRecord ring[TRACE_RING_SIZE];
+static unsigned int ringNext;
+static unsigned int ringCount;
+static unsigned int sampleSeq;
+
+/* Name of the interval ending at each stamp */
+static const char *phaseNames[TRACE_PHASES] = {
+    "accept", "dispatch", "recv", "parse", "open", "read", "send", "close"
+};
+
+static uint64_t tvUs(const struct timeval *tv)
+{
+    return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * threadCpuNs : CPU time of the calling thread, never 0.
+ */
+static uint64_t threadCpuNs(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 1;
+    }
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+/**
+*traceBegin : starts the record of the request on fd and makes it
+*current for the calling thread.
+*args:
+*       acceptedNs: traceNow() when accept() returned
+*/
+void traceBegin(traceRecord *rec, int fd, int cpu, uint64_t acceptedNs,
+                const serverConfig *cfg)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = fd;
+    rec->cpu = cpu;
+    rec->slowNs = (uint64_t) cfg->traceSlowMs * 1000000;
+    rec->sampled = (cfg->traceSample > 0) &&
+        ((__sync_fetch_and_add(&sampleSeq, 1) % cfg->traceSample) == 0);
+    rec->active = rec->sampled || (rec->slowNs > 0);
+    traceCurrent = rec;
+
+    TRACE_PROBE2(request__start, fd, cpu);
+    if (!rec->active) {
+        return;
+    }
+
+    rec->tid = (int) syscall(SYS_gettid);
+    rec->stamp[TRACE_ACCEPT] = acceptedNs;
+    rec->stamp[TRACE_DISPATCH] = traceNow();
+    rec->sliceNs = threadCpuNs();
+}
+
+/**
+*traceThread : the request goes on to be served on the calling thread,
+*which serves nothing else, so its CPU time can be charged to it. The
+*thread it came from must have suspended it.
+*/
+void traceThread(traceRecord *rec)
+{
+    struct rusage ru;
+
+    traceCurrent = rec;
+    if (!rec->active) {
+        return;
+    }
+    rec->tid = (int) syscall(SYS_gettid);
+    rec->sliceNs = threadCpuNs();
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        rec->userUs = tvUs(&ru.ru_utime);
+        rec->sysUs = tvUs(&ru.ru_stime);
+        rec->volCtx = ru.ru_nvcsw;
+        rec->involCtx = ru.ru_nivcsw;
+        rec->ownThread = 1;
+    }
+}
+
+/**
+*traceResume : the calling thread takes up the request of rec again,
+*see traceSuspend.
+*/
+void traceResume(traceRecord *rec)
+{
+    traceCurrent = rec;
+    if (rec->active) {
+        rec->sliceNs = threadCpuNs();
+    }
+}
+
+/**
+*traceSuspend : the calling thread leaves the request of rec for other
+*work, the CPU time since traceResume is charged to it.
+*/
+void traceSuspend(traceRecord *rec)
+{
+    traceCurrent = NULL;
+    if (rec->active && (rec->sliceNs != 0)) {
+        rec->cpuNs += threadCpuNs() - rec->sliceNs;
+        rec->sliceNs = 0;
+    }
+}
+
+/**
+*traceRequestLine : keeps the request line of the current request,
+*with anything unprintable replaced.
+*/
+void traceRequestLine(const char *request, int length)
+{
+    traceRecord *rec = traceCurrent;
+    int i;
+
+    if ((rec == NULL) || !rec->active) {
+        return;
+    }
+    for (i = 0; (i < length) && (i < TRACE_REQUEST_LINE - 1); i++) {
+        if ((request[i] == '\r') || (request[i] == '\n')) {
+            break;
+        }
+        rec->request[i] = ((request[i] < ' ') || (request[i] > '~')) ?
+                          '?' : request[i];
+    }
+    rec->request[i] = '\0';
+}
+
+/**
+*traceEnd : closes the record and keeps it if it was sampled or slow.
+*args:
+*       bytes: bytes sent to the client
+*/
+void traceEnd(traceRecord *rec, size_t bytes)
+{
+    struct rusage ru;
+    uint64_t duration;
+
+    traceCurrent = NULL;
+    rec->bytes = bytes;
+    if (!rec->active) {
+        TRACE_PROBE4(request__done, rec->fd, rec->status, bytes, 0);
+        return;
+    }
+
+    rec->stamp[TRACE_CLOSE] = traceNow();
+    duration = rec->stamp[TRACE_CLOSE] - rec->stamp[TRACE_ACCEPT];
+    TRACE_PROBE4(request__done, rec->fd, rec->status, bytes, duration);
+
+    if (!rec->sampled && (duration < rec->slowNs)) {
+        return;
+    }
+    traceSuspend(rec);
+
+    if (rec->ownThread && (getrusage(RUSAGE_THREAD, &ru) == 0)) {
+        rec->userUs = tvUs(&ru.ru_utime) - rec->userUs;
+        rec->sysUs = tvUs(&ru.ru_stime) - rec->sysUs;
+        rec->volCtx = ru.ru_nvcsw - rec->volCtx;
+        rec->involCtx = ru.ru_nivcsw - rec->involCtx;
+    }
+
+    pthread_mutex_lock(&ringLock);
+    ring[ringNext] = *rec;
+    ringNext = (ringNext + 1) % TRACE_RING_SIZE;
+    if (ringCount < TRACE_RING_SIZE) {
+        ringCount++;
+    }
+    pthread_mutex_unlock(&ringLock);
+}
+
+/**
+ * traceWriteEvent : one complete ("X") event, times in microseconds.
+ */
+static void traceWriteEvent(FILE *out, int *first, const char *name,
+                            const char *cat, uint64_t start, uint64_t end,
+                            int pid, int tid)
+{
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+            *first ? "" : ",", name, cat, start / 1000.0,
+            (end - start) / 1000.0, pid, tid);
+    *first = 0;
+}
+
+/**
+*traceExport : writes the kept records to file as Chrome trace-event
+*JSON and empties the ring.
+*return:
+*       SUCCESS or FAILURE
+*/
+int traceExport(const char *file)
+{
+    traceRecord *recs;
+    traceRecord *rec;
+    unsigned int count, start, i;
+    int phase, prev, first = 1;
+    char name[2 * TRACE_REQUEST_LINE];
+    const char *src;
+    char *dst;
+    int pid = (int) getpid();
+    FILE *out;
+
+    if ((recs = malloc(sizeof(ring))) == NULL) {
+        return FAILURE;
+    }
+
+    /* Copy out oldest first so the lock is not held over file I/O */
+    pthread_mutex_lock(&ringLock);
+    count = ringCount;
+    start = (ringNext + TRACE_RING_SIZE - ringCount) % TRACE_RING_SIZE;
+    for (i = 0; i < count; i++) {
+        recs[i] = ring[(start + i) % TRACE_RING_SIZE];
+    }
+    ringCount = 0;
+    pthread_mutex_unlock(&ringLock);
+
+    if ((out = fopen(file, "w")) == NULL) {
+        error_log("Unable to write trace file %s: %s", file, strerror(errno));
+        free(recs);
+        return FAILURE;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (i = 0; i < count; i++) {
+        rec = &recs[i];
+
+        for (src = rec->request, dst = name; *src != '\0'; src++) {
+            if ((*src == '"') || (*src == '\\')) {
+                *dst++ = '\\';
+            }
+            *dst++ = *src;
+        }
+        *dst = '\0';
+
+        traceWriteEvent(out, &first, name[0] ? name : "request", "request",
+                        rec->stamp[TRACE_ACCEPT], rec->stamp[TRACE_CLOSE],
+                        pid, rec->tid);
+        fprintf(out, ",\"args\":{\"fd\":%d,\"cpu\":%d,\"status\":%d,"
+                "\"bytes\":%llu,\"cpu_us\":%llu,", rec->fd, rec->cpu,
+                rec->status, (unsigned long long) rec->bytes,
+                (unsigned long long) (rec->cpuNs / 1000));
+        if (rec->ownThread) {
+            fprintf(out, "\"user_us\":%llu,\"sys_us\":%llu,"
+                    "\"vol_ctx\":%u,\"invol_ctx\":%u,",
+                    (unsigned long long) rec->userUs,
+                    (unsigned long long) rec->sysUs,
+                    rec->volCtx, rec->involCtx);
+        }
+        fprintf(out, "\"recv_calls\":%u,\"send_calls\":%u,"
+                "\"file_calls\":%u,\"sampled\":%s}}",
+                rec->calls[TRACE_CALL_RECV], rec->calls[TRACE_CALL_SEND],
+                rec->calls[TRACE_CALL_FILE],
+                rec->sampled ? "true" : "false");
+
+        /* Phases that were skipped (error paths, HEAD) have no stamp */
+        prev = TRACE_ACCEPT;
+        for (phase = TRACE_DISPATCH; phase < TRACE_PHASES; phase++) {
+            if (rec->stamp[phase] == 0) {
+                continue;
+            }
+            traceWriteEvent(out, &first, phaseNames[phase], "phase",
+                            rec->stamp[prev], rec->stamp[phase],
+                            pid, rec->tid);
+            fputc('}', out);
+            prev = phase;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    free(recs);
+    if (fclose(out) != 0) {
+        error_log("Unable to write trace file %s: %s", file, strerror(errno));
+        return FAILURE;
+    }
+    debug_log("Wrote %u request traces to %s", count, file);
+    return SUCCESS;
+}
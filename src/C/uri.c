@@ -0,0 +1,256 @@
+/**
+ * @file    uri.c
+ * @authors Kamala Narayan B.S. (kamalanb)
+ *          Srikanth Sedimbi (ssedimbi)
+ * @date   Fri, 29 February 2015
+ *
+ * @brief Canonical request paths. "/index.html?x=1", "/./index.html",
+ * "//%69ndex.html" and "/docs/../index.html" all name one file and
+ * are reduced to one path in a single pass over the request target:
+ * the query is cut off, escapes are decoded, empty and "." segments
+ * dropped and ".." resolved. A ".." climbing above the root is
+ * refused rather than clamped.
+ *
+ * A path naming a directory is served by its index.html. Whether a
+ * path is a directory, and whether that has an index, is remembered
+ * for a couple of seconds so that popular directories are not
+ * stat()ed on every request. Caches and caching rules are keyed on
+ * the resulting path, so equivalent URLs share their entries.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <httpparser.h>
+#include <trace.h>
+#include <uri.h>
+#include <pathindex.h>
+
+enum uriKind {
+    URI_FILE,           /* not a directory, or missing */
+    URI_DIR_INDEX,      /* directory with an index.html */
+    URI_DIR_BARE        /* directory without one */
+};
+
+typedef struct uriIndexEntry {
+    uint32_t hash;
+    int kind;
+    time_t checked;
+    char path[URI_INDEX_PATH];
+} uriIndexEntry;
+
+#define URI_INDEX_LOCKS 16
+
+static uriIndexEntry indexCache[URI_INDEX_SLOTS];
+static pthread_mutex_t indexLocks[URI_INDEX_LOCKS] = {
+    [0 ... URI_INDEX_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int hexValue(char c)
+{
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+*uriNormalize : reduces the request target uri to its canonical path.
+*args:
+*       uri, len: the target, it ends at len bytes or a NUL
+*       out, outSize: filled with the NUL terminated path
+*       query: set to the '?' starting the query in uri, NULL if none
+*return:
+*       SUCCESS, or the HTTP error code to answer with: 400 for a
+*       malformed target, 403 for ".." above the root and 404 for a
+*       path longer than outSize
+*/
+int uriNormalize(const char *uri, size_t len, char *out, size_t outSize,
+                 const char **query)
+{
+    const char *end = uri + len;
+    size_t n = 0, seg = 1;
+    int c, hi, lo;
+
+    *query = NULL;
+    if ((len == 0) || (uri[0] != '/') || (outSize < 2)) {
+        return BAD_REQUEST;
+    }
+    out[n++] = '/';
+
+    for (uri++; ; uri++) {
+        c = ((uri < end) && (*uri != '\0')) ? (unsigned char) *uri : '\0';
+        if ((c == '?') || (c == '#')) {
+            if (c == '?') {
+                *query = uri;
+            }
+            c = '\0';
+        }
+
+        if ((c == '/') || (c == '\0')) {
+            /* The segment out[seg..n) is complete */
+            if ((n - seg == 1) && (out[seg] == '.')) {
+                n = seg;
+            } else if ((n - seg == 2) && (out[seg] == '.') &&
+                       (out[seg + 1] == '.')) {
+                if (seg == 1) {
+                    return NOT_PERMITTED;
+                }
+                for (n = seg - 1; out[n - 1] != '/'; n--) {
+                }
+            }
+            if (c == '\0') {
+                break;
+            }
+            /* "//" is one separator */
+            if (out[n - 1] != '/') {
+                if (n + 1 >= outSize) {
+                    return NOT_FOUND;
+                }
+                out[n++] = '/';
+            }
+            seg = n;
+            continue;
+        }
+
+        if (c == '%') {
+            if ((end - uri < 3) || ((hi = hexValue(uri[1])) < 0) ||
+                ((lo = hexValue(uri[2])) < 0)) {
+                return BAD_REQUEST;
+            }
+            c = (hi << 4) | lo;
+            uri += 2;
+            /* An escaped separator would name a different file */
+            if ((c == '/') || (c == '\0')) {
+                return BAD_REQUEST;
+            }
+        }
+        if ((c < 0x20) || (c == 0x7f)) {
+            return BAD_REQUEST;
+        }
+        if (n + 1 >= outSize) {
+            return NOT_FOUND;
+        }
+        out[n++] = c;
+    }
+
+    out[n] = '\0';
+    return SUCCESS;
+}
+
+static uint32_t hashPath(const char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*path != '\0') {
+        hash = (hash ^ (unsigned char) *path++) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * indexKind : whether root/path is a directory and has an index, from
+ * the cache while its answer is fresh.
+ */
+static int indexKind(const char *root, const char *path, size_t pathLen)
+{
+    char full[MAX_PATH];
+    uint32_t hash = hashPath(path);
+    uriIndexEntry *e = &indexCache[hash & (URI_INDEX_SLOTS - 1)];
+    pthread_mutex_t *lock = &indexLocks[hash % URI_INDEX_LOCKS];
+    time_t now = time(NULL);
+    struct stat st;
+    int kind = -1;
+
+    if (pathLen < URI_INDEX_PATH) {
+        pthread_mutex_lock(lock);
+        if ((e->hash == hash) && (now - e->checked < URI_INDEX_TTL) &&
+            !strcmp(e->path, path)) {
+            kind = e->kind;
+        }
+        pthread_mutex_unlock(lock);
+        if (kind >= 0) {
+            return kind;
+        }
+    }
+
+    snprintf(full, sizeof(full), "%s%s", root, path);
+    kind = URI_FILE;
+    traceCall(TRACE_CALL_FILE);
+    if ((stat(full, &st) == 0) && S_ISDIR(st.st_mode)) {
+        snprintf(full, sizeof(full), "%s%s%s%s", root, path,
+                 (path[pathLen - 1] == '/') ? "" : "/", boilerPlatePage);
+        traceCall(TRACE_CALL_FILE);
+        kind = (access(full, F_OK) == 0) ? URI_DIR_INDEX : URI_DIR_BARE;
+    }
+
+    if (pathLen < URI_INDEX_PATH) {
+        pthread_mutex_lock(lock);
+        e->hash = hash;
+        e->kind = kind;
+        e->checked = now;
+        memcpy(e->path, path, pathLen + 1);
+        pthread_mutex_unlock(lock);
+    }
+    return kind;
+}
+
+/**
+*uriResolve : maps the request target uri onto the file under root
+*that serves it.
+*args:
+*       canonical: MAX_PATH bytes, filled with the canonical path,
+*                  ending in the index file for a directory
+*       resourcePath: MAX_PATH bytes, filled with the file path
+*return:
+*       SUCCESS, or the HTTP error code to answer with
+*/
+int uriResolve(const char *uri, const char *root, char *canonical,
+               char *resourcePath)
+{
+    size_t rootLen = strlen(root), room, len;
+    const char *query;
+    int code;
+
+    if (rootLen + sizeof(boilerPlatePage) + 2 >= MAX_PATH) {
+        return NOT_FOUND;
+    }
+    /* Room for a '/' and the index file name behind the path */
+    room = MAX_PATH - rootLen - sizeof(boilerPlatePage) - 1;
+    if ((code = uriNormalize(uri, strlen(uri), canonical, room,
+                             &query)) != SUCCESS) {
+        return code;
+    }
+
+    /* Scanners ask for paths that were never there, see pathindex.c */
+    len = strlen(canonical);
+    if (!pathIndexMayExist(canonical, len)) {
+        return NOT_FOUND;
+    }
+    switch (indexKind(root, canonical, len)) {
+    case URI_DIR_INDEX:
+        if (canonical[len - 1] != '/') {
+            canonical[len++] = '/';
+        }
+        strcpy(canonical + len, boilerPlatePage);
+        break;
+    case URI_DIR_BARE:
+        return NOT_PERMITTED;
+    }
+
+    strcpy(resourcePath, root);
+    strcat(resourcePath, canonical);
+    return SUCCESS;
+}